@@ -0,0 +1,26 @@
+# This file is licensed under the WTFPL version 2 -- you can see the full
+# license over at http://www.wtfpl.net/txt/copying/
+#
+# - Try to find liburing
+#
+# Once done this will define
+#  LIBURING_FOUND - System has liburing
+#  LIBURING_INCLUDE_DIRS - The liburing include directories
+#  LIBURING_LIBRARIES - The libraries needed to use liburing
+
+find_package(PkgConfig)
+
+find_path(LIBURING_INCLUDE_DIR liburing.h)
+
+find_library(LIBURING_LIBRARY NAMES uring liburing)
+
+set(LIBURING_LIBRARIES ${LIBURING_LIBRARY})
+set(LIBURING_INCLUDE_DIRS ${LIBURING_INCLUDE_DIR})
+
+include(FindPackageHandleStandardArgs)
+# handle the QUIET and REQUIRED arguments and set LIBURING_FOUND to TRUE
+# if all listed variables are TRUE
+find_package_handle_standard_args(Liburing DEFAULT_MSG
+        LIBURING_LIBRARY LIBURING_INCLUDE_DIR)
+
+mark_as_advanced(LIBURING_INCLUDE_DIR LIBURING_LIBRARY)
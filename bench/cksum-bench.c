@@ -0,0 +1,141 @@
+/*
+ *  chiTCP - A simple, testable TCP stack
+ *
+ *  Checksum microbenchmark
+ *
+ *  Measures the throughput of each checksum implementation (see
+ *  chitcp/cksum.h) supported by the CPU, along with the original
+ *  scalar implementation, for inputs from 20 bytes (a TCP header
+ *  with no options) to 64 KiB.
+ *
+ *  Usage: cksum-bench [MEGABYTES]
+ *
+ */
+
+
+/*
+ *  Copyright (c) 2013-2014, The University of Chicago
+ *  All rights reserved.
+ *
+ *  Redistribution and use in source and binary forms, with or without
+ *  modification, are permitted provided that the following conditions are met:
+ *
+ *  - Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ *
+ *  - Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ *  - Neither the name of The University of Chicago nor the names of its
+ *    contributors may be used to endorse or promote products derived from this
+ *    software without specific prior written permission.
+ *
+ *  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ *  AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ *  IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ *  ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ *  LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ *  CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ *  SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ *  INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ *  CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ *  ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ *  POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include <arpa/inet.h>
+
+#include "chitcp/cksum.h"
+#include "chitcp/types.h"
+
+#define DEFAULT_MEGABYTES (256)
+
+static const size_t sizes[] = {20, 40, 64, 256, 576, 1500, 4096, 16384, 65536};
+#define NSIZES (sizeof(sizes) / sizeof(size_t))
+
+/* The scalar loop cksum() used before the vectorized implementations */
+static uint16_t cksum_scalar(const void *_data, size_t len)
+{
+    const uint8_t *data = _data;
+    uint32_t sum;
+
+    for (sum = 0; len >= 2; data += 2, len -= 2)
+        sum += data[0] << 8 | data[1];
+    if (len > 0)
+        sum += data[0] << 8;
+    while (sum > 0xffff)
+        sum = (sum >> 16) + (sum & 0xffff);
+
+    return htons(~sum);
+}
+
+static double now()
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* Sums "size" bytes over and over, until "total" bytes have been summed */
+static void bench(const char *name, uint16_t (*func)(const void *, size_t),
+                  const uint8_t *data, size_t size, size_t total)
+{
+    size_t iterations = total / size;
+    volatile uint16_t sink = 0;
+    double start, elapsed;
+
+    /* Warm up */
+    for (size_t i = 0; i < 1000; i++)
+        sink += func(data, size);
+
+    start = now();
+    for (size_t i = 0; i < iterations; i++)
+        sink += func(data + (i & 7) * 2, size);
+    elapsed = now() - start;
+
+    printf("%-8s %6zu bytes  %8.1f ns/call  %7.2f GB/s\n", name, size,
+           elapsed * 1e9 / iterations, (double) iterations * size / elapsed / 1e9);
+}
+
+int main(int argc, char *argv[])
+{
+    cksum_impl_t impls[] = {CKSUM_IMPL_GENERIC, CKSUM_IMPL_SSE2, CKSUM_IMPL_AVX2};
+    size_t total = DEFAULT_MEGABYTES * 1024 * 1024;
+    uint8_t *data;
+
+    if (argc > 1)
+        total = strtoul(argv[1], NULL, 10) * 1024 * 1024;
+
+    /* The benchmark slides the input by up to 14 bytes,
+     * to avoid always using aligned data */
+    data = malloc(sizes[NSIZES - 1] + 16);
+    if (data == NULL)
+        return EXIT_FAILURE;
+    for (size_t i = 0; i < sizes[NSIZES - 1] + 16; i++)
+        data[i] = rand();
+
+    for (size_t s = 0; s < NSIZES; s++)
+    {
+        bench("scalar", cksum_scalar, data, sizes[s], total);
+
+        for (int i = 0; i < sizeof(impls) / sizeof(cksum_impl_t); i++)
+        {
+            if (chitcp_cksum_set_impl(impls[i]) != CHITCP_OK)
+                continue;
+            bench(chitcp_cksum_impl_str(), chitcp_cksum, data, sizes[s], total);
+        }
+        printf("\n");
+    }
+
+    free(data);
+
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,586 @@
+/*
+ *  chiTCP - A simple, testable TCP stack
+ *
+ *  Benchmark for the inter-daemon I/O paths
+ *
+ *  Sends a stream of chiTCP-sized frames over a loopback TCP connection
+ *  (like the one between two chiTCP daemons) and reports how many system
+ *  calls each I/O strategy needs to move one megabyte:
+ *
+ *   - send: one send() per frame on the sender, and one recv() for the
+ *     header plus one for the payload on the receiver (the way chitcpd
+ *     originally did it).
+ *
+ *   - batch: one sendmsg() per batch of frames, and recv() into a large
+ *     buffer (chitcpd's default sendmsg()/frame reader path).
+ *
+ *   - uring: one IORING_OP_SENDMSG submission per batch on the sender, and a
+ *     multishot recv with a provided buffer ring on the receiver
+ *     (chitcpd's -i option).
+ *
+ *  Only calls that enter the kernel are counted; for io_uring, waiting
+ *  for a completion that is already in the completion queue is free.
+ *
+ *  Usage: uring-bench [-m MEGABYTES] [-s FRAME_SIZE] [-b BATCH] [send|batch|uring]
+ *
+ */
+
+
+/*
+ *  Copyright (c) 2013-2014, The University of Chicago
+ *  All rights reserved.
+ *
+ *  Redistribution and use in source and binary forms, with or without
+ *  modification, are permitted provided that the following conditions are met:
+ *
+ *  - Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ *
+ *  - Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ *  - Neither the name of The University of Chicago nor the names of its
+ *    contributors may be used to endorse or promote products derived from this
+ *    software without specific prior written permission.
+ *
+ *  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ *  AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ *  IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ *  ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ *  LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ *  CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ *  SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ *  INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ *  CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ *  ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ *  POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <limits.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <liburing.h>
+#include "chitcp/packet.h"
+
+/* netinet/tcp.h can't be included along with chitcp/packet.h
+ * (both define struct tcphdr) */
+#ifndef TCP_NODELAY
+#define TCP_NODELAY (1)
+#endif
+
+/* A chiTCP header plus a TCP header (with no options) plus
+ * a full 536-byte MSS payload */
+#define DEFAULT_FRAME_SIZE (HEADER_SIZE + TCP_HEADER_NOOPTIONS_SIZE + 536)
+#define DEFAULT_MEGABYTES (64)
+#define DEFAULT_BATCH (64)
+
+/* The receiver reads the chiTCP header first (to find out the size
+ * of the rest of the frame), like chitcpd does */
+#define HEADER_SIZE (sizeof(chitcphdr_t))
+#define RECV_BUFFER_SIZE (128*1024)
+
+#define RING_ENTRIES (256)
+#define RING_NBUFS (256)
+#define RING_BUF_SIZE (16*1024)
+#define RING_BGID (0)
+
+typedef enum
+{
+    MODE_SEND,
+    MODE_BATCH,
+    MODE_URING
+} bench_mode_t;
+
+typedef struct bench
+{
+    bench_mode_t mode;
+    int sender;
+    int receiver;
+    size_t frame_size;
+    size_t nframes;
+    int batch;
+
+    unsigned long send_syscalls;
+    unsigned long recv_syscalls;
+} bench_t;
+
+static void die(const char *what, int err)
+{
+    fprintf(stderr, "uring-bench: %s: %s\n", what, strerror(err));
+    exit(EXIT_FAILURE);
+}
+
+static int send_all(int fd, const uint8_t *buf, size_t len, unsigned long *syscalls)
+{
+    while (len > 0)
+    {
+        ssize_t nbytes = send(fd, buf, len, MSG_NOSIGNAL);
+        (*syscalls)++;
+        if (nbytes == -1)
+        {
+            if (errno == EINTR)
+                continue;
+            return -1;
+        }
+        buf += nbytes;
+        len -= nbytes;
+    }
+    return 0;
+}
+
+static int recv_all(int fd, uint8_t *buf, size_t len, unsigned long *syscalls)
+{
+    while (len > 0)
+    {
+        ssize_t nbytes = recv(fd, buf, len, 0);
+        (*syscalls)++;
+        if (nbytes == -1 && errno == EINTR)
+            continue;
+        if (nbytes <= 0)
+            return -1;
+        buf += nbytes;
+        len -= nbytes;
+    }
+    return 0;
+}
+
+static int sendv_all(int fd, struct iovec *iov, int iovcnt, unsigned long *syscalls)
+{
+    struct msghdr msg;
+
+    memset(&msg, 0, sizeof(msg));
+    while (iovcnt > 0)
+    {
+        msg.msg_iov = iov;
+        msg.msg_iovlen = iovcnt;
+        ssize_t nbytes = sendmsg(fd, &msg, MSG_NOSIGNAL);
+        (*syscalls)++;
+        if (nbytes == -1)
+        {
+            if (errno == EINTR)
+                continue;
+            return -1;
+        }
+        while (iovcnt > 0 && (size_t) nbytes >= iov->iov_len)
+        {
+            nbytes -= iov->iov_len;
+            iov++;
+            iovcnt--;
+        }
+        if (iovcnt > 0)
+        {
+            iov->iov_base = (uint8_t *) iov->iov_base + nbytes;
+            iov->iov_len -= nbytes;
+        }
+    }
+    return 0;
+}
+
+
+/*
+ * Sender side
+ */
+
+static void *sender_send(bench_t *b, uint8_t *frame)
+{
+    for (size_t i = 0; i < b->nframes; i++)
+        if (send_all(b->sender, frame, b->frame_size, &b->send_syscalls) == -1)
+            die("send", errno);
+    return NULL;
+}
+
+static void *sender_batch(bench_t *b, uint8_t *frame)
+{
+    struct iovec iov[IOV_MAX];
+
+    for (size_t i = 0; i < b->nframes; )
+    {
+        int iovcnt;
+        for (iovcnt = 0; iovcnt < b->batch && i < b->nframes; iovcnt++, i++)
+        {
+            iov[iovcnt].iov_base = frame;
+            iov[iovcnt].iov_len = b->frame_size;
+        }
+        if (sendv_all(b->sender, iov, iovcnt, &b->send_syscalls) == -1)
+            die("sendmsg", errno);
+    }
+    return NULL;
+}
+
+static void *sender_uring(bench_t *b, uint8_t *frame)
+{
+    struct io_uring ring;
+    struct iovec iov[IOV_MAX];
+    struct msghdr msg;
+    struct io_uring_sqe *sqe;
+    struct io_uring_cqe *cqe;
+    int ret;
+
+    ret = io_uring_queue_init(RING_ENTRIES, &ring, 0);
+    if (ret < 0)
+        die("io_uring_queue_init", -ret);
+
+    for (int i = 0; i < b->batch; i++)
+    {
+        iov[i].iov_base = frame;
+        iov[i].iov_len = b->frame_size;
+    }
+
+    /* Like chitcpd_uring_send_frames, each batch is a single SENDMSG
+     * (MSG_WAITALL makes the kernel retry short sends for us) */
+    for (size_t i = 0; i < b->nframes; )
+    {
+        int iovcnt = b->batch;
+        if (b->nframes - i < (size_t) iovcnt)
+            iovcnt = b->nframes - i;
+        i += iovcnt;
+
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_iov = iov;
+        msg.msg_iovlen = iovcnt;
+
+        sqe = io_uring_get_sqe(&ring);
+        io_uring_prep_sendmsg(sqe, b->sender, &msg, MSG_WAITALL | MSG_NOSIGNAL);
+
+        ret = io_uring_submit_and_wait(&ring, 1);
+        b->send_syscalls++;
+        if (ret < 0)
+            die("io_uring_submit_and_wait", -ret);
+
+        ret = io_uring_wait_cqe(&ring, &cqe);
+        if (ret < 0)
+            die("io_uring_wait_cqe", -ret);
+        if (cqe->res < 0)
+            die("IORING_OP_SENDMSG", -cqe->res);
+        if ((size_t) cqe->res != iovcnt * b->frame_size)
+        {
+            fprintf(stderr, "uring-bench: short send (%d bytes)\n", cqe->res);
+            exit(EXIT_FAILURE);
+        }
+        io_uring_cqe_seen(&ring, cqe);
+    }
+
+    io_uring_queue_exit(&ring);
+    return NULL;
+}
+
+static void *sender_thread_func(void *args)
+{
+    bench_t *b = (bench_t *) args;
+    uint8_t *frame = calloc(1, b->frame_size);
+
+    if (frame == NULL)
+        die("calloc", ENOMEM);
+
+    switch (b->mode)
+    {
+    case MODE_SEND:
+        sender_send(b, frame);
+        break;
+    case MODE_BATCH:
+        sender_batch(b, frame);
+        break;
+    case MODE_URING:
+        sender_uring(b, frame);
+        break;
+    }
+
+    free(frame);
+    shutdown(b->sender, SHUT_WR);
+    return NULL;
+}
+
+
+/*
+ * Receiver side
+ */
+
+static size_t receiver_send(bench_t *b)
+{
+    uint8_t *buf = malloc(b->frame_size);
+    size_t total = 0;
+
+    if (buf == NULL)
+        die("malloc", ENOMEM);
+
+    /* Header first, then the payload */
+    for (size_t i = 0; i < b->nframes; i++)
+    {
+        if (recv_all(b->receiver, buf, HEADER_SIZE, &b->recv_syscalls) == -1 ||
+            recv_all(b->receiver, buf + HEADER_SIZE, b->frame_size - HEADER_SIZE, &b->recv_syscalls) == -1)
+            break;
+        total += b->frame_size;
+    }
+
+    free(buf);
+    return total;
+}
+
+static size_t receiver_batch(bench_t *b)
+{
+    uint8_t *buf = malloc(RECV_BUFFER_SIZE);
+    size_t total = 0;
+    ssize_t nbytes;
+
+    if (buf == NULL)
+        die("malloc", ENOMEM);
+
+    for (;;)
+    {
+        nbytes = recv(b->receiver, buf, RECV_BUFFER_SIZE, 0);
+        b->recv_syscalls++;
+        if (nbytes == -1 && errno == EINTR)
+            continue;
+        if (nbytes <= 0)
+            break;
+        total += nbytes;
+    }
+
+    free(buf);
+    return total;
+}
+
+static void arm_recv(struct io_uring *ring, int fd)
+{
+    struct io_uring_sqe *sqe = io_uring_get_sqe(ring);
+
+    io_uring_prep_recv_multishot(sqe, fd, NULL, 0, 0);
+    sqe->flags |= IOSQE_BUFFER_SELECT;
+    sqe->buf_group = RING_BGID;
+}
+
+static size_t receiver_uring(bench_t *b)
+{
+    struct io_uring ring;
+    struct io_uring_buf_ring *br;
+    struct io_uring_cqe *cqe;
+    uint8_t *bufs;
+    size_t total = 0;
+    bool done = false;
+    int ret;
+
+    ret = io_uring_queue_init(RING_ENTRIES, &ring, 0);
+    if (ret < 0)
+        die("io_uring_queue_init", -ret);
+
+    br = io_uring_setup_buf_ring(&ring, RING_NBUFS, RING_BGID, 0, &ret);
+    if (br == NULL)
+        die("io_uring_setup_buf_ring", -ret);
+
+    bufs = malloc(RING_NBUFS * RING_BUF_SIZE);
+    if (bufs == NULL)
+        die("malloc", ENOMEM);
+    for (int i = 0; i < RING_NBUFS; i++)
+        io_uring_buf_ring_add(br, bufs + i * RING_BUF_SIZE, RING_BUF_SIZE, i,
+                              io_uring_buf_ring_mask(RING_NBUFS), i);
+    io_uring_buf_ring_advance(br, RING_NBUFS);
+
+    arm_recv(&ring, b->receiver);
+
+    while (!done)
+    {
+        /* Only count a system call if we actually have to
+         * enter the kernel to submit or wait */
+        if (io_uring_sq_ready(&ring) > 0)
+        {
+            ret = io_uring_submit_and_wait(&ring, 1);
+            b->recv_syscalls++;
+            if (ret < 0)
+                die("io_uring_submit_and_wait", -ret);
+        }
+        else if (io_uring_peek_cqe(&ring, &cqe) != 0)
+        {
+            ret = io_uring_wait_cqe(&ring, &cqe);
+            b->recv_syscalls++;
+            if (ret < 0)
+                die("io_uring_wait_cqe", -ret);
+        }
+
+        unsigned head, seen = 0;
+        io_uring_for_each_cqe(&ring, head, cqe)
+        {
+            seen++;
+            if (cqe->res == -ENOBUFS)
+            {
+                /* All buffers were in use; the recv has been
+                 * terminated, so we need to re-arm it */
+                arm_recv(&ring, b->receiver);
+                continue;
+            }
+            if (cqe->res <= 0)
+            {
+                done = true;
+                break;
+            }
+
+            total += cqe->res;
+
+            int bid = cqe->flags >> IORING_CQE_BUFFER_SHIFT;
+            io_uring_buf_ring_add(br, bufs + bid * RING_BUF_SIZE, RING_BUF_SIZE, bid,
+                                  io_uring_buf_ring_mask(RING_NBUFS), 0);
+            io_uring_buf_ring_advance(br, 1);
+
+            if (!(cqe->flags & IORING_CQE_F_MORE))
+                arm_recv(&ring, b->receiver);
+        }
+        io_uring_cq_advance(&ring, seen);
+    }
+
+    io_uring_free_buf_ring(&ring, br, RING_NBUFS, RING_BGID);
+    io_uring_queue_exit(&ring);
+    free(bufs);
+    return total;
+}
+
+
+/*
+ * Setup
+ */
+
+static void connect_pair(bench_t *b)
+{
+    struct sockaddr_in addr;
+    socklen_t addrlen = sizeof(addr);
+    int listener, yes = 1;
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    addr.sin_port = 0;
+
+    if ((listener = socket(AF_INET, SOCK_STREAM, 0)) == -1)
+        die("socket", errno);
+    if (bind(listener, (struct sockaddr *) &addr, sizeof(addr)) == -1)
+        die("bind", errno);
+    if (listen(listener, 1) == -1)
+        die("listen", errno);
+    if (getsockname(listener, (struct sockaddr *) &addr, &addrlen) == -1)
+        die("getsockname", errno);
+
+    if ((b->sender = socket(AF_INET, SOCK_STREAM, 0)) == -1)
+        die("socket", errno);
+    if (connect(b->sender, (struct sockaddr *) &addr, sizeof(addr)) == -1)
+        die("connect", errno);
+    if ((b->receiver = accept(listener, NULL, NULL)) == -1)
+        die("accept", errno);
+
+    /* Same as the sockets between chiTCP daemons */
+    setsockopt(b->sender, IPPROTO_TCP, TCP_NODELAY, &yes, sizeof(yes));
+    setsockopt(b->receiver, IPPROTO_TCP, TCP_NODELAY, &yes, sizeof(yes));
+
+    close(listener);
+}
+
+static void usage(const char *prog)
+{
+    fprintf(stderr, "Usage: %s [-m MEGABYTES] [-s FRAME_SIZE] [-b BATCH] [send|batch|uring]\n", prog);
+    exit(EXIT_FAILURE);
+}
+
+int main(int argc, char *argv[])
+{
+    bench_t b;
+    pthread_t sender_thread;
+    struct timespec start, end;
+    size_t megabytes = DEFAULT_MEGABYTES;
+    size_t received = 0;
+    double elapsed, mb;
+    int opt;
+
+    memset(&b, 0, sizeof(b));
+    b.frame_size = DEFAULT_FRAME_SIZE;
+    b.batch = DEFAULT_BATCH;
+    b.mode = MODE_BATCH;
+
+    while ((opt = getopt(argc, argv, "m:s:b:h")) != -1)
+        switch (opt)
+        {
+        case 'm':
+            megabytes = strtoul(optarg, NULL, 10);
+            break;
+        case 's':
+            b.frame_size = strtoul(optarg, NULL, 10);
+            break;
+        case 'b':
+            b.batch = atoi(optarg);
+            break;
+        default:
+            usage(argv[0]);
+        }
+
+    if (optind < argc)
+    {
+        if (!strcmp(argv[optind], "send"))
+            b.mode = MODE_SEND;
+        else if (!strcmp(argv[optind], "batch"))
+            b.mode = MODE_BATCH;
+        else if (!strcmp(argv[optind], "uring"))
+            b.mode = MODE_URING;
+        else
+            usage(argv[0]);
+    }
+
+    if (megabytes == 0 || b.frame_size <= HEADER_SIZE || b.batch < 1 || b.batch > IOV_MAX)
+        usage(argv[0]);
+
+    b.nframes = (megabytes * 1024 * 1024) / b.frame_size;
+
+    connect_pair(&b);
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    if (pthread_create(&sender_thread, NULL, sender_thread_func, &b) != 0)
+        die("pthread_create", errno);
+
+    switch (b.mode)
+    {
+    case MODE_SEND:
+        received = receiver_send(&b);
+        break;
+    case MODE_BATCH:
+        received = receiver_batch(&b);
+        break;
+    case MODE_URING:
+        received = receiver_uring(&b);
+        break;
+    }
+
+    pthread_join(sender_thread, NULL);
+
+    clock_gettime(CLOCK_MONOTONIC, &end);
+
+    close(b.sender);
+    close(b.receiver);
+
+    if (received != b.nframes * b.frame_size)
+    {
+        fprintf(stderr, "uring-bench: received %zu bytes, expected %zu\n",
+                received, b.nframes * b.frame_size);
+        return EXIT_FAILURE;
+    }
+
+    elapsed = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+    mb = (double) received / (1024 * 1024);
+
+    printf("mode=%s frames=%zu frame_size=%zu batch=%d\n",
+           b.mode == MODE_SEND? "send" : b.mode == MODE_BATCH? "batch" : "uring",
+           b.nframes, b.frame_size, b.batch);
+    printf("  %.1f MB in %.3f s (%.1f MB/s)\n", mb, elapsed, mb / elapsed);
+    printf("  sender:   %lu syscalls (%.1f per MB)\n", b.send_syscalls, b.send_syscalls / mb);
+    printf("  receiver: %lu syscalls (%.1f per MB)\n", b.recv_syscalls, b.recv_syscalls / mb);
+
+    return EXIT_SUCCESS;
+}
@@ -135,6 +135,7 @@
  */
 
 #include <stdint.h>
+#include <stddef.h>
 #include "chitcp/types.h"
 
 #ifndef BUFFER_H_
@@ -145,10 +146,11 @@
 
 #include <pthread.h>
 
-typedef struct circular_buffer
+/* The bookkeeping of a circular buffer. It contains no pointers, so
+ * it can be placed in memory that is shared between processes (see
+ * circular_buffer_init_shared), with the data following it. */
+typedef struct circular_buffer_state
 {
-    uint8_t *data;
-
     uint32_t seq_initial;
     uint32_t seq_start;
     uint32_t seq_end;
@@ -165,8 +167,35 @@ typedef struct circular_buffer
     pthread_cond_t cv_notempty;
 
     uint32_t maxsize;
+} circular_buffer_state_t;
+
+/* Function called when the contents of a buffer change */
+typedef void (*circular_buffer_notify_t)(void *arg);
+
+typedef struct circular_buffer
+{
+    /* Points to local_state, or to the state in shared memory */
+    circular_buffer_state_t *state;
+    uint8_t *data;
+
+    /* Capacity of the buffer. In a shared buffer, this is a private
+     * copy of state->maxsize (which the other process could overwrite) */
+    uint32_t maxsize;
+
+    /* Is the buffer in shared memory? */
+    bool_t shared;
+
+    /* If not NULL, called whenever data is written to or read from
+     * the buffer, or it is closed (see circular_buffer_set_notify) */
+    circular_buffer_notify_t notify;
+    void *notify_arg;
+
+    circular_buffer_state_t local_state;
 } circular_buffer_t;
 
+/* Offset of the data from the start of a shared buffer's memory */
+#define CIRCULAR_BUFFER_DATA_OFFSET ((sizeof(circular_buffer_state_t) + 63) & ~((size_t) 63))
+
 
 /*
  * circular_buffer_init - Initializes the buffer
@@ -185,6 +214,57 @@ typedef struct circular_buffer
 int circular_buffer_init(circular_buffer_t *buf, uint32_t maxsize);
 
 
+/*
+ * circular_buffer_shared_size - Size of the memory needed by a shared buffer
+ *
+ * maxsize: The maximum capacity of the buffer
+ *
+ * Returns: Number of bytes needed by circular_buffer_init_shared
+ *
+ */
+size_t circular_buffer_shared_size(uint32_t maxsize);
+
+
+/*
+ * circular_buffer_init_shared - Initializes a buffer in shared memory
+ *
+ * Creates an empty buffer whose state and data are stored in "mem"
+ * (instead of being allocated), and whose lock and condition variables
+ * can be used by several processes. The lock is robust: if a process
+ * dies while holding it, the other processes can still use the buffer.
+ *
+ * buf: circular_buffer_t struct
+ *
+ * mem: Shared memory, of at least circular_buffer_shared_size(maxsize)
+ *      bytes. It must remain mapped while the buffer is in use.
+ *
+ * maxsize: The maximum capacity of the buffer
+ *
+ * Returns:
+ *  - CHITCP_OK: Buffer created correctly
+ *  - CHITCP_EINIT: Could not initialize the lock or condition variables
+ *
+ */
+int circular_buffer_init_shared(circular_buffer_t *buf, void *mem, uint32_t maxsize);
+
+
+/*
+ * circular_buffer_attach - Use a buffer created by another process
+ *
+ * buf: circular_buffer_t struct
+ *
+ * mem: Shared memory where circular_buffer_init_shared created the buffer
+ *
+ * memsize: Size of mem (used to validate the capacity of the buffer)
+ *
+ * Returns:
+ *  - CHITCP_OK: Buffer attached correctly
+ *  - CHITCP_EINVAL: mem does not contain a valid buffer
+ *
+ */
+int circular_buffer_attach(circular_buffer_t *buf, void *mem, size_t memsize);
+
+
 /*
  * circular_buffer_set_seq_initial - Set the initial sequence number
  *
@@ -215,7 +295,8 @@ int circular_buffer_set_seq_initial(circular_buffer_t *buf, uint32_t seq_initial
  *
  * If the buffer is closed (using circular_buffer_close)
  * while the function is blocked, the function returns
- * zero immediately.
+ * zero immediately. A non-blocking read from a closed
+ * and empty buffer also returns zero.
  *
  * buf: circular_buffer_t struct
  *
@@ -345,6 +426,17 @@ int circular_buffer_capacity(circular_buffer_t *buf);
  */
 int circular_buffer_count(circular_buffer_t *buf);
 
+/*
+ * circular_buffer_closed - Has the buffer been closed?
+ *
+ * buf: circular_buffer_t struct
+ *
+ * Returns:
+ *  - TRUE if circular_buffer_close has been called, FALSE otherwise
+ *
+ */
+bool_t circular_buffer_closed(circular_buffer_t *buf);
+
 /*
  * circular_buffer_available - Get number of available bytes in buffer
  *
@@ -357,6 +449,30 @@ int circular_buffer_count(circular_buffer_t *buf);
 int circular_buffer_available(circular_buffer_t *buf);
 
 
+/*
+ * circular_buffer_set_notify - Set the function to call when the
+ *                              buffer's contents change
+ *
+ * The function is called after data is written to or read from the
+ * buffer (but not when it is peeked at), and after the buffer is
+ * closed. It is called without holding the buffer's lock, so it can
+ * call any of the functions in this file. Only the changes made
+ * through this circular_buffer_t struct are notified (not the ones
+ * made by another process sharing the buffer).
+ *
+ * buf: circular_buffer_t struct
+ *
+ * notify: Function to call (or NULL, to stop notifying changes)
+ *
+ * arg: Argument to pass to the function
+ *
+ * Returns:
+ *  - CHITCP_OK: Function set successfully
+ *
+ */
+int circular_buffer_set_notify(circular_buffer_t *buf, circular_buffer_notify_t notify, void *arg);
+
+
 /*
  * circular_buffer_close - Close the buffer
  *
@@ -379,6 +495,9 @@ int circular_buffer_close(circular_buffer_t *buf);
 /*
  * circular_buffer_free - Free buffer's resources
  *
+ * A shared buffer is only closed, since its memory is not owned by
+ * the buffer (and the other process may still be using it).
+ *
  * buf: circular_buffer_t struct
  *
  * Returns:
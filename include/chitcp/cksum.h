@@ -0,0 +1,171 @@
+/*
+ *  chiTCP - A simple, testable TCP stack
+ *
+ *  Internet checksum
+ *
+ *  Functions to compute the 16-bit one's complement checksum used in
+ *  IP and TCP headers (RFC 1071), and to update a checksum when a
+ *  field in a header changes, without recomputing it (RFC 1624).
+ *
+ *  The sum is computed with the fastest implementation supported by
+ *  the CPU (AVX2 or SSE2 on x86), falling back to a portable
+ *  implementation with a 64-bit accumulator. The implementation is
+ *  chosen the first time a checksum is computed.
+ *
+ *  All the 16-bit checksums and header fields handled by these
+ *  functions are in network byte order (i.e., exactly as they
+ *  appear in the header).
+ *
+ */
+
+
+/*
+ *  Copyright (c) 2013-2014, The University of Chicago
+ *  All rights reserved.
+ *
+ *  Redistribution and use in source and binary forms, with or without
+ *  modification, are permitted provided that the following conditions are met:
+ *
+ *  - Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ *
+ *  - Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ *  - Neither the name of The University of Chicago nor the names of its
+ *    contributors may be used to endorse or promote products derived from this
+ *    software without specific prior written permission.
+ *
+ *  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ *  AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ *  IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ *  ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ *  LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ *  CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ *  SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ *  INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ *  CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ *  ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ *  POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+#ifndef CHITCP_CKSUM_H_
+#define CHITCP_CKSUM_H_
+
+#include <stdint.h>
+#include <stddef.h>
+
+/* Checksum implementations */
+typedef enum
+{
+    CKSUM_IMPL_AUTO    = 0,   /* Fastest one supported by the CPU */
+    CKSUM_IMPL_GENERIC = 1,   /* Portable, 64-bit accumulator */
+    CKSUM_IMPL_SSE2    = 2,
+    CKSUM_IMPL_AVX2    = 3,
+} cksum_impl_t;
+
+
+/*
+ * chitcp_cksum_partial - Adds data to a partial checksum
+ *
+ * Computes the one's complement sum of the data (as 16-bit words),
+ * and adds it to a partial sum. This can be used to compute the
+ * checksum of data that is not contiguous in memory (e.g., a
+ * pseudo-header and a TCP packet). All the chunks of data, except
+ * the last one, must have an even number of bytes.
+ *
+ * data: Pointer to data (does not need to be aligned)
+ *
+ * len: Number of bytes of data
+ *
+ * sum: Partial sum (zero for the first chunk)
+ *
+ * Returns: Partial sum (use chitcp_cksum_fold to get the checksum)
+ */
+uint32_t chitcp_cksum_partial(const void *data, size_t len, uint32_t sum);
+
+
+/*
+ * chitcp_cksum_fold - Turns a partial sum into a checksum
+ *
+ * sum: Partial sum
+ *
+ * Returns: 16-bit checksum (the one's complement of the folded sum)
+ */
+uint16_t chitcp_cksum_fold(uint32_t sum);
+
+
+/*
+ * chitcp_cksum - Computes the checksum of a buffer
+ *
+ * Unlike cksum() (see utils.h), a zero checksum is returned as zero.
+ *
+ * data: Pointer to data
+ *
+ * len: Number of bytes of data
+ *
+ * Returns: 16-bit checksum
+ */
+uint16_t chitcp_cksum(const void *data, size_t len);
+
+
+/*
+ * chitcp_cksum_update16 - Updates a checksum after a 16-bit field changes
+ *
+ * Implements equation 3 of RFC 1624: HC' = ~(~HC + ~m + m')
+ *
+ * cksum: Old checksum
+ *
+ * old: Old value of the field
+ *
+ * new: New value of the field
+ *
+ * Returns: New checksum
+ */
+uint16_t chitcp_cksum_update16(uint16_t cksum, uint16_t old, uint16_t new);
+
+
+/*
+ * chitcp_cksum_update32 - Updates a checksum after a 32-bit field changes
+ *
+ * Same as chitcp_cksum_update16, but for 32-bit fields (e.g., the
+ * acknowledgement number of a segment that is being retransmitted).
+ *
+ * cksum: Old checksum
+ *
+ * old: Old value of the field
+ *
+ * new: New value of the field
+ *
+ * Returns: New checksum
+ */
+uint16_t chitcp_cksum_update32(uint16_t cksum, uint32_t old, uint32_t new);
+
+
+/*
+ * chitcp_cksum_set_impl - Selects the checksum implementation
+ *
+ * This is meant for testing and benchmarking; by default, the
+ * fastest implementation supported by the CPU is used.
+ *
+ * impl: Implementation to use
+ *
+ * Returns:
+ *  - CHITCP_OK: Implementation selected
+ *  - CHITCP_EINVAL: The implementation is not supported by the
+ *                   CPU (or was not compiled in)
+ */
+int chitcp_cksum_set_impl(cksum_impl_t impl);
+
+
+/*
+ * chitcp_cksum_impl_str - Returns the name of the implementation in use
+ *
+ * Returns: Name of the implementation ("generic", "sse2", or "avx2")
+ */
+const char *chitcp_cksum_impl_str();
+
+
+#endif /* CHITCP_CKSUM_H_ */
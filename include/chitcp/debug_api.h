@@ -132,6 +132,43 @@ typedef struct debug_socket_state
     int recv_len;
 } debug_socket_state_t;
 
+/* Struct containing the performance counters of a chisocket, returned by
+ * chitcpd_get_socket_stats (see below). Times are in nanoseconds. */
+typedef struct debug_socket_stats
+{
+    uint64_t segs_sent;
+    uint64_t segs_rcvd;
+    uint64_t bytes_sent;          /* Payload bytes */
+    uint64_t bytes_rcvd;
+    uint64_t retransmits;
+    uint64_t dup_acks;
+    uint64_t zero_window_probes;
+    uint64_t out_of_order;
+    uint64_t send_blocked_ns;     /* Time spent by send() waiting for space */
+    uint64_t recv_blocked_ns;     /* Time spent by recv() waiting for data */
+    uint64_t rtt_samples;
+    uint64_t rtt_last_ns;
+    uint64_t rtt_min_ns;
+    uint64_t srtt_ns;
+} debug_socket_stats_t;
+
+/* Struct summarizing one of chitcpd's latency histograms, returned by
+ * chitcpd_get_latency (see below). Times are in nanoseconds. The
+ * percentiles are accurate to about 6%, and the maximum is exact. */
+typedef struct debug_latency
+{
+    char group[16];     /* "handler" (time spent handling a request),
+                           "response" (time spent sending its response),
+                           or "tcp_event" (time spent handling a TCP event) */
+    char name[32];      /* Request code (e.g., "SEND") or TCP event */
+    uint64_t count;
+    uint64_t mean_ns;
+    uint64_t p50_ns;
+    uint64_t p99_ns;
+    uint64_t p999_ns;
+    uint64_t max_ns;
+} debug_latency_t;
+
 /* Print the socket information to stdout. (Useful for debugging.) */
 void dump_socket_state(struct debug_socket_state *state, bool_t include_buffers);
 
@@ -196,4 +233,32 @@ debug_socket_state_t *chitcpd_get_socket_state(int sockfd, bool_t include_buffer
 
 int chitcpd_wait_for_state(int sockfd, tcp_state_t tcp_state);
 
+
+/* Get a dump of the binary trace of SOCKFD (the last segments and TCB
+ * transitions of the socket; see src/chitcpd/trace.h for the format, and
+ * the chitcpd-trace tool to print it). Caller will need to free the
+ * returned buffer. LEN is set to the size of the dump.
+ *
+ * Returns NULL (and sets errno) if SOCKFD is invalid or the dump could
+ * not be obtained. */
+uint8_t *chitcpd_get_socket_trace(int sockfd, size_t *len);
+
+
+/* Get the performance counters of SOCKFD (see debug_socket_stats above).
+ * Caller will need to free the returned structure.
+ *
+ * Returns NULL (and sets errno) if SOCKFD is invalid or the counters could
+ * not be obtained. */
+debug_socket_stats_t *chitcpd_get_socket_stats(int sockfd);
+
+
+/* Get a summary of chitcpd's latency histograms (see debug_latency above).
+ * Only histograms with at least one value are included. If RESET, the
+ * histograms are emptied. LATENCIES is set to an array that the caller
+ * will need to free.
+ *
+ * Returns the number of histograms in the array, or -1 (and sets errno)
+ * if the histograms could not be obtained. */
+int chitcpd_get_latency(bool_t reset, debug_latency_t **latencies);
+
 #endif /* __CHITCPD_DEBUG_API__H_ */
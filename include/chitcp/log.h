@@ -64,6 +64,26 @@ typedef enum {
     TRACE    = 70
 } loglevel_t;
 
+/*
+ * Highest log level that is compiled in. Calls to chilog (and the other
+ * logging functions) with a higher level are removed at compile time,
+ * including the evaluation of their arguments. Set with the CHILOG_MAX_LEVEL
+ * CMake option (which defaults to INFO in Release builds).
+ */
+#ifndef CHILOG_MAX_LEVEL
+#define CHILOG_MAX_LEVEL TRACE
+#endif
+
+/* Current logging level. Set it with chitcp_setloglevel */
+extern int chilog_loglevel;
+
+/*
+ * CHILOG_ENABLED - Checks whether messages at a given level are logged
+ *
+ * Useful to skip computing values that are only needed in log messages.
+ */
+#define CHILOG_ENABLED(level) ((level) <= CHILOG_MAX_LEVEL && (level) <= chilog_loglevel)
+
 /* Log prefixes when dumping the contents of packets */
 #define LOG_INBOUND ('<')
 #define LOG_OUTBOUND ('>')
@@ -76,6 +96,11 @@ typedef enum {
 #define MINLOG_RCVD_DROP ("DROP_RCVD")
 #define MINLOG_RCVD_DUPLD ("RCVD_DUPLICATE")
 #define MINLOG_RCVD_DELAYED ("RCVD_DELAYED")
+#define MINLOG_RCVD_BADSUM ("DROP_BADSUM")
+
+/* Default number of records in each thread's ring in asynchronous mode */
+#define CHILOG_ASYNC_DEFAULT_RING_SIZE (256)
+
 /*
  * chitcp_setloglevel - Sets the logging level
  *
@@ -90,6 +115,70 @@ typedef enum {
 void chitcp_setloglevel(loglevel_t level);
 
 
+/*
+ * chilog_async_start - Switches logging to asynchronous mode
+ *
+ * By default, chilog formats each message and writes it to stdout
+ * (under the stdout lock, and followed by a flush) in the calling thread.
+ *
+ * In asynchronous mode, chilog only formats the message itself and copies
+ * it, along with a timestamp and the thread's name, into a ring owned by
+ * the calling thread (each thread gets its own ring the first time it logs
+ * a message). A background thread collects the records from all the rings,
+ * in timestamp order, and writes them to stdout in batches. Logging never
+ * blocks: if a thread's ring is full, the message is dropped and counted
+ * (see chilog_async_dropped). Messages longer than a ring record (around
+ * 450 characters) are truncated.
+ *
+ * ring_size: Number of records in each thread's ring. Rounded up to a
+ *            power of two. If zero, CHILOG_ASYNC_DEFAULT_RING_SIZE is used.
+ *
+ * Returns:
+ *  - CHITCP_OK: Asynchronous logging started
+ *  - CHITCP_EINVAL: Asynchronous logging was already started
+ *  - CHITCP_ENOMEM: Could not allocate memory for the logging thread
+ *  - CHITCP_ETHREAD: Could not create the logging thread
+ */
+int chilog_async_start(unsigned int ring_size);
+
+
+/*
+ * chilog_async_stop - Switches logging back to synchronous mode
+ *
+ * Writes out all the pending records and stops the background thread.
+ * This function is also registered with atexit() by chilog_async_start.
+ *
+ * Returns:
+ *  - CHITCP_OK: Asynchronous logging stopped
+ *  - CHITCP_EINVAL: Asynchronous logging was not running
+ */
+int chilog_async_stop(void);
+
+
+/*
+ * chilog_async_dropped - Returns the number of dropped log messages
+ *
+ * Returns: Number of messages that were dropped because a thread's ring
+ *          was full since asynchronous logging was started.
+ */
+unsigned long chilog_async_dropped(void);
+
+
+/*
+ * chilog_set_thread_name - Updates the thread name shown in log messages
+ *
+ * In asynchronous mode, the name of a thread is looked up only once, and
+ * has to be updated explicitly if the thread is renamed. There is no need
+ * to call this function directly: set_thread_name (see utils.h) calls it
+ * when a thread renames itself.
+ *
+ * name: New name of the calling thread
+ *
+ * Returns: nothing.
+ */
+void chilog_set_thread_name(const char *name);
+
+
 /*
  * chilog - Print a log message
  *
@@ -152,4 +241,27 @@ void chilog_chitcp(loglevel_t level, uint8_t *packet, char prefix);
 void chilog_hex (loglevel_t level, void *data, int len);
 
 
+/*
+ * The logging functions are wrapped in macros that check the level before
+ * the call, so the arguments are not evaluated (and the call is compiled
+ * out entirely if the level is above CHILOG_MAX_LEVEL). The functions can
+ * still be called directly by enclosing their name in parentheses.
+ */
+#define chilog(level, ...) \
+    do { if (CHILOG_ENABLED(level)) (chilog)(level, __VA_ARGS__); } while (0)
+
+#define chilog_tcp(level, packet, prefix) \
+    do { if (CHILOG_ENABLED(level)) (chilog_tcp)(level, packet, prefix); } while (0)
+
+#define chilog_tcp_minimal(src, dst, sockfd, packet, prefix) \
+    do { if (CHILOG_ENABLED(MINIMAL) && chilog_loglevel == MINIMAL) \
+             (chilog_tcp_minimal)(src, dst, sockfd, packet, prefix); } while (0)
+
+#define chilog_chitcp(level, packet, prefix) \
+    do { if (CHILOG_ENABLED(level)) (chilog_chitcp)(level, packet, prefix); } while (0)
+
+#define chilog_hex(level, data, len) \
+    do { if (CHILOG_ENABLED(level)) (chilog_hex)(level, data, len); } while (0)
+
+
 #endif /* CHITCP_LOG_H_ */
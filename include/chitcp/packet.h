@@ -44,6 +44,7 @@
 #include <stdint.h>
 #include <stdbool.h>
 #include <netinet/in.h>
+#include "chitcp/types.h"
 #include "utlist.h"
 
 
@@ -70,13 +71,41 @@ uint32_t chitcp_htonl(uint32_t hostlong);
  *
  */
 
+/* Default number of bytes reserved in front of a packet's raw contents,
+ * so lower-layer headers (the chiTCP header, or the headers written to
+ * a capture file) can be prepended in place (see chitcp_tcp_packet_push) */
+#define TCP_PACKET_HEADROOM (64)
+
 /* struct to contain a single TCP packet */
 typedef struct tcp_packet
 {
     uint8_t    *raw;
     size_t  length;
+    size_t  headroom;   /* Bytes available in front of raw */
 } tcp_packet_t;
 
+/* Returns pointer to the start of the buffer that contains the packet
+ * (including its headroom) */
+#define TCP_PACKET_BUFFER(p) ((p)->raw - (p)->headroom)
+
+
+/*
+ * chitcp_tcp_packet_alloc - Allocates the raw contents of a TCP packet
+ *
+ * The contents of the packet are not initialized.
+ *
+ * packet: Pointer to unitialized tcp_packet_t variable.
+ *
+ * headroom: Number of bytes to reserve in front of the packet.
+ *
+ * length: Size of the packet (TCP header + payload) in bytes.
+ *
+ * Returns:
+ *  - CHITCP_OK: Packet allocated correctly
+ *  - CHITCP_ENOMEM: Could not allocate memory for the packet
+ */
+int chitcp_tcp_packet_alloc(tcp_packet_t *packet, size_t headroom, size_t length);
+
 
 /*
  * chitcp_tcp_packet_init - Initializes a tcp_packet_t struct with a payload.
@@ -87,10 +116,14 @@ typedef struct tcp_packet
  * packet: Pointer to unitialized tcp_packet_t variable.
  *
  * payload: Pointer to payload. The payload will be DEEP COPIED to the packet.
+ *          The raw contents of the packet are allocated from the calling
+ *          thread's packet pool (see pool.h), with TCP_PACKET_HEADROOM
+ *          bytes of headroom.
  *
  * payload_len: Size of the payload in number of bytes.
  *
- * Returns: the size in bytes of the TCP packet.
+ * Returns: the size in bytes of the TCP packet, or CHITCP_ENOMEM if
+ *          the packet could not be allocated.
  */
 int chitcp_tcp_packet_init(tcp_packet_t *packet, const uint8_t* payload, uint16_t payload_len);
 
@@ -102,6 +135,9 @@ int chitcp_tcp_packet_init(tcp_packet_t *packet, const uint8_t* payload, uint16_
  * the packet (header + payload). It does not free up the tcp_packet_t variable
  * itself. It is the responsibility of the calling function to do so.
  *
+ * The raw contents must have been allocated by chitcp_tcp_packet_init (or,
+ * more generally, with chitcp_pool_alloc), and can be freed from any thread.
+ *
  * packet: Pointer to packet.
  *
  * Returns: nothing.
@@ -109,6 +145,93 @@ int chitcp_tcp_packet_init(tcp_packet_t *packet, const uint8_t* payload, uint16_
 void chitcp_tcp_packet_free(tcp_packet_t *packet);
 
 
+/*
+ * chitcp_tcp_packet_clone - Makes a shallow copy of a TCP packet
+ *
+ * The raw contents of the packet are reference-counted, so the copy
+ * shares them with the original packet instead of copying them
+ * (e.g., to keep a segment in a retransmission queue after sending it,
+ * or to deliver a duplicate of a received segment). Both packets must
+ * be freed with chitcp_tcp_packet_free, and the raw contents are only
+ * released after both have been freed.
+ *
+ * Since the raw contents are shared, neither packet should be modified
+ * unless chitcp_tcp_packet_unshare is called first.
+ *
+ * Note that chitcpd_send_tcp_packet may also keep a reference to the
+ * raw contents of the packet it sends (until the packet is actually
+ * written to the network). So, once a packet has been sent, it must be
+ * treated as shared: if you keep it (e.g., in a retransmission queue)
+ * and need to change it (e.g., to update its ACK number or window),
+ * call chitcp_tcp_packet_unshare first. Otherwise, the modified bytes
+ * may be the ones that are sent. (In debug builds, chitcpd aborts if
+ * a packet is modified while it is waiting to be sent)
+ *
+ * dst: Pointer to unitialized tcp_packet_t variable.
+ *
+ * src: Packet to copy.
+ *
+ * Returns: the size in bytes of the TCP packet.
+ */
+int chitcp_tcp_packet_clone(tcp_packet_t *dst, const tcp_packet_t *src);
+
+
+/*
+ * chitcp_tcp_packet_unshare - Makes sure a packet can be modified
+ *
+ * If the packet's raw contents are shared with other packets (see
+ * chitcp_tcp_packet_clone), they are copied, so the packet can be
+ * modified (e.g., to set a fresh ACK number in a retransmitted
+ * segment) without affecting the other packets. If the packet is the
+ * only one using the raw contents, this function does nothing.
+ *
+ * packet: Pointer to packet.
+ *
+ * Returns:
+ *  - CHITCP_OK: The packet can be modified
+ *  - CHITCP_ENOMEM: Could not allocate memory for the copy
+ */
+int chitcp_tcp_packet_unshare(tcp_packet_t *packet);
+
+
+/*
+ * chitcp_tcp_packet_push - Prepends a header to a packet
+ *
+ * Uses "len" bytes of the packet's headroom, and updates the packet so
+ * raw points to the start of the new header (so the packet can be written
+ * out with a single contiguous write). Since raw no longer points to the
+ * TCP header, the TCP_* macros must not be used on the packet until the
+ * header is removed with chitcp_tcp_packet_pull.
+ *
+ * The headroom is part of the packet's raw contents, so the packet
+ * must not be shared (see chitcp_tcp_packet_unshare).
+ *
+ * packet: Pointer to packet.
+ *
+ * len: Size of the header in bytes.
+ *
+ * Returns: Pointer to the new header (which is not necessarily aligned),
+ *          or NULL if there is not enough headroom.
+ */
+uint8_t *chitcp_tcp_packet_push(tcp_packet_t *packet, size_t len);
+
+
+/*
+ * chitcp_tcp_packet_pull - Removes a header from the front of a packet
+ *
+ * Undoes chitcp_tcp_packet_push: the "len" bytes at the start of the
+ * packet become headroom again.
+ *
+ * packet: Pointer to packet.
+ *
+ * len: Size of the header in bytes.
+ *
+ * Returns: Pointer to the new start of the packet, or NULL if the
+ *          packet is shorter than "len" bytes.
+ */
+uint8_t *chitcp_tcp_packet_pull(tcp_packet_t *packet, size_t len);
+
+
 /*
  *
  *  List of TCP Packets
@@ -156,7 +279,8 @@ int chitcp_packet_list_append(tcp_packet_list_t **pl, tcp_packet_t *packet);
 /*
  * chitcp_packet_list_pop_head - Removes the packet at the head of the list.
  *
- * Note: This function doesn't return the packet, it just removes it.
+ * Note: This function doesn't return the packet, it just removes it
+ *       (and frees the list node, but not the packet).
  *
  * pl: Pointer to head pointer (head pointer is updated to point to new head,
  *     or set to NULL if the list is empty after the packet is removed).
@@ -284,6 +408,45 @@ typedef struct tcphdr
 #define SEG_UP(p) (chitcp_ntohs(TCP_PACKET_HEADER(p)->urp))
 
 
+/*
+ * chitcp_tcp_checksum - Computes the checksum of a TCP packet
+ *
+ * The checksum covers the packet and an IPv4 or IPv6 pseudo-header
+ * (RFC 9293, section 3.1) built from the source and destination
+ * addresses. IPv4-mapped IPv6 addresses are treated as IPv4 addresses.
+ * If the addresses are not both IPv4 or both IPv6, the checksum
+ * only covers the packet.
+ *
+ * The current value of the checksum field is ignored (i.e., the
+ * checksum is computed as if it were zero). The packet is not modified.
+ *
+ * packet: TCP packet
+ *
+ * src: Source address
+ *
+ * dst: Destination address
+ *
+ * Returns: The checksum, in network byte order (i.e., the value
+ *          that should be stored in the header's sum field)
+ */
+uint16_t chitcp_tcp_checksum(const tcp_packet_t *packet, const struct sockaddr *src, const struct sockaddr *dst);
+
+
+/*
+ * chitcp_tcp_checksum_valid - Checks the checksum of a TCP packet
+ *
+ * packet: TCP packet
+ *
+ * src: Source address
+ *
+ * dst: Destination address
+ *
+ * Returns: TRUE if the checksum in the packet's header is correct,
+ *          FALSE otherwise.
+ */
+bool_t chitcp_tcp_checksum_valid(const tcp_packet_t *packet, const struct sockaddr *src, const struct sockaddr *dst);
+
+
 /*
  *
  *  chiTCP Header
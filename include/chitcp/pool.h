@@ -0,0 +1,186 @@
+/*
+ *  chiTCP - A simple, testable TCP stack
+ *
+ *  Per-thread memory pools for packets
+ *
+ *  Every TCP segment involves a few small allocations (the packet's
+ *  raw bytes, a list node, the frame queued for the network layer,
+ *  etc.) that are usually freed on a different thread from the one
+ *  that allocated them. This module provides a simple allocator for
+ *  these objects:
+ *
+ *  - Each thread has its own pool, so allocating and freeing on the
+ *    same thread does not require any locking.
+ *
+ *  - Each pool has a few size classes: small blocks for header-only
+ *    segments (e.g., ACKs) and bookkeeping structs, and larger blocks
+ *    for MSS-sized segments. Requests larger than the largest size
+ *    class are simply malloc'd.
+ *
+ *  - Each block has a small header that precedes the data, so the
+ *    data (e.g., a packet's raw bytes) is inline with the block.
+ *
+ *  - A block freed by a thread other than the one that allocated it
+ *    is pushed onto the owning pool's "remote free" list, which is
+ *    a lock-free stack. The owner takes the entire list with a single
+ *    atomic exchange the next time its own free list is empty.
+ *
+ *  - When a thread exits, its pool is kept around (blocks it allocated
+ *    may still be in use), and is adopted by the next thread that
+ *    needs a pool. Memory is never returned to the system.
+ *
+ *  - Blocks are reference-counted, so several owners can share
+ *    the same (immutable) block, which is only returned to its pool
+ *    when the last reference is released with chitcp_pool_free.
+ *
+ */
+
+
+/*
+ *  Copyright (c) 2013-2014, The University of Chicago
+ *  All rights reserved.
+ *
+ *  Redistribution and use in source and binary forms, with or without
+ *  modification, are permitted provided that the following conditions are met:
+ *
+ *  - Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ *
+ *  - Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ *  - Neither the name of The University of Chicago nor the names of its
+ *    contributors may be used to endorse or promote products derived from this
+ *    software without specific prior written permission.
+ *
+ *  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ *  AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ *  IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ *  ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ *  LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ *  CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ *  SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ *  INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ *  CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ *  ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ *  POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+#ifndef CHITCP_POOL_H_
+#define CHITCP_POOL_H_
+
+#include <stdlib.h>
+
+/* Number of size classes, and size of the largest one */
+#define POOL_NCLASSES (3)
+#define POOL_MAX_CLASS_SIZE (2048)
+
+/* Number of blocks that are allocated at once when a
+ * pool runs out of blocks of a given size class */
+#define POOL_CHUNK_BLOCKS (64)
+
+
+/* Memory used by the pools (see chitcp_pool_stats) */
+typedef struct chitcp_pool_stats
+{
+    /* Size of the data in each size class */
+    size_t class_size[POOL_NCLASSES];
+
+    /* Number of blocks of each size class that have been allocated
+     * (in chunks of POOL_CHUNK_BLOCKS). Blocks are never returned
+     * to the system, so this is the high-water mark of each class. */
+    unsigned long class_blocks[POOL_NCLASSES];
+
+    /* Number of blocks currently in use that were allocated directly
+     * with malloc (blocks larger than POOL_MAX_CLASS_SIZE, and blocks
+     * allocated when a pool could not be created) */
+    unsigned long large_blocks;
+
+    /* Number of pools, and number of pools whose thread has exited */
+    unsigned long pools;
+    unsigned long orphan_pools;
+} chitcp_pool_stats_t;
+
+
+/*
+ * chitcp_pool_alloc - Allocates memory from the calling thread's pool
+ *
+ * The memory is not initialized.
+ *
+ * size: Number of bytes to allocate
+ *
+ * Returns: Pointer to the allocated memory, or NULL if
+ *          memory could not be allocated.
+ */
+void *chitcp_pool_alloc(size_t size);
+
+
+/*
+ * chitcp_pool_calloc - Allocates zeroed memory from the calling thread's pool
+ *
+ * nmemb: Number of elements
+ *
+ * size: Size of each element
+ *
+ * Returns: Pointer to the allocated memory, or NULL if
+ *          memory could not be allocated.
+ */
+void *chitcp_pool_calloc(size_t nmemb, size_t size);
+
+
+/*
+ * chitcp_pool_free - Releases a reference to memory allocated from a pool
+ *
+ * If this was the last reference to the memory, it is returned to the
+ * pool it was allocated from. This function can be called from any
+ * thread. ptr must have been returned by chitcp_pool_alloc or
+ * chitcp_pool_calloc (it must NOT have been returned by malloc).
+ *
+ * ptr: Memory to free (if NULL, this function does nothing)
+ *
+ * Returns: nothing.
+ */
+void chitcp_pool_free(void *ptr);
+
+
+/*
+ * chitcp_pool_ref - Adds a reference to memory allocated from a pool
+ *
+ * Every call to this function must be matched by a call to chitcp_pool_free.
+ *
+ * ptr: Memory allocated with chitcp_pool_alloc or chitcp_pool_calloc
+ *
+ * Returns: ptr
+ */
+void *chitcp_pool_ref(void *ptr);
+
+
+/*
+ * chitcp_pool_refcount - Returns the number of references to a block
+ *
+ * If the result is 1, the caller holds the only reference to the block
+ * (and no other thread can acquire one), so it is safe to modify it.
+ *
+ * ptr: Memory allocated with chitcp_pool_alloc or chitcp_pool_calloc
+ *
+ * Returns: Number of references
+ */
+unsigned int chitcp_pool_refcount(const void *ptr);
+
+
+/*
+ * chitcp_pool_stats - Returns the amount of memory used by the pools
+ *
+ * The counters are updated when pools grow (not on every allocation),
+ * so this function does not add any overhead to chitcp_pool_alloc.
+ *
+ * stats: Pointer to a chitcp_pool_stats_t that will be filled in.
+ *
+ * Returns: nothing.
+ */
+void chitcp_pool_stats(chitcp_pool_stats_t *stats);
+
+
+#endif /* CHITCP_POOL_H_ */
@@ -0,0 +1,195 @@
+/*
+ *  chiTCP - A simple, testable TCP stack
+ *
+ *  Shared-memory socket buffers
+ *
+ *  In shared-memory mode, the chiTCP daemon places the send and
+ *  receive buffers of a socket in a memory region (backed by a memfd)
+ *  and passes the region's file descriptor to the client process,
+ *  which maps it and reads/writes the payload directly (instead of
+ *  copying it in SEND and RECV messages). The region starts with a
+ *  header, followed by the two buffers (see circular_buffer_init_shared).
+ *
+ */
+
+/*
+ *  Copyright (c) 2013-2014, The University of Chicago
+ *  All rights reserved.
+ *
+ *  Redistribution and use in source and binary forms, with or without
+ *  modification, are permitted provided that the following conditions are met:
+ *
+ *  - Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ *
+ *  - Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ *  - Neither the name of The University of Chicago nor the names of its
+ *    contributors may be used to endorse or promote products derived from this
+ *    software without specific prior written permission.
+ *
+ *  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ *  AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ *  IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ *  ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ *  LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ *  CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ *  SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ *  INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ *  CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ *  ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ *  POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+#ifndef CHITCP_SHM_H_
+#define CHITCP_SHM_H_
+
+#include <stdint.h>
+#include <stdatomic.h>
+#include "chitcp/types.h"
+#include "chitcp/buffer.h"
+
+#define CHITCP_SHM_MAGIC (0x63745348)  /* "chTS" */
+
+/* Header of a shared-memory region */
+typedef struct chitcp_shm_header
+{
+    uint32_t magic;
+    uint32_t size;         /* Size of the whole region */
+    uint32_t bufsize;      /* Capacity of each buffer */
+    uint32_t send_offset;  /* Offset of the send buffer */
+    uint32_t recv_offset;  /* Offset of the receive buffer */
+
+    /* Copy of the socket's TCP state, updated by the daemon, so the
+     * client can check the state without asking the daemon */
+    atomic_int tcp_state;
+
+    /* Set once the daemon has initialized the buffers (this only
+     * happens when the socket's TCP thread starts) */
+    atomic_bool ready;
+} chitcp_shm_header_t;
+
+/* A mapping of a shared-memory region */
+typedef struct chitcp_shm
+{
+    int fd;
+    size_t size;
+    chitcp_shm_header_t *header;  /* NULL if not mapped */
+} chitcp_shm_t;
+
+
+/*
+ * chitcp_shm_create - Creates a shared-memory region for a socket
+ *
+ * The region is large enough for two buffers of "bufsize" bytes,
+ * but the buffers are not initialized (see chitcp_shm_init_buffers)
+ *
+ * shm: Mapping to initialize
+ *
+ * bufsize: Capacity of each buffer
+ *
+ * tcp_state: Initial TCP state of the socket
+ *
+ * Returns:
+ *  - CHITCP_OK: Region created and mapped
+ *  - CHITCP_EINIT: The region could not be created or mapped
+ *
+ */
+int chitcp_shm_create(chitcp_shm_t *shm, uint32_t bufsize, tcp_state_t tcp_state);
+
+
+/*
+ * chitcp_shm_map - Maps a shared-memory region created by another process
+ *
+ * shm: Mapping to initialize. On success, it owns the file descriptor.
+ *
+ * fd: File descriptor of the region
+ *
+ * Returns:
+ *  - CHITCP_OK: Region mapped
+ *  - CHITCP_EINVAL: fd is not a chiTCP shared-memory region
+ *  - CHITCP_EINIT: The region could not be mapped
+ *
+ */
+int chitcp_shm_map(chitcp_shm_t *shm, int fd);
+
+
+/*
+ * chitcp_shm_unmap - Unmaps a shared-memory region, and closes its descriptor
+ *
+ * The region itself is released once all the processes have unmapped it.
+ *
+ * shm: Mapping (it is ignored if it is not mapped)
+ *
+ * Returns:
+ *  - CHITCP_OK: Region unmapped
+ *
+ */
+int chitcp_shm_unmap(chitcp_shm_t *shm);
+
+
+/*
+ * chitcp_shm_init_buffers - Initializes the buffers in a region
+ *
+ * Called by the process that created the region. Marks the region
+ * as ready.
+ *
+ * shm: Mapping
+ *
+ * send, recv: Buffers to initialize (see circular_buffer_init_shared)
+ *
+ * Returns:
+ *  - CHITCP_OK: Buffers initialized
+ *  - CHITCP_EINIT: The buffers could not be initialized
+ *
+ */
+int chitcp_shm_init_buffers(chitcp_shm_t *shm, circular_buffer_t *send, circular_buffer_t *recv);
+
+
+/*
+ * chitcp_shm_attach_buffers - Attaches to the buffers in a region
+ *
+ * Called by the process that mapped the region.
+ *
+ * shm: Mapping
+ *
+ * send, recv: Buffers to attach (see circular_buffer_attach)
+ *
+ * Returns:
+ *  - CHITCP_OK: Buffers attached
+ *  - CHITCP_EWOULDBLOCK: The buffers have not been initialized yet
+ *  - CHITCP_EINVAL: The region does not contain valid buffers
+ *
+ */
+int chitcp_shm_attach_buffers(chitcp_shm_t *shm, circular_buffer_t *send, circular_buffer_t *recv);
+
+
+/*
+ * chitcp_shm_set_state - Updates the copy of the socket's TCP state
+ *
+ * shm: Mapping (it is ignored if it is not mapped)
+ *
+ * tcp_state: TCP state
+ *
+ */
+static inline void chitcp_shm_set_state(chitcp_shm_t *shm, tcp_state_t tcp_state)
+{
+    if (shm->header)
+        atomic_store_explicit(&shm->header->tcp_state, tcp_state, memory_order_release);
+}
+
+/*
+ * chitcp_shm_get_state - Returns the copy of the socket's TCP state
+ *
+ * shm: Mapping
+ *
+ */
+static inline tcp_state_t chitcp_shm_get_state(chitcp_shm_t *shm)
+{
+    return atomic_load_explicit(&shm->header->tcp_state, memory_order_acquire);
+}
+
+#endif /* CHITCP_SHM_H_ */
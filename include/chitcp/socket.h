@@ -11,6 +11,15 @@
  *  The documentation in this header file focuses on discussing
  *  the limits of the chisocket version of the functions.
  *
+ *  If the CHITCPD_SHM environment variable is set (to anything
+ *  other than "0"), the sockets are created in shared-memory mode:
+ *  the daemon places the send and receive buffers of each socket in
+ *  memory shared with the application, so chisocket_send() and
+ *  chisocket_recv() can copy the data directly to and from the
+ *  buffers (the daemon is only sent a short wakeup message). If
+ *  shared memory can't be used, the data is sent to the daemon
+ *  as usual. See chitcp/shm.h.
+ *
  *  TODO: Wait until these functions are fully implemented before
  *        writing this.
  *
@@ -55,6 +64,9 @@
 #include <unistd.h>
 #include <arpa/inet.h>
 #include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/epoll.h>
 
 extern int chisocket_socket(int domain, int type, int protocol);
 extern int chisocket_bind(int sockfd, const struct sockaddr *addr, socklen_t addrlen);
@@ -65,5 +77,91 @@ extern int chisocket_close(int sockfd);
 extern ssize_t chisocket_recv(int sockfd, void *buffer, size_t length, int flags);
 extern ssize_t chisocket_send(int sockfd, const void *buffer, size_t length, int flags);
 
+/*
+ * Non-blocking mode
+ *
+ * A socket is non-blocking if it was created with SOCK_NONBLOCK in its
+ * type, or if O_NONBLOCK is set with chisocket_fcntl (F_GETFL and
+ * F_SETFL are the only supported commands, and O_NONBLOCK is the only
+ * flag). Accepted sockets are always blocking. On a non-blocking socket:
+ *
+ *  - chisocket_accept fails with EAGAIN if there are no pending connections.
+ *  - chisocket_connect fails with EINPROGRESS right after starting the
+ *    three-way handshake. The socket becomes writable once the connection
+ *    is established (or gets a HUP event if it fails).
+ *  - chisocket_send and chisocket_recv behave as if MSG_DONTWAIT was set.
+ *
+ * The supported flags in chisocket_send and chisocket_recv are:
+ *
+ *  - MSG_DONTWAIT: Fail with EAGAIN instead of blocking. A send only
+ *    writes as much data as fits in the send buffer.
+ *  - MSG_PEEK (recv only): Return the data without removing it from
+ *    the receive buffer.
+ *  - MSG_WAITALL (recv only): Block until "length" bytes have been
+ *    received, or the connection is closed. It is ignored in
+ *    non-blocking mode and with MSG_PEEK.
+ *
+ * Any other flags are ignored.
+ */
+extern int chisocket_fcntl(int sockfd, int cmd, ...);
+
+/* Operations that can be part of a batch */
+#define CHISOCKET_OP_SEND  (1)
+#define CHISOCKET_OP_RECV  (2)
+#define CHISOCKET_OP_CLOSE (3)
+
+/* An operation in a batch (see chisocket_batch) */
+typedef struct chisocket_op
+{
+    int op;             /* CHISOCKET_OP_* */
+    int sockfd;
+    void *buffer;       /* Data to send, or where to store the received data */
+    size_t length;
+    int flags;
+
+    /* Result of the operation (set by chisocket_batch) */
+    ssize_t ret;        /* Same as chisocket_send/recv/close */
+    int error;          /* errno, if ret is -1 */
+} chisocket_op_t;
+
+/*
+ * chisocket_batch - Performs several send/recv/close operations
+ *
+ * The operations are sent to the daemon in a single request, and are
+ * performed one after the other, in order (so a recv that blocks will
+ * hold up the operations that follow it). This is useful to send and
+ * receive small messages on many sockets without making a request
+ * per socket. Operations in a batch never use shared memory.
+ *
+ * ops: Array of operations. On return, the ret and error fields of
+ *      each operation contain its result.
+ *
+ * nops: Number of operations
+ *
+ * Returns: 0 if the batch was performed (even if some of the
+ *          operations failed), or -1 (with errno set) if it wasn't.
+ */
+extern int chisocket_batch(chisocket_op_t *ops, size_t nops);
+
+/*
+ * chisocket_poll and chisocket_epoll_* work like their UNIX counterparts,
+ * but they only accept chisockets, and the epoll instances are not file
+ * descriptors (they must be closed with chisocket_epoll_close, and are
+ * closed automatically when the thread's connection to the daemon
+ * is closed).
+ *
+ * The only events are POLLIN/EPOLLIN (accept or recv won't block),
+ * POLLOUT/EPOLLOUT (send won't block) and POLLHUP/EPOLLHUP (the socket
+ * is not connected). Events are always level-triggered: other flags,
+ * like EPOLLET and EPOLLONESHOT, make chisocket_epoll_ctl fail with
+ * EINVAL. A socket is removed from all the interest lists when it
+ * is freed.
+ */
+extern int chisocket_poll(struct pollfd *fds, nfds_t nfds, int timeout);
+extern int chisocket_epoll_create(void);
+extern int chisocket_epoll_ctl(int epfd, int op, int sockfd, struct epoll_event *event);
+extern int chisocket_epoll_wait(int epfd, struct epoll_event *events, int maxevents, int timeout);
+extern int chisocket_epoll_close(int epfd);
+
 #endif  /* __CHITCP_SOCKET_H__ */
 
@@ -49,6 +49,8 @@
  * cksum - Computes a checksum
  *
  * Computes a 16-bit checksum that can be used in an IP or TCP header.
+ * A zero checksum is returned as 0xFFFF (see chitcp/cksum.h for
+ * more checksum functions).
  *
  * _data: Pointer to data to generate the checksum on
  *
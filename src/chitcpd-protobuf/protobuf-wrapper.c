@@ -43,16 +43,30 @@
 #include <stdio.h>
 #include <unistd.h>
 #include <errno.h>
+#include <string.h>
+#include <sys/socket.h>
 
 #include "chitcp/types.h"
 #include "protobuf-wrapper.h"
 
 
 int chitcpd_send_msg(int sockfd, const ChitcpdMsg *msg)
+{
+    return chitcpd_send_msg_fd(sockfd, msg, -1);
+}
+
+int chitcpd_send_msg_fd(int sockfd, const ChitcpdMsg *msg, int fd)
 {
     int nbytes;
     size_t size;
     uint8_t *packed;
+    struct msghdr mh;
+    struct iovec iov;
+    union
+    {
+        struct cmsghdr align;
+        char buf[CMSG_SPACE(sizeof(int))];
+    } cmsg;
 
     size = chitcpd_msg__get_packed_size(msg);
     packed = malloc(sizeof(size_t) + size); /* message length, then message */
@@ -66,8 +80,29 @@ int chitcpd_send_msg(int sockfd, const ChitcpdMsg *msg)
     *((size_t *) packed) = size; /* copy over the length (host byte order) */
     chitcpd_msg__pack(msg, packed + sizeof(size_t));
 
+    memset(&mh, 0, sizeof(mh));
+    iov.iov_base = packed;
+    iov.iov_len = sizeof(size_t) + size;
+    mh.msg_iov = &iov;
+    mh.msg_iovlen = 1;
+
+    if (fd >= 0)
+    {
+        /* The descriptor is passed with the first byte of the message */
+        struct cmsghdr *c;
+
+        memset(&cmsg, 0, sizeof(cmsg));
+        mh.msg_control = cmsg.buf;
+        mh.msg_controllen = sizeof(cmsg.buf);
+        c = CMSG_FIRSTHDR(&mh);
+        c->cmsg_level = SOL_SOCKET;
+        c->cmsg_type = SCM_RIGHTS;
+        c->cmsg_len = CMSG_LEN(sizeof(int));
+        memcpy(CMSG_DATA(c), &fd, sizeof(int));
+    }
+
     /* Send request */
-    nbytes = send(sockfd, packed, sizeof(size_t) + size, 0);
+    nbytes = sendmsg(sockfd, &mh, 0);
     free(packed);
     if (nbytes == -1 && (errno == ECONNRESET || errno == EPIPE))
     {
@@ -85,23 +120,56 @@ int chitcpd_send_msg(int sockfd, const ChitcpdMsg *msg)
 }
 
 int chitcpd_recv_msg(int sockfd, ChitcpdMsg **msg_p)
+{
+    return chitcpd_recv_msg_fd(sockfd, msg_p, NULL);
+}
+
+int chitcpd_recv_msg_fd(int sockfd, ChitcpdMsg **msg_p, int *fd)
 {
     int nbytes;
     size_t size;
     uint8_t *packed;
+    int passed_fd = -1;
+    struct msghdr mh;
+    struct iovec iov;
+    struct cmsghdr *c;
+    union
+    {
+        struct cmsghdr align;
+        char buf[CMSG_SPACE(sizeof(int))];
+    } cmsg;
+
+    /* Get the message length (and the descriptor passed with it, if any) */
+    memset(&mh, 0, sizeof(mh));
+    iov.iov_base = &size;
+    iov.iov_len = sizeof(size_t);
+    mh.msg_iov = &iov;
+    mh.msg_iovlen = 1;
+    mh.msg_control = cmsg.buf;
+    mh.msg_controllen = sizeof(cmsg.buf);
+
+    nbytes = recvmsg(sockfd, &mh, MSG_WAITALL | MSG_CMSG_CLOEXEC);
+
+    for (c = CMSG_FIRSTHDR(&mh); nbytes > 0 && c != NULL; c = CMSG_NXTHDR(&mh, c))
+    {
+        if (c->cmsg_level == SOL_SOCKET && c->cmsg_type == SCM_RIGHTS)
+            memcpy(&passed_fd, CMSG_DATA(c), sizeof(int));
+    }
 
-    /* Get the message length */
-    nbytes = recv(sockfd, &size, sizeof(size_t), MSG_WAITALL);
     if (nbytes == 0)
     {
         /* Peer disconnected */
         errno = ECONNRESET;
         close(sockfd);
+        if (passed_fd >= 0)
+            close(passed_fd);
         return -1;
     }
     else if (nbytes == -1)
     {
         perror("chitcpd_recv_msg: Unexpected error in recv()");
+        if (passed_fd >= 0)
+            close(passed_fd);
         return -2;
     }
 
@@ -109,6 +177,8 @@ int chitcpd_recv_msg(int sockfd, ChitcpdMsg **msg_p)
     if (!packed)
     {
         perror("chitcpd_recv_msg: malloc failed");
+        if (passed_fd >= 0)
+            close(passed_fd);
         return -2;
     }
 
@@ -120,12 +190,16 @@ int chitcpd_recv_msg(int sockfd, ChitcpdMsg **msg_p)
         errno = ECONNRESET;
         free(packed);
         close(sockfd);
+        if (passed_fd >= 0)
+            close(passed_fd);
         return -1;
     }
     else if (nbytes == -1)
     {
         perror("chitcpd_recv_msg: Unexpected error in recv()");
         free(packed);
+        if (passed_fd >= 0)
+            close(passed_fd);
         return -2;
     }
 
@@ -135,9 +209,16 @@ int chitcpd_recv_msg(int sockfd, ChitcpdMsg **msg_p)
     {
         errno = EPROTO;
         perror("chitcpd_recv_msg: Error unpacking chitcpd msg");
+        if (passed_fd >= 0)
+            close(passed_fd);
         return -2;
     }
 
+    if (fd)
+        *fd = passed_fd;
+    else if (passed_fd >= 0)
+        close(passed_fd);
+
     return CHITCP_OK;
 }
 
@@ -156,3 +237,16 @@ int chitcpd_send_and_recv_msg(int sockfd, const ChitcpdMsg *req, ChitcpdMsg **re
 
     return CHITCP_OK;
 }
+
+int chitcpd_send_and_recv_msg_fd(int sockfd, const ChitcpdMsg *req, ChitcpdMsg **resp, int *fd)
+{
+    int r;
+
+    if ((r = chitcpd_send_msg(sockfd, req)) < 0)
+        return r;
+
+    if ((r = chitcpd_recv_msg_fd(sockfd, resp, fd)) < 0)
+        return r;
+
+    return CHITCP_OK;
+}
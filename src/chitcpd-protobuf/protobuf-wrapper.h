@@ -58,6 +58,16 @@
  */
 int chitcpd_send_msg(int sockfd, const ChitcpdMsg *msg);
 
+/*
+ * chitcpd_send_msg_fd - Same as chitcpd_send_msg, but also passes a
+ *                       file descriptor to the peer (SOCKFD must be
+ *                       a UNIX socket)
+ *
+ * fd: File descriptor to pass (if negative, no descriptor is passed)
+ *
+ */
+int chitcpd_send_msg_fd(int sockfd, const ChitcpdMsg *msg, int fd);
+
 /*
  * chitcpd_recv_msg - Deserialize a message from SOCKFD. If unsuccessful,
  *                    this function automatically closes SOCKFD. The caller
@@ -75,6 +85,17 @@ int chitcpd_send_msg(int sockfd, const ChitcpdMsg *msg);
  */
 int chitcpd_recv_msg(int sockfd, ChitcpdMsg **msg);
 
+/*
+ * chitcpd_recv_msg_fd - Same as chitcpd_recv_msg, but also receives the
+ *                       file descriptor passed with the message (if any)
+ *
+ * fd: Location in which to store the received file descriptor, or -1
+ *     if the message was not accompanied by one. If NULL, a received
+ *     descriptor is closed.
+ *
+ */
+int chitcpd_recv_msg_fd(int sockfd, ChitcpdMsg **msg, int *fd);
+
 /*
  * chitcpd_send_and_recv_msg - Combines the functionality of chitcpd_send_msg
  *                             and chitcpd_recv_msg.
@@ -91,6 +112,14 @@ int chitcpd_recv_msg(int sockfd, ChitcpdMsg **msg);
  */
 int chitcpd_send_and_recv_msg(int sockfd, const ChitcpdMsg *req, ChitcpdMsg **resp);
 
+/*
+ * chitcpd_send_and_recv_msg_fd - Same as chitcpd_send_and_recv_msg, but
+ *                                also receives the file descriptor passed
+ *                                with the response (see chitcpd_recv_msg_fd)
+ *
+ */
+int chitcpd_send_and_recv_msg_fd(int sockfd, const ChitcpdMsg *req, ChitcpdMsg **resp, int *fd);
+
 
 #endif /* PROTOBUF_WRAPPER_H */
 
@@ -56,16 +56,92 @@
 #include <assert.h>
 #include <time.h>
 #include <errno.h>
+#include <limits.h>
+#include <sys/uio.h>
 #include "handlers.h"
 #include "connection.h"
+#include "framing.h"
+#include "epoll_rx.h"
+#include "uring.h"
 #include "chitcp/chitcpd.h"
 #include "chitcp/addr.h"
 #include "chitcp/log.h"
 #include "chitcp/utils.h"
+#include "chitcp/pool.h"
+#include "chitcp/cksum.h"
 #include "breakpoint.h"
+#include "trace.h"
+#include "pcap.h"
+#include "readiness.h"
 
 
 
+/*
+ * chitcpd_recv_frames - Process the chiTCP packets in a frame reader
+ *
+ * Takes every complete chiTCP packet out of the frame reader and
+ * hands it to chitcpd_recv_tcp_packet.
+ *
+ * si: Server info
+ *
+ * reader: Frame reader
+ *
+ * local_addr, peer_addr: Addresses of the real connection the packets
+ *                        were received on.
+ *
+ * Returns:
+ *  - CHITCP_OK: All complete packets were processed
+ *  - CHITCP_EINVAL: A malformed packet was received (the connection
+ *                   should be closed, as we can no longer find where
+ *                   the next packet starts)
+ *  - CHITCP_ENOMEM: Could not allocate memory for a packet
+ *
+ */
+int chitcpd_recv_frames(serverinfo_t *si, frame_reader_t *reader, struct sockaddr *local_addr, struct sockaddr *peer_addr)
+{
+    chitcphdr_t chitcp_header;
+    tcp_packet_t *packet;
+    int ret;
+
+    while ((ret = chitcpd_frame_reader_next(reader, &chitcp_header, &packet)) == CHITCP_OK)
+    {
+        chilog(TRACE, "Received a chiTCP header.");
+        chilog_chitcp(TRACE, (uint8_t *)&chitcp_header, LOG_INBOUND);
+
+        chilog(TRACE, "chiTCP packet contains a TCP payload");
+
+        /* Print the packet to the log */
+        chilog_tcp(TRACE, packet, LOG_INBOUND);
+
+        /* chitcpd_recv_tcp_packet does the heavy lifting of getting the
+         * packet to the right socket */
+        ret = chitcpd_recv_tcp_packet(si, packet, local_addr, peer_addr);
+
+        if(ret != CHITCP_OK)
+        {
+            /* TODO: Should send some sort of ICMP-ish message back to peer.
+             * For now, we just silently drop the packet */
+            chilog(WARNING, "Received a packet but did not find a socket to deliver it to (in real TCP, a ICMP message would be sent back to peer)");
+            atomic_fetch_add_explicit(&si->metrics.packets_no_socket, 1, memory_order_relaxed);
+            chitcp_tcp_packet_free(packet);
+            free(packet);
+        }
+    }
+
+    if (ret == CHITCP_EINVAL)
+    {
+        chilog(ERROR, "Received a chiTCP with an unknown payload type (proto=%i)", chitcp_header.proto);
+        return CHITCP_EINVAL;
+    }
+    else if (ret == CHITCP_ENOMEM)
+    {
+        chilog(ERROR, "Could not allocate memory for a received packet");
+        return CHITCP_ENOMEM;
+    }
+
+    return CHITCP_OK;
+}
+
 /*
  * chitcpd_connection_thread_func - Connection thread function
  *
@@ -88,20 +164,25 @@ void* chitcpd_connection_thread_func(void *args)
     set_thread_name(pthread_self(), cta->thread_name);
     free(args);
     struct sockaddr_storage local_addr, peer_addr;
-    chitcphdr_t chitcp_header;
-    uint8_t buf[1000];
-    uint16_t payload_len;
-    int ret;
+    frame_reader_t reader;
     /* Get the local and peer addresses */
     socklen_t lsize, psize;
     lsize = psize = sizeof(struct sockaddr_storage);
     getsockname(connection->realsocket_recv, (struct sockaddr*) &local_addr, &lsize);
     getpeername(connection->realsocket_recv, (struct sockaddr*) &peer_addr, &psize);
 
+    if (chitcpd_frame_reader_init(&reader, FRAME_READER_BUFFER_SIZE) != CHITCP_OK)
+    {
+        chilog(ERROR, "Could not allocate frame buffer for fd %d", connection->realsocket_recv);
+        close(connection->realsocket_recv);
+        pthread_exit(NULL);
+    }
+
     do
     {
-        /* Receive a chiTCP header */
-        nbytes = recv(connection->realsocket_recv, &chitcp_header, sizeof(chitcphdr_t), MSG_WAITALL);
+        /* Receive as many bytes as are available (possibly
+         * containing several chiTCP packets) */
+        nbytes = chitcpd_frame_reader_fill(&reader, connection->realsocket_recv, 0);
 
         if (nbytes == 0)
         {
@@ -111,76 +192,28 @@ void* chitcpd_connection_thread_func(void *args)
         }
         else if (nbytes == -1)
         {
+            if (errno == EINTR)
+                continue;
+
             chilog(ERROR, "Socket recv() failed on fd %d: %s", connection->realsocket_recv,
                     strerror(errno));
             close(connection->realsocket_recv);
-            pthread_exit(NULL);
+            done = 1;
         }
         else if (si->state != CHITCPD_STATE_STOPPING)
         {
-            chilog(TRACE, "Received a chiTCP header.");
-            chilog_chitcp(TRACE, (uint8_t *)&chitcp_header, LOG_INBOUND);
-
-            /* Inspect the chiTCP header to determine ho w to proceed */
-
-            payload_len = chitcp_ntohs(chitcp_header.payload_len);
-
-            if(chitcp_header.proto == CHITCP_PROTO_TCP)
-            {
-                /* This means the header will be following by a TCP packet */
-
-                /* Receive the packet */
-                nbytes = recv(connection->realsocket_recv, buf, payload_len, MSG_WAITALL);
-                if (nbytes == 0)
-                {
-                    // Server closed the connection
-                    close(connection->realsocket_recv);
-                    done = 1;
-                }
-                else if (nbytes == -1)
-                {
-                    chilog(ERROR, "Socket recv() failed on fd %d: %s",
-                            connection->realsocket_recv,
-                            strerror(errno));
-                    close(connection->realsocket_recv);
-                    pthread_exit(NULL);
-                }
-                else
-                {
-                    chilog(TRACE, "chiTCP packet contains a TCP payload");
-
-                    /* Allocate memory for received TCP packet */
-                    tcp_packet_t *packet = malloc(sizeof(tcp_packet_t));
-                    packet->raw = malloc(payload_len);
-                    memcpy(packet->raw, buf, payload_len);
-                    packet->length = payload_len;
-
-                    /* Print the packet to the log */
-                    chilog_tcp(TRACE, packet, LOG_INBOUND);
-
-                    /* chitcpd_recv_tcp_packet does the heavy lifting of getting the
-                     * packet to the right socket */
-                    ret = chitcpd_recv_tcp_packet(si, packet, (struct sockaddr*) &local_addr, (struct sockaddr*) &peer_addr);
-
-                    if(ret != CHITCP_OK)
-                    {
-                        /* TODO: Should send some sort of ICMP-ish message back to peer.
-                         * For now, we just silently drop the packet */
-                        chilog(WARNING, "Received a packet but did not find a socket to deliver it to (in real TCP, a ICMP message would be sent back to peer)");
-                    }
-                }
-            }
-            else
+            /* Process every complete chiTCP packet we have received */
+            if (chitcpd_recv_frames(si, &reader, (struct sockaddr*) &local_addr, (struct sockaddr*) &peer_addr) != CHITCP_OK)
             {
-                chilog(ERROR, "Received a chiTCP with an unknown payload type (proto=%i)", chitcp_header.proto);
                 close(connection->realsocket_recv);
                 done = 1;
             }
-
         }
     }
     while (!done);
 
+    chitcpd_frame_reader_free(&reader);
+
     pthread_exit(NULL);
 }
 
@@ -220,6 +253,146 @@ tcpconnentry_t* chitcpd_get_connection(serverinfo_t *si, struct sockaddr* addr)
 }
 
 
+/*
+ * chitcpd_connection_hash - Hash a chiTCP socket's 4-tuple
+ *
+ * Computes a FNV-1a hash of the local and remote IP addresses and ports,
+ * to pick which of the connections to a peer a socket will use.
+ *
+ * local_addr, remote_addr: Local and remote addresses (and ports) of the socket
+ *
+ * Returns: Hash value
+ *
+ */
+static uint32_t chitcpd_connection_hash(struct sockaddr* local_addr, struct sockaddr* remote_addr)
+{
+    struct sockaddr *addrs[2] = {local_addr, remote_addr};
+    uint32_t hash = 2166136261u;
+    const uint8_t *bytes;
+    size_t len;
+    in_port_t port;
+
+    for(int i=0; i < 2; i++)
+    {
+        if(addrs[i]->sa_family == AF_INET)
+        {
+            bytes = (const uint8_t *) &((struct sockaddr_in *) addrs[i])->sin_addr;
+            len = sizeof(struct in_addr);
+        }
+        else
+        {
+            bytes = (const uint8_t *) &((struct sockaddr_in6 *) addrs[i])->sin6_addr;
+            len = sizeof(struct in6_addr);
+        }
+
+        port = chitcp_get_addr_port(addrs[i]);
+
+        for(size_t j=0; j < len; j++)
+            hash = (hash ^ bytes[j]) * 16777619u;
+        for(size_t j=0; j < sizeof(in_port_t); j++)
+            hash = (hash ^ ((uint8_t *) &port)[j]) * 16777619u;
+    }
+
+    return hash;
+}
+
+/*
+ * chitcpd_get_socket_connection - Pick the TCP connection a chiTCP socket will use
+ *
+ * There may be several TCP connections to the same peer chiTCP daemon
+ * (see si->connection_stripes). The socket's 4-tuple is hashed to
+ * pick one of them. Since the socket always sends its packets
+ * through the same connection, they will arrive in order.
+ *
+ * Note that the result depends on the number of connections to the
+ * peer at the time of the call (which can grow as the peer establishes
+ * new connections), so this function should only be called once per
+ * socket, and the result stored in the socket's realtcpconn field.
+ *
+ * si: Server info
+ *
+ * local_addr, remote_addr: Local and remote addresses (and ports) of the socket
+ *
+ * Returns: Pointer to entry in connection table with connection to peer.
+ *          NULL if a connection to that peer has not been established yet.
+ *
+ */
+tcpconnentry_t* chitcpd_get_socket_connection(serverinfo_t *si, struct sockaddr* local_addr, struct sockaddr* remote_addr)
+{
+    assert(remote_addr->sa_family == AF_INET || remote_addr->sa_family == AF_INET6);
+
+    tcpconnentry_t *ret = NULL;
+    int nconnections = 0, n;
+
+    pthread_mutex_lock(&si->lock_connection_table);
+    /* Count the connections to the peer */
+    for(int i=0; i < si->connection_table_size; i++)
+    {
+        if(!si->connection_table[i].available &&
+           chitcp_addr_cmp(remote_addr, (struct sockaddr *) &si->connection_table[i].peer_addr) == 0)
+            nconnections++;
+    }
+
+    if(nconnections > 0)
+    {
+        /* Find the n-th connection to the peer */
+        n = chitcpd_connection_hash(local_addr, remote_addr) % nconnections;
+        for(int i=0; i < si->connection_table_size; i++)
+        {
+            if(!si->connection_table[i].available &&
+               chitcp_addr_cmp(remote_addr, (struct sockaddr *) &si->connection_table[i].peer_addr) == 0 &&
+               n-- == 0)
+            {
+                ret = &si->connection_table[i];
+                break;
+            }
+        }
+    }
+    pthread_mutex_unlock(&si->lock_connection_table);
+
+    return ret;
+}
+
+/*
+ * chitcpd_get_unpaired_connection - Get a loopback connection that does not
+ *                                   have a receive socket yet
+ *
+ * When connecting to the loopback address, the receive socket of a
+ * connection is the one returned by accept() in the network thread
+ * (see chitcpd_create_connection). Since all the connections to the
+ * loopback address are equivalent, it does not matter which connection
+ * an accepted socket is paired with.
+ *
+ * si: Server info
+ *
+ * addr: Address of peer where chiTCP daemon is running
+ *
+ * Returns: Pointer to entry in connection table with connection to peer.
+ *          NULL if there is no such connection.
+ *
+ */
+tcpconnentry_t* chitcpd_get_unpaired_connection(serverinfo_t *si, struct sockaddr* addr)
+{
+    assert(addr->sa_family == AF_INET || addr->sa_family == AF_INET6);
+
+    tcpconnentry_t *ret = NULL;
+
+    pthread_mutex_lock(&si->lock_connection_table);
+    for(int i=0; i < si->connection_table_size; i++)
+    {
+        if(!si->connection_table[i].available &&
+           si->connection_table[i].realsocket_recv == -1 &&
+           chitcp_addr_cmp(addr, (struct sockaddr *) &si->connection_table[i].peer_addr) == 0)
+        {
+            ret = &si->connection_table[i];
+            break;
+        }
+    }
+    pthread_mutex_unlock(&si->lock_connection_table);
+
+    return ret;
+}
+
 /*
  * chitcpd_get_available_connection_entry - Find an avalable slot in the connection table
  *
@@ -247,7 +420,7 @@ tcpconnentry_t* chitcpd_get_available_connection_entry(serverinfo_t *si)
 
 
 /*
- * chitcpd_create_connection - Establish a connection to another chiTCP daemon
+ * chitcpd_open_connection - Establish a single connection to another chiTCP daemon
  *
  * si: Server info
  *
@@ -257,7 +430,7 @@ tcpconnentry_t* chitcpd_get_available_connection_entry(serverinfo_t *si)
  *          NULL if the connection table is full, or if connection was unsuccessful
  *
  */
-tcpconnentry_t* chitcpd_create_connection(serverinfo_t *si, struct sockaddr* addr)
+static tcpconnentry_t* chitcpd_open_connection(serverinfo_t *si, struct sockaddr* addr)
 {
     assert(addr->sa_family == AF_INET || addr->sa_family == AF_INET6);
 
@@ -303,6 +476,16 @@ tcpconnentry_t* chitcpd_create_connection(serverinfo_t *si, struct sockaddr* add
     connection->realsocket_recv = -1;
 
     connect(connection->realsocket_send, (struct sockaddr*) &connection->peer_addr, addrsize);
+    chitcpd_connection_local_addr(connection->realsocket_send, (struct sockaddr*) &connection->peer_addr, &connection->local_addr);
+
+    if(chitcpd_create_connection_writer_thread(si, connection) != CHITCP_OK)
+    {
+        /* Give the entry back, so it isn't mistaken for an open connection */
+        close(connection->realsocket_send);
+        connection->realsocket_send = -1;
+        connection->available = TRUE;
+        return NULL;
+    }
 
     /* Create connection thread */
 
@@ -321,6 +504,42 @@ tcpconnentry_t* chitcpd_create_connection(serverinfo_t *si, struct sockaddr* add
     return connection;
 }
 
+/*
+ * chitcpd_create_connection - Establish connections to another chiTCP daemon
+ *
+ * Opens si->connection_stripes TCP connections to the peer (or,
+ * with the UDP transport, just adds the peer to the connection table).
+ *
+ * si: Server info
+ *
+ * addr: Address of peer running a chiTCP daemon
+ *
+ * Returns: Pointer to entry in connection table for the first new connection.
+ *          NULL if the connection table is full, or if connection was unsuccessful
+ *
+ */
+tcpconnentry_t* chitcpd_create_connection(serverinfo_t *si, struct sockaddr* addr)
+{
+    tcpconnentry_t *ret = NULL, *connection;
+
+    /* With the UDP transport, there is nothing to establish: all
+     * datagrams are sent through the daemon's network socket */
+    if(si->transport == CHITCPD_TRANSPORT_UDP)
+        return chitcpd_add_connection(si, si->network_socket, si->network_socket, addr);
+
+    for(int i=0; i < si->connection_stripes; i++)
+    {
+        connection = chitcpd_open_connection(si, addr);
+
+        if(connection == NULL)
+            break;
+        if(ret == NULL)
+            ret = connection;
+    }
+
+    return ret;
+}
+
 int chitcpd_create_connection_thread(serverinfo_t *si, tcpconnentry_t* connection)
 {
     connection_thread_args_t *cta;
@@ -329,6 +548,18 @@ int chitcpd_create_connection_thread(serverinfo_t *si, tcpconnentry_t* connectio
     /* For naming the connection threads we create (for debugging/logging) */
     static int next_thread_id = 0;
 
+    /* With the epoll-based network layer, we don't create a thread
+     * for the connection. One of the epoll receive threads will
+     * handle it instead. */
+    if (si->epoll_rx_nthreads > 0)
+        return chitcpd_epoll_rx_add_connection(si, connection);
+
+#ifdef CHITCPD_HAVE_LIBURING
+    /* Same with the io_uring backend */
+    if (si->uring_rx != NULL)
+        return chitcpd_uring_rx_add_connection(si, connection);
+#endif
+
     cta = malloc(sizeof(connection_thread_args_t));
     cta->si = si;
     cta->connection = connection;
@@ -345,6 +576,58 @@ int chitcpd_create_connection_thread(serverinfo_t *si, tcpconnentry_t* connectio
     return CHITCP_OK;
 }
 
+int chitcpd_create_connection_writer_thread(serverinfo_t *si, tcpconnentry_t* connection)
+{
+    connection_thread_args_t *cta;
+    pthread_t writer_thread;
+
+    /* For naming the writer threads we create (for debugging/logging) */
+    static int next_thread_id = 0;
+
+    pthread_mutex_lock(&connection->lock_tx);
+    connection->tx_queue = NULL;
+    connection->tx_queue_bytes = 0;
+    connection->tx_closed = FALSE;
+    pthread_mutex_unlock(&connection->lock_tx);
+
+    cta = malloc(sizeof(connection_thread_args_t));
+    cta->si = si;
+    cta->connection = connection;
+    snprintf(cta->thread_name, 16, "network-tx-%d", next_thread_id++);
+
+    if (pthread_create(&writer_thread, NULL, chitcpd_connection_writer_thread_func, cta) != 0)
+    {
+        perror("Could not create a connection writer thread");
+        free(cta);
+        return CHITCP_ETHREAD;
+    }
+
+    connection->writer_thread = writer_thread;
+
+    return CHITCP_OK;
+}
+
+/*
+ * chitcpd_close_connection_tx - Close a connection's transmit queue
+ *
+ * Any packets still in the queue are discarded, the writer thread
+ * is told to exit, and TCP threads waiting for space in the queue
+ * are woken up (and their sends will fail).
+ *
+ * connection: Connection entry
+ *
+ * Returns: Nothing.
+ *
+ */
+void chitcpd_close_connection_tx(tcpconnentry_t* connection)
+{
+    pthread_mutex_lock(&connection->lock_tx);
+    connection->tx_closed = TRUE;
+    pthread_cond_broadcast(&connection->cv_tx);
+    pthread_cond_broadcast(&connection->cv_tx_space);
+    pthread_mutex_unlock(&connection->lock_tx);
+}
+
 /*
  * chitcpd_add_connection - Add a connection to the connection table.
  *
@@ -393,10 +676,365 @@ tcpconnentry_t* chitcpd_add_connection(serverinfo_t *si, socket_t realsocket_sen
     /* Set sockets */
     ret->realsocket_send = realsocket_send;
     ret->realsocket_recv = realsocket_recv;
+    chitcpd_connection_local_addr(realsocket_send, (struct sockaddr*) &ret->peer_addr, &ret->local_addr);
+
+    if(chitcpd_create_connection_writer_thread(si, ret) != CHITCP_OK)
+        return NULL;
 
     return ret;
 }
 
+/*
+ * chitcpd_connection_local_addr - Get our address on a connection to a peer
+ *
+ * Finds the address that the peer sees as the source of the packets
+ * sent through a real socket. If the socket is not bound to a specific
+ * address (like the network socket of the UDP transport), this is the
+ * address of the interface that the kernel uses to reach the peer.
+ *
+ * realsocket: Real socket used to send packets to the peer
+ *
+ * peer_addr: Address of the peer
+ *
+ * local_addr: Pointer to where the address will be stored. If the
+ *             address can't be found, it is set to the ANY address.
+ *
+ * Returns:
+ *  - CHITCP_OK: The address was found
+ *  - CHITCP_ESOCKET: The address could not be found
+ *
+ */
+int chitcpd_connection_local_addr(socket_t realsocket, struct sockaddr *peer_addr, struct sockaddr_storage *local_addr)
+{
+    socklen_t size = sizeof(struct sockaddr_storage);
+    socket_t probe;
+    int rc;
+
+    memset(local_addr, 0, sizeof(struct sockaddr_storage));
+
+    if (getsockname(realsocket, (struct sockaddr *) local_addr, &size) == 0 &&
+        (local_addr->ss_family == AF_INET || local_addr->ss_family == AF_INET6) &&
+        !chitcp_addr_is_any((struct sockaddr *) local_addr))
+        return CHITCP_OK;
+
+    /* Connecting a UDP socket doesn't send anything, but it makes
+     * the kernel pick the source address for the peer */
+    memset(local_addr, 0, sizeof(struct sockaddr_storage));
+    local_addr->ss_family = peer_addr->sa_family;
+    size = sizeof(struct sockaddr_storage);
+
+    probe = socket(peer_addr->sa_family, SOCK_DGRAM, 0);
+    if (probe == -1)
+        return CHITCP_ESOCKET;
+
+    rc = connect(probe, peer_addr, peer_addr->sa_family == AF_INET?
+                 sizeof(struct sockaddr_in) : sizeof(struct sockaddr_in6));
+    if (rc == 0)
+        rc = getsockname(probe, (struct sockaddr *) local_addr, &size);
+    close(probe);
+
+    if (rc == -1)
+    {
+        chilog(WARNING, "Could not find the local address used to reach a peer: %s", strerror(errno));
+        memset(local_addr, 0, sizeof(struct sockaddr_storage));
+        local_addr->ss_family = peer_addr->sa_family;
+        return CHITCP_ESOCKET;
+    }
+
+    return CHITCP_OK;
+}
+
+/*
+ * chitcpd_sendv_all - Write an array of buffers to a real socket
+ *
+ * Keeps calling sendmsg() until all the buffers have been written,
+ * to account for partial writes.
+ *
+ * realsocket: Real socket
+ *
+ * iov: Buffers to write. Their contents may be modified.
+ *
+ * iovcnt: Number of buffers
+ *
+ * Returns: Number of bytes written, or -1 if an error happened.
+ *
+ */
+static ssize_t chitcpd_sendv_all(socket_t realsocket, struct iovec *iov, int iovcnt)
+{
+    struct msghdr msg;
+    ssize_t nbytes, nwritten = 0;
+
+    memset(&msg, 0, sizeof(struct msghdr));
+    msg.msg_iov = iov;
+    msg.msg_iovlen = iovcnt;
+
+    while (msg.msg_iovlen > 0)
+    {
+        nbytes = sendmsg(realsocket, &msg, MSG_NOSIGNAL);
+
+        if (nbytes == -1 && errno == EINTR)
+            continue;
+        else if (nbytes <= 0)
+            return -1;
+
+        nwritten += nbytes;
+
+        /* Skip over the iovecs that were written in full, and
+         * adjust the one that was partially written (if any) */
+        while (msg.msg_iovlen > 0 && (size_t) nbytes >= msg.msg_iov->iov_len)
+        {
+            nbytes -= msg.msg_iov->iov_len;
+            msg.msg_iov++;
+            msg.msg_iovlen--;
+        }
+        if (msg.msg_iovlen > 0)
+        {
+            msg.msg_iov->iov_base = (uint8_t *) msg.msg_iov->iov_base + nbytes;
+            msg.msg_iov->iov_len -= nbytes;
+        }
+    }
+
+    return nwritten;
+}
+
+/*
+ * chitcpd_send_datagrams - Send an array of buffers as UDP datagrams
+ *
+ * Each buffer is sent as a separate datagram to the connection's peer,
+ * using as few sendmmsg() calls as possible. Datagrams that cannot be
+ * sent are dropped (it is up to chiTCP to recover from this, just
+ * like it would recover from a packet lost in the network).
+ *
+ * connection: Connection entry
+ *
+ * iov: Buffers to send
+ *
+ * iovcnt: Number of buffers
+ *
+ * Returns: Nothing.
+ *
+ */
+static void chitcpd_send_datagrams(tcpconnentry_t *connection, struct iovec *iov, int iovcnt)
+{
+    struct mmsghdr msgs[iovcnt];
+    socklen_t addrsize;
+    int nsent = 0, n;
+
+    if(connection->peer_addr.ss_family == AF_INET)
+        addrsize = sizeof(struct sockaddr_in);
+    else
+        addrsize = sizeof(struct sockaddr_in6);
+
+    memset(msgs, 0, sizeof(msgs));
+    for(int i=0; i < iovcnt; i++)
+    {
+        msgs[i].msg_hdr.msg_name = &connection->peer_addr;
+        msgs[i].msg_hdr.msg_namelen = addrsize;
+        msgs[i].msg_hdr.msg_iov = &iov[i];
+        msgs[i].msg_hdr.msg_iovlen = 1;
+    }
+
+    while (nsent < iovcnt)
+    {
+        n = sendmmsg(connection->realsocket_send, msgs + nsent, iovcnt - nsent, 0);
+
+        if (n == -1)
+        {
+            if (errno == EINTR)
+                continue;
+
+            /* sendmmsg() only fails if the first datagram could not be sent */
+            chilog(WARNING, "Dropping a datagram that could not be sent on fd %d: %s",
+                    connection->realsocket_send, strerror(errno));
+            n = 1;
+        }
+
+        nsent += n;
+    }
+}
+
+/*
+ * chitcpd_tx_frame_free - Free a frame from the transmit queue
+ *
+ * frame: Frame to free
+ *
+ * Returns: Nothing.
+ *
+ */
+static void chitcpd_tx_frame_free(tx_frame_t *frame)
+{
+    /* Release our reference to the packet's buffer, if we had one */
+    chitcp_pool_free(frame->buffer);
+    chitcp_pool_free(frame);
+}
+
+#ifndef NDEBUG
+/*
+ * chitcpd_tx_frame_check - Checks that a frame wasn't modified while queued
+ *
+ * A frame that shares its buffer with a packet is corrupted if the
+ * owner of the packet modifies it without unsharing it first. This is
+ * a bug in the TCP code, which we'd rather catch here than on the wire.
+ *
+ * frame: Frame that is about to be sent
+ *
+ * Returns: Nothing.
+ *
+ */
+static void chitcpd_tx_frame_check(tx_frame_t *frame)
+{
+    if (frame->buffer != NULL && chitcp_cksum(frame->data, frame->length) != frame->cksum)
+    {
+        chilog(CRITICAL, "A TCP packet was modified after it was sent. "
+                         "Call chitcp_tcp_packet_unshare before modifying a packet you have sent.");
+        abort();
+    }
+}
+#endif
+
+/*
+ * chitcpd_connection_writer_thread_func - Connection writer thread function
+ *
+ * This thread is spawned when a connection to a peer chiTCP daemon
+ * is established, and is the only thread that writes to the
+ * connection's realsocket_send. It waits for the TCP threads to
+ * add packets to the connection's transmit queue, and sends all the
+ * queued packets with as few sendmsg() calls as possible (up to
+ * IOV_MAX packets per call). With the UDP transport, each packet is
+ * sent in its own datagram (using sendmmsg() to send several
+ * datagrams per call).
+ *
+ * args: arguments (a connection_thread_args_t variable)
+ *
+ * Returns: Nothing.
+ *
+ */
+void* chitcpd_connection_writer_thread_func(void *args)
+{
+    connection_thread_args_t *cta = (connection_thread_args_t *) args;
+
+    serverinfo_t *si = cta->si;
+    tcpconnentry_t *connection = cta->connection;
+    set_thread_name(pthread_self(), cta->thread_name);
+    free(args);
+
+    struct iovec iov[IOV_MAX];
+    tx_frame_t *frames, *frame, *next;
+    size_t nbytes;
+    int iovcnt;
+    bool_t done = FALSE;
+
+#ifdef CHITCPD_HAVE_LIBURING
+    chitcpd_uring_tx_t uring_tx;
+    bool_t use_ring = FALSE;
+
+    /* If we can't set up io_uring, we just use sendmsg() */
+    if (si->use_uring && si->transport == CHITCPD_TRANSPORT_TCP)
+    {
+        if (chitcpd_uring_tx_init(&uring_tx) != CHITCP_OK)
+            chilog(WARNING, "Using sendmsg() instead of io_uring for fd %d.", connection->realsocket_send);
+        else
+            use_ring = TRUE;
+    }
+#endif
+
+    while (!done)
+    {
+        /* Wait for packets, and take all of them at once, so the
+         * TCP threads can keep adding packets while we write */
+        pthread_mutex_lock(&connection->lock_tx);
+        while (connection->tx_queue == NULL && !connection->tx_closed)
+            pthread_cond_wait(&connection->cv_tx, &connection->lock_tx);
+        frames = connection->tx_queue;
+        connection->tx_queue = NULL;
+        done = connection->tx_closed;
+        pthread_mutex_unlock(&connection->lock_tx);
+
+#ifndef NDEBUG
+        DL_FOREACH(frames, frame)
+            chitcpd_tx_frame_check(frame);
+#endif
+
+        frame = frames;
+
+#ifdef CHITCPD_HAVE_LIBURING
+        if (use_ring && frame != NULL && !done)
+        {
+            /* Send all the frames with a single submission */
+            nbytes = 0;
+            DL_FOREACH(frames, frame)
+                nbytes += frame->length;
+
+            if (chitcpd_uring_send_frames(&uring_tx, connection->realsocket_send, frames) == -1)
+            {
+                chitcpd_close_connection_tx(connection);
+                done = TRUE;
+            }
+
+            pthread_mutex_lock(&connection->lock_tx);
+            connection->tx_queue_bytes -= nbytes;
+            pthread_cond_broadcast(&connection->cv_tx_space);
+            pthread_mutex_unlock(&connection->lock_tx);
+
+            /* DL_FOREACH leaves frame set to NULL, so the
+             * sendmsg() loop below is skipped */
+        }
+#endif
+
+        while (frame != NULL && !done)
+        {
+            nbytes = 0;
+            for (iovcnt = 0; frame != NULL && iovcnt < IOV_MAX; iovcnt++, frame = frame->next)
+            {
+                iov[iovcnt].iov_base = frame->data;
+                iov[iovcnt].iov_len = frame->length;
+                nbytes += frame->length;
+            }
+
+            chilog(TRACE, "Writing %i chiTCP packets (%zu bytes) to fd %d", iovcnt, nbytes, connection->realsocket_send);
+
+            if (si->transport == CHITCPD_TRANSPORT_UDP)
+                chitcpd_send_datagrams(connection, iov, iovcnt);
+            else if (chitcpd_sendv_all(connection->realsocket_send, iov, iovcnt) == -1)
+            {
+                chilog(ERROR, "Socket sendmsg() failed on fd %d: %s", connection->realsocket_send,
+                        strerror(errno));
+                chitcpd_close_connection_tx(connection);
+                done = TRUE;
+            }
+
+            pthread_mutex_lock(&connection->lock_tx);
+            connection->tx_queue_bytes -= nbytes;
+            pthread_cond_broadcast(&connection->cv_tx_space);
+            pthread_mutex_unlock(&connection->lock_tx);
+        }
+
+        for (frame = frames; frame != NULL; frame = next)
+        {
+            next = frame->next;
+            chitcpd_tx_frame_free(frame);
+        }
+    }
+
+    /* Discard any packets that were queued after the queue was closed */
+    pthread_mutex_lock(&connection->lock_tx);
+    for (frame = connection->tx_queue; frame != NULL; frame = next)
+    {
+        next = frame->next;
+        chitcpd_tx_frame_free(frame);
+    }
+    connection->tx_queue = NULL;
+    connection->tx_queue_bytes = 0;
+    pthread_mutex_unlock(&connection->lock_tx);
+
+#ifdef CHITCPD_HAVE_LIBURING
+    if (use_ring)
+        chitcpd_uring_tx_free(&uring_tx);
+#endif
+
+    pthread_exit(NULL);
+}
+
 /*
  * chitcpd_send_tcp_packet - Sends a TCP packet over chiTCP
  *
@@ -404,9 +1042,20 @@ tcpconnentry_t* chitcpd_add_connection(serverinfo_t *si, socket_t realsocket_sen
  *
  * sock: Socket table entry
  *
- * tcp_packet: TCP packet to send
+ * tcp_packet: TCP packet to send. If the packet has enough headroom, and
+ *             is not shared (see chitcp_tcp_packet_clone), the chiTCP header
+ *             is prepended in place and the connection's transmit queue
+ *             takes a reference to the packet's buffer; otherwise, the
+ *             packet is copied. Either way, the caller can free the packet
+ *             when this function returns, but must not modify it without
+ *             calling chitcp_tcp_packet_unshare first (in debug builds,
+ *             the writer thread aborts if the frame was modified; see
+ *             chitcpd_tx_frame_check).
  *
- * Returns: Number of bytes of data (excluding packet headers) sent
+ * Returns: Number of bytes of data (excluding packet headers) sent,
+ *          or -1 if the packet could not be queued (e.g., because the
+ *          connection is closing). If the transmit queue is full, this
+ *          function blocks until there is room in the queue.
  *
  */
 int chitcpd_send_tcp_packet(serverinfo_t *si, chisocketentry_t *sock, tcp_packet_t* tcp_packet)
@@ -417,50 +1066,108 @@ int chitcpd_send_tcp_packet(serverinfo_t *si, chisocketentry_t *sock, tcp_packet
     {
         chilog(TRACE, "chitcpd_send_tcp_packet: dropping the packet");
         chilog_tcp_minimal((struct sockaddr *) &sock->local_addr, (struct sockaddr *) &sock->remote_addr, SOCKET_NO(si, sock), tcp_packet, MINLOG_SEND_DROP);
+        chitcpd_trace_add(sock, TRACE_SEG_DROPPED, 0, sock->tcp_state, tcp_packet);
         return tcp_packet->length; /* fake that the packet was sent */
     }
     tcpconnentry_t *connection = sock->socket_state.active.realtcpconn;
 
-    /* Allocate memory for the chiTCP header and the TCP packet */
-    uint8_t *full_packet = calloc(sizeof(chitcphdr_t) + tcp_packet->length, 1);
-
-
     /* Create the chiTCP header */
-    chitcphdr_t *header = (chitcphdr_t *) full_packet;
-    header->payload_len = chitcp_htons(tcp_packet->length);
-    header->proto = CHITCP_PROTO_TCP;
+    chitcphdr_t header;
+    memset(&header, 0, sizeof(chitcphdr_t));
+    header.payload_len = chitcp_htons(tcp_packet->length);
+    header.proto = CHITCP_PROTO_TCP;
+
+    /* Compute the TCP checksum now that the header is final. It is
+     * written below to whatever buffer is actually sent, so we
+     * don't modify the packet if it is shared. The pseudo-header
+     * uses the addresses of the real connection, which is what the
+     * peer verifies the checksum against (sock->local_addr may be
+     * the ANY address) */
+    uint16_t sum = TCP_PACKET_HEADER(tcp_packet)->sum;
+    if (!(si->cksum_offload & CHITCPD_CKSUM_OFFLOAD_TX))
+        sum = chitcp_tcp_checksum(tcp_packet, (struct sockaddr *) &connection->local_addr, (struct sockaddr *) &connection->peer_addr);
+
+    size_t frame_len = sizeof(chitcphdr_t) + tcp_packet->length;
+    bool_t in_place = tcp_packet->headroom >= sizeof(chitcphdr_t) &&
+                      chitcp_pool_refcount(TCP_PACKET_BUFFER(tcp_packet)) == 1;
+    tx_frame_t *frame = chitcp_pool_alloc(sizeof(tx_frame_t) + (in_place? 0 : frame_len));
+
+    if (frame == NULL)
+    {
+        chilog(ERROR, "Could not allocate memory for an outbound packet");
+        return -1;
+    }
+    frame->length = frame_len;
 
-    /* Copy the packet */
-    memcpy(full_packet + sizeof(chitcphdr_t), tcp_packet->raw, tcp_packet->length);
+    if (in_place)
+    {
+        /* Nobody else is using the packet's buffer, so we can write the
+         * chiTCP header into its headroom, and just take a reference
+         * to the buffer (which is released by the writer thread) */
+        TCP_PACKET_HEADER(tcp_packet)->sum = sum;
+        frame->data = chitcp_tcp_packet_push(tcp_packet, sizeof(chitcphdr_t));
+        memcpy(frame->data, &header, sizeof(chitcphdr_t));
+        chitcp_tcp_packet_pull(tcp_packet, sizeof(chitcphdr_t));
+        frame->buffer = chitcp_pool_ref(TCP_PACKET_BUFFER(tcp_packet));
+#ifndef NDEBUG
+        frame->cksum = chitcp_cksum(frame->data, frame->length);
+#endif
+    }
+    else
+    {
+        frame->data = frame->inline_data;
+        frame->buffer = NULL;
+        memcpy(frame->data, &header, sizeof(chitcphdr_t));
+        memcpy(frame->data + sizeof(chitcphdr_t), tcp_packet->raw, tcp_packet->length);
+        ((tcphdr_t *) (frame->data + sizeof(chitcphdr_t)))->sum = sum;
+    }
 
     /* Print the chiTCP header and the full TCP packet */
     chilog(TRACE, "Sending a chiTCP packet with a TCP payload.");
     chilog(TRACE, "chiTCP Header:");
-    chilog_chitcp(TRACE, (uint8_t*) header, LOG_OUTBOUND);
+    chilog_chitcp(TRACE, (uint8_t*) &header, LOG_OUTBOUND);
 
     chilog(TRACE, "TCP payload:");
     chilog_tcp_minimal((struct sockaddr *) &sock->local_addr, (struct sockaddr *) &sock->remote_addr, SOCKET_NO(si, sock), tcp_packet, MINLOG_SEND);
     chilog_tcp(TRACE, tcp_packet, LOG_OUTBOUND);
+    chitcpd_trace_add(sock, TRACE_SEG_SENT, 0, sock->tcp_state, tcp_packet);
+    chitcpd_stats_segment_sent(&sock->stats, &sock->socket_state.active.tcp_data, tcp_packet);
 
-    /* Send the chiTCP header and the TCP packet */
-    int nbytes, nleft, nwritten = 0;
+    if (si->libpcap != NULL)
+    {
+        /* Capture the segment as it will be sent (with its checksum), by
+         * taking a reference to the frame's buffer (or the frame itself,
+         * if the segment was copied to it) */
+        tcp_packet_t sent;
+        sent.raw = frame->data + sizeof(chitcphdr_t);
+        sent.length = tcp_packet->length;
+        sent.headroom = sent.raw - (frame->buffer != NULL? frame->buffer : (uint8_t *) frame);
+        chitcpd_pcap_packet(si->libpcap, &sent, (struct sockaddr *) &sock->local_addr, (struct sockaddr *) &sock->remote_addr,
+                            CHITCPD_PCAP_OUTBOUND, SOCKET_NO(si, sock), sock->id, sock->tcp_state);
+    }
 
-    uint8_t *buf = full_packet;
-    nleft = sizeof(chitcphdr_t) + tcp_packet->length;
+    /* Add the packet to the connection's transmit queue. If the queue
+     * is full, the TCP thread blocks until the writer thread drains it
+     * (this is how backpressure from the network reaches the TCP layer) */
+    pthread_mutex_lock(&connection->lock_tx);
+    while (connection->tx_queue_bytes >= si->tx_queue_limit && !connection->tx_closed)
+    {
+        chilog(DEBUG, "Transmit queue on fd %d is full (%zu bytes). Waiting.",
+                connection->realsocket_send, connection->tx_queue_bytes);
+        pthread_cond_wait(&connection->cv_tx_space, &connection->lock_tx);
+    }
 
-    /* TODO: Possible race condition if multiple TCP threads want to send
-     * at the same time *and* this send() doesn't send the entire packet */
-    while ( nleft > 0 ) {
-        if ( (nbytes = send(connection->realsocket_send, buf, nleft, 0)) <= 0 ) {
-            return -1;
-        }
-        nleft -= nbytes;
-        buf += nbytes;
-        nwritten += nbytes;
+    if (connection->tx_closed)
+    {
+        pthread_mutex_unlock(&connection->lock_tx);
+        chitcpd_tx_frame_free(frame);
+        return -1;
     }
-    assert(nwritten == sizeof(chitcphdr_t) + tcp_packet->length);
 
-    free(full_packet);
+    DL_APPEND(connection->tx_queue, frame);
+    connection->tx_queue_bytes += frame_len;
+    pthread_cond_signal(&connection->cv_tx);
+    pthread_mutex_unlock(&connection->lock_tx);
 
     return tcp_packet->length;
 }
@@ -469,7 +1176,6 @@ int chitcpd_send_tcp_packet(serverinfo_t *si, chisocketentry_t *sock, tcp_packet
 /* Forward declarations */
 void chitcpd_queue_packet_delivery(serverinfo_t *si, chisocketentry_t *entry, tcp_packet_t* tcp_packet, struct sockaddr_storage *local_addr, struct sockaddr_storage *remote_addr, char* log_prefix);
 void chitcpd_deliver_packet(serverinfo_t *si, chisocketentry_t *entry, tcp_packet_t* tcp_packet, struct sockaddr_storage *local_addr, struct sockaddr_storage *remote_addr, char* log_prefix);
-int chitcpd_pcap_packet(serverinfo_t *si, tcp_packet_t* tcp_packet, struct sockaddr_storage *local_addr, struct sockaddr_storage *peer_addr);
 
 
 void* chitcpd_packet_delivery_thread_func(void *args)
@@ -498,7 +1204,9 @@ void* chitcpd_packet_delivery_thread_func(void *args)
             {
                 chitcpd_deliver_packet(si, list_entry->entry, list_entry->tcp_packet,
                                        &list_entry->local_addr, &list_entry->remote_addr, list_entry->log_prefix);
+                chitcpd_histogram_add(&si->metrics.delivery_delay, chitcpd_stats_clock() - list_entry->received);
                 DL_DELETE(si->delivery_queue, list_entry);
+                chitcp_pool_free(list_entry);
             }
             else
             {
@@ -534,7 +1242,8 @@ void* chitcpd_packet_delivery_thread_func(void *args)
  * peer_addr: Address of peer from whence the TCP packet arrived
  *
  * Returns:
- *  - CHITCP_OK: Packet was processed correctly
+ *  - CHITCP_OK: Packet was processed correctly (or it was dropped, and
+ *               freed, because its checksum was not correct)
  *  - CHITCP_ESOCKET: Invalid socket
  *
  */
@@ -543,6 +1252,7 @@ int chitcpd_recv_tcp_packet(serverinfo_t *si, tcp_packet_t* tcp_packet, struct s
     tcphdr_t *header = (tcphdr_t*) tcp_packet->raw;
     chisocketentry_t *entry;
     struct sockaddr_storage local_addr, remote_addr;
+    uint64_t received = chitcpd_stats_clock();
 
     /* We construct the addresses based on the underlying TCP addresses */
     memcpy(&local_addr, local_realaddr, sizeof(struct sockaddr_storage));
@@ -550,6 +1260,19 @@ int chitcpd_recv_tcp_packet(serverinfo_t *si, tcp_packet_t* tcp_packet, struct s
     chitcp_set_addr_port((struct sockaddr*) &local_addr, header->dest);
     chitcp_set_addr_port((struct sockaddr*) &remote_addr, header->source);
 
+    /* Verify the checksum before we trust anything in the header */
+    if (!(si->cksum_offload & CHITCPD_CKSUM_OFFLOAD_RX) &&
+        !chitcp_tcp_checksum_valid(tcp_packet, (struct sockaddr *) &remote_addr, (struct sockaddr *) &local_addr))
+    {
+        atomic_fetch_add_explicit(&si->cksum_drops, 1, memory_order_relaxed);
+        chilog(DEBUG, "Dropping a packet with a bad checksum (0x%04x)", chitcp_ntohs(header->sum));
+        chilog_tcp_minimal((struct sockaddr *) &remote_addr, (struct sockaddr *) &local_addr, -1, tcp_packet, MINLOG_RCVD_BADSUM);
+        chitcp_tcp_packet_free(tcp_packet);
+        free(tcp_packet);
+
+        return CHITCP_OK;
+    }
+
     /* Get entry of socket that will receive this packet */
     entry = chitcpd_lookup_socket(si, (struct sockaddr *) &local_addr, (struct sockaddr *) &remote_addr, FALSE);
 
@@ -583,9 +1306,12 @@ int chitcpd_recv_tcp_packet(serverinfo_t *si, tcp_packet_t* tcp_packet, struct s
     {
         /* If dropping the packet, we don't do anything but we log it */
         chilog_tcp_minimal((struct sockaddr *) &local_addr, (struct sockaddr *) &remote_addr, SOCKET_NO(si, entry), tcp_packet, MINLOG_RCVD_DROP);
+        chitcpd_trace_add(entry, TRACE_SEG_DROPPED, 0, entry->tcp_state, tcp_packet);
     }
     else
     {
+        chitcpd_trace_add(entry, TRACE_SEG_RCVD, 0, entry->tcp_state, tcp_packet);
+
 
         /* If DBG_RESP_WITHHOLD, we add the packet to the withheld list.
          * If DBG_RESP_DUPLICATE, we add the packet to the withheld list (this will be the duplicate)
@@ -596,16 +1322,15 @@ int chitcpd_recv_tcp_packet(serverinfo_t *si, tcp_packet_t* tcp_packet, struct s
             /* Put the packet on the socket's withheld_packets queue */
             chilog(TRACE, "chitcpd_recv_tcp_packet: withholding a copy");
 
-            withheld_tcp_packet_t *wp = calloc(sizeof(withheld_tcp_packet_t), 1);
+            withheld_tcp_packet_t *wp = chitcp_pool_calloc(1, sizeof(withheld_tcp_packet_t));
 
-            /* If we're creating a duplicate, make a deep copy */
+            /* If we're creating a duplicate, the duplicate shares
+             * the packet's (reference-counted) raw contents */
             if (r == DBG_RESP_DUPLICATE)
             {
-                wp->packet = calloc(sizeof(tcp_packet_t), 1);
-                wp->packet->length = tcp_packet->length;
-                wp->packet->raw = calloc(tcp_packet->length, 1);
+                wp->packet = malloc(sizeof(tcp_packet_t));
+                chitcp_tcp_packet_clone(wp->packet, tcp_packet);
                 wp->duplicate = TRUE;
-                memcpy(wp->packet->raw, tcp_packet->raw, tcp_packet->length);
             }
             /* Otherwise, if we're just withholding the packet, we just
              * need to point to it, since it won't be processed (and freed)
@@ -652,6 +1377,7 @@ int chitcpd_recv_tcp_packet(serverinfo_t *si, tcp_packet_t* tcp_packet, struct s
             {
                 /* No need to put the packet in the delivery queue; just deliver the packet */
                 chitcpd_deliver_packet(si, entry, tcp_packet, &local_addr, &remote_addr, MINLOG_RCVD);
+                chitcpd_histogram_add(&si->metrics.delivery_delay, chitcpd_stats_clock() - received);
             }
 
 
@@ -678,7 +1404,7 @@ int chitcpd_recv_tcp_packet(serverinfo_t *si, tcp_packet_t* tcp_packet, struct s
                                            withheld_packet->duplicate? MINLOG_RCVD_DUPLD : MINLOG_RCVD_DELAYED);
                 }
 
-                free(withheld_packet);
+                chitcp_pool_free(withheld_packet);
             }
         }
 
@@ -692,7 +1418,7 @@ int chitcpd_recv_tcp_packet(serverinfo_t *si, tcp_packet_t* tcp_packet, struct s
 
 void chitcpd_queue_packet_delivery(serverinfo_t *si, chisocketentry_t *entry, tcp_packet_t* tcp_packet, struct sockaddr_storage *local_addr, struct sockaddr_storage *remote_addr, char* log_prefix)
 {
-    packet_delivery_list_entry_t *delivery_entry = malloc(sizeof(packet_delivery_list_entry_t));
+    packet_delivery_list_entry_t *delivery_entry = chitcp_pool_alloc(sizeof(packet_delivery_list_entry_t));
 
     delivery_entry->entry = entry;
     delivery_entry->tcp_packet = tcp_packet;
@@ -700,6 +1426,7 @@ void chitcpd_queue_packet_delivery(serverinfo_t *si, chisocketentry_t *entry, tc
     memcpy(&delivery_entry->local_addr, local_addr, sizeof(struct sockaddr_storage));
     memcpy(&delivery_entry->remote_addr, remote_addr, sizeof(struct sockaddr_storage));
 
+    delivery_entry->received = chitcpd_stats_clock();
     clock_gettime(CLOCK_REALTIME, &delivery_entry->delivery_time);
 
     long latency_ns = (long) (si->latency * SECOND_F);
@@ -726,7 +1453,12 @@ void chitcpd_deliver_packet(serverinfo_t *si, chisocketentry_t *entry, tcp_packe
                        tcp_packet,
                        log_prefix);
 
-    chitcpd_pcap_packet(si, tcp_packet, remote_addr, local_addr);
+    if (si->libpcap != NULL)
+        chitcpd_pcap_packet(si->libpcap, tcp_packet, (struct sockaddr *) remote_addr, (struct sockaddr *) local_addr,
+                            CHITCPD_PCAP_INBOUND, SOCKET_NO(si, entry), entry->id, entry->tcp_state);
+
+    CHITCPD_STATS_ADD(&entry->stats, segs_rcvd, 1);
+    CHITCPD_STATS_ADD(&entry->stats, bytes_rcvd, TCP_PAYLOAD_LEN(tcp_packet));
 
     /* We need to treat this differently depending on whether the socket is active or passive */
     if(entry->actpas_type == SOCKET_ACTIVE)
@@ -772,77 +1504,8 @@ void chitcpd_deliver_packet(serverinfo_t *si, chisocketentry_t *entry, tcp_packe
         DL_APPEND(socket_state->pending_connections, pending_connection);
         pthread_cond_broadcast(&socket_state->cv_pending_connections);
         pthread_mutex_unlock(&socket_state->lock_pending_connections);
-    }
-}
-
-
-/***************************/
-/**** PCAP file logging ****/
-/***************************/
-
-
 
-/* Define a new pcap record, when logging to a pcap file. */
-typedef struct pcaprecord_hdr {
-   uint32_t ts_sec;         /* timestamp seconds */
-   uint32_t ts_nsec;        /* timestamp nanoseconds */
-   uint32_t incl_len;       /* length of data saved */
-   uint32_t orig_len;       /* original length of packet */
-} pcaprec_hdr_t;
-
-/* IP Header struct, necessary when creating pcap file */
-struct iphdr
-{
-#if __BYTE_ORDER == __LITTLE_ENDIAN
-    uint8_t  ihl:4,
-             version:4;
-#elif __BYTE_ORDER == __BIG_ENDIAN
-    uint8_t  version:4,
-             ihl:4;
-#else
-#error __BYTE_ORDER must be defined as __LITTLE_ENDIAN or __BIG_ENDIAN!
-#endif
-    uint8_t tos;         /* Type of service */
-    uint16_t len;        /* Total Length */
-    uint16_t id;         /* Identification */
-    uint16_t off;        /* Fragment flags + Fragment Offset */
-    uint8_t ttl;         /* Time to Live */
-    uint8_t proto;       /* protocol */
-    uint16_t cksum;      /* checksum */
-    uint32_t src;     /* Source Address */
-    uint32_t dst;     /* Destination Address */
-  } __attribute__ ((packed)) ;
-typedef struct iphdr iphdr_t;
-
-int chitcpd_pcap_packet(serverinfo_t *si, tcp_packet_t* tcp_packet, struct sockaddr_storage *local_addr, struct sockaddr_storage *peer_addr)
-{
-    if (si->libpcap_file != NULL) {
-        pcaprec_hdr_t pcap_header;
-        struct timespec spec;
-        clock_gettime(CLOCK_REALTIME, &spec);
-        pcap_header.ts_sec = spec.tv_sec;
-        pcap_header.ts_nsec = spec.tv_nsec;
-        pcap_header.incl_len = sizeof(iphdr_t) + tcp_packet->length;
-        pcap_header.orig_len = pcap_header.incl_len;
-
-        /* TODO: Assumes IPv4 */
-        iphdr_t ip_header = {0};
-
-        ip_header.src = ((struct sockaddr_in *) peer_addr)->sin_addr.s_addr;
-        ip_header.dst = ((struct sockaddr_in *) local_addr)->sin_addr.s_addr;
-
-        ip_header.version = 4;
-        ip_header.ihl = 5;
-        ip_header.len = htons(20 + tcp_packet->length);
-        ip_header.ttl = 233;
-        ip_header.proto = 6;
-        ip_header.cksum = cksum(&ip_header, sizeof(iphdr_t));
-
-        fwrite(&pcap_header, sizeof(pcaprec_hdr_t), 1, si->libpcap_file);
-        fwrite(&ip_header, sizeof(iphdr_t), 1, si->libpcap_file);
-        fwrite(tcp_packet->raw, tcp_packet->length, 1, si->libpcap_file);
-        fflush(si->libpcap_file); /* Flush to make sure we get the data out, in case the server is improperly shutdown. */
+        /* The passive socket is now readable */
+        chitcpd_poll_notify(si, entry);
     }
-
-    return CHITCP_OK;
 }
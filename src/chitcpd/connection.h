@@ -43,6 +43,7 @@
 
 #include "serverinfo.h"
 #include "chitcp/packet.h"
+#include "framing.h"
 
 typedef struct connection_thread_args
 {
@@ -52,6 +53,7 @@ typedef struct connection_thread_args
 } connection_thread_args_t;
 
 void* chitcpd_connection_thread_func(void *args);
+void* chitcpd_connection_writer_thread_func(void *args);
 
 
 typedef struct packet_delivery_thread_args
@@ -63,10 +65,20 @@ void* chitcpd_packet_delivery_thread_func(void *args);
 
 
 tcpconnentry_t* chitcpd_get_connection(serverinfo_t *si, struct sockaddr* addr);
+tcpconnentry_t* chitcpd_get_socket_connection(serverinfo_t *si, struct sockaddr* local_addr, struct sockaddr* remote_addr);
+tcpconnentry_t* chitcpd_get_unpaired_connection(serverinfo_t *si, struct sockaddr* addr);
 tcpconnentry_t* chitcpd_create_connection(serverinfo_t *si, struct sockaddr* addr);
 tcpconnentry_t* chitcpd_add_connection(serverinfo_t *si, socket_t realsocket_send, socket_t realsocket_recv, struct sockaddr* addr);
 int chitcpd_create_connection_thread(serverinfo_t *si, tcpconnentry_t* connection);
+int chitcpd_create_connection_writer_thread(serverinfo_t *si, tcpconnentry_t* connection);
+void chitcpd_close_connection_tx(tcpconnentry_t* connection);
+int chitcpd_connection_local_addr(socket_t realsocket, struct sockaddr *peer_addr, struct sockaddr_storage *local_addr);
 
+int chitcpd_recv_frames(serverinfo_t *si, frame_reader_t *reader, struct sockaddr *local_addr, struct sockaddr *peer_addr);
+/* Sends a TCP packet to the socket's peer. The packet may still be
+ * in use after this function returns, so it must not be modified
+ * without calling chitcp_tcp_packet_unshare first (see
+ * chitcp_tcp_packet_clone in packet.h) */
 int chitcpd_send_tcp_packet(serverinfo_t *si, chisocketentry_t *sock, tcp_packet_t* tcp_packet);
 int chitcpd_recv_tcp_packet(serverinfo_t *si, tcp_packet_t* tcp_packet, struct sockaddr *local_realaddr, struct sockaddr *peer_realaddr);
 
@@ -0,0 +1,332 @@
+/*
+ *  chiTCP - A simple, testable TCP stack
+ *
+ *  epoll-based network layer.
+ *
+ *  By default, chitcpd creates a connection thread for every TCP
+ *  connection to a peer chiTCP daemon, which blocks on recv() until
+ *  packets arrive. When chitcpd is connected to many peers, this means
+ *  a lot of (mostly idle) threads. Instead, when this network layer is
+ *  enabled (chitcpd -e), a small, fixed number of threads multiplex all
+ *  the connections with epoll. Each connection is assigned to one of
+ *  these threads, which reads from it without blocking whenever epoll
+ *  reports it as readable, and hands any complete chiTCP packets to
+ *  chitcpd_recv_tcp_packet.
+ *
+ */
+
+
+/*
+ *  Copyright (c) 2013-2014, The University of Chicago
+ *  All rights reserved.
+ *
+ *  Redistribution and use in source and binary forms, with or without
+ *  modification, are permitted provided that the following conditions are met:
+ *
+ *  - Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ *
+ *  - Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ *  - Neither the name of The University of Chicago nor the names of its
+ *    contributors may be used to endorse or promote products derived from this
+ *    software without specific prior written permission.
+ *
+ *  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ *  AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ *  IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ *  ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ *  LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ *  CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ *  SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ *  INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ *  CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ *  ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ *  POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include "epoll_rx.h"
+#include "connection.h"
+#include "framing.h"
+#include "chitcp/log.h"
+#include "chitcp/utils.h"
+#include "chitcp/utlist.h"
+
+/* Per-connection state kept by an epoll receive thread */
+typedef struct epoll_rx_conn
+{
+    tcpconnentry_t *connection;
+    frame_reader_t reader;
+
+    /* Addresses of the real TCP connection */
+    struct sockaddr_storage local_addr;
+    struct sockaddr_storage peer_addr;
+
+    struct epoll_rx_conn *prev;
+    struct epoll_rx_conn *next;
+} epoll_rx_conn_t;
+
+/* Arguments to an epoll receive thread */
+typedef struct epoll_rx_thread_args
+{
+    serverinfo_t *si;
+    epoll_rx_thread_t *rxt;
+    char thread_name[16];
+} epoll_rx_thread_args_t;
+
+
+/*
+ * chitcpd_epoll_rx_remove - Stop receiving on a connection, and close it
+ *
+ * rxt: Receive thread the connection is assigned to
+ *
+ * rxc: Connection state
+ *
+ * Returns: Nothing.
+ *
+ */
+static void chitcpd_epoll_rx_remove(epoll_rx_thread_t *rxt, epoll_rx_conn_t *rxc)
+{
+    epoll_ctl(rxt->epoll_fd, EPOLL_CTL_DEL, rxc->connection->realsocket_recv, NULL);
+    close(rxc->connection->realsocket_recv);
+
+    pthread_mutex_lock(&rxt->lock_conns);
+    DL_DELETE(rxt->conns, rxc);
+    rxt->nconns--;
+    pthread_mutex_unlock(&rxt->lock_conns);
+
+    chitcpd_frame_reader_free(&rxc->reader);
+    free(rxc);
+}
+
+
+/*
+ * chitcpd_epoll_rx_thread_func - epoll receive thread function
+ *
+ * args: arguments (epoll_rx_thread_args_t)
+ *
+ * Returns: Nothing.
+ *
+ */
+static void* chitcpd_epoll_rx_thread_func(void *args)
+{
+    epoll_rx_thread_args_t *rta = (epoll_rx_thread_args_t *) args;
+    serverinfo_t *si = rta->si;
+    epoll_rx_thread_t *rxt = rta->rxt;
+    set_thread_name(pthread_self(), rta->thread_name);
+    free(args);
+
+    struct epoll_event events[EPOLL_RX_MAX_EVENTS];
+    epoll_rx_conn_t *rxc;
+    ssize_t nbytes;
+    int nevents;
+
+    while (si->state != CHITCPD_STATE_STOPPING)
+    {
+        nevents = epoll_wait(rxt->epoll_fd, events, EPOLL_RX_MAX_EVENTS, -1);
+
+        if (nevents == -1)
+        {
+            if (errno == EINTR)
+                continue;
+
+            chilog(ERROR, "epoll_wait() failed: %s", strerror(errno));
+            break;
+        }
+
+        for (int i = 0; i < nevents; i++)
+        {
+            /* The eventfd is only written to when we have to stop */
+            if (events[i].data.ptr == NULL)
+                continue;
+
+            rxc = (epoll_rx_conn_t *) events[i].data.ptr;
+
+            /* Read whatever is available. If there is more data than fits
+             * in the frame reader's buffer, epoll will report the socket
+             * as readable again, so other connections are not starved. */
+            nbytes = chitcpd_frame_reader_fill(&rxc->reader, rxc->connection->realsocket_recv, MSG_DONTWAIT);
+
+            if (nbytes == -1 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR))
+                continue;
+
+            if (nbytes == 0)
+            {
+                /* Peer closed the connection */
+                chitcpd_epoll_rx_remove(rxt, rxc);
+            }
+            else if (nbytes == -1)
+            {
+                chilog(ERROR, "Socket recv() failed on fd %d: %s", rxc->connection->realsocket_recv,
+                        strerror(errno));
+                chitcpd_epoll_rx_remove(rxt, rxc);
+            }
+            else if (si->state != CHITCPD_STATE_STOPPING)
+            {
+                if (chitcpd_recv_frames(si, &rxc->reader, (struct sockaddr*) &rxc->local_addr, (struct sockaddr*) &rxc->peer_addr) != CHITCP_OK)
+                    chitcpd_epoll_rx_remove(rxt, rxc);
+            }
+        }
+    }
+
+    pthread_exit(NULL);
+}
+
+
+/* See epoll_rx.h */
+int chitcpd_epoll_rx_start(serverinfo_t *si)
+{
+    epoll_rx_thread_args_t *rta;
+    epoll_rx_thread_t *rxt;
+    struct epoll_event ev;
+
+    si->epoll_rx_threads = calloc(si->epoll_rx_nthreads, sizeof(epoll_rx_thread_t));
+    if (si->epoll_rx_threads == NULL)
+        return CHITCP_ENOMEM;
+    si->epoll_rx_next = 0;
+
+    for (int i = 0; i < si->epoll_rx_nthreads; i++)
+    {
+        rxt = &si->epoll_rx_threads[i];
+
+        pthread_mutex_init(&rxt->lock_conns, NULL);
+        rxt->conns = NULL;
+        rxt->nconns = 0;
+
+        rxt->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+        rxt->wakeup_fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+        if (rxt->epoll_fd == -1 || rxt->wakeup_fd == -1)
+        {
+            perror("Could not create epoll instance");
+            return CHITCP_ESOCKET;
+        }
+
+        memset(&ev, 0, sizeof(struct epoll_event));
+        ev.events = EPOLLIN;
+        ev.data.ptr = NULL;
+        if (epoll_ctl(rxt->epoll_fd, EPOLL_CTL_ADD, rxt->wakeup_fd, &ev) == -1)
+        {
+            perror("Could not add eventfd to epoll instance");
+            return CHITCP_ESOCKET;
+        }
+
+        rta = malloc(sizeof(epoll_rx_thread_args_t));
+        if (rta == NULL)
+            return CHITCP_ENOMEM;
+        rta->si = si;
+        rta->rxt = rxt;
+        snprintf(rta->thread_name, 16, "network-epoll-%d", i);
+
+        if (pthread_create(&rxt->thread, NULL, chitcpd_epoll_rx_thread_func, rta) != 0)
+        {
+            perror("Could not create epoll receive thread");
+            free(rta);
+            return CHITCP_ETHREAD;
+        }
+    }
+
+    return CHITCP_OK;
+}
+
+
+/* See epoll_rx.h */
+int chitcpd_epoll_rx_add_connection(serverinfo_t *si, tcpconnentry_t *connection)
+{
+    epoll_rx_thread_t *rxt;
+    epoll_rx_conn_t *rxc;
+    struct epoll_event ev;
+    socklen_t lsize, psize;
+
+    rxc = calloc(1, sizeof(epoll_rx_conn_t));
+    if (rxc == NULL)
+        return CHITCP_ENOMEM;
+
+    if (chitcpd_frame_reader_init(&rxc->reader, FRAME_READER_BUFFER_SIZE) != CHITCP_OK)
+    {
+        free(rxc);
+        return CHITCP_ENOMEM;
+    }
+
+    rxc->connection = connection;
+
+    /* Get the local and peer addresses */
+    lsize = psize = sizeof(struct sockaddr_storage);
+    getsockname(connection->realsocket_recv, (struct sockaddr*) &rxc->local_addr, &lsize);
+    getpeername(connection->realsocket_recv, (struct sockaddr*) &rxc->peer_addr, &psize);
+
+    /* Assign connections to threads in round-robin order */
+    pthread_mutex_lock(&si->lock_connection_table);
+    rxt = &si->epoll_rx_threads[si->epoll_rx_next];
+    si->epoll_rx_next = (si->epoll_rx_next + 1) % si->epoll_rx_nthreads;
+    pthread_mutex_unlock(&si->lock_connection_table);
+
+    pthread_mutex_lock(&rxt->lock_conns);
+    DL_APPEND(rxt->conns, rxc);
+    rxt->nconns++;
+    pthread_mutex_unlock(&rxt->lock_conns);
+
+    memset(&ev, 0, sizeof(struct epoll_event));
+    ev.events = EPOLLIN;
+    ev.data.ptr = rxc;
+    if (epoll_ctl(rxt->epoll_fd, EPOLL_CTL_ADD, connection->realsocket_recv, &ev) == -1)
+    {
+        chilog(ERROR, "Could not add fd %d to epoll instance: %s", connection->realsocket_recv, strerror(errno));
+        pthread_mutex_lock(&rxt->lock_conns);
+        DL_DELETE(rxt->conns, rxc);
+        rxt->nconns--;
+        pthread_mutex_unlock(&rxt->lock_conns);
+        chitcpd_frame_reader_free(&rxc->reader);
+        free(rxc);
+        return CHITCP_ESOCKET;
+    }
+
+    return CHITCP_OK;
+}
+
+
+/* See epoll_rx.h */
+int chitcpd_epoll_rx_stop(serverinfo_t *si)
+{
+    epoll_rx_thread_t *rxt;
+    epoll_rx_conn_t *rxc, *tmp;
+    uint64_t one = 1;
+
+    if (si->epoll_rx_threads == NULL)
+        return CHITCP_OK;
+
+    for (int i = 0; i < si->epoll_rx_nthreads; i++)
+    {
+        rxt = &si->epoll_rx_threads[i];
+
+        if (write(rxt->wakeup_fd, &one, sizeof(uint64_t)) != sizeof(uint64_t))
+            chilog(WARNING, "Could not wake up epoll receive thread %d", i);
+        pthread_join(rxt->thread, NULL);
+
+        DL_FOREACH_SAFE(rxt->conns, rxc, tmp)
+        {
+            DL_DELETE(rxt->conns, rxc);
+            rxt->nconns--;
+            chitcpd_frame_reader_free(&rxc->reader);
+            free(rxc);
+        }
+
+        close(rxt->epoll_fd);
+        close(rxt->wakeup_fd);
+        pthread_mutex_destroy(&rxt->lock_conns);
+    }
+
+    free(si->epoll_rx_threads);
+    si->epoll_rx_threads = NULL;
+
+    return CHITCP_OK;
+}
@@ -0,0 +1,101 @@
+/*
+ *  chiTCP - A simple, testable TCP stack
+ *
+ *  See epoll_rx.c
+ *
+ */
+
+
+/*
+ *  Copyright (c) 2013-2014, The University of Chicago
+ *  All rights reserved.
+ *
+ *  Redistribution and use in source and binary forms, with or without
+ *  modification, are permitted provided that the following conditions are met:
+ *
+ *  - Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ *
+ *  - Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ *  - Neither the name of The University of Chicago nor the names of its
+ *    contributors may be used to endorse or promote products derived from this
+ *    software without specific prior written permission.
+ *
+ *  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ *  AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ *  IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ *  ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ *  LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ *  CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ *  SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ *  INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ *  CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ *  ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ *  POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+#ifndef EPOLL_RX_H_
+#define EPOLL_RX_H_
+
+#include "serverinfo.h"
+
+/* Maximum number of events returned by a single epoll_wait() call */
+#define EPOLL_RX_MAX_EVENTS (64)
+
+/*
+ * chitcpd_epoll_rx_start - Start the epoll receive threads
+ *
+ * Creates si->epoll_rx_nthreads threads, each with its own epoll
+ * instance. Only used if si->epoll_rx_nthreads > 0.
+ *
+ * si: Server info
+ *
+ * Returns:
+ *  - CHITCP_OK: The threads have started correctly
+ *  - CHITCP_ENOMEM: Could not allocate memory
+ *  - CHITCP_ESOCKET: Could not create an epoll instance or eventfd
+ *  - CHITCP_ETHREAD: Could not create a thread
+ *
+ */
+int chitcpd_epoll_rx_start(serverinfo_t *si);
+
+
+/*
+ * chitcpd_epoll_rx_add_connection - Start receiving packets on a connection
+ *
+ * Registers the connection's realsocket_recv with one of the
+ * epoll receive threads (in round-robin order). This replaces
+ * creating a connection thread for the connection.
+ *
+ * si: Server info
+ *
+ * connection: Connection entry
+ *
+ * Returns:
+ *  - CHITCP_OK: The connection has been registered
+ *  - CHITCP_ENOMEM: Could not allocate memory
+ *  - CHITCP_ESOCKET: Could not register the socket with epoll
+ *
+ */
+int chitcpd_epoll_rx_add_connection(serverinfo_t *si, tcpconnentry_t *connection);
+
+
+/*
+ * chitcpd_epoll_rx_stop - Stop the epoll receive threads
+ *
+ * Wakes up and joins every epoll receive thread, and releases the
+ * state associated with the connections they were handling.
+ *
+ * si: Server info
+ *
+ * Returns:
+ *  - CHITCP_OK: The threads have stopped
+ *
+ */
+int chitcpd_epoll_rx_stop(serverinfo_t *si);
+
+#endif /* EPOLL_RX_H_ */
@@ -0,0 +1,187 @@
+/*
+ *  chiTCP - A simple, testable TCP stack
+ *
+ *  Decoding of the chiTCP frames exchanged by chiTCP daemons.
+ *
+ *  Each chiTCP packet sent between two daemons is a chiTCP header
+ *  followed by its payload (currently, always a TCP packet). Since
+ *  daemons communicate over a stream, the receiving side has to
+ *  delimit frames using the payload_len field in the chiTCP header.
+ *
+ *  See framing.h for descriptions of the functions.
+ *
+ */
+
+/*
+ *  Copyright (c) 2013-2014, The University of Chicago
+ *  All rights reserved.
+ *
+ *  Redistribution and use in source and binary forms, with or without
+ *  modification, are permitted provided that the following conditions are met:
+ *
+ *  - Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ *
+ *  - Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ *  - Neither the name of The University of Chicago nor the names of its
+ *    contributors may be used to endorse or promote products derived from this
+ *    software without specific prior written permission.
+ *
+ *  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ *  AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ *  IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ *  ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ *  LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ *  CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ *  SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ *  INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ *  CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ *  ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ *  POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include "framing.h"
+#include "chitcp/pool.h"
+
+/* See framing.h */
+int chitcpd_frame_reader_init(frame_reader_t *fr, size_t size)
+{
+    if (size < FRAME_MAX_SIZE)
+        return CHITCP_EINVAL;
+
+    fr->buf = malloc(size);
+    if (fr->buf == NULL)
+        return CHITCP_ENOMEM;
+
+    fr->size = size;
+    fr->start = 0;
+    fr->end = 0;
+
+    return CHITCP_OK;
+}
+
+/* See framing.h */
+void chitcpd_frame_reader_free(frame_reader_t *fr)
+{
+    free(fr->buf);
+    fr->buf = NULL;
+}
+
+/*
+ * chitcpd_frame_reader_compact - Make room at the end of the reader's buffer
+ *
+ * fr: Frame reader
+ *
+ * needed: Number of bytes we need after the undecoded bytes
+ *
+ * Returns: Nothing
+ *
+ */
+static void chitcpd_frame_reader_compact(frame_reader_t *fr, size_t needed)
+{
+    if (fr->start == fr->end)
+    {
+        /* Everything has been decoded. Start over from the beginning */
+        fr->start = fr->end = 0;
+    }
+    else if (fr->size - fr->start < FRAME_MAX_SIZE || fr->size - fr->end < needed)
+    {
+        /* A partial frame at the end of the buffer might not fit in the
+         * remaining space, so we move it to the start of the buffer */
+        memmove(fr->buf, fr->buf + fr->start, fr->end - fr->start);
+        fr->end -= fr->start;
+        fr->start = 0;
+    }
+}
+
+/* See framing.h */
+ssize_t chitcpd_frame_reader_fill(frame_reader_t *fr, socket_t realsocket, int flags)
+{
+    ssize_t nbytes;
+
+    chitcpd_frame_reader_compact(fr, 0);
+
+    nbytes = recv(realsocket, fr->buf + fr->end, fr->size - fr->end, flags);
+
+    if (nbytes > 0)
+        fr->end += nbytes;
+
+    return nbytes;
+}
+
+/* See framing.h */
+int chitcpd_frame_reader_append(frame_reader_t *fr, const uint8_t *data, size_t len)
+{
+    chitcpd_frame_reader_compact(fr, len);
+
+    if (fr->size - fr->end < len)
+        return CHITCP_ENOMEM;
+
+    memcpy(fr->buf + fr->end, data, len);
+    fr->end += len;
+
+    return CHITCP_OK;
+}
+
+/* See framing.h */
+int chitcpd_frame_decode(const uint8_t *data, size_t len, chitcphdr_t *header, tcp_packet_t **packet)
+{
+    uint16_t payload_len;
+    tcp_packet_t *p;
+
+    if (len < sizeof(chitcphdr_t))
+        return 0;
+
+    /* The frame may not be suitably aligned, so we copy the header */
+    memcpy(header, data, sizeof(chitcphdr_t));
+    payload_len = chitcp_ntohs(header->payload_len);
+
+    if (header->proto != CHITCP_PROTO_TCP || payload_len < TCP_HEADER_NOOPTIONS_SIZE)
+        return CHITCP_EINVAL;
+
+    if (len < sizeof(chitcphdr_t) + payload_len)
+        return 0;
+
+    /* This is the only copy of the packet: from here on, the packet is
+     * passed around by reference until the TCP thread frees it. */
+    p = malloc(sizeof(tcp_packet_t));
+    if (p == NULL)
+        return CHITCP_ENOMEM;
+
+    /* Leave room in front of the packet, so the pcap headers can
+     * be prepended in place when the packet is delivered */
+    if (chitcp_tcp_packet_alloc(p, TCP_PACKET_HEADROOM, payload_len) != CHITCP_OK)
+    {
+        free(p);
+        return CHITCP_ENOMEM;
+    }
+    memcpy(p->raw, data + sizeof(chitcphdr_t), payload_len);
+
+    *packet = p;
+
+    return sizeof(chitcphdr_t) + payload_len;
+}
+
+/* See framing.h */
+int chitcpd_frame_reader_next(frame_reader_t *fr, chitcphdr_t *header, tcp_packet_t **packet)
+{
+    int nbytes;
+
+    nbytes = chitcpd_frame_decode(fr->buf + fr->start, fr->end - fr->start, header, packet);
+
+    if (nbytes == 0)
+        return CHITCP_ENOENT;
+    else if (nbytes < 0)
+        return nbytes;
+
+    fr->start += nbytes;
+
+    return CHITCP_OK;
+}
@@ -0,0 +1,187 @@
+/*
+ *  chiTCP - A simple, testable TCP stack
+ *
+ *  See framing.c
+ *
+ */
+
+/*
+ *  Copyright (c) 2013-2014, The University of Chicago
+ *  All rights reserved.
+ *
+ *  Redistribution and use in source and binary forms, with or without
+ *  modification, are permitted provided that the following conditions are met:
+ *
+ *  - Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ *
+ *  - Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ *  - Neither the name of The University of Chicago nor the names of its
+ *    contributors may be used to endorse or promote products derived from this
+ *    software without specific prior written permission.
+ *
+ *  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ *  AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ *  IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ *  ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ *  LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ *  CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ *  SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ *  INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ *  CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ *  ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ *  POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+#ifndef FRAMING_H_
+#define FRAMING_H_
+
+#include <stdint.h>
+#include <sys/types.h>
+#include "chitcp/types.h"
+#include "chitcp/packet.h"
+
+/* Largest possible chiTCP frame: a chiTCP header followed by a payload
+ * whose length is the largest value that fits in payload_len. This
+ * comfortably covers a full-sized segment with any TCP options. */
+#define FRAME_MAX_SIZE (sizeof(chitcphdr_t) + UINT16_MAX)
+
+/* Default size of a frame reader's buffer. Must be at least FRAME_MAX_SIZE;
+ * making it larger allows more frames to be read with a single recv() */
+#define FRAME_READER_BUFFER_SIZE (128 * 1024)
+
+/* A frame reader accumulates the bytes received on a connection between
+ * two chiTCP daemons, and splits them into chiTCP frames (a chiTCP header
+ * followed by its payload). Bytes are read in large chunks, so a single
+ * recv() will usually return several frames. */
+typedef struct frame_reader
+{
+    uint8_t *buf;
+    size_t size;
+
+    /* First byte that has not been decoded yet */
+    size_t start;
+
+    /* One past the last byte received */
+    size_t end;
+} frame_reader_t;
+
+
+/*
+ * chitcpd_frame_reader_init - Initializes a frame reader
+ *
+ * fr: Frame reader
+ *
+ * size: Size of the reader's buffer (must be at least FRAME_MAX_SIZE)
+ *
+ * Returns:
+ *  - CHITCP_OK: Frame reader initialized correctly
+ *  - CHITCP_EINVAL: Buffer size is too small
+ *  - CHITCP_ENOMEM: Could not allocate the buffer
+ *
+ */
+int chitcpd_frame_reader_init(frame_reader_t *fr, size_t size);
+
+
+/*
+ * chitcpd_frame_reader_free - Frees the resources used by a frame reader
+ *
+ * fr: Frame reader
+ *
+ * Returns: Nothing
+ *
+ */
+void chitcpd_frame_reader_free(frame_reader_t *fr);
+
+
+/*
+ * chitcpd_frame_reader_fill - Receive bytes from a socket into the reader
+ *
+ * Performs a single recv() on the socket, reading as many bytes as will fit
+ * in the reader's buffer. Any undecoded bytes are first moved to the start
+ * of the buffer if necessary.
+ *
+ * fr: Frame reader
+ *
+ * realsocket: Socket to receive from
+ *
+ * flags: Flags passed to recv() (e.g., MSG_DONTWAIT)
+ *
+ * Returns: Same as recv()
+ *
+ */
+ssize_t chitcpd_frame_reader_fill(frame_reader_t *fr, socket_t realsocket, int flags);
+
+
+/*
+ * chitcpd_frame_reader_append - Add bytes that were received elsewhere
+ *
+ * For when the bytes are not received with recv() on the socket
+ * (e.g., when they are delivered by io_uring into a separate buffer).
+ * Any undecoded bytes are first moved to the start of the buffer
+ * if necessary.
+ *
+ * fr: Frame reader
+ *
+ * data: Bytes to add
+ *
+ * len: Number of bytes
+ *
+ * Returns:
+ *  - CHITCP_OK: The bytes were added to the reader
+ *  - CHITCP_ENOMEM: There is not enough room in the reader's buffer
+ *                   (frames must be decoded before adding more bytes)
+ *
+ */
+int chitcpd_frame_reader_append(frame_reader_t *fr, const uint8_t *data, size_t len);
+
+
+/*
+ * chitcpd_frame_decode - Decode a single chiTCP frame from a byte array
+ *
+ * If a complete frame is available at the start of the array, the
+ * chiTCP header is copied into *header, and a new TCP packet is allocated
+ * and returned in *packet (the packet must be freed by whoever ends up
+ * consuming it, as any other packet received from the network).
+ *
+ * data: Bytes to decode
+ *
+ * len: Number of bytes available
+ *
+ * header: Output parameter for the chiTCP header
+ *
+ * packet: Output parameter for the TCP packet
+ *
+ * Returns:
+ *  - A positive value: Number of bytes consumed by the frame
+ *  - 0: There are not enough bytes for a complete frame
+ *  - CHITCP_EINVAL: The frame is malformed or of an unknown type
+ *  - CHITCP_ENOMEM: Could not allocate the packet
+ *
+ */
+int chitcpd_frame_decode(const uint8_t *data, size_t len, chitcphdr_t *header, tcp_packet_t **packet);
+
+
+/*
+ * chitcpd_frame_reader_next - Extract the next frame from the reader
+ *
+ * fr: Frame reader
+ *
+ * header: Output parameter for the chiTCP header
+ *
+ * packet: Output parameter for the TCP packet (see chitcpd_frame_decode)
+ *
+ * Returns:
+ *  - CHITCP_OK: A frame was extracted
+ *  - CHITCP_ENOENT: No complete frame is available; more bytes are needed
+ *  - CHITCP_EINVAL: The frame is malformed or of an unknown type
+ *  - CHITCP_ENOMEM: Could not allocate the packet
+ *
+ */
+int chitcpd_frame_reader_next(frame_reader_t *fr, chitcphdr_t *header, tcp_packet_t **packet);
+
+#endif /* FRAMING_H_ */
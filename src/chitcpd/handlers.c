@@ -43,6 +43,7 @@
 #include <stdio.h>
 #include <errno.h>
 #include <string.h>
+#include <fcntl.h>
 #include "handlers.h"
 #include "chitcp/chitcpd.h"
 #include "chitcp/socket.h"
@@ -55,6 +56,8 @@
 #include "tcp_thread.h"
 #include "breakpoint.h"
 #include "tcp.h"
+#include "trace.h"
+#include "readiness.h"
 
 /* Dispatch table */
 
@@ -75,6 +78,17 @@ HANDLER_FUNCTION(CHITCPD_MSG_CODE__CLOSE);
 HANDLER_FUNCTION(CHITCPD_MSG_CODE__GET_SOCKET_STATE);
 HANDLER_FUNCTION(CHITCPD_MSG_CODE__GET_SOCKET_BUFFER_CONTENTS);
 HANDLER_FUNCTION(CHITCPD_MSG_CODE__WAIT_FOR_STATE);
+HANDLER_FUNCTION(CHITCPD_MSG_CODE__GET_SOCKET_TRACE);
+HANDLER_FUNCTION(CHITCPD_MSG_CODE__GET_SOCKET_STATS);
+HANDLER_FUNCTION(CHITCPD_MSG_CODE__GET_LATENCY);
+HANDLER_FUNCTION(CHITCPD_MSG_CODE__SHM_NOTIFY);
+HANDLER_FUNCTION(CHITCPD_MSG_CODE__BATCH);
+HANDLER_FUNCTION(CHITCPD_MSG_CODE__POLL);
+HANDLER_FUNCTION(CHITCPD_MSG_CODE__EPOLL_CREATE);
+HANDLER_FUNCTION(CHITCPD_MSG_CODE__EPOLL_CTL);
+HANDLER_FUNCTION(CHITCPD_MSG_CODE__EPOLL_WAIT);
+HANDLER_FUNCTION(CHITCPD_MSG_CODE__EPOLL_CLOSE);
+HANDLER_FUNCTION(CHITCPD_MSG_CODE__FCNTL);
 
 /* Handling DEBUG requires a slightly modified prototype */
 int chitcpd_handle_CHITCPD_MSG_CODE__DEBUG(serverinfo_t *si, ChitcpdMsg *req, ChitcpdMsg *resp_outer, ChitcpdResp *resp_inner, int client_sockfd);
@@ -91,7 +105,18 @@ handler_function handlers[] =
     HANDLER_ENTRY(CHITCPD_MSG_CODE__CLOSE),
     HANDLER_ENTRY(CHITCPD_MSG_CODE__GET_SOCKET_STATE),
     HANDLER_ENTRY(CHITCPD_MSG_CODE__GET_SOCKET_BUFFER_CONTENTS),
-    HANDLER_ENTRY(CHITCPD_MSG_CODE__WAIT_FOR_STATE)
+    HANDLER_ENTRY(CHITCPD_MSG_CODE__WAIT_FOR_STATE),
+    HANDLER_ENTRY(CHITCPD_MSG_CODE__GET_SOCKET_TRACE),
+    HANDLER_ENTRY(CHITCPD_MSG_CODE__GET_SOCKET_STATS),
+    HANDLER_ENTRY(CHITCPD_MSG_CODE__GET_LATENCY),
+    HANDLER_ENTRY(CHITCPD_MSG_CODE__SHM_NOTIFY),
+    HANDLER_ENTRY(CHITCPD_MSG_CODE__BATCH),
+    HANDLER_ENTRY(CHITCPD_MSG_CODE__POLL),
+    HANDLER_ENTRY(CHITCPD_MSG_CODE__EPOLL_CREATE),
+    HANDLER_ENTRY(CHITCPD_MSG_CODE__EPOLL_CTL),
+    HANDLER_ENTRY(CHITCPD_MSG_CODE__EPOLL_WAIT),
+    HANDLER_ENTRY(CHITCPD_MSG_CODE__EPOLL_CLOSE),
+    HANDLER_ENTRY(CHITCPD_MSG_CODE__FCNTL)
 };
 
 static char *code_strs[] =
@@ -109,7 +134,18 @@ static char *code_strs[] =
     "RESP",
     "DEBUG",
     "DEBUG_EVENT",
-    "WAIT_FOR_STATE"
+    "WAIT_FOR_STATE",
+    "GET_SOCKET_TRACE",
+    "GET_SOCKET_STATS",
+    "GET_LATENCY",
+    "SHM_NOTIFY",
+    "BATCH",
+    "POLL",
+    "EPOLL_CREATE",
+    "EPOLL_CTL",
+    "EPOLL_WAIT",
+    "EPOLL_CLOSE",
+    "FCNTL"
 };
 
 static inline char *handler_code_string (int code)
@@ -117,12 +153,405 @@ static inline char *handler_code_string (int code)
     return code_strs[code-1];
 }
 
+/* A pipelined request (see handler_conn_t) waiting for a worker */
+typedef struct handler_request
+{
+    ChitcpdMsg *req;
+    uint64_t received;
+
+    struct handler_request *prev;
+    struct handler_request *next;
+} handler_request_t;
+
+/* State of a connection on chitcpd's UNIX socket.
+ *
+ * Requests without a request ID are handled by the dispatch thread,
+ * one at a time and in order. Requests with a request ID (pipelined
+ * requests) are handed off to worker threads, so a request that blocks
+ * (e.g., a RECV on a socket with no data) doesn't hold up the requests
+ * that follow it. Their responses are sent as they complete, tagged
+ * with the request ID. A worker is created whenever there are more
+ * pending requests than idle workers, up to CHITCPD_HANDLER_MAX_WORKERS.
+ * Beyond that, requests fail with EAGAIN instead of waiting for a
+ * worker (if all the workers are blocked, a request that would unblock
+ * them would otherwise never run).
+ *
+ * When the client disconnects, the dispatch thread interrupts the
+ * requests that are still blocked on the client's sockets, and joins
+ * the workers before freeing the sockets. */
+typedef struct handler_conn
+{
+    serverinfo_t *si;
+
+    /* Dispatch thread. It reads the requests from the client socket,
+     * and frees the chisockets created through this connection when
+     * the client disconnects. */
+    pthread_t owner;
+    pthread_mutex_t *handler_lock;
+
+    /* Responses are sent through a duplicate of the client socket, so
+     * any thread can send them while the dispatch thread is reading
+     * from the client socket. -1 if sending a response failed. */
+    socket_t send_socket;
+    pthread_mutex_t lock_send;
+
+    /* Pipelined requests waiting for a worker */
+    handler_request_t *queue;
+    unsigned int nqueued;
+    unsigned int nidle;
+    bool_t closing;
+
+    /* Workers (joined by the dispatch thread) */
+    pthread_t workers[CHITCPD_HANDLER_MAX_WORKERS];
+    unsigned int nworkers;
+
+    pthread_mutex_t lock;
+    pthread_cond_t cv;
+} handler_conn_t;
+
+static void handler_conn_free(handler_conn_t *conn)
+{
+    if (conn->send_socket != -1)
+        close(conn->send_socket);
+    pthread_mutex_destroy(&conn->lock_send);
+    pthread_mutex_destroy(&conn->lock);
+    pthread_cond_destroy(&conn->cv);
+    free(conn);
+}
+
+/* Is a chisocket (or epoll instance) created by this connection's
+ * dispatch thread, or by one of its workers (and not yet claimed by
+ * the dispatch thread; see chitcpd_claim_socket)? */
+static bool_t handler_conn_owns(handler_conn_t *conn, pthread_t creator)
+{
+    if (pthread_equal(creator, conn->owner))
+        return TRUE;
+
+    for (unsigned int i = 0; i < conn->nworkers; i++)
+        if (pthread_equal(creator, conn->workers[i]))
+            return TRUE;
+
+    return FALSE;
+}
+
+/*
+ * chitcpd_resp_free - Frees the submessages allocated by a handler
+ *
+ * resp: Response
+ *
+ * Returns: Nothing.
+ *
+ */
+static void chitcpd_resp_free(ChitcpdResp *resp)
+{
+    if (resp->has_buf)
+    {
+        /* This buffer was allocated in RECV. */
+        free(resp->buf.data);
+        resp->has_buf = FALSE;
+    }
+    if (resp->socket_state != NULL)
+    {
+        /* This submessage was allocated in GET_SOCKET_STATE. */
+        free(resp->socket_state);
+        resp->socket_state = NULL;
+    }
+    if (resp->socket_buffer_contents != NULL)
+    {
+        /* This submessage was allocated in GET_SOCKET_BUFFER_CONTENTS. */
+        if (resp->socket_buffer_contents->snd.data != NULL)
+            free(resp->socket_buffer_contents->snd.data);
+        if (resp->socket_buffer_contents->rcv.data != NULL)
+            free(resp->socket_buffer_contents->rcv.data);
+        free(resp->socket_buffer_contents);
+        resp->socket_buffer_contents = NULL;
+    }
+    if (resp->has_trace)
+    {
+        /* This buffer was allocated in GET_SOCKET_TRACE. */
+        free(resp->trace.data);
+        resp->has_trace = FALSE;
+    }
+    if (resp->socket_stats != NULL)
+    {
+        /* This submessage was allocated in GET_SOCKET_STATS. */
+        free(resp->socket_stats);
+        resp->socket_stats = NULL;
+    }
+    if (resp->latency != NULL)
+    {
+        /* These submessages were allocated in GET_LATENCY. */
+        for (size_t i = 0; i < resp->n_latency; i++)
+            free(resp->latency[i]);
+        free(resp->latency);
+        resp->latency = NULL;
+        resp->n_latency = 0;
+    }
+    if (resp->batch != NULL)
+    {
+        /* These submessages were allocated in BATCH. */
+        for (size_t i = 0; i < resp->n_batch; i++)
+        {
+            chitcpd_resp_free(resp->batch[i]);
+            free(resp->batch[i]);
+        }
+        free(resp->batch);
+        resp->batch = NULL;
+        resp->n_batch = 0;
+    }
+    if (resp->events != NULL)
+    {
+        /* These submessages were allocated in POLL or EPOLL_WAIT. */
+        for (size_t i = 0; i < resp->n_events; i++)
+            free(resp->events[i]);
+        free(resp->events);
+        resp->events = NULL;
+        resp->n_events = 0;
+    }
+}
+
+/* Makes the dispatch thread the creator of the chisocket (or epoll
+ * instance) returned by a SOCKET, ACCEPT or EPOLL_CREATE request */
+static void chitcpd_claim_socket(handler_conn_t *conn, ChitcpdMsgCode code, ChitcpdResp *resp)
+{
+    if ((code == CHITCPD_MSG_CODE__SOCKET || code == CHITCPD_MSG_CODE__ACCEPT) && resp->ret >= 0)
+        conn->si->chisocket_table[resp->ret].creator_thread = conn->owner;
+    else if (code == CHITCPD_MSG_CODE__EPOLL_CREATE && resp->ret >= 0)
+        chitcpd_epoll_set_owner(conn->si, resp->ret, conn->owner);
+}
+
+/* Sends a response through the connection (and passes "fd" along with
+ * it, if it is not -1). Returns a negative value if it couldn't be sent. */
+static int handler_conn_send(handler_conn_t *conn, ChitcpdMsg *msg, int fd)
+{
+    int rc;
+
+    pthread_mutex_lock(&conn->lock_send);
+    if (conn->send_socket != -1)
+    {
+        rc = chitcpd_send_msg_fd(conn->send_socket, msg, fd);
+
+        /* If the client disconnected, chitcpd_send_msg_fd
+         * has already closed the socket */
+        if (rc == -2)
+            close(conn->send_socket);
+        if (rc < 0)
+            conn->send_socket = -1;
+    }
+    else
+        rc = -1;
+    pthread_mutex_unlock(&conn->lock_send);
+
+    return rc;
+}
+
+/*
+ * chitcpd_handle_request - Runs the handler for a request, and sends
+ *                          the response back to the client
+ *
+ * conn: Connection the request was received on
+ *
+ * req: Request (it is freed by this function)
+ *
+ * received: When the request was received (see chitcpd_stats_clock)
+ *
+ * Returns:
+ *  - CHITCP_OK: The response was sent
+ *  - CHITCP_ESOCKET: The response could not be sent
+ *
+ */
+static int chitcpd_handle_request(handler_conn_t *conn, ChitcpdMsg *req, uint64_t received)
+{
+    serverinfo_t *si = conn->si;
+    ChitcpdMsg resp_outer = CHITCPD_MSG__INIT;
+    ChitcpdResp resp_inner = CHITCPD_RESP__INIT;
+    ChitcpdMsgCode code = req->code;
+    uint64_t handled, sent;
+    int rc, fd;
+
+    resp_outer.code = CHITCPD_MSG_CODE__RESP;
+    resp_outer.resp = &resp_inner;
+
+    /* Pipelined responses are tagged with the ID of their request */
+    resp_outer.has_request_id = req->has_request_id;
+    resp_outer.request_id = req->request_id;
+
+    /* Call handler function using dispatch table */
+    rc = handlers[code](si, req, &resp_inner);
+    handled = chitcpd_stats_clock();
+
+    if(rc != CHITCP_OK)
+    {
+        chilog(ERROR, "Error when handling request.");
+        /* We don't need to bail out just because one request failed */
+    }
+
+    /* A chisocket created by a worker belongs to the dispatch thread
+     * (which will free it if the client disconnects) */
+    if (!pthread_equal(pthread_self(), conn->owner))
+    {
+        if (code == CHITCPD_MSG_CODE__BATCH)
+        {
+            for (size_t i = 0; i < resp_inner.n_batch; i++)
+                chitcpd_claim_socket(conn, req->batch_args->requests[i]->code, resp_inner.batch[i]);
+        }
+        else
+            chitcpd_claim_socket(conn, code, &resp_inner);
+    }
+
+    chitcpd_msg__free_unpacked(req, NULL);
+
+    /* Send response. If the handler created a shared-memory
+     * region, its descriptor is passed along with the response */
+    fd = resp_inner.has_shm_fd? resp_inner.shm_fd : -1;
+
+    rc = handler_conn_send(conn, &resp_outer, fd);
+    sent = chitcpd_stats_clock();
+
+    chitcpd_histogram_add(&si->metrics.rpc_duration, sent - received);
+    if (code < CHITCPD_METRICS_MSG_CODES)
+    {
+        chitcpd_histogram_add(&si->metrics.rpc_handler[code], handled - received);
+        chitcpd_histogram_add(&si->metrics.rpc_response[code], sent - handled);
+    }
+
+    chitcpd_resp_free(&resp_inner);
+
+    return rc < 0? CHITCP_ESOCKET : CHITCP_OK;
+}
+
+/*
+ * chitcpd_handler_worker - Worker thread function
+ *
+ * Handles pipelined requests (see handler_conn_t) until
+ * the client disconnects.
+ *
+ * args: Connection (handler_conn_t)
+ *
+ * Returns: Nothing.
+ *
+ */
+static void* chitcpd_handler_worker(void *args)
+{
+    handler_conn_t *conn = (handler_conn_t *) args;
+    handler_request_t *item;
+
+    set_thread_name(pthread_self(), "socket-worker");
+
+    pthread_mutex_lock(&conn->lock);
+    for(;;)
+    {
+        while(conn->queue == NULL && !conn->closing)
+            pthread_cond_wait(&conn->cv, &conn->lock);
+
+        if(conn->closing)
+            break;
+
+        item = conn->queue;
+        DL_DELETE(conn->queue, item);
+        conn->nqueued--;
+        conn->nidle--;
+        pthread_mutex_unlock(&conn->lock);
+
+        /* Pipelined requests don't take the handler lock, since a
+         * blocked request would otherwise hold up the shutdown */
+        chitcpd_handle_request(conn, item->req, item->received);
+        free(item);
+
+        pthread_mutex_lock(&conn->lock);
+        conn->nidle++;
+    }
+    conn->nidle--;
+    pthread_mutex_unlock(&conn->lock);
+
+    return NULL;
+}
+
+/*
+ * chitcpd_handler_enqueue - Hands off a pipelined request to a worker
+ *
+ * conn: Connection
+ *
+ * req: Request
+ *
+ * received: When the request was received
+ *
+ * Returns:
+ *  - CHITCP_OK: The request will be handled by a worker
+ *  - CHITCP_ENOMEM: Could not allocate memory for the request
+ *  - CHITCP_ETHREAD: There are no workers, and one could not be created
+ *  - CHITCP_EWOULDBLOCK: All the workers are busy, and no more can be
+ *                        created (the request must not wait for them)
+ *
+ */
+static int chitcpd_handler_enqueue(handler_conn_t *conn, ChitcpdMsg *req, uint64_t received)
+{
+    handler_request_t *item;
+    int rc = CHITCP_OK;
+
+    item = malloc(sizeof(handler_request_t));
+    if (item == NULL)
+        return CHITCP_ENOMEM;
+
+    item->req = req;
+    item->received = received;
+
+    pthread_mutex_lock(&conn->lock);
+    /* If no worker is idle, we need another one. The existing ones may
+     * all be blocked, so the request doesn't wait for them if we can't
+     * create one. */
+    if (conn->nidle <= conn->nqueued)
+    {
+        if (conn->nworkers < CHITCPD_HANDLER_MAX_WORKERS &&
+            pthread_create(&conn->workers[conn->nworkers], NULL, chitcpd_handler_worker, conn) == 0)
+        {
+            conn->nworkers++;
+            conn->nidle++;
+        }
+        else if (conn->nworkers == 0)
+            rc = CHITCP_ETHREAD;
+        else
+            rc = CHITCP_EWOULDBLOCK;
+    }
+
+    if (rc == CHITCP_OK)
+    {
+        DL_APPEND(conn->queue, item);
+        conn->nqueued++;
+        pthread_cond_signal(&conn->cv);
+    }
+    else
+        free(item);
+    pthread_mutex_unlock(&conn->lock);
+
+    return rc;
+}
+
+/* Fails a pipelined request without running its handler (and frees it) */
+static int chitcpd_handler_reject(handler_conn_t *conn, ChitcpdMsg *req, int error_code)
+{
+    ChitcpdMsg resp_outer = CHITCPD_MSG__INIT;
+    ChitcpdResp resp_inner = CHITCPD_RESP__INIT;
+
+    resp_outer.code = CHITCPD_MSG_CODE__RESP;
+    resp_outer.resp = &resp_inner;
+    resp_outer.has_request_id = req->has_request_id;
+    resp_outer.request_id = req->request_id;
+    resp_inner.ret = -1;
+    resp_inner.error_code = error_code;
+
+    chitcpd_msg__free_unpacked(req, NULL);
+
+    return handler_conn_send(conn, &resp_outer, -1);
+}
+
 /*
  * chitcpd_handler_dispatch - Handler thread function
  *
  * Handles a connection on chitcpd's UNIX socket, and dispatches
  * incoming requests to the appropriate function, using the
- * dispatch table defined above.
+ * dispatch table defined above (pipelined requests are handed
+ * off to worker threads; see handler_conn_t)
  *
  * args: arguments (in handler_thread_args_t)
  *
@@ -138,13 +567,37 @@ void* chitcpd_handler_dispatch(void *args)
     pthread_mutex_t *handler_lock = ha->handler_lock;
     set_thread_name(pthread_self(), ha->thread_name);
     ChitcpdMsg *req;
-    ChitcpdMsg resp_outer = CHITCPD_MSG__INIT;
-    ChitcpdResp resp_inner = CHITCPD_RESP__INIT;
+    handler_conn_t *conn;
+    handler_request_t *item, *tmp;
     bool_t done = FALSE; /* Should we keep looping? */
+    uint64_t received;
     int rc;
 
-    resp_outer.code = CHITCPD_MSG_CODE__RESP;
-    resp_outer.resp = &resp_inner;
+    conn = calloc(1, sizeof(handler_conn_t));
+    if (conn == NULL)
+    {
+        chilog(ERROR, "Could not allocate memory for connection.");
+        close(client_socket);
+        free(args);
+        return NULL;
+    }
+    conn->send_socket = dup(client_socket);
+    if (conn->send_socket == -1)
+    {
+        chilog(ERROR, "Could not duplicate client socket.");
+        close(client_socket);
+        free(conn);
+        free(args);
+        return NULL;
+    }
+    conn->si = si;
+    conn->owner = pthread_self();
+    conn->handler_lock = handler_lock;
+    pthread_mutex_init(&conn->lock_send, NULL);
+    pthread_mutex_init(&conn->lock, NULL);
+    pthread_cond_init(&conn->cv, NULL);
+
+    atomic_fetch_add_explicit(&si->metrics.handler_threads, 1, memory_order_relaxed);
 
     do
     {
@@ -152,48 +605,36 @@ void* chitcpd_handler_dispatch(void *args)
         if (rc < 0)
             break;
 
-        chilog(TRACE, "Received request (code=%s)", handler_code_string(req->code));
+        received = chitcpd_stats_clock();
 
-        /* We have received a request, so we grab the handler lock to
-         * prevent a race condition when the server is shutting down */
-        pthread_mutex_lock(handler_lock);
+        chilog(TRACE, "Received request (code=%s)", handler_code_string(req->code));
 
-        /* Call handler function using dispatch table */
-        rc = handlers[req->code](si, req, &resp_inner);
+        if (req->has_request_id)
+        {
+            rc = chitcpd_handler_enqueue(conn, req, received);
+            if (rc == CHITCP_OK)
+                continue;
 
-        chitcpd_msg__free_unpacked(req, NULL);
+            if (rc == CHITCP_EWOULDBLOCK)
+            {
+                chilog(WARNING, "All %u workers of this handler are busy. Rejecting request.", CHITCPD_HANDLER_MAX_WORKERS);
+                if (chitcpd_handler_reject(conn, req, EAGAIN) < 0)
+                {
+                    close(client_socket);
+                    break;
+                }
+                continue;
+            }
 
-        if(rc != CHITCP_OK)
-        {
-            chilog(ERROR, "Error when handling request.");
-            /* We don't need to bail out just because one request failed */
+            /* If the request can't be handed off, we handle it here */
+            chilog(WARNING, "Could not hand off pipelined request. Handling it in order.");
         }
 
-        /* Send response */
-        rc = chitcpd_send_msg(client_socket, &resp_outer);
+        /* We have received a request, so we grab the handler lock to
+         * prevent a race condition when the server is shutting down */
+        pthread_mutex_lock(handler_lock);
 
-        if (resp_inner.has_buf)
-        {
-            /* This buffer was allocated in RECV. */
-            free(resp_inner.buf.data);
-            resp_inner.has_buf = FALSE;
-        }
-        if (resp_inner.socket_state != NULL)
-        {
-            /* This submessage was allocated in GET_SOCKET_STATE. */
-            free(resp_inner.socket_state);
-            resp_inner.socket_state = NULL;
-        }
-        if (resp_inner.socket_buffer_contents != NULL)
-        {
-            /* This submessage was allocated in GET_SOCKET_BUFFER_CONTENTS. */
-            if (resp_inner.socket_buffer_contents->snd.data != NULL)
-                free(resp_inner.socket_buffer_contents->snd.data);
-            if (resp_inner.socket_buffer_contents->rcv.data != NULL)
-                free(resp_inner.socket_buffer_contents->rcv.data);
-            free(resp_inner.socket_buffer_contents);
-            resp_inner.socket_buffer_contents = NULL;
-        }
+        rc = chitcpd_handle_request(conn, req, received);
 
         /* We're done processing the request (we've run the handler and
          * we've returned a response). We can release the handler lock and,
@@ -201,12 +642,56 @@ void* chitcpd_handler_dispatch(void *args)
          * safely */
         pthread_mutex_unlock(handler_lock);
 
-        if (rc < 0)
+        if (rc != CHITCP_OK)
+        {
+            /* The response could not be sent. The client socket
+             * is no longer of any use. */
+            close(client_socket);
             break;
+        }
 
     }
     while (!done);
 
+    /* Discard the pipelined requests no worker has picked up,
+     * and let the workers exit once they are done with the
+     * requests they are handling (their responses are discarded) */
+    pthread_mutex_lock(&conn->lock);
+    conn->closing = TRUE;
+    DL_FOREACH_SAFE(conn->queue, item, tmp)
+    {
+        DL_DELETE(conn->queue, item);
+        chitcpd_msg__free_unpacked(item->req, NULL);
+        free(item);
+    }
+    conn->nqueued = 0;
+    pthread_cond_broadcast(&conn->cv);
+    pthread_mutex_unlock(&conn->lock);
+
+    pthread_mutex_lock(&conn->lock_send);
+    if (conn->send_socket != -1)
+        shutdown(conn->send_socket, SHUT_RDWR);
+    pthread_mutex_unlock(&conn->lock_send);
+
+    /* Workers may be blocked on our sockets (e.g., in a RECV), and
+     * would use them after they are freed, so we wake them up and
+     * wait for them to exit. No worker is created from now on, so
+     * conn->workers doesn't change. */
+    for(int i=0; i < si->chisocket_table_size; i++)
+    {
+        chisocketentry_t *entry = &si->chisocket_table[i];
+        if(!entry->available && handler_conn_owns(conn, entry->creator_thread))
+            chitcpd_interrupt_socket_entry(si, entry);
+    }
+    for(unsigned int i=0; i < conn->nworkers; i++)
+        chitcpd_epoll_close_owned(si, conn->workers[i]);
+    chitcpd_epoll_close_owned(si, pthread_self());
+
+    for(unsigned int i=0; i < conn->nworkers; i++)
+        pthread_join(conn->workers[i], NULL);
+    if (conn->nworkers > 0)
+        chilog(DEBUG, "Joined the %u workers of this handler.", conn->nworkers);
+
     /* TODO: Be more discerning about what kind of shutdown this is */
     if(si->state == CHITCPD_STATE_STOPPING)
         chilog(DEBUG, "chiTCP daemon is stopping. Freeing open sockets for this handler...");
@@ -243,13 +728,46 @@ void* chitcpd_handler_dispatch(void *args)
     else
         chilog(DEBUG, "This handler had no sockets to free.");
 
+    /* A worker may have created an epoll instance after we closed the
+     * others (they belong to us once the worker is done) */
+    if (chitcpd_epoll_close_owned(si, pthread_self()) > 0)
+        chilog(DEBUG, "Closed the epoll instances of this handler.");
+
     chilog(DEBUG, "Handler is exiting.");
+    atomic_fetch_sub_explicit(&si->metrics.handler_threads, 1, memory_order_relaxed);
+    handler_conn_free(conn);
     free(args);
     return NULL;
 }
 
 
 
+/*
+ * chitcpd_create_shm - Creates the shared-memory region of a socket
+ *
+ * The region's descriptor is passed to the client along with
+ * the response (see chitcpd_handler_dispatch)
+ *
+ * entry: Socket entry
+ *
+ * resp: Response to the client
+ *
+ * Returns: Nothing.
+ *
+ */
+static void chitcpd_create_shm(chisocketentry_t *entry, ChitcpdResp *resp)
+{
+    if (chitcp_shm_create(&entry->shm, TCP_BUFFER_SIZE, entry->tcp_state) != CHITCP_OK)
+    {
+        chilog(WARNING, "Could not create shared memory for socket. Not using shared memory.");
+        return;
+    }
+
+    resp->has_shm_fd = TRUE;
+    resp->shm_fd = entry->shm.fd;
+}
+
+
 /* Handler for chisocket_socket() */
 HANDLER_FUNCTION(CHITCPD_MSG_CODE__SOCKET)
 {
@@ -264,7 +782,8 @@ HANDLER_FUNCTION(CHITCPD_MSG_CODE__SOCKET)
     req = req_msg->socket_args;
 
     domain = req->domain;
-    type = req->type;
+    /* The type can include the same flags as in socket(2) */
+    type = req->type & ~(SOCK_NONBLOCK | SOCK_CLOEXEC);
     protocol = req->protocol;
 
     ret = chitcpd_allocate_socket(si, &socket_index);
@@ -274,6 +793,12 @@ HANDLER_FUNCTION(CHITCPD_MSG_CODE__SOCKET)
         si->chisocket_table[socket_index].domain = domain;
         si->chisocket_table[socket_index].type = type;
         si->chisocket_table[socket_index].protocol = protocol;
+        si->chisocket_table[socket_index].nonblocking = (req->type & SOCK_NONBLOCK) != 0;
+
+        /* If the client can't get a shared-memory region, it simply
+         * sends its data in SEND and RECV requests */
+        if (req->has_shm && req->shm)
+            chitcpd_create_shm(&si->chisocket_table[socket_index], resp);
 
         resp->ret = socket_index;
         resp->error_code = 0;
@@ -494,10 +1019,25 @@ HANDLER_FUNCTION(CHITCPD_MSG_CODE__ACCEPT)
     }
 
     /* Get the next pending connection from the pending connection queue.
-     * If there are no pending connections, then block until one arrives */
+     * If there are no pending connections, then block until one arrives
+     * (or fail with EAGAIN, if the socket is non-blocking) */
     pthread_mutex_lock(&socket_state->lock_pending_connections);
-    while(socket_state->pending_connections == NULL)
+    if(socket_state->pending_connections == NULL && entry->nonblocking)
+    {
+        pthread_mutex_unlock(&socket_state->lock_pending_connections);
+        ret = -1;
+        error_code = EAGAIN;
+        goto done;
+    }
+    while(socket_state->pending_connections == NULL && !entry->interrupted)
         pthread_cond_wait(&socket_state->cv_pending_connections, &socket_state->lock_pending_connections);
+    if(socket_state->pending_connections == NULL)
+    {
+        pthread_mutex_unlock(&socket_state->lock_pending_connections);
+        ret = -1;
+        error_code = EINTR;
+        goto done;
+    }
     pending_connection = socket_state->pending_connections;
     DL_DELETE(socket_state->pending_connections, pending_connection);
     pthread_mutex_unlock(&socket_state->lock_pending_connections);
@@ -533,7 +1073,7 @@ HANDLER_FUNCTION(CHITCPD_MSG_CODE__ACCEPT)
     pthread_mutex_init(&active_socket_state->lock_event, NULL);
     pthread_cond_init(&active_socket_state->cv_event, NULL);
 
-    active_socket_state->realtcpconn = chitcpd_get_connection(si, remote_addr);
+    active_socket_state->realtcpconn = chitcpd_get_socket_connection(si, local_addr, remote_addr);
 
     memcpy(&active_entry->local_addr, local_addr, sizeof(struct sockaddr_storage));
     memcpy(&active_entry->remote_addr, remote_addr, sizeof(struct sockaddr_storage));
@@ -558,6 +1098,11 @@ HANDLER_FUNCTION(CHITCPD_MSG_CODE__ACCEPT)
      * correctly happen in the TCP thread. */
     active_entry->tcp_state = LISTEN;
 
+    /* The accepted socket inherits the shared-memory mode
+     * of the passive socket (unless the client can't attach to it) */
+    if (entry->shm.header != NULL && !(req->has_no_shm && req->no_shm))
+        chitcpd_create_shm(active_entry, resp);
+
     pthread_mutex_lock(&active_socket_state->tcp_data.lock_pending_packets);
     chilog(TRACE, "accept() initial packet: enqueueing a copy");
     chitcp_packet_list_append(&active_socket_state->tcp_data.pending_packets, pending_connection->initial_packet);
@@ -576,9 +1121,11 @@ HANDLER_FUNCTION(CHITCPD_MSG_CODE__ACCEPT)
     pthread_cond_broadcast(&active_socket_state->cv_event);
     pthread_mutex_unlock(&active_socket_state->lock_event);
 
-    /* Wait for socket to enter ESTABLISHED state */
+    /* Wait for socket to enter ESTABLISHED state. If we're interrupted,
+     * the new socket is returned anyway (it will be freed along with
+     * the client's other sockets) */
     chilog(TRACE, "Waiting for ESTABLISHED...");
-    while(active_entry->tcp_state != ESTABLISHED)
+    while(active_entry->tcp_state != ESTABLISHED && !active_entry->interrupted)
         pthread_cond_wait(&active_entry->cv_tcp_state, &active_entry->lock_tcp_state);
     pthread_mutex_unlock(&active_entry->lock_tcp_state);
 
@@ -662,7 +1209,8 @@ HANDLER_FUNCTION(CHITCPD_MSG_CODE__CONNECT)
     /* See if we are already connected to the chiTCP daemon on the peer */
     connection = chitcpd_get_connection(si, (struct sockaddr*) &addr);
 
-    /* If not, establish a connection with the peer's chiTCP daemon */
+    /* If not, establish a connection (or several connections, see
+     * si->connection_stripes) with the peer's chiTCP daemon */
     if(connection == NULL)
     {
         chilog(DEBUG, "No connection entry found, creating one.");
@@ -690,8 +1238,6 @@ HANDLER_FUNCTION(CHITCPD_MSG_CODE__CONNECT)
     pthread_mutex_init(&socket_state->lock_event, NULL);
     pthread_cond_init(&socket_state->cv_event, NULL);
 
-    socket_state->realtcpconn = connection;
-
     /* Zero out the local address, effectively binding the local address
      * to the ANY address. This is not ideal, but will work.
      * Ideally, we would query the routing table to determine what
@@ -711,6 +1257,14 @@ HANDLER_FUNCTION(CHITCPD_MSG_CODE__CONNECT)
     /* Copy remote address */
     memcpy(&entry->remote_addr, &addr, sizeof(struct sockaddr_storage));
 
+    /* Pick one of the connections to the peer, now that
+     * we know the socket's 4-tuple */
+    if(connection != NULL)
+        socket_state->realtcpconn = chitcpd_get_socket_connection(si,
+                (struct sockaddr *) &entry->local_addr, (struct sockaddr *) &entry->remote_addr);
+    else
+        socket_state->realtcpconn = NULL;
+
     /* Update port table */
     si->port_table[port] = entry;
 
@@ -728,6 +1282,18 @@ HANDLER_FUNCTION(CHITCPD_MSG_CODE__CONNECT)
     pthread_cond_broadcast(&socket_state->cv_event);
     pthread_mutex_unlock(&socket_state->lock_event);
 
+    /* A non-blocking socket doesn't wait for the three-way handshake.
+     * The socket becomes writable (see chitcpd_socket_events) once
+     * it is ESTABLISHED */
+    if (entry->nonblocking)
+    {
+        pthread_mutex_unlock(&entry->lock_tcp_state);
+        chilog(TRACE, "Non-blocking socket, not waiting for ESTABLISHED");
+        ret = -1;
+        error_code = EINPROGRESS;
+        goto done;
+    }
+
     /* Wait for socket to enter ESTABLISHED state */
     chilog(TRACE, "Waiting for ESTABLISHED...");
     /* TODO: There is a potential race condition here, where the thread
@@ -742,7 +1308,7 @@ HANDLER_FUNCTION(CHITCPD_MSG_CODE__CONNECT)
      *       to ensure that a connection teardown cannot be initiated if the socket
      *       is in ESTABLISHED state by connect() hasn't returned yet.
      */
-    while(entry->tcp_state != ESTABLISHED)
+    while(entry->tcp_state != ESTABLISHED && !entry->interrupted)
     {
         struct timespec ts;
         int rc;
@@ -757,6 +1323,13 @@ HANDLER_FUNCTION(CHITCPD_MSG_CODE__CONNECT)
             chilog(TRACE, "Waiting for ESTABLISHED... [timeout, state=%i]", entry->tcp_state);
         }
     }
+    if (entry->tcp_state != ESTABLISHED)
+    {
+        pthread_mutex_unlock(&entry->lock_tcp_state);
+        ret = -1;
+        error_code = EINTR;
+        goto done;
+    }
     pthread_mutex_unlock(&entry->lock_tcp_state);
 
     chilog(TRACE, "Socket connection is ESTABLISHED");
@@ -780,6 +1353,7 @@ HANDLER_FUNCTION(CHITCPD_MSG_CODE__SEND)
     chisocket_t sockfd;
     uint8_t *data;
     size_t length;
+    int flags;
     int ret, error_code = 0;;
     ChitcpdSendArgs *req;
 
@@ -792,9 +1366,7 @@ HANDLER_FUNCTION(CHITCPD_MSG_CODE__SEND)
     sockfd = req->sockfd;
     length = req->buf.len;
     data = req->buf.data;
-
-    /* TODO: handle the different flags */
-    /* int flags = req->flags; */
+    flags = req->flags;
 
     if(length <= 0)
     {
@@ -845,8 +1417,30 @@ HANDLER_FUNCTION(CHITCPD_MSG_CODE__SEND)
     socket_state = &entry->socket_state.active;
     tcp_data = &socket_state->tcp_data;
     int nbytes;
+    uint64_t start;
+
+    start = chitcpd_stats_clock();
+    if (entry->nonblocking || (flags & MSG_DONTWAIT))
+    {
+        /* Non-blocking writes to the buffer are all-or-nothing, so we
+         * only write as much as fits in it (like send(2) does) */
+        int available = circular_buffer_available(&tcp_data->send);
+
+        if (available > 0)
+            nbytes = circular_buffer_write(&tcp_data->send, data, MIN(length, available), BUFFER_NONBLOCKING);
+        else
+            nbytes = CHITCP_EWOULDBLOCK;
+    }
+    else
+        nbytes = circular_buffer_write(&tcp_data->send, data, length, BUFFER_BLOCKING);
+    CHITCPD_STATS_ADD(&entry->stats, send_blocked_ns, chitcpd_stats_clock() - start);
 
-    nbytes = circular_buffer_write(&tcp_data->send, data, length, BUFFER_BLOCKING);
+    if (nbytes == CHITCP_EWOULDBLOCK)
+    {
+        ret = -1;
+        error_code = EAGAIN;
+        goto done;
+    }
 
     /* TODO: Be more discerning about the returned error */
     if (nbytes < 0)
@@ -885,6 +1479,7 @@ HANDLER_FUNCTION(CHITCPD_MSG_CODE__RECV)
 {
     chisocket_t sockfd;
     size_t length;
+    int flags;
     int ret, error_code = 0;;
     ChitcpdRecvArgs *req;
 
@@ -896,7 +1491,8 @@ HANDLER_FUNCTION(CHITCPD_MSG_CODE__RECV)
 
     sockfd = req->sockfd;
     length = req->len;
-    /* TODO: handle the different flags */
+    flags = req->flags;
+
     if(length <= 0)
     {
         chilog(ERROR, "Invalid length: %i", length);
@@ -938,49 +1534,89 @@ HANDLER_FUNCTION(CHITCPD_MSG_CODE__RECV)
     }
 
     /* Extract maximum possible data from buffer.
-     * This call may block if there is no data to receive */
+     * This call may block if there is no data to receive (unless the
+     * socket is non-blocking, or MSG_DONTWAIT is set). With MSG_WAITALL,
+     * we keep reading until there are "length" bytes, or the buffer is
+     * closed. MSG_PEEK leaves the data in the buffer (and MSG_WAITALL
+     * is ignored, since the buffer could be smaller than "length") */
     active_chisocket_state_t *socket_state;
     tcp_data_t *tcp_data;
-    int nbytes;
+    bool_t blocking, peek, waitall;
+    int nbytes, rc;
 
     socket_state = &si->chisocket_table[sockfd].socket_state.active;
     tcp_data = &si->chisocket_table[sockfd].socket_state.active.tcp_data;
 
-    resp->buf.data = malloc(length);
-    nbytes = circular_buffer_read(&tcp_data->recv, resp->buf.data, length, BUFFER_BLOCKING);
+    blocking = !entry->nonblocking && !(flags & MSG_DONTWAIT);
+    peek = (flags & MSG_PEEK) != 0;
+    waitall = blocking && !peek && (flags & MSG_WAITALL);
 
-    /* TODO: Be more discerning about the returned error */
-    if (nbytes < 0)
-    {
-        chilog(ERROR, "circular_buffer_write returned an error: %i", nbytes);
-        ret = -1;
-        error_code = EINVAL;
-        goto done;
-    }
-    if (nbytes == 0)
+    uint64_t start;
+
+    resp->buf.data = malloc(length);
+    start = chitcpd_stats_clock();
+    nbytes = 0;
+    do
     {
-        /* This means the buffer has been closed */
-        assert(entry->tcp_state == CLOSING    ||
-               entry->tcp_state == TIME_WAIT  ||
-               entry->tcp_state == CLOSE_WAIT ||
-               entry->tcp_state == LAST_ACK   ||
-               entry->tcp_state == CLOSED);
+        if (peek)
+            rc = circular_buffer_peek(&tcp_data->recv, resp->buf.data, length, blocking);
+        else
+            rc = circular_buffer_read(&tcp_data->recv, resp->buf.data + nbytes, length - nbytes, blocking);
 
-        ret = 0;
-        goto done;
-    }
+        if (rc <= 0)
+            break;
+
+        nbytes += rc;
+        chilog(DEBUG, "recv() has extracted %i bytes from the recv buffer", rc);
 
-    chilog(DEBUG, "recv() has extracted %i bytes from the recv buffer", nbytes);
+        /* We don't signal the TCP thread if the connection has not yet
+         * been synchronized (or if no data was removed from the buffer) */
+        if (!peek &&
+            (entry->tcp_state == ESTABLISHED ||
+             entry->tcp_state == FIN_WAIT_1  || entry->tcp_state == FIN_WAIT_2))
+        {
+            pthread_mutex_lock(&socket_state->lock_event);
+            socket_state->flags.app_recv = 1;
+            pthread_cond_broadcast(&socket_state->cv_event);
+            pthread_mutex_unlock(&socket_state->lock_event);
+        }
+    } while (waitall && nbytes < length);
+    CHITCPD_STATS_ADD(&si->chisocket_table[sockfd].stats, recv_blocked_ns, chitcpd_stats_clock() - start);
 
-    /* We don't signal the TCP thread if the connection has not yet
-     * been synchronized */
-    if (entry->tcp_state == ESTABLISHED ||
-        entry->tcp_state == FIN_WAIT_1  || entry->tcp_state == FIN_WAIT_2)
+    /* If the buffer was closed after reading some data (with MSG_WAITALL),
+     * we return that data */
+    if (nbytes == 0)
     {
-        pthread_mutex_lock(&socket_state->lock_event);
-        socket_state->flags.app_recv = 1;
-        pthread_cond_broadcast(&socket_state->cv_event);
-        pthread_mutex_unlock(&socket_state->lock_event);
+        free(resp->buf.data);
+        resp->buf.data = NULL;
+
+        if (rc == CHITCP_EWOULDBLOCK)
+        {
+            ret = -1;
+            error_code = EAGAIN;
+            goto done;
+        }
+
+        /* TODO: Be more discerning about the returned error */
+        if (rc < 0)
+        {
+            chilog(ERROR, "circular_buffer_read returned an error: %i", rc);
+            ret = -1;
+            error_code = EINVAL;
+            goto done;
+        }
+
+        /* This means the buffer has been closed (or the
+         * request was interrupted by its client going away) */
+        assert(atomic_load(&entry->interrupted)  ||
+               entry->tcp_state == CLOSING    ||
+               entry->tcp_state == TIME_WAIT  ||
+               entry->tcp_state == CLOSE_WAIT ||
+               entry->tcp_state == LAST_ACK   ||
+               entry->tcp_state == CLOSED);
+
+        ret = 0;
+        goto done;
     }
 
     ret = nbytes;
@@ -1000,6 +1636,156 @@ HANDLER_FUNCTION(CHITCPD_MSG_CODE__RECV)
 }
 
 
+/* Handler for the wakeups sent by chisocket_send() and chisocket_recv()
+ * in shared-memory mode. The client has already written to (or read from)
+ * the buffers, so we only have to notify the TCP thread, as SEND and RECV
+ * would have done. */
+HANDLER_FUNCTION(CHITCPD_MSG_CODE__SHM_NOTIFY)
+{
+    chisocket_t sockfd;
+    int ret, error_code = 0;
+    ChitcpdShmNotifyArgs *req;
+
+    chilog(TRACE, ">>> Entering handler for CHITCPD_MSG_CODE__SHM_NOTIFY");
+
+    /* Unpack request */
+    assert(req_msg->shm_notify_args != NULL);
+    req = req_msg->shm_notify_args;
+
+    sockfd = req->sockfd;
+
+    if(sockfd < 0 || sockfd >= si->chisocket_table_size || si->chisocket_table[sockfd].available)
+    {
+        chilog(ERROR, "Not a valid chisocket descriptor: %i", sockfd);
+        ret = -1;
+        error_code = EBADF;
+        goto done;
+    }
+    chisocketentry_t *entry = &si->chisocket_table[sockfd];
+
+    if(entry->actpas_type != SOCKET_ACTIVE || entry->shm.header == NULL)
+    {
+        chilog(ERROR, "Not an active socket in shared-memory mode: %i", sockfd);
+        ret = -1;
+        error_code = EINVAL;
+        goto done;
+    }
+
+    active_chisocket_state_t *socket_state = &entry->socket_state.active;
+    bool_t app_send, app_recv;
+
+    /* As in SEND and RECV, we don't notify the TCP thread if the
+     * connection has not been synchronized yet */
+    app_send = req->sent &&
+               (entry->tcp_state == ESTABLISHED || entry->tcp_state == CLOSE_WAIT);
+    app_recv = req->received &&
+               (entry->tcp_state == ESTABLISHED ||
+                entry->tcp_state == FIN_WAIT_1  || entry->tcp_state == FIN_WAIT_2);
+
+    if (app_send || app_recv)
+    {
+        pthread_mutex_lock(&socket_state->lock_event);
+        if (app_send)
+            socket_state->flags.app_send = 1;
+        if (app_recv)
+            socket_state->flags.app_recv = 1;
+        pthread_cond_broadcast(&socket_state->cv_event);
+        pthread_mutex_unlock(&socket_state->lock_event);
+    }
+
+    ret = 0;
+
+done:
+    /* Create response */
+    resp->ret = ret;
+    resp->error_code = error_code;
+
+    chilog(TRACE, "<<< Exiting handler for CHITCPD_MSG_CODE__SHM_NOTIFY");
+
+    return CHITCP_OK;
+}
+
+
+/* Handler for chisocket_batch(). The requests in the batch are run one
+ * after the other, exactly as if they had been sent separately (so a
+ * blocking request holds up the rest of the batch), and the responses
+ * are returned in the same order. */
+HANDLER_FUNCTION(CHITCPD_MSG_CODE__BATCH)
+{
+    int ret, error_code = 0;
+    ChitcpdBatchArgs *req;
+    int nhandlers = sizeof(handlers) / sizeof(handler_function);
+
+    chilog(TRACE, ">>> Entering handler for CHITCPD_MSG_CODE__BATCH");
+
+    /* Unpack request */
+    assert(req_msg->batch_args != NULL);
+    req = req_msg->batch_args;
+
+    /* This will be freed back in the dispatch function */
+    resp->n_batch = 0;
+    resp->batch = calloc(req->n_requests, sizeof(ChitcpdResp *));
+    if (resp->batch == NULL && req->n_requests > 0)
+    {
+        ret = -1;
+        error_code = ENOMEM;
+        goto done;
+    }
+
+    for (size_t i = 0; i < req->n_requests; i++)
+    {
+        ChitcpdMsg *sub_msg = req->requests[i];
+        ChitcpdResp *sub_resp;
+        int code = sub_msg->code;
+
+        sub_resp = malloc(sizeof(ChitcpdResp));
+        if (sub_resp == NULL)
+        {
+            ret = -1;
+            error_code = ENOMEM;
+            goto done;
+        }
+        chitcpd_resp__init(sub_resp);
+        resp->batch[resp->n_batch++] = sub_resp;
+
+        if (code <= CHITCPD_MSG_CODE__INIT || code >= nhandlers ||
+            handlers[code] == NULL || code == CHITCPD_MSG_CODE__BATCH)
+        {
+            chilog(ERROR, "Request can't be part of a batch (code=%i)", code);
+            sub_resp->ret = -1;
+            sub_resp->error_code = EINVAL;
+            continue;
+        }
+
+        /* Only one descriptor can be passed along with the response,
+         * so the sockets created in a batch don't use shared memory */
+        if (code == CHITCPD_MSG_CODE__SOCKET && sub_msg->socket_args != NULL)
+            sub_msg->socket_args->has_shm = FALSE;
+        else if (code == CHITCPD_MSG_CODE__ACCEPT && sub_msg->accept_args != NULL)
+        {
+            sub_msg->accept_args->has_no_shm = TRUE;
+            sub_msg->accept_args->no_shm = TRUE;
+        }
+
+        if (handlers[code](si, sub_msg, sub_resp) != CHITCP_OK)
+            chilog(ERROR, "Error when handling request in batch (code=%s).", handler_code_string(code));
+
+        assert(!sub_resp->has_shm_fd);
+    }
+
+    ret = resp->n_batch;
+
+done:
+    /* Create response */
+    resp->ret = ret;
+    resp->error_code = error_code;
+
+    chilog(TRACE, "<<< Exiting handler for CHITCPD_MSG_CODE__BATCH");
+
+    return CHITCP_OK;
+}
+
+
 /* Handler for chisocket_close() */
 HANDLER_FUNCTION(CHITCPD_MSG_CODE__CLOSE)
 {
@@ -1132,12 +1918,13 @@ HANDLER_FUNCTION(CHITCPD_MSG_CODE__CLOSE)
          * until we're in FIN_WAIT_2 *and* the retransmission queue is empty.
          * However, a simultaneous close could land us in CLOSING or TIME_WAIT */
         while(! (entry->tcp_state == FIN_WAIT_2 || entry->tcp_state == CLOSING ||
-                 entry->tcp_state == TIME_WAIT || entry->tcp_state == CLOSED ))
+                 entry->tcp_state == TIME_WAIT || entry->tcp_state == CLOSED ) &&
+              !entry->interrupted)
             pthread_cond_wait(&entry->cv_tcp_state, &entry->lock_tcp_state);
     }
     else if (entry->tcp_state == CLOSE_WAIT)
     {
-        while(! (entry->tcp_state == LAST_ACK || entry->tcp_state == CLOSED) )
+        while(! (entry->tcp_state == LAST_ACK || entry->tcp_state == CLOSED) && !entry->interrupted)
             pthread_cond_wait(&entry->cv_tcp_state, &entry->lock_tcp_state);
     }
 
@@ -1146,6 +1933,13 @@ HANDLER_FUNCTION(CHITCPD_MSG_CODE__CLOSE)
     else if (entry->tcp_state == FIN_WAIT_2 || entry->tcp_state == CLOSING ||
              entry->tcp_state == TIME_WAIT  || entry->tcp_state == LAST_ACK )
         chilog(TRACE, "Socket entered a closing state");
+    else if (entry->interrupted)
+    {
+        ret = -1;
+        error_code = EINTR;
+        pthread_mutex_unlock(&entry->lock_tcp_state);
+        goto done;
+    }
     else
     {
         chilog(ERROR, "Socket entered an inconsistent state %i", entry->tcp_state);
@@ -1349,11 +2143,18 @@ HANDLER_FUNCTION(CHITCPD_MSG_CODE__WAIT_FOR_STATE)
 
     pthread_mutex_lock(&entry->lock_tcp_state);
     chilog(TRACE, "Socket %i is %s. Waiting for %s.", sockfd, tcp_str(entry->tcp_state), tcp_str(tcp_state));
-    while(entry->tcp_state != tcp_state)
+    while(entry->tcp_state != tcp_state && !entry->interrupted)
     {
         pthread_cond_wait(&entry->cv_tcp_state, &entry->lock_tcp_state);
         chilog(TRACE, "Socket %i is %s. Waiting for %s.", sockfd, tcp_str(entry->tcp_state), tcp_str(tcp_state));
     }
+    if (entry->tcp_state != tcp_state)
+    {
+        pthread_mutex_unlock(&entry->lock_tcp_state);
+        ret = -1;
+        error_code = EINTR;
+        goto done;
+    }
     pthread_mutex_unlock(&entry->lock_tcp_state);
 
     ret = 0;
@@ -1367,3 +2168,476 @@ HANDLER_FUNCTION(CHITCPD_MSG_CODE__WAIT_FOR_STATE)
 
     return CHITCP_OK;
 }
+
+
+/* Handler for chitcpd_get_socket_trace() */
+HANDLER_FUNCTION(CHITCPD_MSG_CODE__GET_SOCKET_TRACE)
+{
+    chisocket_t sockfd;
+    int ret, error_code = 0;
+    ChitcpdGetSocketTraceArgs *req;
+    uint8_t *dump = NULL;
+    size_t len;
+
+    chilog(TRACE, ">>> Entering handler for CHITCPD_MSG_CODE__GET_SOCKET_TRACE");
+
+    /* Unpack request */
+    assert(req_msg->get_socket_trace_args != NULL);
+    req = req_msg->get_socket_trace_args;
+
+    sockfd = req->sockfd;
+
+    if(sockfd < 0 || sockfd >= si->chisocket_table_size || si->chisocket_table[sockfd].available)
+    {
+        chilog(ERROR, "Not a valid chisocket descriptor: %i", sockfd);
+        ret = -1;
+        error_code = EBADF;
+        goto done;
+    }
+
+    /* Traces are never freed while the daemon is running (see
+     * serverinfo.h), so the lock only serializes this with the
+     * allocation of socket slots */
+    pthread_mutex_lock(&si->lock_chisocket_table);
+    if(si->chisocket_table[sockfd].trace != NULL)
+        dump = chitcpd_trace_dump(si->chisocket_table[sockfd].trace, sockfd, &len);
+    else
+        errno = ENODATA;
+    pthread_mutex_unlock(&si->lock_chisocket_table);
+
+    if(dump == NULL)
+    {
+        ret = -1;
+        error_code = errno;
+    }
+    else
+    {
+        /* This will be freed back in the dispatch function. */
+        resp->has_trace = TRUE;
+        resp->trace.data = dump;
+        resp->trace.len = len;
+        ret = 0;
+    }
+
+ done:
+    /* Create response */
+    resp->ret = ret;
+    resp->error_code = error_code;
+
+    chilog(TRACE, "<<< Exiting handler for CHITCPD_MSG_CODE__GET_SOCKET_TRACE");
+
+    return CHITCP_OK;
+}
+
+
+HANDLER_FUNCTION(CHITCPD_MSG_CODE__GET_SOCKET_STATS)
+{
+    chisocket_t sockfd;
+    int ret, error_code = 0;
+    ChitcpdGetSocketStatsArgs *req;
+    ChitcpdSocketStats *socket_stats;
+    chitcpd_socket_stats_t *stats;
+
+    chilog(TRACE, ">>> Entering handler for CHITCPD_MSG_CODE__GET_SOCKET_STATS");
+
+    /* Unpack request */
+    assert(req_msg->get_socket_stats_args != NULL);
+    req = req_msg->get_socket_stats_args;
+
+    sockfd = req->sockfd;
+
+    if(sockfd < 0 || sockfd >= si->chisocket_table_size || si->chisocket_table[sockfd].available)
+    {
+        chilog(ERROR, "Not a valid chisocket descriptor: %i", sockfd);
+        ret = -1;
+        error_code = EBADF;
+        goto done;
+    }
+
+    /* This will be freed back in the dispatch function. */
+    socket_stats = malloc(sizeof(ChitcpdSocketStats));
+    if(socket_stats == NULL)
+    {
+        ret = -1;
+        error_code = ENOMEM;
+        goto done;
+    }
+    chitcpd_socket_stats__init(socket_stats);
+
+    /* The counters are read one by one, without any locks, so the
+     * values may not be consistent with each other if the socket
+     * is active. */
+    stats = &si->chisocket_table[sockfd].stats;
+    socket_stats->segs_sent = CHITCPD_STATS_GET(stats, segs_sent);
+    socket_stats->segs_rcvd = CHITCPD_STATS_GET(stats, segs_rcvd);
+    socket_stats->bytes_sent = CHITCPD_STATS_GET(stats, bytes_sent);
+    socket_stats->bytes_rcvd = CHITCPD_STATS_GET(stats, bytes_rcvd);
+    socket_stats->retransmits = CHITCPD_STATS_GET(stats, retransmits);
+    socket_stats->dup_acks = CHITCPD_STATS_GET(stats, dup_acks);
+    socket_stats->zero_window_probes = CHITCPD_STATS_GET(stats, zero_window_probes);
+    socket_stats->out_of_order = CHITCPD_STATS_GET(stats, out_of_order);
+    socket_stats->send_blocked_ns = CHITCPD_STATS_GET(stats, send_blocked_ns);
+    socket_stats->recv_blocked_ns = CHITCPD_STATS_GET(stats, recv_blocked_ns);
+    socket_stats->rtt_samples = CHITCPD_STATS_GET(stats, rtt_samples);
+    socket_stats->rtt_last_ns = CHITCPD_STATS_GET(stats, rtt_last_ns);
+    socket_stats->rtt_min_ns = CHITCPD_STATS_GET(stats, rtt_min_ns);
+    socket_stats->srtt_ns = CHITCPD_STATS_GET(stats, srtt_ns);
+
+    resp->socket_stats = socket_stats;
+    ret = 0;
+
+ done:
+    /* Create response */
+    resp->ret = ret;
+    resp->error_code = error_code;
+
+    chilog(TRACE, "<<< Exiting handler for CHITCPD_MSG_CODE__GET_SOCKET_STATS");
+
+    return CHITCP_OK;
+}
+
+
+/* Adds a summary of a latency histogram to a GET_LATENCY response
+ * (if the histogram is not empty) */
+static int latency_add(ChitcpdResp *resp, char *group, char *name, chitcpd_histogram_t *h, bool_t reset)
+{
+    chitcpd_histogram_snapshot_t snap;
+    ChitcpdLatency *latency;
+
+    chitcpd_histogram_snapshot(h, &snap, reset);
+    if (snap.count == 0)
+        return CHITCP_OK;
+
+    latency = malloc(sizeof(ChitcpdLatency));
+    if (latency == NULL)
+        return CHITCP_ENOMEM;
+    chitcpd_latency__init(latency);
+
+    /* The strings are static, so they are not freed with the submessage */
+    latency->group = group;
+    latency->name = name;
+    latency->count = snap.count;
+    latency->mean_ns = snap.sum / snap.count;
+    latency->p50_ns = chitcpd_histogram_percentile(&snap, 50.0);
+    latency->p99_ns = chitcpd_histogram_percentile(&snap, 99.0);
+    latency->p999_ns = chitcpd_histogram_percentile(&snap, 99.9);
+    latency->max_ns = snap.max;
+
+    resp->latency[resp->n_latency++] = latency;
+
+    return CHITCP_OK;
+}
+
+HANDLER_FUNCTION(CHITCPD_MSG_CODE__GET_LATENCY)
+{
+    int ret, error_code = 0;
+    ChitcpdGetLatencyArgs *req;
+    chitcpd_metrics_t *metrics = &si->metrics;
+    int ncodes = sizeof(code_strs) / sizeof(char *);
+    int rc = CHITCP_OK;
+
+    chilog(TRACE, ">>> Entering handler for CHITCPD_MSG_CODE__GET_LATENCY");
+
+    /* Unpack request */
+    assert(req_msg->get_latency_args != NULL);
+    req = req_msg->get_latency_args;
+
+    if (ncodes >= CHITCPD_METRICS_MSG_CODES)
+        ncodes = CHITCPD_METRICS_MSG_CODES - 1;
+
+    /* This will be freed back in the dispatch function. Request codes
+     * start at 1 (INIT is not handled here), and so do TCP events. */
+    resp->n_latency = 0;
+    resp->latency = malloc((2 * ncodes + (CHITCPD_METRICS_TCP_EVENTS - 1)) * sizeof(ChitcpdLatency *));
+    if (resp->latency == NULL)
+    {
+        ret = -1;
+        error_code = ENOMEM;
+        goto done;
+    }
+
+    for (int code = 1; code <= ncodes && rc == CHITCP_OK; code++)
+        rc = latency_add(resp, "handler", handler_code_string(code), &metrics->rpc_handler[code], req->reset);
+    for (int code = 1; code <= ncodes && rc == CHITCP_OK; code++)
+        rc = latency_add(resp, "response", handler_code_string(code), &metrics->rpc_response[code], req->reset);
+    for (int event = APPLICATION_CONNECT; event <= CLEANUP && rc == CHITCP_OK; event++)
+        rc = latency_add(resp, "tcp_event", tcp_event_str(event), &metrics->tcp_event[event], req->reset);
+
+    if (rc != CHITCP_OK)
+    {
+        ret = -1;
+        error_code = ENOMEM;
+        goto done;
+    }
+
+    ret = 0;
+
+ done:
+    /* Create response */
+    resp->ret = ret;
+    resp->error_code = error_code;
+
+    chilog(TRACE, "<<< Exiting handler for CHITCPD_MSG_CODE__GET_LATENCY");
+
+    return CHITCP_OK;
+}
+
+/* Adds the events returned by chitcpd_poll or chitcpd_epoll_wait to a
+ * response. Returns CHITCP_OK, or CHITCP_ENOMEM (the events added so
+ * far are freed back in the dispatch function). */
+static int poll_events_add(ChitcpdResp *resp, chitcpd_poll_event_t *events, int nevents, bool_t has_data)
+{
+    resp->n_events = 0;
+    resp->events = malloc(nevents * sizeof(ChitcpdPollEvent *));
+    if (resp->events == NULL && nevents > 0)
+        return CHITCP_ENOMEM;
+
+    for (int i = 0; i < nevents; i++)
+    {
+        ChitcpdPollEvent *ev = malloc(sizeof(ChitcpdPollEvent));
+        if (ev == NULL)
+            return CHITCP_ENOMEM;
+
+        chitcpd_poll_event__init(ev);
+        ev->sockfd = events[i].sockfd;
+        ev->events = events[i].events;
+        ev->has_revents = TRUE;
+        ev->revents = events[i].revents;
+        ev->has_data = has_data;
+        ev->data = events[i].data;
+
+        resp->events[resp->n_events++] = ev;
+    }
+
+    return CHITCP_OK;
+}
+
+
+/* Handler for chisocket_poll() */
+HANDLER_FUNCTION(CHITCPD_MSG_CODE__POLL)
+{
+    int ret, error_code = 0;
+    ChitcpdPollArgs *req;
+    chitcpd_poll_event_t *fds;
+    int nfds, nready;
+
+    chilog(TRACE, ">>> Entering handler for CHITCPD_MSG_CODE__POLL");
+
+    /* Unpack request */
+    assert(req_msg->poll_args != NULL);
+    req = req_msg->poll_args;
+
+    nfds = req->n_fds;
+    fds = calloc(nfds > 0? nfds : 1, sizeof(chitcpd_poll_event_t));
+    if (fds == NULL)
+    {
+        ret = -1;
+        error_code = ENOMEM;
+        goto done;
+    }
+
+    for (int i = 0; i < nfds; i++)
+    {
+        fds[i].sockfd = req->fds[i]->sockfd;
+        fds[i].events = req->fds[i]->events;
+    }
+
+    /* This call may block until one of the sockets is ready */
+    error_code = chitcpd_poll(si, fds, nfds, req->timeout, &nready);
+    if (error_code == 0 && poll_events_add(resp, fds, nfds, FALSE) != CHITCP_OK)
+        error_code = ENOMEM;
+
+    ret = error_code? -1 : nready;
+
+    free(fds);
+
+done:
+    /* Create response */
+    resp->ret = ret;
+    resp->error_code = error_code;
+
+    chilog(TRACE, "<<< Exiting handler for CHITCPD_MSG_CODE__POLL");
+
+    return CHITCP_OK;
+}
+
+
+/* Handler for chisocket_epoll_create() */
+HANDLER_FUNCTION(CHITCPD_MSG_CODE__EPOLL_CREATE)
+{
+    int epfd, error_code;
+
+    chilog(TRACE, ">>> Entering handler for CHITCPD_MSG_CODE__EPOLL_CREATE");
+
+    error_code = chitcpd_epoll_create(si, &epfd);
+
+    /* Create response */
+    resp->ret = error_code? -1 : epfd;
+    resp->error_code = error_code;
+
+    chilog(TRACE, "<<< Exiting handler for CHITCPD_MSG_CODE__EPOLL_CREATE");
+
+    return CHITCP_OK;
+}
+
+
+/* Handler for chisocket_epoll_ctl() */
+HANDLER_FUNCTION(CHITCPD_MSG_CODE__EPOLL_CTL)
+{
+    int error_code;
+    ChitcpdEpollCtlArgs *req;
+
+    chilog(TRACE, ">>> Entering handler for CHITCPD_MSG_CODE__EPOLL_CTL");
+
+    /* Unpack request */
+    assert(req_msg->epoll_ctl_args != NULL);
+    req = req_msg->epoll_ctl_args;
+
+    error_code = chitcpd_epoll_ctl(si, req->epfd, req->op, req->sockfd, req->events, req->data);
+
+    /* Create response */
+    resp->ret = error_code? -1 : 0;
+    resp->error_code = error_code;
+
+    chilog(TRACE, "<<< Exiting handler for CHITCPD_MSG_CODE__EPOLL_CTL");
+
+    return CHITCP_OK;
+}
+
+
+/* Handler for chisocket_epoll_wait() */
+HANDLER_FUNCTION(CHITCPD_MSG_CODE__EPOLL_WAIT)
+{
+    int ret, error_code = 0;
+    ChitcpdEpollWaitArgs *req;
+    chitcpd_poll_event_t *events;
+    int maxevents, nready;
+
+    chilog(TRACE, ">>> Entering handler for CHITCPD_MSG_CODE__EPOLL_WAIT");
+
+    /* Unpack request */
+    assert(req_msg->epoll_wait_args != NULL);
+    req = req_msg->epoll_wait_args;
+
+    /* There can't be more events than sockets */
+    maxevents = req->maxevents;
+    if (maxevents > si->chisocket_table_size)
+        maxevents = si->chisocket_table_size;
+
+    if (maxevents <= 0)
+    {
+        ret = -1;
+        error_code = EINVAL;
+        goto done;
+    }
+
+    events = calloc(maxevents, sizeof(chitcpd_poll_event_t));
+    if (events == NULL)
+    {
+        ret = -1;
+        error_code = ENOMEM;
+        goto done;
+    }
+
+    /* This call may block until one of the sockets is ready */
+    error_code = chitcpd_epoll_wait(si, req->epfd, events, maxevents, req->timeout, &nready);
+    if (error_code == 0 && poll_events_add(resp, events, nready, TRUE) != CHITCP_OK)
+        error_code = ENOMEM;
+
+    ret = error_code? -1 : nready;
+
+    free(events);
+
+done:
+    /* Create response */
+    resp->ret = ret;
+    resp->error_code = error_code;
+
+    chilog(TRACE, "<<< Exiting handler for CHITCPD_MSG_CODE__EPOLL_WAIT");
+
+    return CHITCP_OK;
+}
+
+
+/* Handler for chisocket_epoll_close() */
+HANDLER_FUNCTION(CHITCPD_MSG_CODE__EPOLL_CLOSE)
+{
+    int error_code;
+    ChitcpdEpollCloseArgs *req;
+
+    chilog(TRACE, ">>> Entering handler for CHITCPD_MSG_CODE__EPOLL_CLOSE");
+
+    /* Unpack request */
+    assert(req_msg->epoll_close_args != NULL);
+    req = req_msg->epoll_close_args;
+
+    error_code = chitcpd_epoll_close(si, req->epfd);
+
+    /* Create response */
+    resp->ret = error_code? -1 : 0;
+    resp->error_code = error_code;
+
+    chilog(TRACE, "<<< Exiting handler for CHITCPD_MSG_CODE__EPOLL_CLOSE");
+
+    return CHITCP_OK;
+}
+
+
+/* Handler for chisocket_fcntl() */
+HANDLER_FUNCTION(CHITCPD_MSG_CODE__FCNTL)
+{
+    chisocket_t sockfd;
+    int ret, error_code = 0;
+    ChitcpdFcntlArgs *req;
+
+    chilog(TRACE, ">>> Entering handler for CHITCPD_MSG_CODE__FCNTL");
+
+    /* Unpack request */
+    assert(req_msg->fcntl_args != NULL);
+    req = req_msg->fcntl_args;
+
+    sockfd = req->sockfd;
+
+    if(sockfd < 0 || sockfd >= si->chisocket_table_size || si->chisocket_table[sockfd].available)
+    {
+        chilog(ERROR, "Not a valid chisocket descriptor: %i", sockfd);
+        ret = -1;
+        error_code = EBADF;
+        goto done;
+    }
+    chisocketentry_t *entry = &si->chisocket_table[sockfd];
+
+    /* O_NONBLOCK is the only file status flag that chisockets have */
+    switch(req->cmd)
+    {
+    case F_GETFL:
+        ret = O_RDWR | (entry->nonblocking? O_NONBLOCK : 0);
+        break;
+
+    case F_SETFL:
+        if (!req->has_arg)
+        {
+            ret = -1;
+            error_code = EINVAL;
+            goto done;
+        }
+        entry->nonblocking = (req->arg & O_NONBLOCK) != 0;
+        ret = 0;
+        break;
+
+    default:
+        chilog(ERROR, "Unsupported fcntl() command: %i", req->cmd);
+        ret = -1;
+        error_code = EINVAL;
+        goto done;
+    }
+
+done:
+    /* Create response */
+    resp->ret = ret;
+    resp->error_code = error_code;
+
+    chilog(TRACE, "<<< Exiting handler for CHITCPD_MSG_CODE__FCNTL");
+
+    return CHITCP_OK;
+}
@@ -42,6 +42,13 @@
 
 #include "serverinfo.h"
 
+/* Maximum number of worker threads handling the pipelined requests
+ * of a connection on the UNIX socket (see handlers.c). Since a worker
+ * is busy for as long as its request blocks, this should be well above
+ * the number of threads an application has blocked on its sockets.
+ * Once it is reached, further requests fail with EAGAIN. */
+#define CHITCPD_HANDLER_MAX_WORKERS (128)
+
 typedef struct handler_thread_args
 {
     serverinfo_t *si;
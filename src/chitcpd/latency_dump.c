@@ -0,0 +1,124 @@
+/*
+ *  chiTCP - A simple, testable TCP stack
+ *
+ *  chitcpd-latency: Prints the latency histograms of a running chitcpd
+ *
+ *  For each request code and TCP event, prints how many times it was
+ *  handled, and the mean and percentiles of the time it took (see
+ *  metrics.h). The histograms can also be reset, to measure a
+ *  specific workload.
+ *
+ */
+
+
+/*
+ *  Copyright (c) 2013-2014, The University of Chicago
+ *  All rights reserved.
+ *
+ *  Redistribution and use in source and binary forms, with or without
+ *  modification, are permitted provided that the following conditions are met:
+ *
+ *  - Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ *
+ *  - Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ *  - Neither the name of The University of Chicago nor the names of its
+ *    contributors may be used to endorse or promote products derived from this
+ *    software without specific prior written permission.
+ *
+ *  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ *  AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ *  IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ *  ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ *  LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ *  CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ *  SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ *  INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ *  CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ *  ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ *  POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <errno.h>
+#include <string.h>
+#include <inttypes.h>
+
+#include "chitcp/debug_api.h"
+#include "chitcp/types.h"
+
+#define USAGE "Usage: chitcpd-latency [-r] [-R]\n" \
+              "  -r  Reset the histograms after printing them\n" \
+              "  -R  Reset the histograms without printing them\n"
+
+/* Prints a time in nanoseconds with a suitable unit */
+static void print_time(uint64_t ns)
+{
+    if (ns < 10000)
+        printf(" %8" PRIu64 "ns", ns);
+    else if (ns < 10000000)
+        printf(" %8.1fus", ns / 1e3);
+    else if (ns < 10000000000ULL)
+        printf(" %8.1fms", ns / 1e6);
+    else
+        printf(" %8.1fs ", ns / 1e9);
+}
+
+
+int main(int argc, char *argv[])
+{
+    int opt, n;
+    bool_t reset = FALSE, print = TRUE;
+    debug_latency_t *latencies;
+
+    while ((opt = getopt(argc, argv, "rRh")) != -1)
+        switch (opt)
+        {
+        case 'r':
+            reset = TRUE;
+            break;
+        case 'R':
+            reset = TRUE;
+            print = FALSE;
+            break;
+        case 'h':
+            printf(USAGE);
+            exit(0);
+        default:
+            printf("ERROR: Unknown option -%c\n", opt);
+            exit(-1);
+        }
+
+    n = chitcpd_get_latency(reset, &latencies);
+    if (n < 0)
+    {
+        perror("Could not get the latency histograms from chitcpd");
+        exit(-1);
+    }
+
+    if (print)
+    {
+        printf("%-10s %-20s %10s %10s %10s %10s %10s %10s\n",
+               "GROUP", "NAME", "COUNT", "MEAN", "P50", "P99", "P99.9", "MAX");
+        for (int i = 0; i < n; i++)
+        {
+            printf("%-10s %-20s %10" PRIu64, latencies[i].group, latencies[i].name, latencies[i].count);
+            print_time(latencies[i].mean_ns);
+            print_time(latencies[i].p50_ns);
+            print_time(latencies[i].p99_ns);
+            print_time(latencies[i].p999_ns);
+            print_time(latencies[i].max_ns);
+            printf("\n");
+        }
+    }
+
+    free(latencies);
+
+    return 0;
+}
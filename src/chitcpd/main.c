@@ -52,50 +52,210 @@
 #include <unistd.h>
 #include <string.h>
 #include <signal.h>
+#include <pthread.h>
+#include <stdatomic.h>
 #include <arpa/inet.h>
 
 #include "chitcp/chitcpd.h"
 #include "chitcp/log.h"
+#include "chitcp/utils.h"
 #include "server.h"
+#include "trace.h"
+#include "pcap.h"
+
+static atomic_bool signal_thread_stop = false;
+
+/*
+ * signal_thread - Handles the signals that are blocked in every thread
+ *
+ * SIGUSR1 dumps the traces of all the sockets. SIGTERM and SIGINT flush
+ * the capture file (if any) and stop the daemon. Once the daemon is
+ * stopping, they are unblocked in this thread, so sending them again
+ * kills the daemon (in case it doesn't manage to stop).
+ *
+ * Since these signals are blocked in every thread, this thread can
+ * handle them synchronously (and do things like allocating memory and
+ * writing to files, which a signal handler cannot do).
+ *
+ * The thread exits when signal_thread_stop is set and it is sent a
+ * SIGUSR1 (see main), so it is done with the server info before it
+ * is freed.
+ *
+ * args: Server info
+ *
+ * Returns: Nothing.
+ */
+static void *signal_thread(void *args)
+{
+    serverinfo_t *si = (serverinfo_t *) args;
+    sigset_t set, stop;
+    char filename[64];
+    int sig, ndumps = 0;
+
+    set_thread_name(pthread_self(), "signals");
+
+    sigemptyset(&set);
+    sigaddset(&set, SIGUSR1);
+    sigaddset(&set, SIGTERM);
+    sigaddset(&set, SIGINT);
+
+    sigemptyset(&stop);
+    sigaddset(&stop, SIGTERM);
+    sigaddset(&stop, SIGINT);
+
+    while(sigwait(&set, &sig) == 0)
+    {
+        if(atomic_load(&signal_thread_stop))
+            break;
+
+        if(sig == SIGUSR1)
+        {
+            snprintf(filename, sizeof(filename), "chitcpd-trace.%i.%i", (int) getpid(), ndumps++);
+            chitcpd_trace_dump_all(si, filename);
+            continue;
+        }
+
+        /* Get the capture on disk first, in case stopping the
+         * daemon does not go well */
+        if(si->libpcap != NULL)
+            chitcpd_pcap_flush(si->libpcap);
+
+        chitcpd_server_stop(si);
+
+        /* Keep handling SIGUSR1, but let SIGTERM and SIGINT take their
+         * default action from now on */
+        sigdelset(&set, SIGTERM);
+        sigdelset(&set, SIGINT);
+        pthread_sigmask(SIG_UNBLOCK, &stop, NULL);
+    }
+
+    return NULL;
+}
+
 
 int main(int argc, char *argv[])
 {
     int rc;
     serverinfo_t *si;
     sigset_t new;
+    pthread_t sig_thread;
+    bool_t sig_thread_running = FALSE;
     int opt;
     char *port = NULL;
     char *usocket = NULL;
     char *cap_file = NULL;
+    int cap_snaplen = 0;
+    int cap_rotate_mb = 0;
+    int cap_rotate_secs = 0;
+    bool_t cap_mmap = FALSE;
     int verbosity = 0;
+    int stripes = 0;
+    int epoll_threads = 0;
+    bool_t use_uring = FALSE;
+    int cksum_offload = 0;
+    bool_t async_log = FALSE;
+    char *metrics_addr = NULL;
+    chitcpd_transport_t transport = CHITCPD_TRANSPORT_TCP;
 
-    /* Stop SIGPIPE from messing with our sockets */
+    /* Stop SIGPIPE from messing with our sockets, and leave SIGUSR1,
+     * SIGTERM, and SIGINT to signal_thread */
     sigemptyset (&new);
     sigaddset(&new, SIGPIPE);
+    sigaddset(&new, SIGUSR1);
+    sigaddset(&new, SIGTERM);
+    sigaddset(&new, SIGINT);
     if (pthread_sigmask(SIG_BLOCK, &new, NULL) != 0)
     {
-        perror("Unable to mask SIGPIPE");
+        perror("Unable to mask signals");
         exit(-1);
     }
 
     /* Process command-line arguments */
-    while ((opt = getopt(argc, argv, "c:p:s:vh")) != -1)
+    while ((opt = getopt(argc, argv, "c:l:C:G:mp:s:n:ue:io:aM:vh")) != -1)
         switch (opt)
         {
         case 'c':
             cap_file = strdup(optarg);
             break;
+        case 'l':
+            cap_snaplen = atoi(optarg);
+            if(cap_snaplen < 1)
+            {
+                printf("ERROR: Snapshot length must be at least 1\n");
+                exit(-1);
+            }
+            break;
+        case 'C':
+            cap_rotate_mb = atoi(optarg);
+            if(cap_rotate_mb < 1)
+            {
+                printf("ERROR: Capture file size must be at least 1 MB\n");
+                exit(-1);
+            }
+            break;
+        case 'G':
+            cap_rotate_secs = atoi(optarg);
+            if(cap_rotate_secs < 1)
+            {
+                printf("ERROR: Capture rotation interval must be at least 1 second\n");
+                exit(-1);
+            }
+            break;
+        case 'm':
+            cap_mmap = TRUE;
+            break;
         case 'p':
             port = strdup(optarg);
             break;
         case 's':
             usocket = strdup(optarg);
             break;
+        case 'n':
+            stripes = atoi(optarg);
+            if(stripes < 1)
+            {
+                printf("ERROR: Number of connections per peer must be at least 1\n");
+                exit(-1);
+            }
+            break;
+        case 'u':
+            transport = CHITCPD_TRANSPORT_UDP;
+            break;
+        case 'e':
+            epoll_threads = atoi(optarg);
+            if(epoll_threads < 1)
+            {
+                printf("ERROR: Number of epoll threads must be at least 1\n");
+                exit(-1);
+            }
+            break;
+        case 'i':
+            use_uring = TRUE;
+            break;
+        case 'o':
+            if(!strcmp(optarg, "tx"))
+                cksum_offload = CHITCPD_CKSUM_OFFLOAD_TX;
+            else if(!strcmp(optarg, "rx"))
+                cksum_offload = CHITCPD_CKSUM_OFFLOAD_RX;
+            else if(!strcmp(optarg, "all"))
+                cksum_offload = CHITCPD_CKSUM_OFFLOAD_TX | CHITCPD_CKSUM_OFFLOAD_RX;
+            else
+            {
+                printf("ERROR: Checksum offload must be tx, rx, or all\n");
+                exit(-1);
+            }
+            break;
+        case 'a':
+            async_log = TRUE;
+            break;
+        case 'M':
+            metrics_addr = strdup(optarg);
+            break;
         case 'v':
             verbosity++;
             break;
         case 'h':
-            printf("Usage: chitcpd [-p PORT] [-s UNIX_SOCKET] [(-v|-vv|-vvv|-vvvv)]\n");
+            printf("Usage: chitcpd [-c CAPTURE_FILE [-l SNAPLEN] [-C MB] [-G SECONDS] [-m]] [-p PORT] [-s UNIX_SOCKET] [-n CONNECTIONS_PER_PEER] [-u] [-e EPOLL_THREADS] [-i] [-o (tx|rx|all)] [-a] [-M (METRICS_PORT|METRICS_SOCKET)] [(-v|-vv|-vvv|-vvvv)]\n");
             exit(0);
         default:
             printf("ERROR: Unknown option -%c\n", opt);
@@ -128,6 +288,12 @@ int main(int argc, char *argv[])
         break;
     }
 
+    if(async_log && chilog_async_start(0) != CHITCP_OK)
+    {
+        fprintf(stderr, "Could not start asynchronous logging.\n");
+        exit(-1);
+    }
+
 
     /* Allocate the serverinfo struct. It contains all of the daemon's state */
     si = calloc(1, sizeof(serverinfo_t));
@@ -140,6 +306,16 @@ int main(int argc, char *argv[])
     else
         chitcp_unix_socket(si->server_socket_path, UNIX_PATH_MAX);
     si->libpcap_file_name = cap_file;
+    si->libpcap_snaplen = cap_snaplen;
+    si->libpcap_rotate_bytes = (uint64_t) cap_rotate_mb * 1000000;
+    si->libpcap_rotate_seconds = cap_rotate_secs;
+    si->libpcap_mmap = cap_mmap;
+    si->connection_stripes = stripes;
+    si->transport = transport;
+    si->epoll_rx_nthreads = epoll_threads;
+    si->use_uring = use_uring;
+    si->cksum_offload = cksum_offload;
+    si->metrics_addr = metrics_addr;
 
     /* Run the daemon */
     rc = chitcpd_server_init(si);
@@ -158,6 +334,21 @@ int main(int argc, char *argv[])
 
     chilog(INFO, "chitcpd running. UNIX socket: %s. TCP socket: %i", si->server_socket_path, ntohs(si->server_port));
 
+    if (pthread_create(&sig_thread, NULL, signal_thread, si) == 0)
+        sig_thread_running = TRUE;
+    else
+    {
+        /* Nobody will wait for the signals we blocked, so let SIGTERM
+         * and SIGINT kill the daemon, and ignore SIGUSR1 */
+        chilog(WARNING, "Could not create signal thread. SIGUSR1 will not dump traces, and SIGTERM will kill the daemon.");
+        signal(SIGUSR1, SIG_IGN);
+        sigemptyset(&new);
+        sigaddset(&new, SIGUSR1);
+        sigaddset(&new, SIGTERM);
+        sigaddset(&new, SIGINT);
+        pthread_sigmask(SIG_UNBLOCK, &new, NULL);
+    }
+
     /* Wait for daemon to be done */
     rc = chitcpd_server_wait(si);
     if(rc != 0)
@@ -166,8 +357,20 @@ int main(int argc, char *argv[])
         return rc;
     }
 
+    /* Stop the signal thread before freeing what it uses (SIGUSR1 is
+     * still blocked in every thread, so it is delivered to sigwait) */
+    if (sig_thread_running)
+    {
+        atomic_store(&signal_thread_stop, true);
+        pthread_kill(sig_thread, SIGUSR1);
+        pthread_join(sig_thread, NULL);
+    }
+
     chitcpd_server_free(si);
     free(si);
 
+    if(async_log)
+        chilog_async_stop();
+
     return CHITCP_OK;
 }
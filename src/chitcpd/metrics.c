@@ -0,0 +1,426 @@
+/*
+ *  chiTCP - A simple, testable TCP stack
+ *
+ *  Daemon-wide metrics
+ *
+ *  see metrics.h for descriptions of functions, parameters, and return values.
+ *
+ */
+
+
+/*
+ *  Copyright (c) 2013-2014, The University of Chicago
+ *  All rights reserved.
+ *
+ *  Redistribution and use in source and binary forms, with or without
+ *  modification, are permitted provided that the following conditions are met:
+ *
+ *  - Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ *
+ *  - Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ *  - Neither the name of The University of Chicago nor the names of its
+ *    contributors may be used to endorse or promote products derived from this
+ *    software without specific prior written permission.
+ *
+ *  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ *  AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ *  IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ *  ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ *  LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ *  CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ *  SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ *  INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ *  CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ *  ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ *  POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <inttypes.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/time.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include "metrics.h"
+#include "serverinfo.h"
+#include "pcap.h"
+#include "chitcp/log.h"
+#include "chitcp/pool.h"
+#include "chitcp/utils.h"
+#include "chitcp/utlist.h"
+
+/* How long to wait for a client to send its request */
+#define METRICS_RECV_TIMEOUT_SECONDS (1)
+
+/* Size of the buffer used to read requests (anything after
+ * the first METRICS_REQUEST_MAX bytes of a request is ignored) */
+#define METRICS_REQUEST_MAX (4096)
+
+
+/* See metrics.h */
+uint64_t chitcpd_histogram_bound(int bucket)
+{
+    int k, e;
+
+    if (bucket == 0)
+        return 1ULL << CHITCPD_HISTOGRAM_MIN_SHIFT;
+    if (bucket >= CHITCPD_HISTOGRAM_NBUCKETS - 1)
+        return UINT64_MAX;
+
+    k = bucket - 1;
+    e = CHITCPD_HISTOGRAM_MIN_SHIFT + (k >> CHITCPD_HISTOGRAM_SUB_BITS);
+
+    return ((1ULL << CHITCPD_HISTOGRAM_SUB_BITS) + (k & ((1 << CHITCPD_HISTOGRAM_SUB_BITS) - 1)) + 1)
+           << (e - CHITCPD_HISTOGRAM_SUB_BITS);
+}
+
+/* See metrics.h */
+void chitcpd_histogram_snapshot(chitcpd_histogram_t *h, chitcpd_histogram_snapshot_t *snap, bool_t reset)
+{
+    snap->count = 0;
+    for (int i = 0; i < CHITCPD_HISTOGRAM_NBUCKETS; i++)
+    {
+        if (reset)
+            snap->buckets[i] = atomic_exchange_explicit(&h->buckets[i], 0, memory_order_relaxed);
+        else
+            snap->buckets[i] = atomic_load_explicit(&h->buckets[i], memory_order_relaxed);
+        snap->count += snap->buckets[i];
+    }
+
+    if (reset)
+    {
+        snap->sum = atomic_exchange_explicit(&h->sum, 0, memory_order_relaxed);
+        snap->max = atomic_exchange_explicit(&h->max, 0, memory_order_relaxed);
+    }
+    else
+    {
+        snap->sum = atomic_load_explicit(&h->sum, memory_order_relaxed);
+        snap->max = atomic_load_explicit(&h->max, memory_order_relaxed);
+    }
+}
+
+/* See metrics.h */
+uint64_t chitcpd_histogram_percentile(const chitcpd_histogram_snapshot_t *snap, double p)
+{
+    uint64_t rank, seen = 0, lower;
+    int i;
+
+    if (snap->count == 0)
+        return 0;
+
+    /* The value at this (1-based) rank is the percentile */
+    rank = (uint64_t) (p / 100.0 * snap->count + 0.999999);
+    if (rank < 1)
+        rank = 1;
+    if (rank > snap->count)
+        rank = snap->count;
+
+    for (i = 0; i < CHITCPD_HISTOGRAM_NBUCKETS - 1; i++)
+    {
+        seen += snap->buckets[i];
+        if (seen >= rank)
+            break;
+    }
+
+    lower = (i == 0)? 0 : chitcpd_histogram_bound(i - 1);
+    if (i == CHITCPD_HISTOGRAM_NBUCKETS - 1)
+        return lower;
+
+    return lower + (chitcpd_histogram_bound(i) - lower) / 2;
+}
+
+/* Writes the HELP and TYPE lines of a metric */
+static void write_header(FILE *f, const char *name, const char *type, const char *help)
+{
+    fprintf(f, "# HELP %s %s\n", name, help);
+    fprintf(f, "# TYPE %s %s\n", name, type);
+}
+
+/* Writes a metric without labels */
+static void write_value(FILE *f, const char *name, const char *type, const char *help, uint64_t value)
+{
+    write_header(f, name, type, help);
+    fprintf(f, "%s %" PRIu64 "\n", name, value);
+}
+
+/* Writes a histogram (with its values converted from nanoseconds to seconds) */
+static void write_histogram(FILE *f, const char *name, const char *help, chitcpd_histogram_t *h)
+{
+    uint64_t count = 0;
+
+    write_header(f, name, "histogram", help);
+    for (int i = 0; i < CHITCPD_HISTOGRAM_NBUCKETS - 1; i++)
+    {
+        count += atomic_load_explicit(&h->buckets[i], memory_order_relaxed);
+        fprintf(f, "%s_bucket{le=\"%.9g\"} %" PRIu64 "\n", name, chitcpd_histogram_bound(i) / 1e9, count);
+    }
+    count += atomic_load_explicit(&h->buckets[CHITCPD_HISTOGRAM_NBUCKETS - 1], memory_order_relaxed);
+    fprintf(f, "%s_bucket{le=\"+Inf\"} %" PRIu64 "\n", name, count);
+    fprintf(f, "%s_sum %.9f\n", name, atomic_load_explicit(&h->sum, memory_order_relaxed) / 1e9);
+    fprintf(f, "%s_count %" PRIu64 "\n", name, count);
+}
+
+/* See metrics.h */
+int chitcpd_metrics_write(serverinfo_t *si, FILE *f)
+{
+    chitcpd_metrics_t *metrics = &si->metrics;
+    uint64_t sockets[LAST_ACK + 1] = {0};
+    uint64_t nsockets = 0, nconnections = 0, ndelivery = 0;
+    packet_delivery_list_entry_t *delivery_entry;
+    chitcp_pool_stats_t pool_stats;
+
+    /* Gauges that are computed from the daemon's tables */
+    pthread_mutex_lock(&si->lock_chisocket_table);
+    for (int i = 0; i < si->chisocket_table_size; i++)
+    {
+        chisocketentry_t *entry = &si->chisocket_table[i];
+        if (!entry->available)
+        {
+            nsockets++;
+            if (IS_VALID_TCP_STATE(entry->tcp_state))
+                sockets[entry->tcp_state]++;
+        }
+    }
+    pthread_mutex_unlock(&si->lock_chisocket_table);
+
+    pthread_mutex_lock(&si->lock_connection_table);
+    for (int i = 0; i < si->connection_table_size; i++)
+        if (!si->connection_table[i].available)
+            nconnections++;
+    pthread_mutex_unlock(&si->lock_connection_table);
+
+    pthread_mutex_lock(&si->lock_delivery);
+    DL_FOREACH(si->delivery_queue, delivery_entry)
+        ndelivery++;
+    pthread_mutex_unlock(&si->lock_delivery);
+
+    chitcp_pool_stats(&pool_stats);
+
+    write_header(f, "chitcpd_sockets", "gauge", "Number of chiTCP sockets in each TCP state.");
+    for (int i = CLOSED; i <= LAST_ACK; i++)
+        fprintf(f, "chitcpd_sockets{state=\"%s\"} %" PRIu64 "\n", tcp_str(i), sockets[i]);
+
+    write_value(f, "chitcpd_socket_table_used", "gauge", "Number of entries in use in the socket table.", nsockets);
+    write_value(f, "chitcpd_socket_table_size", "gauge", "Number of entries in the socket table.", si->chisocket_table_size);
+    write_value(f, "chitcpd_connection_table_used", "gauge", "Number of connections to other chiTCP daemons.", nconnections);
+    write_value(f, "chitcpd_connection_table_size", "gauge", "Number of entries in the connection table.", si->connection_table_size);
+    write_value(f, "chitcpd_delivery_queue_packets", "gauge", "Number of packets waiting in the delivery queue.", ndelivery);
+    write_value(f, "chitcpd_handler_threads", "gauge", "Number of threads handling chiTCP socket library connections.",
+                atomic_load_explicit(&metrics->handler_threads, memory_order_relaxed));
+
+    write_value(f, "chitcpd_packets_no_socket_total", "counter", "Packets dropped because no socket could receive them.",
+                atomic_load_explicit(&metrics->packets_no_socket, memory_order_relaxed));
+    write_value(f, "chitcpd_packets_bad_checksum_total", "counter", "Packets dropped because of a bad checksum.",
+                atomic_load_explicit(&si->cksum_drops, memory_order_relaxed));
+    if (si->libpcap != NULL)
+        write_value(f, "chitcpd_capture_dropped_total", "counter", "Packets that could not be written to the capture file.",
+                    atomic_load_explicit(&si->libpcap->drops, memory_order_relaxed));
+    write_value(f, "chitcpd_log_dropped_total", "counter", "Log messages dropped because a log ring was full.",
+                chilog_async_dropped());
+
+    write_header(f, "chitcpd_pool_blocks", "gauge", "Number of blocks allocated by the packet pools, by block size.");
+    for (int i = 0; i < POOL_NCLASSES; i++)
+        fprintf(f, "chitcpd_pool_blocks{size=\"%zu\"} %lu\n", pool_stats.class_size[i], pool_stats.class_blocks[i]);
+    fprintf(f, "chitcpd_pool_blocks{size=\"large\"} %lu\n", pool_stats.large_blocks);
+    write_value(f, "chitcpd_pools", "gauge", "Number of packet pools.", pool_stats.pools);
+    write_value(f, "chitcpd_pools_orphaned", "gauge", "Number of packet pools whose thread has exited.", pool_stats.orphan_pools);
+
+    write_histogram(f, "chitcpd_rpc_duration_seconds",
+                    "Time from receiving a socket library request to sending its response.", &metrics->rpc_duration);
+    write_histogram(f, "chitcpd_delivery_delay_seconds",
+                    "Time from receiving a packet from the network to delivering it to its socket.", &metrics->delivery_delay);
+
+    return ferror(f)? CHITCP_EINVAL : CHITCP_OK;
+}
+
+/* Reads a request (which we don't look at) and sends the metrics
+ * back in an HTTP response */
+static void metrics_serve(serverinfo_t *si, int client_socket)
+{
+    char request[METRICS_REQUEST_MAX + 1];
+    char header[160];
+    size_t received = 0, body_len = 0;
+    char *body = NULL;
+    struct timeval timeout = { .tv_sec = METRICS_RECV_TIMEOUT_SECONDS, .tv_usec = 0 };
+    FILE *f;
+    ssize_t n;
+
+    /* Read until the end of the request's headers */
+    setsockopt(client_socket, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+    while (received < METRICS_REQUEST_MAX)
+    {
+        n = recv(client_socket, request + received, METRICS_REQUEST_MAX - received, 0);
+        if (n <= 0)
+            break;
+        received += n;
+        request[received] = '\0';
+        if (strstr(request, "\r\n\r\n") != NULL || strstr(request, "\n\n") != NULL)
+            break;
+    }
+
+    f = open_memstream(&body, &body_len);
+    if (f == NULL)
+        return;
+    if (chitcpd_metrics_write(si, f) != CHITCP_OK)
+        chilog(WARNING, "Could not write the daemon's metrics");
+    fclose(f);
+
+    snprintf(header, sizeof(header),
+             "HTTP/1.0 200 OK\r\n"
+             "Content-Type: text/plain; version=0.0.4\r\n"
+             "Content-Length: %zu\r\n"
+             "Connection: close\r\n\r\n", body_len);
+
+    if (send(client_socket, header, strlen(header), MSG_NOSIGNAL) == (ssize_t) strlen(header))
+    {
+        for (size_t sent = 0; sent < body_len; sent += n)
+        {
+            n = send(client_socket, body + sent, body_len - sent, MSG_NOSIGNAL);
+            if (n <= 0)
+                break;
+        }
+    }
+
+    free(body);
+}
+
+/*
+ * chitcpd_metrics_thread_func - Metrics thread function
+ *
+ * Answers the connections on the metrics socket, one at a time.
+ *
+ * args: Server info
+ *
+ * Returns: Nothing.
+ *
+ */
+static void *chitcpd_metrics_thread_func(void *args)
+{
+    serverinfo_t *si = (serverinfo_t *) args;
+    int client_socket;
+
+    set_thread_name(pthread_self(), "metrics");
+
+    for(;;)
+    {
+        client_socket = accept(si->metrics_socket, NULL, NULL);
+        if (client_socket == -1)
+        {
+            /* The socket is shut down when the daemon stops */
+            if (si->state == CHITCPD_STATE_STOPPING || errno == EINVAL || errno == EBADF)
+                break;
+
+            perror("Could not accept() connection on metrics socket");
+            continue;
+        }
+
+        metrics_serve(si, client_socket);
+        close(client_socket);
+    }
+
+    return NULL;
+}
+
+/* Returns TRUE if the metrics address is a TCP port */
+static bool_t metrics_addr_is_port(const char *addr)
+{
+    if (*addr == '\0')
+        return FALSE;
+    for (const char *c = addr; *c != '\0'; c++)
+        if (*c < '0' || *c > '9')
+            return FALSE;
+
+    return TRUE;
+}
+
+/* See metrics.h */
+int chitcpd_metrics_start(serverinfo_t *si)
+{
+    struct sockaddr_storage addr;
+    socklen_t addr_len;
+    int on = 1;
+
+    memset(&addr, 0, sizeof(addr));
+
+    if (metrics_addr_is_port(si->metrics_addr))
+    {
+        struct sockaddr_in *in = (struct sockaddr_in *) &addr;
+
+        in->sin_family = AF_INET;
+        in->sin_port = chitcp_htons(atoi(si->metrics_addr));
+        in->sin_addr.s_addr = chitcp_htonl(INADDR_LOOPBACK);
+        addr_len = sizeof(struct sockaddr_in);
+    }
+    else
+    {
+        struct sockaddr_un *un = (struct sockaddr_un *) &addr;
+
+        if (strlen(si->metrics_addr) >= sizeof(un->sun_path))
+        {
+            fprintf(stderr, "Metrics socket path is too long: %s\n", si->metrics_addr);
+            return CHITCP_ESOCKET;
+        }
+        un->sun_family = AF_UNIX;
+        strcpy(un->sun_path, si->metrics_addr);
+        addr_len = sizeof(struct sockaddr_un);
+
+        unlink(un->sun_path);
+    }
+
+    if ((si->metrics_socket = socket(addr.ss_family, SOCK_STREAM, 0)) == -1)
+    {
+        perror("Could not open metrics socket");
+        return CHITCP_ESOCKET;
+    }
+
+    if (addr.ss_family == AF_INET)
+        setsockopt(si->metrics_socket, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+
+    if (bind(si->metrics_socket, (struct sockaddr *) &addr, addr_len) == -1)
+    {
+        perror("Could not bind metrics socket");
+        close(si->metrics_socket);
+        return CHITCP_ESOCKET;
+    }
+
+    if (listen(si->metrics_socket, 5) == -1)
+    {
+        perror("Metrics socket listen() failed");
+        close(si->metrics_socket);
+        return CHITCP_ESOCKET;
+    }
+
+    if (pthread_create(&si->metrics_thread, NULL, chitcpd_metrics_thread_func, si) != 0)
+    {
+        perror("Could not create metrics thread");
+        close(si->metrics_socket);
+        return CHITCP_ETHREAD;
+    }
+
+    return CHITCP_OK;
+}
+
+/* See metrics.h */
+int chitcpd_metrics_stop(serverinfo_t *si)
+{
+    /* Shutting down the socket makes accept() return in the metrics thread */
+    shutdown(si->metrics_socket, SHUT_RDWR);
+    pthread_join(si->metrics_thread, NULL);
+    close(si->metrics_socket);
+
+    if (!metrics_addr_is_port(si->metrics_addr))
+        unlink(si->metrics_addr);
+
+    return CHITCP_OK;
+}
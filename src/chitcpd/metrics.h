@@ -0,0 +1,257 @@
+/*
+ *  chiTCP - A simple, testable TCP stack
+ *
+ *  Daemon-wide metrics
+ *
+ *  chitcpd keeps a few counters and latency histograms that are not
+ *  specific to any socket (see stats.h for the per-socket counters).
+ *  These, together with gauges that are computed when they are requested
+ *  (number of sockets in each state, delivery queue depth, etc.), can be
+ *  served in the Prometheus text exposition format on a local UNIX socket
+ *  or TCP port.
+ *
+ *  chitcpd also keeps latency histograms of each request handler and each
+ *  type of TCP event, which are obtained (and reset) with the GET_LATENCY
+ *  request (see the chitcpd-latency tool).
+ *
+ */
+
+
+/*
+ *  Copyright (c) 2013-2014, The University of Chicago
+ *  All rights reserved.
+ *
+ *  Redistribution and use in source and binary forms, with or without
+ *  modification, are permitted provided that the following conditions are met:
+ *
+ *  - Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ *
+ *  - Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ *  - Neither the name of The University of Chicago nor the names of its
+ *    contributors may be used to endorse or promote products derived from this
+ *    software without specific prior written permission.
+ *
+ *  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ *  AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ *  IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ *  ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ *  LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ *  CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ *  SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ *  INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ *  CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ *  ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ *  POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+#ifndef METRICS_H_
+#define METRICS_H_
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdatomic.h>
+#include "chitcp/types.h"
+
+/* The histograms are log-linear: values below 2^CHITCPD_HISTOGRAM_MIN_SHIFT
+ * (64 ns, about the cost of reading the clock) go in the first bucket, and
+ * values of 2^CHITCPD_HISTOGRAM_MAX_SHIFT (about 34 s) or more go in the last
+ * one. Each power of two in between is split into 2^CHITCPD_HISTOGRAM_SUB_BITS
+ * buckets of the same width, so the relative error of a value is at most
+ * 12.5%. The largest value is kept exactly. */
+#define CHITCPD_HISTOGRAM_MIN_SHIFT (6)
+#define CHITCPD_HISTOGRAM_MAX_SHIFT (35)
+#define CHITCPD_HISTOGRAM_SUB_BITS (3)
+#define CHITCPD_HISTOGRAM_NBUCKETS \
+    (((CHITCPD_HISTOGRAM_MAX_SHIFT - CHITCPD_HISTOGRAM_MIN_SHIFT) << CHITCPD_HISTOGRAM_SUB_BITS) + 2)
+
+/* A histogram of durations (in nanoseconds). Any thread can add values to it. */
+typedef struct chitcpd_histogram
+{
+    atomic_uint_least64_t buckets[CHITCPD_HISTOGRAM_NBUCKETS];
+    atomic_uint_least64_t sum;
+    atomic_uint_least64_t max;
+} chitcpd_histogram_t;
+
+/* A copy of the values in a histogram (see chitcpd_histogram_snapshot) */
+typedef struct chitcpd_histogram_snapshot
+{
+    uint64_t buckets[CHITCPD_HISTOGRAM_NBUCKETS];
+    uint64_t count;
+    uint64_t sum;
+    uint64_t max;
+} chitcpd_histogram_snapshot_t;
+
+/* Number of request codes (ChitcpdMsgCode) and TCP events (tcp_event_type_t)
+ * that have their own latency histograms. */
+#define CHITCPD_METRICS_MSG_CODES (32)
+#define CHITCPD_METRICS_TCP_EVENTS (16)
+
+/* Daemon-wide counters */
+typedef struct chitcpd_metrics
+{
+    /* Packets that were dropped because there was no socket to deliver
+     * them to */
+    atomic_uint_least64_t packets_no_socket;
+
+    /* Number of threads handling connections on the UNIX socket */
+    atomic_int handler_threads;
+
+    /* Time from receiving a request on the UNIX socket to sending its response */
+    chitcpd_histogram_t rpc_duration;
+
+    /* Time from receiving a packet from the network to adding it to its
+     * socket's pending packets (including the simulated latency, if any) */
+    chitcpd_histogram_t delivery_delay;
+
+    /* Time spent in each request handler, and in packing and sending its
+     * response, by request code. These are not served with the rest of
+     * the metrics, because they are reset by GET_LATENCY. */
+    chitcpd_histogram_t rpc_handler[CHITCPD_METRICS_MSG_CODES];
+    chitcpd_histogram_t rpc_response[CHITCPD_METRICS_MSG_CODES];
+
+    /* Time spent by the TCP state handlers on each type of event (same) */
+    chitcpd_histogram_t tcp_event[CHITCPD_METRICS_TCP_EVENTS];
+} chitcpd_metrics_t;
+
+struct serverinfo;
+
+
+/*
+ * chitcpd_histogram_bucket - Returns the bucket a value belongs in
+ *
+ * value: Value (in nanoseconds)
+ *
+ * Returns: Index of the bucket
+ */
+static inline int chitcpd_histogram_bucket(uint64_t value)
+{
+    int e;
+
+    if (value < (1ULL << CHITCPD_HISTOGRAM_MIN_SHIFT))
+        return 0;
+
+    e = 63 - __builtin_clzll(value);
+    if (e >= CHITCPD_HISTOGRAM_MAX_SHIFT)
+        return CHITCPD_HISTOGRAM_NBUCKETS - 1;
+
+    return 1 + ((e - CHITCPD_HISTOGRAM_MIN_SHIFT) << CHITCPD_HISTOGRAM_SUB_BITS)
+             + ((value >> (e - CHITCPD_HISTOGRAM_SUB_BITS)) & ((1 << CHITCPD_HISTOGRAM_SUB_BITS) - 1));
+}
+
+
+/*
+ * chitcpd_histogram_add - Adds a value to a histogram
+ *
+ * h: Histogram
+ *
+ * value: Value (in nanoseconds)
+ *
+ * Returns: nothing
+ */
+static inline void chitcpd_histogram_add(chitcpd_histogram_t *h, uint64_t value)
+{
+    uint64_t max = atomic_load_explicit(&h->max, memory_order_relaxed);
+
+    atomic_fetch_add_explicit(&h->buckets[chitcpd_histogram_bucket(value)], 1, memory_order_relaxed);
+    atomic_fetch_add_explicit(&h->sum, value, memory_order_relaxed);
+
+    /* On failure, max is updated with the current maximum */
+    while (value > max &&
+           !atomic_compare_exchange_weak_explicit(&h->max, &max, value, memory_order_relaxed, memory_order_relaxed))
+        ;
+}
+
+
+/*
+ * chitcpd_histogram_bound - Returns the upper bound of a bucket
+ *
+ * bucket: Index of the bucket
+ *
+ * Returns: The smallest value that is larger than every value in the
+ *          bucket (in nanoseconds), or UINT64_MAX for the last bucket.
+ */
+uint64_t chitcpd_histogram_bound(int bucket);
+
+
+/*
+ * chitcpd_histogram_snapshot - Copies the values in a histogram
+ *
+ * The histogram can be updated while it is being copied, so the copy
+ * may include only some of the values added at the same time.
+ *
+ * h: Histogram
+ *
+ * snap: Copy
+ *
+ * reset: If TRUE, the histogram is emptied (without losing any values
+ *        that are added while it is being copied)
+ *
+ * Returns: nothing
+ */
+void chitcpd_histogram_snapshot(chitcpd_histogram_t *h, chitcpd_histogram_snapshot_t *snap, bool_t reset);
+
+
+/*
+ * chitcpd_histogram_percentile - Returns a percentile of the values in a histogram
+ *
+ * snap: Copy of the histogram
+ *
+ * p: Percentile (0 < p <= 100)
+ *
+ * Returns: The midpoint of the bucket the percentile falls in (in
+ *          nanoseconds), or 0 if the histogram is empty. If it falls
+ *          in the last bucket, its lower bound is returned.
+ */
+uint64_t chitcpd_histogram_percentile(const chitcpd_histogram_snapshot_t *snap, double p);
+
+
+/*
+ * chitcpd_metrics_write - Writes all the daemon's metrics in the Prometheus
+ *                         text exposition format (version 0.0.4)
+ *
+ * si: Server info
+ *
+ * f: File to write to
+ *
+ * Returns:
+ *  - CHITCP_OK: Metrics were written
+ *  - CHITCP_EINVAL: Could not write to the file
+ */
+int chitcpd_metrics_write(struct serverinfo *si, FILE *f);
+
+
+/*
+ * chitcpd_metrics_start - Starts serving the metrics
+ *
+ * Creates the listening socket, and a thread that answers each connection
+ * on it with an HTTP response containing the metrics. The address is taken
+ * from si->metrics_addr: if it is a number, the metrics are served on that
+ * TCP port of the loopback interface. Otherwise, it is the path of a UNIX
+ * socket.
+ *
+ * si: Server info
+ *
+ * Returns:
+ *  - CHITCP_OK: The thread has started correctly
+ *  - CHITCP_ESOCKET: Could not create socket
+ *  - CHITCP_ETHREAD: Could not create thread
+ */
+int chitcpd_metrics_start(struct serverinfo *si);
+
+
+/*
+ * chitcpd_metrics_stop - Stops serving the metrics
+ *
+ * si: Server info
+ *
+ * Returns:
+ *  - CHITCP_OK: The thread has stopped
+ */
+int chitcpd_metrics_stop(struct serverinfo *si);
+
+#endif /* METRICS_H_ */
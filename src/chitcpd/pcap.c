@@ -0,0 +1,903 @@
+/*
+ *  chiTCP - A simple, testable TCP stack
+ *
+ *  Asynchronous writer for libpcap and pcapng capture files
+ *
+ *  see pcap.h for descriptions of functions, parameters, and return values.
+ *
+ */
+
+
+/*
+ *  Copyright (c) 2013-2014, The University of Chicago
+ *  All rights reserved.
+ *
+ *  Redistribution and use in source and binary forms, with or without
+ *  modification, are permitted provided that the following conditions are met:
+ *
+ *  - Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ *
+ *  - Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ *  - Neither the name of The University of Chicago nor the names of its
+ *    contributors may be used to endorse or promote products derived from this
+ *    software without specific prior written permission.
+ *
+ *  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ *  AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ *  IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ *  ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ *  LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ *  CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ *  SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ *  INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ *  CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ *  ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ *  POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <limits.h>
+#include <sys/mman.h>
+#include <netinet/in.h>
+
+#include "pcap.h"
+#include "chitcp/log.h"
+#include "chitcp/utils.h"
+#include "chitcp/pool.h"
+#include "chitcp/addr.h"
+
+/* Header of a pcap file (with nanosecond timestamps) */
+typedef struct pcap_hdr
+{
+    uint32_t magic_number;   /* magic number */
+    uint16_t version_major;  /* major version number */
+    uint16_t version_minor;  /* minor version number */
+    int32_t  thiszone;       /* GMT to local correction */
+    uint32_t sigfigs;        /* accuracy of timestamps */
+    uint32_t snaplen;        /* max length of captured packets, in octets */
+    uint32_t network;        /* data link type */
+} pcap_hdr_t;
+
+#define PCAP_MAGIC_NSEC (0xa1b23c4d)
+#define PCAP_LINKTYPE_RAW (101)
+
+/* Header of a pcap record */
+typedef struct pcaprecord_hdr
+{
+    uint32_t ts_sec;         /* timestamp seconds */
+    uint32_t ts_nsec;        /* timestamp nanoseconds */
+    uint32_t incl_len;       /* length of data saved */
+    uint32_t orig_len;       /* original length of packet */
+} pcaprec_hdr_t;
+
+/* IP Header struct, necessary when creating pcap file */
+struct iphdr
+{
+#if __BYTE_ORDER == __LITTLE_ENDIAN
+    uint8_t  ihl:4,
+             version:4;
+#elif __BYTE_ORDER == __BIG_ENDIAN
+    uint8_t  version:4,
+             ihl:4;
+#else
+#error __BYTE_ORDER must be defined as __LITTLE_ENDIAN or __BIG_ENDIAN!
+#endif
+    uint8_t tos;         /* Type of service */
+    uint16_t len;        /* Total Length */
+    uint16_t id;         /* Identification */
+    uint16_t off;        /* Fragment flags + Fragment Offset */
+    uint8_t ttl;         /* Time to Live */
+    uint8_t proto;       /* protocol */
+    uint16_t cksum;      /* checksum */
+    uint32_t src;     /* Source Address */
+    uint32_t dst;     /* Destination Address */
+  } __attribute__ ((packed)) ;
+typedef struct iphdr iphdr_t;
+
+/* IPv6 header, for packets between IPv6 sockets */
+typedef struct ip6hdr
+{
+    uint32_t vtcfl;      /* Version, traffic class, and flow label */
+    uint16_t len;        /* Payload length */
+    uint8_t next;        /* Next header */
+    uint8_t hops;        /* Hop limit */
+    uint8_t src[16];     /* Source Address */
+    uint8_t dst[16];     /* Destination Address */
+} __attribute__ ((packed)) ip6hdr_t;
+
+/* pcapng blocks and options (see draft-ietf-opsawg-pcapng) */
+#define PCAPNG_SHB (0x0A0D0D0A)     /* Section Header Block */
+#define PCAPNG_IDB (0x00000001)     /* Interface Description Block */
+#define PCAPNG_EPB (0x00000006)     /* Enhanced Packet Block */
+#define PCAPNG_BYTE_ORDER_MAGIC (0x1A2B3C4D)
+
+#define PCAPNG_OPT_ENDOFOPT (0)
+#define PCAPNG_OPT_COMMENT (1)
+#define PCAPNG_SHB_USERAPPL (4)
+#define PCAPNG_IF_NAME (2)
+#define PCAPNG_IF_TSRESOL (9)
+#define PCAPNG_EPB_FLAGS (2)
+
+/* Fixed part of an Enhanced Packet Block */
+typedef struct pcapng_epb_hdr
+{
+    uint32_t type;
+    uint32_t total_len;
+    uint32_t iface;
+    uint32_t ts_high;
+    uint32_t ts_low;
+    uint32_t incl_len;
+    uint32_t orig_len;
+} pcapng_epb_hdr_t;
+
+/* Largest block built on the stack (interface descriptions, and
+ * the part of a packet block that follows the packet) */
+#define PCAPNG_MAX_BLOCK (512)
+
+#define PAD4(n) (((n) + 3) & ~((size_t) 3))
+
+/* Number of bytes a queued packet counts against CHITCPD_PCAP_MAX_QUEUED */
+#define PCAP_QUEUED_LEN(p) (sizeof(pcaprec_hdr_t) + sizeof(iphdr_t) + (p)->length)
+
+#ifndef MIN
+#define MIN(a, b) ((a) < (b) ? (a) : (b))
+#endif
+
+
+/* Returns true if addr is an IPv6 address (other than
+ * an IPv4-mapped address) */
+static bool_t pcap_is_ipv6(const chitcpd_pcap_addr_t *addr)
+{
+    return addr->sa.sa_family == AF_INET6 && !IN6_IS_ADDR_V4MAPPED(&addr->in6.sin6_addr);
+}
+
+/* Returns the IPv4 address in addr (which may also be an
+ * IPv4-mapped IPv6 address), in network order */
+static uint32_t pcap_ipv4_addr(const chitcpd_pcap_addr_t *addr)
+{
+    uint32_t a;
+
+    if (addr->sa.sa_family == AF_INET)
+        return addr->in.sin_addr.s_addr;
+
+    memcpy(&a, &addr->in6.sin6_addr.s6_addr[12], sizeof(a));
+    return a;
+}
+
+/* Stores the IPv6 address in addr (or the IPv4-mapped
+ * address, if it is an IPv4 address) in a */
+static void pcap_ipv6_addr(const chitcpd_pcap_addr_t *addr, uint8_t *a)
+{
+    if (addr->sa.sa_family == AF_INET6)
+    {
+        memcpy(a, &addr->in6.sin6_addr, 16);
+        return;
+    }
+
+    memset(a, 0, 10);
+    a[10] = a[11] = 0xff;
+    memcpy(a + 12, &addr->in.sin_addr, 4);
+}
+
+/* Builds the IP header of a captured packet in buf (which must be
+ * at least sizeof(ip6hdr_t) bytes long). Returns its length. */
+static size_t pcap_ip_header(chitcpd_pcap_record_t *rec, uint8_t *buf)
+{
+    if (pcap_is_ipv6(&rec->src) || pcap_is_ipv6(&rec->dst))
+    {
+        ip6hdr_t ip6_header = {0};
+
+        ip6_header.vtcfl = htonl(6 << 28);
+        ip6_header.len = htons(rec->packet.length);
+        ip6_header.next = 6;
+        ip6_header.hops = 233;
+        pcap_ipv6_addr(&rec->src, ip6_header.src);
+        pcap_ipv6_addr(&rec->dst, ip6_header.dst);
+        memcpy(buf, &ip6_header, sizeof(ip6hdr_t));
+
+        return sizeof(ip6hdr_t);
+    }
+    else
+    {
+        iphdr_t ip_header = {0};
+
+        ip_header.src = pcap_ipv4_addr(&rec->src);
+        ip_header.dst = pcap_ipv4_addr(&rec->dst);
+        ip_header.version = 4;
+        ip_header.ihl = 5;
+        ip_header.len = htons(sizeof(iphdr_t) + rec->packet.length);
+        ip_header.ttl = 233;
+        ip_header.proto = 6;
+        ip_header.cksum = cksum(&ip_header, sizeof(iphdr_t));
+        memcpy(buf, &ip_header, sizeof(iphdr_t));
+
+        return sizeof(iphdr_t);
+    }
+}
+
+/* Length of the IP header that pcap_ip_header builds */
+static size_t pcap_ip_header_len(chitcpd_pcap_record_t *rec)
+{
+    return (pcap_is_ipv6(&rec->src) || pcap_is_ipv6(&rec->dst))? sizeof(ip6hdr_t) : sizeof(iphdr_t);
+}
+
+/* Appends a pcapng option to a block being built at buf.
+ * Returns the length of the option. */
+static size_t pcapng_option(uint8_t *buf, uint16_t code, const void *value, uint16_t len)
+{
+    memcpy(buf, &code, sizeof(uint16_t));
+    memcpy(buf + 2, &len, sizeof(uint16_t));
+    memcpy(buf + 4, value, len);
+    memset(buf + 4 + len, 0, PAD4(len) - len);
+
+    return 4 + PAD4(len);
+}
+
+/* Finishes a pcapng block being built at buf, whose body (after the
+ * block type and length) and options take up len bytes.
+ * Returns the total length of the block. */
+static size_t pcapng_block_end(uint8_t *buf, uint32_t type, size_t len)
+{
+    uint32_t total_len = 8 + len + 4 + 4;
+
+    memset(buf + 8 + len, 0, 4);    /* opt_endofopt */
+    memcpy(buf, &type, sizeof(uint32_t));
+    memcpy(buf + 4, &total_len, sizeof(uint32_t));
+    memcpy(buf + total_len - 4, &total_len, sizeof(uint32_t));
+
+    return total_len;
+}
+
+/* Builds the Section Header Block that starts a pcapng file */
+static size_t pcapng_shb(uint8_t *buf)
+{
+    uint32_t bom = PCAPNG_BYTE_ORDER_MAGIC;
+    uint16_t version[2] = {1, 0};
+    int64_t section_len = -1;
+    size_t len = 0;
+
+    memcpy(buf + 8, &bom, 4);
+    memcpy(buf + 12, version, 4);
+    memcpy(buf + 16, &section_len, 8);
+    len = 16;
+    len += pcapng_option(buf + 8 + len, PCAPNG_SHB_USERAPPL, "chitcpd", strlen("chitcpd"));
+
+    return pcapng_block_end(buf, PCAPNG_SHB, len);
+}
+
+/* Builds the Interface Description Block of the socket that
+ * captured a packet */
+static size_t pcapng_idb(chitcpd_pcap_t *pcap, chitcpd_pcap_record_t *rec, uint8_t *buf)
+{
+    chitcpd_pcap_addr_t *local = rec->direction == CHITCPD_PCAP_OUTBOUND? &rec->src : &rec->dst;
+    uint16_t linktype[2] = {PCAP_LINKTYPE_RAW, 0};
+    uint8_t tsresol = 9;    /* Nanoseconds */
+    char name[16], addr[INET6_ADDRSTRLEN + 8], comment[128];
+    size_t len;
+
+    snprintf(name, sizeof(name), "S%i", rec->sockfd);
+    chitcp_addr_str(&local->sa, addr, sizeof(addr));
+    snprintf(comment, sizeof(comment), "chiTCP socket %i (%s)", rec->sockfd, addr);
+
+    memcpy(buf + 8, linktype, 4);
+    memcpy(buf + 12, &pcap->opts.snaplen, 4);
+    len = 8;
+    len += pcapng_option(buf + 8 + len, PCAPNG_IF_NAME, name, strlen(name));
+    len += pcapng_option(buf + 8 + len, PCAPNG_OPT_COMMENT, comment, strlen(comment));
+    len += pcapng_option(buf + 8 + len, PCAPNG_IF_TSRESOL, &tsresol, 1);
+
+    return pcapng_block_end(buf, PCAPNG_IDB, len);
+}
+
+/* Builds the options and trailer of a packet's Enhanced Packet Block,
+ * including the padding after the packet */
+static size_t pcapng_epb_trailer(chitcpd_pcap_record_t *rec, uint32_t incl_len, uint8_t *buf)
+{
+    uint32_t flags = rec->direction;
+    size_t pad = PAD4(incl_len) - incl_len;
+    char comment[32];
+    uint32_t total_len;
+    size_t len;
+
+    snprintf(comment, sizeof(comment), "S%i %s", rec->sockfd, tcp_str(rec->tcp_state));
+
+    memset(buf, 0, pad);
+    len = pad;
+    len += pcapng_option(buf + len, PCAPNG_EPB_FLAGS, &flags, sizeof(flags));
+    len += pcapng_option(buf + len, PCAPNG_OPT_COMMENT, comment, strlen(comment));
+    memset(buf + len, 0, 4);    /* opt_endofopt */
+    len += 4;
+
+    total_len = sizeof(pcapng_epb_hdr_t) + incl_len + len + 4;
+    memcpy(buf + len, &total_len, sizeof(uint32_t));
+
+    return len + 4;
+}
+
+/* Writes the output buffer to the file */
+static int pcap_flush_buffer(chitcpd_pcap_t *pcap)
+{
+    size_t off = 0;
+
+    while (off < pcap->buf_len)
+    {
+        ssize_t n = write(pcap->fd, pcap->buf + off, pcap->buf_len - off);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n < 0)
+        {
+            chilog(ERROR, "Could not write to capture file: %s. Capture has stopped.", strerror(errno));
+            pcap->failed = TRUE;
+            break;
+        }
+        off += n;
+    }
+    pcap->buf_len = 0;
+
+    return pcap->failed? CHITCP_EINIT : CHITCP_OK;
+}
+
+/* Makes sure the next len bytes can be copied to the mapped window.
+ * In write() mode, this does nothing. */
+static int pcap_reserve(chitcpd_pcap_t *pcap, uint64_t len)
+{
+    if (!pcap->opts.use_mmap || pcap->failed)
+        return CHITCP_OK;
+
+    if (ftruncate(pcap->fd, pcap->file_bytes + len) != 0)
+    {
+        chilog(ERROR, "Could not extend capture file: %s. Capture has stopped.", strerror(errno));
+        pcap->failed = TRUE;
+        return CHITCP_EINIT;
+    }
+
+    return CHITCP_OK;
+}
+
+/* Appends data to the current file (the space must have been
+ * reserved with pcap_reserve) */
+static void pcap_emit(chitcpd_pcap_t *pcap, const void *data, size_t len)
+{
+    const uint8_t *p = data;
+
+    if (pcap->failed)
+        return;
+
+    if (!pcap->opts.use_mmap)
+    {
+        if (pcap->buf_len + len > CHITCPD_PCAP_BUFFER_SIZE && pcap_flush_buffer(pcap) != CHITCP_OK)
+            return;
+        memcpy(pcap->buf + pcap->buf_len, p, len);
+        pcap->buf_len += len;
+        pcap->file_bytes += len;
+        return;
+    }
+
+    while (len > 0)
+    {
+        size_t chunk;
+
+        if (pcap->map == NULL || pcap->file_bytes >= pcap->map_offset + CHITCPD_PCAP_MMAP_WINDOW)
+        {
+            if (pcap->map != NULL)
+                munmap(pcap->map, CHITCPD_PCAP_MMAP_WINDOW);
+            pcap->map_offset = pcap->file_bytes - (pcap->file_bytes % CHITCPD_PCAP_MMAP_WINDOW);
+            pcap->map = mmap(NULL, CHITCPD_PCAP_MMAP_WINDOW, PROT_READ | PROT_WRITE, MAP_SHARED, pcap->fd, pcap->map_offset);
+            if (pcap->map == MAP_FAILED)
+            {
+                chilog(ERROR, "Could not map capture file: %s. Capture has stopped.", strerror(errno));
+                pcap->map = NULL;
+                pcap->failed = TRUE;
+                return;
+            }
+        }
+
+        chunk = MIN(len, pcap->map_offset + CHITCPD_PCAP_MMAP_WINDOW - pcap->file_bytes);
+        memcpy(pcap->map + (pcap->file_bytes - pcap->map_offset), p, chunk);
+        pcap->file_bytes += chunk;
+        p += chunk;
+        len -= chunk;
+    }
+}
+
+/* Forgets all the pcapng interfaces. Interface numbers are local to a
+ * section, so this must be done whenever a new SHB is written. */
+static void pcapng_reset_ifaces(chitcpd_pcap_t *pcap)
+{
+    for (int i = 0; i < pcap->nifaces; i++)
+        pcap->ifaces[i].file_number = UINT_MAX;
+    pcap->next_iface = 0;
+}
+
+/* Creates a new capture file, and writes the pcap header to it */
+static int pcap_open_file(chitcpd_pcap_t *pcap)
+{
+    char filename[PATH_MAX];
+
+    if (pcap->opts.rotate_bytes || pcap->opts.rotate_seconds)
+        snprintf(filename, sizeof(filename), "%s.%u", pcap->opts.filename, pcap->file_number);
+    else
+        snprintf(filename, sizeof(filename), "%s", pcap->opts.filename);
+
+    pcap->file_bytes = 0;
+    pcap->file_packets = 0;
+    pcap->file_opened = time(NULL);
+    pcap->map = NULL;
+    pcap->map_offset = 0;
+
+    /* Mapping a file for writing requires opening it for reading too */
+    pcap->fd = open(filename, (pcap->opts.use_mmap? O_RDWR : O_WRONLY) | O_CREAT | O_TRUNC, 0644);
+    if (pcap->fd < 0)
+    {
+        chilog(ERROR, "Could not open capture file %s: %s", filename, strerror(errno));
+        pcap->failed = TRUE;
+        return CHITCP_EINIT;
+    }
+
+    chilog(INFO, "Capturing packets to %s", filename);
+
+    if (pcap->opts.format == CHITCPD_PCAP_FORMAT_PCAPNG)
+    {
+        uint8_t shb[PCAPNG_MAX_BLOCK];
+        size_t len = pcapng_shb(shb);
+
+        /* Sockets have to be described again in the new section */
+        pcapng_reset_ifaces(pcap);
+
+        if (pcap_reserve(pcap, len) != CHITCP_OK)
+            return CHITCP_EINIT;
+        pcap_emit(pcap, shb, len);
+    }
+    else
+    {
+        pcap_hdr_t header;
+
+        header.magic_number = PCAP_MAGIC_NSEC;
+        header.version_major = 2;
+        header.version_minor = 4;
+        header.thiszone = 0;
+        header.sigfigs = 0;
+        header.snaplen = pcap->opts.snaplen;
+        header.network = PCAP_LINKTYPE_RAW;
+
+        if (pcap_reserve(pcap, sizeof(pcap_hdr_t)) != CHITCP_OK)
+            return CHITCP_EINIT;
+        pcap_emit(pcap, &header, sizeof(pcap_hdr_t));
+    }
+
+    return pcap->failed? CHITCP_EINIT : CHITCP_OK;
+}
+
+/* Writes out everything that has been emitted to the current file,
+ * and syncs it to disk */
+static int pcap_sync_file(chitcpd_pcap_t *pcap)
+{
+    if (pcap->fd < 0)
+        return CHITCP_EINIT;
+
+    pcap_flush_buffer(pcap);
+
+    if (pcap->map != NULL)
+        msync(pcap->map, CHITCPD_PCAP_MMAP_WINDOW, MS_SYNC);
+
+    if (fsync(pcap->fd) != 0 && !pcap->failed)
+    {
+        chilog(ERROR, "Could not sync capture file: %s", strerror(errno));
+        pcap->failed = TRUE;
+    }
+
+    return pcap->failed? CHITCP_EINIT : CHITCP_OK;
+}
+
+static void pcap_close_file(chitcpd_pcap_t *pcap)
+{
+    if (pcap->fd < 0)
+        return;
+
+    pcap_sync_file(pcap);
+
+    if (pcap->map != NULL)
+    {
+        munmap(pcap->map, CHITCPD_PCAP_MMAP_WINDOW);
+        pcap->map = NULL;
+    }
+
+    close(pcap->fd);
+    pcap->fd = -1;
+}
+
+static void pcap_rotate(chitcpd_pcap_t *pcap)
+{
+    pcap_close_file(pcap);
+    pcap->file_number++;
+    pcap_open_file(pcap);
+}
+
+/* Returns the pcapng interface of a record's socket in the current
+ * file, or NULL if the socket has not been described in this file */
+static chitcpd_pcap_iface_t *pcapng_iface(chitcpd_pcap_t *pcap, chitcpd_pcap_record_t *rec)
+{
+    chitcpd_pcap_iface_t *iface;
+
+    if (rec->sockfd < 0 || rec->sockfd >= pcap->nifaces)
+        return NULL;
+
+    iface = &pcap->ifaces[rec->sockfd];
+    if (iface->file_number != pcap->file_number || iface->socket_id != rec->socket_id)
+        return NULL;
+
+    return iface;
+}
+
+/* Assigns a record to its socket's pcapng interface, creating the
+ * interface if necessary. Returns CHITCP_ENOMEM if the interface
+ * table could not be grown. */
+static int pcapng_assign_iface(chitcpd_pcap_t *pcap, chitcpd_pcap_record_t *rec)
+{
+    chitcpd_pcap_iface_t *iface = pcapng_iface(pcap, rec);
+
+    rec->new_iface = (iface == NULL);
+    if (iface != NULL)
+    {
+        rec->iface = iface->iface;
+        return CHITCP_OK;
+    }
+
+    if (rec->sockfd >= pcap->nifaces)
+    {
+        int n = rec->sockfd + 64;
+        chitcpd_pcap_iface_t *ifaces = realloc(pcap->ifaces, n * sizeof(chitcpd_pcap_iface_t));
+
+        if (ifaces == NULL)
+            return CHITCP_ENOMEM;
+        for (int i = pcap->nifaces; i < n; i++)
+            ifaces[i].file_number = UINT_MAX;
+        pcap->ifaces = ifaces;
+        pcap->nifaces = n;
+    }
+
+    iface = &pcap->ifaces[rec->sockfd];
+    iface->socket_id = rec->socket_id;
+    iface->file_number = pcap->file_number;
+    iface->iface = rec->iface = pcap->next_iface++;
+
+    return CHITCP_OK;
+}
+
+/* Number of bytes a record takes up in the capture file. In a pcapng file,
+ * this includes the description of the record's interface, if it has
+ * not been described yet. */
+static size_t pcap_record_len(chitcpd_pcap_t *pcap, chitcpd_pcap_record_t *rec)
+{
+    uint8_t block[PCAPNG_MAX_BLOCK];
+    size_t incl_len = MIN(pcap_ip_header_len(rec) + rec->packet.length, pcap->opts.snaplen);
+
+    if (pcap->opts.format != CHITCPD_PCAP_FORMAT_PCAPNG)
+        return sizeof(pcaprec_hdr_t) + incl_len;
+
+    return (pcapng_iface(pcap, rec) == NULL? pcapng_idb(pcap, rec, block) : 0) +
+           sizeof(pcapng_epb_hdr_t) + incl_len + pcapng_epb_trailer(rec, incl_len, block);
+}
+
+static void pcap_write_record(chitcpd_pcap_t *pcap, chitcpd_pcap_record_t *rec)
+{
+    uint8_t ip_header[sizeof(ip6hdr_t)];
+    size_t ip_len = pcap_ip_header(rec, ip_header);
+    uint32_t orig_len = ip_len + rec->packet.length;
+    uint32_t incl_len = MIN(orig_len, pcap->opts.snaplen);
+
+    if (pcap->opts.format == CHITCPD_PCAP_FORMAT_PCAPNG)
+    {
+        uint8_t block[PCAPNG_MAX_BLOCK];
+        uint64_t ts = (uint64_t) rec->ts.tv_sec * 1000000000ULL + rec->ts.tv_nsec;
+        pcapng_epb_hdr_t epb_header;
+
+        if (rec->new_iface)
+            pcap_emit(pcap, block, pcapng_idb(pcap, rec, block));
+
+        epb_header.type = PCAPNG_EPB;
+        epb_header.iface = rec->iface;
+        epb_header.ts_high = ts >> 32;
+        epb_header.ts_low = ts & 0xFFFFFFFF;
+        epb_header.incl_len = incl_len;
+        epb_header.orig_len = orig_len;
+        epb_header.total_len = sizeof(pcapng_epb_hdr_t) + incl_len + pcapng_epb_trailer(rec, incl_len, block);
+        pcap_emit(pcap, &epb_header, sizeof(pcapng_epb_hdr_t));
+    }
+    else
+    {
+        pcaprec_hdr_t pcap_header;
+
+        pcap_header.ts_sec = rec->ts.tv_sec;
+        pcap_header.ts_nsec = rec->ts.tv_nsec;
+        pcap_header.orig_len = orig_len;
+        pcap_header.incl_len = incl_len;
+        pcap_emit(pcap, &pcap_header, sizeof(pcaprec_hdr_t));
+    }
+
+    pcap_emit(pcap, ip_header, MIN(ip_len, incl_len));
+    if (incl_len > ip_len)
+        pcap_emit(pcap, rec->packet.raw, incl_len - ip_len);
+
+    if (pcap->opts.format == CHITCPD_PCAP_FORMAT_PCAPNG)
+    {
+        uint8_t block[PCAPNG_MAX_BLOCK];
+        pcap_emit(pcap, block, pcapng_epb_trailer(rec, incl_len, block));
+    }
+
+    pcap->file_packets++;
+}
+
+/* Writes all the queued packets, rotating the capture file as needed */
+static void pcap_write_queued(chitcpd_pcap_t *pcap)
+{
+    chitcpd_pcap_record_t *rec, *prev = NULL, *next;
+    size_t queued = 0;
+
+    rec = atomic_exchange_explicit(&pcap->queue, NULL, memory_order_acquire);
+    if (rec == NULL)
+        return;
+
+    /* The queue is newest first */
+    while (rec != NULL)
+    {
+        next = rec->next;
+        rec->next = prev;
+        prev = rec;
+        rec = next;
+    }
+    rec = prev;
+
+    if (!pcap->failed && pcap->opts.rotate_seconds && pcap->file_packets > 0 &&
+        time(NULL) - pcap->file_opened >= pcap->opts.rotate_seconds)
+        pcap_rotate(pcap);
+
+    while (rec != NULL)
+    {
+        chitcpd_pcap_record_t *end;
+        uint64_t batch_bytes = 0, batch_packets = 0;
+
+        /* Take as many packets as fit in the current file (if the file is
+         * empty, it gets at least one, even if it is larger than the
+         * rotation size) */
+        for (end = rec; end != NULL; end = end->next)
+        {
+            size_t len = pcap_record_len(pcap, end);
+            if (!pcap->failed && pcap->opts.rotate_bytes && pcap->file_packets + batch_packets > 0 &&
+                pcap->file_bytes + batch_bytes + len > pcap->opts.rotate_bytes)
+                break;
+            if (pcap->opts.format == CHITCPD_PCAP_FORMAT_PCAPNG &&
+                !pcap->failed && pcapng_assign_iface(pcap, end) != CHITCP_OK)
+            {
+                chilog(ERROR, "Could not allocate memory for capture interfaces. Capture has stopped.");
+                pcap->failed = TRUE;
+            }
+            batch_bytes += len;
+            batch_packets++;
+        }
+
+        if (batch_packets == 0)
+        {
+            pcap_rotate(pcap);
+            continue;
+        }
+
+        pcap_reserve(pcap, batch_bytes);
+
+        for (; rec != end; rec = next)
+        {
+            next = rec->next;
+            if (pcap->failed)
+                atomic_fetch_add_explicit(&pcap->drops, 1, memory_order_relaxed);
+            else
+                pcap_write_record(pcap, rec);
+            queued += PCAP_QUEUED_LEN(&rec->packet);
+            chitcp_tcp_packet_free(&rec->packet);
+            chitcp_pool_free(rec);
+        }
+    }
+
+    pcap_flush_buffer(pcap);
+
+    atomic_fetch_sub_explicit(&pcap->queued_bytes, queued, memory_order_relaxed);
+}
+
+static void *pcap_writer_thread(void *args)
+{
+    chitcpd_pcap_t *pcap = (chitcpd_pcap_t *) args;
+    uint64_t flush;
+    bool_t stop;
+
+    set_thread_name(pthread_self(), "pcap_writer");
+
+    pthread_mutex_lock(&pcap->lock);
+    for (;;)
+    {
+        if (!pcap->wakeup && !pcap->stop && pcap->flush_requested == pcap->flush_done)
+        {
+            struct timespec deadline;
+            clock_gettime(CLOCK_REALTIME, &deadline);
+            deadline.tv_nsec += CHITCPD_PCAP_FLUSH_INTERVAL * 1000000L;
+            deadline.tv_sec += deadline.tv_nsec / 1000000000L;
+            deadline.tv_nsec %= 1000000000L;
+            pthread_cond_timedwait(&pcap->cv, &pcap->lock, &deadline);
+        }
+        pcap->wakeup = FALSE;
+        flush = pcap->flush_requested;
+        stop = pcap->stop;
+        pthread_mutex_unlock(&pcap->lock);
+
+        pcap_write_queued(pcap);
+        if (flush != pcap->flush_done)
+            pcap_sync_file(pcap);
+
+        pthread_mutex_lock(&pcap->lock);
+        if (flush != pcap->flush_done)
+        {
+            pcap->flush_done = flush;
+            pthread_cond_broadcast(&pcap->cv_flushed);
+        }
+        if (stop)
+            break;
+    }
+    pthread_mutex_unlock(&pcap->lock);
+
+    return NULL;
+}
+
+
+/* See pcap.h */
+int chitcpd_pcap_open(chitcpd_pcap_t **pcap, const chitcpd_pcap_options_t *opts)
+{
+    chitcpd_pcap_t *p = calloc(1, sizeof(chitcpd_pcap_t));
+
+    if (p == NULL)
+        return CHITCP_ENOMEM;
+
+    p->opts = *opts;
+    if (p->opts.snaplen == 0)
+        p->opts.snaplen = CHITCPD_PCAP_DEFAULT_SNAPLEN;
+    if (p->opts.format == CHITCPD_PCAP_FORMAT_AUTO)
+    {
+        size_t len = strlen(p->opts.filename);
+        bool_t pcapng = len >= strlen(".pcapng") && !strcmp(p->opts.filename + len - strlen(".pcapng"), ".pcapng");
+        p->opts.format = pcapng? CHITCPD_PCAP_FORMAT_PCAPNG : CHITCPD_PCAP_FORMAT_PCAP;
+    }
+
+    atomic_init(&p->queue, NULL);
+    atomic_init(&p->queued_bytes, 0);
+    atomic_init(&p->drops, 0);
+    pthread_mutex_init(&p->lock, NULL);
+    pthread_cond_init(&p->cv, NULL);
+    pthread_cond_init(&p->cv_flushed, NULL);
+    p->fd = -1;
+
+    if (!p->opts.use_mmap && (p->buf = malloc(CHITCPD_PCAP_BUFFER_SIZE)) == NULL)
+    {
+        free(p);
+        return CHITCP_ENOMEM;
+    }
+
+    /* The first file is created here, so a bad filename is reported
+     * right away */
+    if (pcap_open_file(p) != CHITCP_OK || pcap_flush_buffer(p) != CHITCP_OK)
+    {
+        pcap_close_file(p);
+        free(p->buf);
+        free(p);
+        return CHITCP_EINIT;
+    }
+
+    if (pthread_create(&p->writer_thread, NULL, pcap_writer_thread, p) != 0)
+    {
+        pcap_close_file(p);
+        free(p->buf);
+        free(p);
+        return CHITCP_ETHREAD;
+    }
+
+    *pcap = p;
+
+    return CHITCP_OK;
+}
+
+/* See pcap.h */
+void chitcpd_pcap_packet(chitcpd_pcap_t *pcap, const tcp_packet_t *packet,
+                         const struct sockaddr *src, const struct sockaddr *dst,
+                         chitcpd_pcap_direction_t direction, int sockfd,
+                         uint64_t socket_id, tcp_state_t state)
+{
+    chitcpd_pcap_record_t *rec;
+    size_t len = PCAP_QUEUED_LEN(packet), queued;
+
+    if (atomic_load_explicit(&pcap->queued_bytes, memory_order_relaxed) + len > CHITCPD_PCAP_MAX_QUEUED ||
+        (rec = chitcp_pool_alloc(sizeof(chitcpd_pcap_record_t))) == NULL)
+    {
+        atomic_fetch_add_explicit(&pcap->drops, 1, memory_order_relaxed);
+        return;
+    }
+
+    clock_gettime(CLOCK_REALTIME, &rec->ts);
+    memcpy(&rec->src, src, src->sa_family == AF_INET6? sizeof(struct sockaddr_in6) : sizeof(struct sockaddr_in));
+    memcpy(&rec->dst, dst, dst->sa_family == AF_INET6? sizeof(struct sockaddr_in6) : sizeof(struct sockaddr_in));
+    chitcp_tcp_packet_clone(&rec->packet, packet);
+    rec->sockfd = sockfd;
+    rec->socket_id = socket_id;
+    rec->tcp_state = state;
+    rec->direction = direction;
+
+    rec->next = atomic_load_explicit(&pcap->queue, memory_order_relaxed);
+    while (!atomic_compare_exchange_weak_explicit(&pcap->queue, &rec->next, rec,
+                                                  memory_order_release, memory_order_relaxed))
+        ;
+
+    /* Only wake up the writer early (which involves taking its lock)
+     * when the queue grows past half of the output buffer */
+    queued = atomic_fetch_add_explicit(&pcap->queued_bytes, len, memory_order_relaxed);
+    if (queued < CHITCPD_PCAP_BUFFER_SIZE / 2 && queued + len >= CHITCPD_PCAP_BUFFER_SIZE / 2)
+    {
+        pthread_mutex_lock(&pcap->lock);
+        pcap->wakeup = TRUE;
+        pthread_cond_signal(&pcap->cv);
+        pthread_mutex_unlock(&pcap->lock);
+    }
+}
+
+/* See pcap.h */
+int chitcpd_pcap_flush(chitcpd_pcap_t *pcap)
+{
+    uint64_t request;
+
+    pthread_mutex_lock(&pcap->lock);
+    request = ++pcap->flush_requested;
+    pthread_cond_signal(&pcap->cv);
+    while (pcap->flush_done < request && !pcap->stop)
+        pthread_cond_wait(&pcap->cv_flushed, &pcap->lock);
+    pthread_mutex_unlock(&pcap->lock);
+
+    return pcap->failed? CHITCP_EINIT : CHITCP_OK;
+}
+
+/* See pcap.h */
+int chitcpd_pcap_close(chitcpd_pcap_t *pcap)
+{
+    unsigned long drops;
+    int rc;
+
+    pthread_mutex_lock(&pcap->lock);
+    pcap->stop = TRUE;
+    pthread_cond_signal(&pcap->cv);
+    pthread_cond_broadcast(&pcap->cv_flushed);
+    pthread_mutex_unlock(&pcap->lock);
+
+    pthread_join(pcap->writer_thread, NULL);
+
+    /* Write anything that was queued while the writer was stopping */
+    pcap_write_queued(pcap);
+    pcap_close_file(pcap);
+
+    drops = atomic_load(&pcap->drops);
+    if (drops > 0)
+        chilog(WARNING, "%lu packets were not captured", drops);
+
+    rc = pcap->failed? CHITCP_EINIT : CHITCP_OK;
+
+    pthread_mutex_destroy(&pcap->lock);
+    pthread_cond_destroy(&pcap->cv);
+    pthread_cond_destroy(&pcap->cv_flushed);
+    free(pcap->ifaces);
+    free(pcap->buf);
+    free(pcap);
+
+    return rc;
+}
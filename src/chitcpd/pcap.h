@@ -0,0 +1,294 @@
+/*
+ *  chiTCP - A simple, testable TCP stack
+ *
+ *  Asynchronous writer for libpcap and pcapng capture files
+ *
+ *  Capturing a packet only involves queueing a reference to it (the
+ *  packet's raw contents are reference-counted, see chitcp_tcp_packet_clone).
+ *  A writer thread drains the queue every CHITCPD_PCAP_FLUSH_INTERVAL
+ *  milliseconds (or sooner, if a lot of data is queued), and writes all
+ *  the queued packets to the capture file at once, either with a single
+ *  write() or by copying them to a memory-mapped window of the file.
+ *
+ *  Packets are captured with a synthetic IPv4 or IPv6 header. In pcapng
+ *  files, each chiTCP socket gets its own interface (named after the
+ *  socket, e.g., "S3"), and every packet is flagged as inbound or outbound
+ *  and carries a comment with the socket's TCP state (e.g., "S3 ESTABLISHED").
+ *
+ */
+
+
+/*
+ *  Copyright (c) 2013-2014, The University of Chicago
+ *  All rights reserved.
+ *
+ *  Redistribution and use in source and binary forms, with or without
+ *  modification, are permitted provided that the following conditions are met:
+ *
+ *  - Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ *
+ *  - Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ *  - Neither the name of The University of Chicago nor the names of its
+ *    contributors may be used to endorse or promote products derived from this
+ *    software without specific prior written permission.
+ *
+ *  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ *  AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ *  IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ *  ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ *  LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ *  CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ *  SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ *  INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ *  CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ *  ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ *  POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+#ifndef PCAP_H_
+#define PCAP_H_
+
+#include <stdint.h>
+#include <stdatomic.h>
+#include <pthread.h>
+#include <time.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include "chitcp/packet.h"
+#include "chitcp/types.h"
+
+/* Default maximum number of bytes of each packet saved to the capture file
+ * (including the IP header) */
+#define CHITCPD_PCAP_DEFAULT_SNAPLEN (65535)
+
+/* How often the writer thread writes the queued packets (in milliseconds).
+ * This is also the most capture data that can be lost if the daemon crashes
+ * (unless the file is memory-mapped, see chitcpd_pcap_options_t) */
+#define CHITCPD_PCAP_FLUSH_INTERVAL (50)
+
+/* Size of the writer's output buffer. The writer is woken up before
+ * CHITCPD_PCAP_FLUSH_INTERVAL if more than half of this is queued. */
+#define CHITCPD_PCAP_BUFFER_SIZE (1 << 20)
+
+/* Size of the window of the file that is mapped at a time (must be a
+ * multiple of the page size) */
+#define CHITCPD_PCAP_MMAP_WINDOW (4 << 20)
+
+/* Maximum number of bytes that can be queued. If the writer falls this
+ * far behind, packets are dropped from the capture (but not from the
+ * connection they were captured from) */
+#define CHITCPD_PCAP_MAX_QUEUED (64 << 20)
+
+/* Capture file formats */
+typedef enum
+{
+    CHITCPD_PCAP_FORMAT_AUTO   = 0,  /* pcapng if the file name ends in .pcapng */
+    CHITCPD_PCAP_FORMAT_PCAP   = 1,
+    CHITCPD_PCAP_FORMAT_PCAPNG = 2,
+} chitcpd_pcap_format_t;
+
+/* Direction of a captured packet (these are also the values of
+ * the direction bits of a pcapng packet's flags) */
+typedef enum
+{
+    CHITCPD_PCAP_INBOUND  = 1,
+    CHITCPD_PCAP_OUTBOUND = 2,
+} chitcpd_pcap_direction_t;
+
+/* Capture options */
+typedef struct chitcpd_pcap_options
+{
+    /* Name of the capture file. If the file is rotated, a sequence number
+     * is appended to it (e.g., capture.pcap.0, capture.pcap.1, ...) */
+    const char *filename;
+
+    chitcpd_pcap_format_t format;
+
+    /* Maximum number of bytes saved from each packet (0 for the default) */
+    uint32_t snaplen;
+
+    /* Start a new file when the current one would exceed this many
+     * bytes (0 to never rotate on size) */
+    uint64_t rotate_bytes;
+
+    /* Start a new file when the current one is this many seconds
+     * old (0 to never rotate on time) */
+    unsigned int rotate_seconds;
+
+    /* Write to a memory-mapped window of the file, instead of using write().
+     * The file is extended before every batch of packets is copied into it,
+     * so a crash of the daemon never loses data that has been copied to the
+     * map, and never leaves a partial record at the end of the file. */
+    bool_t use_mmap;
+} chitcpd_pcap_options_t;
+
+/* An IPv4 or IPv6 address (a struct sockaddr_storage would make
+ * queued packets several times larger) */
+typedef union chitcpd_pcap_addr
+{
+    struct sockaddr sa;
+    struct sockaddr_in in;
+    struct sockaddr_in6 in6;
+} chitcpd_pcap_addr_t;
+
+/* A queued packet */
+typedef struct chitcpd_pcap_record
+{
+    struct chitcpd_pcap_record *next;
+    struct timespec ts;
+    chitcpd_pcap_addr_t src;
+    chitcpd_pcap_addr_t dst;
+    tcp_packet_t packet;    /* Shares the raw contents of the captured packet */
+
+    /* Socket the packet was sent or received on */
+    int sockfd;
+    uint64_t socket_id;
+    uint8_t tcp_state;
+    uint8_t direction;
+
+    /* Set by the writer thread (pcapng only) */
+    bool_t new_iface;       /* The socket's interface must be described first */
+    uint32_t iface;
+} chitcpd_pcap_record_t;
+
+/* The pcapng interface of a socket (see chitcpd_pcap_t.ifaces) */
+typedef struct chitcpd_pcap_iface
+{
+    uint64_t socket_id;
+    unsigned int file_number;   /* File the interface was described in */
+    uint32_t iface;
+} chitcpd_pcap_iface_t;
+
+/* A capture */
+typedef struct chitcpd_pcap
+{
+    chitcpd_pcap_options_t opts;
+
+    /* Packets waiting to be written, newest first. Any thread can push
+     * packets to it without taking a lock, and the writer takes all of them
+     * at once by replacing it with NULL */
+    _Atomic(chitcpd_pcap_record_t *) queue;
+    atomic_size_t queued_bytes;
+
+    /* Number of packets that were not captured */
+    atomic_ulong drops;
+
+    /* Used to wake up the writer, and to wait for flushes */
+    pthread_mutex_t lock;
+    pthread_cond_t cv;
+    pthread_cond_t cv_flushed;
+    uint64_t flush_requested;
+    uint64_t flush_done;
+    bool_t wakeup;
+    bool_t stop;
+
+    pthread_t writer_thread;
+
+    /* The following fields are only accessed by the writer thread
+     * (or before it starts, and after it stops) */
+    int fd;
+    unsigned int file_number;
+    uint64_t file_bytes;        /* Bytes written to the current file */
+    uint64_t file_packets;      /* Packets written to the current file */
+    time_t file_opened;
+    bool_t failed;              /* An I/O error happened; stop capturing */
+
+    uint8_t *buf;               /* Output buffer (write() mode) */
+    size_t buf_len;
+
+    uint8_t *map;               /* Mapped window (mmap mode) */
+    uint64_t map_offset;        /* Offset in the file of the mapped window */
+
+    /* pcapng interfaces, indexed by socket number. An entry is only valid
+     * if it was described in the current file, for the same socket (and
+     * not for an earlier socket with the same number). The table is reset,
+     * and interfaces are numbered from zero again, in each new file */
+    chitcpd_pcap_iface_t *ifaces;
+    int nifaces;
+    uint32_t next_iface;
+} chitcpd_pcap_t;
+
+
+/*
+ * chitcpd_pcap_open - Creates a capture file and starts its writer thread
+ *
+ * pcap: Set to the new capture
+ *
+ * opts: Capture options (they are copied, but the filename is not)
+ *
+ * Returns:
+ *  - CHITCP_OK: The capture has started
+ *  - CHITCP_ENOMEM: Could not allocate memory for the capture
+ *  - CHITCP_EINIT: Could not create the capture file
+ *  - CHITCP_ETHREAD: Could not create the writer thread
+ */
+int chitcpd_pcap_open(chitcpd_pcap_t **pcap, const chitcpd_pcap_options_t *opts);
+
+
+/*
+ * chitcpd_pcap_packet - Captures a packet
+ *
+ * The packet is queued for the writer thread, so this function never
+ * does any I/O. It can be called from any thread.
+ *
+ * pcap: Capture
+ *
+ * packet: Packet. It is not copied: the capture keeps a reference to its
+ *         raw contents until it is written to the file.
+ *
+ * src: Source address of the packet
+ *
+ * dst: Destination address of the packet
+ *
+ * direction: Whether the packet was received or sent by the socket
+ *
+ * sockfd: Socket number
+ *
+ * socket_id: Identifies the socket, even if its number is reused
+ *            (see chisocketentry_t.id)
+ *
+ * state: TCP state of the socket
+ *
+ * Returns: nothing
+ */
+void chitcpd_pcap_packet(chitcpd_pcap_t *pcap, const tcp_packet_t *packet,
+                         const struct sockaddr *src, const struct sockaddr *dst,
+                         chitcpd_pcap_direction_t direction, int sockfd,
+                         uint64_t socket_id, tcp_state_t state);
+
+
+/*
+ * chitcpd_pcap_flush - Writes all the captured packets to disk
+ *
+ * Waits until the writer thread has written every packet captured before
+ * this function was called, and has synced the capture file.
+ *
+ * pcap: Capture
+ *
+ * Returns:
+ *  - CHITCP_OK: The packets have been written
+ *  - CHITCP_EINIT: The capture file could not be written
+ */
+int chitcpd_pcap_flush(chitcpd_pcap_t *pcap);
+
+
+/*
+ * chitcpd_pcap_close - Stops a capture
+ *
+ * The writer thread writes all the queued packets before stopping,
+ * and the capture file is synced and closed. The capture is freed.
+ *
+ * pcap: Capture
+ *
+ * Returns:
+ *  - CHITCP_OK: The capture has been stopped
+ *  - CHITCP_EINIT: The capture file could not be written
+ */
+int chitcpd_pcap_close(chitcpd_pcap_t *pcap);
+
+#endif /* PCAP_H_ */
@@ -0,0 +1,639 @@
+/*
+ *  chiTCP - A simple, testable TCP stack
+ *
+ *  Readiness of chisockets (chisocket_poll and chisocket_epoll_*)
+ *
+ *  See readiness.h for more details.
+ *
+ */
+
+/*
+ *  Copyright (c) 2013-2014, The University of Chicago
+ *  All rights reserved.
+ *
+ *  Redistribution and use in source and binary forms, with or without
+ *  modification, are permitted provided that the following conditions are met:
+ *
+ *  - Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ *
+ *  - Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ *  - Neither the name of The University of Chicago nor the names of its
+ *    contributors may be used to endorse or promote products derived from this
+ *    software without specific prior written permission.
+ *
+ *  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ *  AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ *  IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ *  ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ *  LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ *  CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ *  SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ *  INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ *  CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ *  ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ *  POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+#include <stdlib.h>
+#include <errno.h>
+#include <time.h>
+#include <sys/epoll.h>
+
+#include "readiness.h"
+#include "chitcp/buffer.h"
+#include "chitcp/log.h"
+#include "chitcp/utlist.h"
+
+
+/* Computes the absolute (CLOCK_MONOTONIC) time at which
+ * a timeout in milliseconds expires */
+static void poll_deadline(struct timespec *deadline, int timeout)
+{
+    clock_gettime(CLOCK_MONOTONIC, deadline);
+    deadline->tv_sec += timeout / 1000;
+    deadline->tv_nsec += (long) (timeout % 1000) * 1000000L;
+    if (deadline->tv_nsec >= 1000000000L)
+    {
+        deadline->tv_sec++;
+        deadline->tv_nsec -= 1000000000L;
+    }
+}
+
+/* Waits on an interest list's condition variable (with lock_poll held).
+ * Returns TRUE if the timeout has expired. */
+static bool_t poll_wait(serverinfo_t *si, chitcpd_epoll_t *ep, int timeout, struct timespec *deadline)
+{
+    if (timeout < 0)
+    {
+        pthread_cond_wait(&ep->cv, &si->lock_poll);
+        return FALSE;
+    }
+
+    return pthread_cond_timedwait(&ep->cv, &si->lock_poll, deadline) == ETIMEDOUT;
+}
+
+static chitcpd_epoll_t *epoll_alloc(int epfd)
+{
+    chitcpd_epoll_t *ep = calloc(1, sizeof(chitcpd_epoll_t));
+    pthread_condattr_t attr;
+
+    if (ep == NULL)
+        return NULL;
+
+    ep->epfd = epfd;
+    ep->owner = pthread_self();
+
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    pthread_cond_init(&ep->cv, &attr);
+    pthread_condattr_destroy(&attr);
+
+    return ep;
+}
+
+static void epoll_free(chitcpd_epoll_t *ep)
+{
+    pthread_cond_destroy(&ep->cv);
+    free(ep);
+}
+
+/* Finds an (open) epoll instance. Called with lock_poll held. */
+static chitcpd_epoll_t *epoll_find(serverinfo_t *si, int epfd)
+{
+    chitcpd_epoll_t *ep;
+
+    DL_FOREACH(si->epolls, ep)
+    {
+        if (ep->epfd == epfd)
+            return ep;
+    }
+
+    return NULL;
+}
+
+static chitcpd_poll_item_t *item_find(chitcpd_epoll_t *ep, int sockfd)
+{
+    chitcpd_poll_item_t *item;
+
+    DL_FOREACH(ep->items, item)
+    {
+        if (item->sockfd == sockfd)
+            return item;
+    }
+
+    return NULL;
+}
+
+/* Adds a socket to an interest list. Called with lock_poll held. */
+static chitcpd_poll_item_t *item_add(chitcpd_epoll_t *ep, chisocketentry_t *entry, int sockfd, uint32_t events, uint64_t data)
+{
+    chitcpd_poll_item_t *item = calloc(1, sizeof(chitcpd_poll_item_t));
+
+    if (item == NULL)
+        return NULL;
+
+    item->ep = ep;
+    item->entry = entry;
+    item->sockfd = sockfd;
+    item->events = events;
+    item->data = data;
+
+    DL_APPEND(ep->items, item);
+    DL_APPEND2(entry->poll_items, item, entry_prev, entry_next);
+    atomic_fetch_add(&entry->poll_nitems, 1);
+
+    /* The socket may already be ready */
+    item->queued = TRUE;
+    DL_APPEND2(ep->ready, item, ready_prev, ready_next);
+
+    return item;
+}
+
+/* Removes a socket from an interest list. Called with lock_poll held. */
+static void item_remove(chitcpd_poll_item_t *item)
+{
+    chitcpd_epoll_t *ep = item->ep;
+
+    if (item->queued)
+        DL_DELETE2(ep->ready, item, ready_prev, ready_next);
+    if (item->entry != NULL)
+    {
+        DL_DELETE2(item->entry->poll_items, item, entry_prev, entry_next);
+        atomic_fetch_sub(&item->entry->poll_nitems, 1);
+    }
+    DL_DELETE(ep->items, item);
+    free(item);
+}
+
+/* Wakes up the threads waiting on an item's interest list.
+ * Called with lock_poll held. */
+static void item_notify(chitcpd_poll_item_t *item)
+{
+    if (item->queued)
+        return;
+
+    item->queued = TRUE;
+    DL_APPEND2(item->ep->ready, item, ready_prev, ready_next);
+    pthread_cond_broadcast(&item->ep->cv);
+}
+
+/* Closes an epoll instance. Called with lock_poll held. */
+static void epoll_close(serverinfo_t *si, chitcpd_epoll_t *ep)
+{
+    chitcpd_poll_item_t *item, *tmp;
+
+    DL_FOREACH_SAFE(ep->items, item, tmp)
+        item_remove(item);
+
+    DL_DELETE(si->epolls, ep);
+    ep->closed = TRUE;
+
+    if (ep->nwaiters > 0)
+        pthread_cond_broadcast(&ep->cv);
+    else
+        epoll_free(ep);
+}
+
+/* See readiness.h */
+void chitcpd_poll_init(serverinfo_t *si)
+{
+    si->epolls = NULL;
+    si->epoll_next_fd = 0;
+    pthread_mutex_init(&si->lock_poll, NULL);
+}
+
+/* See readiness.h */
+void chitcpd_poll_free(serverinfo_t *si)
+{
+    chitcpd_epoll_t *ep, *tmp;
+
+    pthread_mutex_lock(&si->lock_poll);
+    DL_FOREACH_SAFE(si->epolls, ep, tmp)
+        epoll_close(si, ep);
+    pthread_mutex_unlock(&si->lock_poll);
+
+    pthread_mutex_destroy(&si->lock_poll);
+}
+
+/* See readiness.h */
+uint32_t chitcpd_socket_events(chisocketentry_t *entry)
+{
+    tcp_state_t state = entry->tcp_state;
+    uint32_t events = 0;
+
+    if (entry->actpas_type == SOCKET_PASSIVE)
+    {
+        if (entry->socket_state.passive.pending_connections != NULL)
+            events |= POLLIN;
+    }
+    else if (entry->actpas_type == SOCKET_ACTIVE)
+    {
+        tcp_data_t *tcp_data = &entry->socket_state.active.tcp_data;
+
+        /* The buffers are only accessed in the states where SEND and
+         * RECV access them (before that, they may not be initialized) */
+        switch (state)
+        {
+        case ESTABLISHED:
+        case FIN_WAIT_1:
+        case FIN_WAIT_2:
+        case CLOSE_WAIT:
+            if (circular_buffer_count(&tcp_data->recv) > 0 || circular_buffer_closed(&tcp_data->recv))
+                events |= POLLIN;
+            if ((state == ESTABLISHED || state == CLOSE_WAIT) && circular_buffer_available(&tcp_data->send) > 0)
+                events |= POLLOUT;
+            break;
+
+        case CLOSING:
+        case LAST_ACK:
+        case TIME_WAIT:
+            /* RECV returns 0 right away */
+            events |= POLLIN;
+            break;
+
+        case CLOSED:
+            events |= POLLHUP;
+            break;
+
+        default:
+            /* The connection is being established */
+            break;
+        }
+    }
+    else
+    {
+        /* Not connected (nor listening) yet */
+        events |= POLLHUP;
+    }
+
+    return events;
+}
+
+/* See readiness.h */
+void chitcpd_poll_notify(serverinfo_t *si, chisocketentry_t *entry)
+{
+    chitcpd_poll_item_t *item;
+
+    /* Most sockets are not in any interest list. If the socket is
+     * being added to one right now, it will be checked anyway. */
+    if (atomic_load_explicit(&entry->poll_nitems, memory_order_relaxed) == 0)
+        return;
+
+    pthread_mutex_lock(&si->lock_poll);
+    DL_FOREACH2(entry->poll_items, item, entry_next)
+        item_notify(item);
+    pthread_mutex_unlock(&si->lock_poll);
+}
+
+/* See readiness.h */
+void chitcpd_poll_buffer_notify(void *arg)
+{
+    chisocketentry_t *entry = (chisocketentry_t *) arg;
+
+    chitcpd_poll_notify(entry->si, entry);
+}
+
+/* See readiness.h */
+void chitcpd_poll_forget(serverinfo_t *si, chisocketentry_t *entry)
+{
+    chitcpd_poll_item_t *item, *tmp;
+
+    pthread_mutex_lock(&si->lock_poll);
+    DL_FOREACH_SAFE2(entry->poll_items, item, tmp, entry_next)
+    {
+        /* The item is removed from its interest list the next time
+         * the list is checked (chitcpd_poll reports it as POLLNVAL) */
+        DL_DELETE2(entry->poll_items, item, entry_prev, entry_next);
+        item->entry = NULL;
+        item_notify(item);
+    }
+    atomic_store(&entry->poll_nitems, 0);
+    pthread_mutex_unlock(&si->lock_poll);
+}
+
+/* See readiness.h */
+void chitcpd_poll_wakeup_all(serverinfo_t *si)
+{
+    chitcpd_epoll_t *ep;
+
+    pthread_mutex_lock(&si->lock_poll);
+    DL_FOREACH(si->epolls, ep)
+        pthread_cond_broadcast(&ep->cv);
+    pthread_mutex_unlock(&si->lock_poll);
+}
+
+/* See readiness.h */
+int chitcpd_poll(serverinfo_t *si, chitcpd_poll_event_t *fds, int nfds, int timeout, int *nready)
+{
+    chitcpd_epoll_t *ep;
+    chitcpd_poll_item_t **items, *item, *tmp;
+    struct timespec deadline;
+    bool_t timed_out = FALSE;
+    int n, rc = 0;
+
+    /* A temporary interest list, which is not visible to other threads
+     * (but its items are notified like any other) */
+    ep = epoll_alloc(-1);
+    items = calloc(nfds > 0? nfds : 1, sizeof(chitcpd_poll_item_t *));
+    if (ep == NULL || items == NULL)
+    {
+        if (ep != NULL)
+            epoll_free(ep);
+        free(items);
+        return ENOMEM;
+    }
+
+    if (timeout > 0)
+        poll_deadline(&deadline, timeout);
+
+    pthread_mutex_lock(&si->lock_poll);
+
+    for (int i = 0; i < nfds; i++)
+    {
+        int sockfd = fds[i].sockfd;
+
+        if (sockfd < 0 || sockfd >= si->chisocket_table_size || si->chisocket_table[sockfd].available)
+            continue;
+
+        items[i] = item_add(ep, &si->chisocket_table[sockfd], sockfd, fds[i].events, i);
+        if (items[i] == NULL)
+        {
+            rc = ENOMEM;
+            goto done;
+        }
+    }
+
+    for(;;)
+    {
+        /* We check all the sockets, so we start over with an empty ready list */
+        DL_FOREACH_SAFE2(ep->ready, item, tmp, ready_next)
+        {
+            DL_DELETE2(ep->ready, item, ready_prev, ready_next);
+            item->queued = FALSE;
+        }
+
+        n = 0;
+        for (int i = 0; i < nfds; i++)
+        {
+            if (items[i] == NULL || items[i]->entry == NULL)
+                fds[i].revents = POLLNVAL;
+            else
+                fds[i].revents = chitcpd_socket_events(items[i]->entry) & (fds[i].events | POLLHUP | POLLERR);
+
+            if (fds[i].revents != 0)
+                n++;
+        }
+
+        if (n > 0 || timeout == 0 || timed_out)
+            break;
+
+        if (si->state == CHITCPD_STATE_STOPPING)
+        {
+            rc = EINTR;
+            break;
+        }
+
+        timed_out = poll_wait(si, ep, timeout, &deadline);
+    }
+
+    *nready = n;
+
+done:
+    DL_FOREACH_SAFE(ep->items, item, tmp)
+        item_remove(item);
+    pthread_mutex_unlock(&si->lock_poll);
+
+    epoll_free(ep);
+    free(items);
+
+    return rc;
+}
+
+/* See readiness.h */
+int chitcpd_epoll_create(serverinfo_t *si, int *epfd)
+{
+    chitcpd_epoll_t *ep;
+
+    pthread_mutex_lock(&si->lock_poll);
+    ep = epoll_alloc(si->epoll_next_fd);
+    if (ep != NULL)
+    {
+        si->epoll_next_fd++;
+        DL_APPEND(si->epolls, ep);
+        *epfd = ep->epfd;
+    }
+    pthread_mutex_unlock(&si->lock_poll);
+
+    return ep == NULL? ENOMEM : 0;
+}
+
+/* See readiness.h */
+int chitcpd_epoll_ctl(serverinfo_t *si, int epfd, int op, int sockfd, uint32_t events, uint64_t data)
+{
+    chitcpd_epoll_t *ep;
+    chitcpd_poll_item_t *item;
+    int rc = 0;
+
+    pthread_mutex_lock(&si->lock_poll);
+
+    ep = epoll_find(si, epfd);
+    if (ep == NULL || sockfd < 0 || sockfd >= si->chisocket_table_size || si->chisocket_table[sockfd].available)
+    {
+        rc = EBADF;
+        goto done;
+    }
+
+    if ((op == EPOLL_CTL_ADD || op == EPOLL_CTL_MOD) && (events & ~CHITCPD_EPOLL_EVENTS))
+    {
+        rc = EINVAL;
+        goto done;
+    }
+
+    item = item_find(ep, sockfd);
+
+    switch (op)
+    {
+    case EPOLL_CTL_ADD:
+        if (item != NULL)
+            rc = EEXIST;
+        else if (item_add(ep, &si->chisocket_table[sockfd], sockfd, events, data) == NULL)
+            rc = ENOMEM;
+        break;
+
+    case EPOLL_CTL_MOD:
+        if (item == NULL)
+            rc = ENOENT;
+        else
+        {
+            item->events = events;
+            item->data = data;
+            item_notify(item);
+        }
+        break;
+
+    case EPOLL_CTL_DEL:
+        if (item == NULL)
+            rc = ENOENT;
+        else
+            item_remove(item);
+        break;
+
+    default:
+        rc = EINVAL;
+    }
+
+done:
+    pthread_mutex_unlock(&si->lock_poll);
+
+    return rc;
+}
+
+/* Checks the items in an interest list's ready list, and returns the
+ * events of (up to maxevents) ready sockets. Called with lock_poll held. */
+static int epoll_collect(chitcpd_epoll_t *ep, chitcpd_poll_event_t *events, int maxevents)
+{
+    chitcpd_poll_item_t *item;
+    uint32_t revents;
+    int nqueued, n = 0;
+
+    DL_COUNT2(ep->ready, item, nqueued, ready_next);
+
+    /* Each item is taken from the front of the ready list and, if its
+     * socket is ready, put back at the end (events are level-triggered) */
+    for (int i = 0; i < nqueued && n < maxevents; i++)
+    {
+        item = ep->ready;
+        DL_DELETE2(ep->ready, item, ready_prev, ready_next);
+        item->queued = FALSE;
+
+        /* The socket has been freed */
+        if (item->entry == NULL)
+        {
+            item_remove(item);
+            continue;
+        }
+
+        revents = chitcpd_socket_events(item->entry) & (item->events | POLLHUP | POLLERR);
+        if (revents == 0)
+            continue;
+
+        events[n].sockfd = item->sockfd;
+        events[n].events = item->events;
+        events[n].revents = revents;
+        events[n].data = item->data;
+        n++;
+
+        item->queued = TRUE;
+        DL_APPEND2(ep->ready, item, ready_prev, ready_next);
+    }
+
+    return n;
+}
+
+/* See readiness.h */
+int chitcpd_epoll_wait(serverinfo_t *si, int epfd, chitcpd_poll_event_t *events, int maxevents, int timeout, int *nready)
+{
+    chitcpd_epoll_t *ep;
+    struct timespec deadline;
+    bool_t timed_out = FALSE;
+    int n = 0, rc = 0;
+
+    if (maxevents <= 0)
+        return EINVAL;
+
+    if (timeout > 0)
+        poll_deadline(&deadline, timeout);
+
+    pthread_mutex_lock(&si->lock_poll);
+
+    ep = epoll_find(si, epfd);
+    if (ep == NULL)
+    {
+        pthread_mutex_unlock(&si->lock_poll);
+        return EBADF;
+    }
+
+    ep->nwaiters++;
+    for(;;)
+    {
+        if (ep->closed)
+        {
+            rc = EBADF;
+            break;
+        }
+
+        n = epoll_collect(ep, events, maxevents);
+        if (n > 0 || timeout == 0 || timed_out)
+            break;
+
+        if (si->state == CHITCPD_STATE_STOPPING)
+        {
+            rc = EINTR;
+            break;
+        }
+
+        timed_out = poll_wait(si, ep, timeout, &deadline);
+    }
+    ep->nwaiters--;
+
+    /* The instance was closed while we were waiting */
+    if (ep->closed && ep->nwaiters == 0)
+        epoll_free(ep);
+
+    pthread_mutex_unlock(&si->lock_poll);
+
+    *nready = n;
+
+    return rc;
+}
+
+/* See readiness.h */
+int chitcpd_epoll_close(serverinfo_t *si, int epfd)
+{
+    chitcpd_epoll_t *ep;
+
+    pthread_mutex_lock(&si->lock_poll);
+    ep = epoll_find(si, epfd);
+    if (ep != NULL)
+        epoll_close(si, ep);
+    pthread_mutex_unlock(&si->lock_poll);
+
+    return ep == NULL? EBADF : 0;
+}
+
+/* See readiness.h */
+void chitcpd_epoll_set_owner(serverinfo_t *si, int epfd, pthread_t owner)
+{
+    chitcpd_epoll_t *ep;
+
+    pthread_mutex_lock(&si->lock_poll);
+    ep = epoll_find(si, epfd);
+    if (ep != NULL)
+        ep->owner = owner;
+    pthread_mutex_unlock(&si->lock_poll);
+}
+
+/* See readiness.h */
+int chitcpd_epoll_close_owned(serverinfo_t *si, pthread_t owner)
+{
+    chitcpd_epoll_t *ep, *tmp;
+    int closed = 0;
+
+    pthread_mutex_lock(&si->lock_poll);
+    DL_FOREACH_SAFE(si->epolls, ep, tmp)
+    {
+        if (pthread_equal(ep->owner, owner))
+        {
+            epoll_close(si, ep);
+            closed++;
+        }
+    }
+    pthread_mutex_unlock(&si->lock_poll);
+
+    return closed;
+}
@@ -0,0 +1,325 @@
+/*
+ *  chiTCP - A simple, testable TCP stack
+ *
+ *  Readiness of chisockets (chisocket_poll and chisocket_epoll_*)
+ *
+ *  The daemon keeps the interest lists of the epoll instances created
+ *  by the clients. Each socket keeps track of the interest lists it
+ *  is in, and wakes them up when its readiness may have changed: when
+ *  data is written to or read from its buffers, when its TCP state
+ *  changes, and when a passive socket receives a connection. Readiness
+ *  is level-triggered, and is always computed from the current state
+ *  of the socket (see chitcpd_socket_events).
+ *
+ */
+
+/*
+ *  Copyright (c) 2013-2014, The University of Chicago
+ *  All rights reserved.
+ *
+ *  Redistribution and use in source and binary forms, with or without
+ *  modification, are permitted provided that the following conditions are met:
+ *
+ *  - Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ *
+ *  - Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ *  - Neither the name of The University of Chicago nor the names of its
+ *    contributors may be used to endorse or promote products derived from this
+ *    software without specific prior written permission.
+ *
+ *  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ *  AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ *  IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ *  ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ *  LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ *  CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ *  SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ *  INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ *  CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ *  ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ *  POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+#ifndef READINESS_H_
+#define READINESS_H_
+
+#include <stdint.h>
+#include <poll.h>
+#include "serverinfo.h"
+
+/* The events that can be requested in an interest list. Any other flag
+ * (e.g., EPOLLET or EPOLLONESHOT) is rejected, instead of being ignored */
+#define CHITCPD_EPOLL_EVENTS (POLLIN | POLLOUT | POLLHUP | POLLERR)
+
+/* A socket in an interest list */
+typedef struct chitcpd_poll_item
+{
+    struct chitcpd_epoll *ep;
+
+    /* NULL once the socket has been freed */
+    chisocketentry_t *entry;
+    int sockfd;
+
+    uint32_t events;    /* Events the client is interested in */
+    uint64_t data;      /* Returned to the client with the events */
+
+    /* Is the item in the interest list's ready list? */
+    bool_t queued;
+
+    struct chitcpd_poll_item *prev;         /* Interest list */
+    struct chitcpd_poll_item *next;
+    struct chitcpd_poll_item *ready_prev;   /* Ready list */
+    struct chitcpd_poll_item *ready_next;
+    struct chitcpd_poll_item *entry_prev;   /* Socket's list of items */
+    struct chitcpd_poll_item *entry_next;
+} chitcpd_poll_item_t;
+
+/* An epoll instance. The ready list contains the items whose socket
+ * may be ready (the ones that have been notified since they were last
+ * checked, and the ones that were ready when they were last checked).
+ * All the instances are protected by the serverinfo's lock_poll. */
+typedef struct chitcpd_epoll
+{
+    int epfd;
+
+    /* Dispatch thread of the client connection that created
+     * the instance (it is freed when the client disconnects) */
+    pthread_t owner;
+
+    chitcpd_poll_item_t *items;
+    chitcpd_poll_item_t *ready;
+
+    /* Threads waiting in chitcpd_epoll_wait. If the instance is
+     * closed while they wait, the last one to wake up frees it. */
+    unsigned int nwaiters;
+    bool_t closed;
+    pthread_cond_t cv;
+
+    struct chitcpd_epoll *prev;
+    struct chitcpd_epoll *next;
+} chitcpd_epoll_t;
+
+/* A socket and its events, in chitcpd_poll and chitcpd_epoll_wait */
+typedef struct chitcpd_poll_event
+{
+    int sockfd;
+    uint32_t events;    /* Requested events (chitcpd_poll only) */
+    uint32_t revents;   /* Returned events */
+    uint64_t data;      /* chitcpd_epoll_wait only */
+} chitcpd_poll_event_t;
+
+
+/*
+ * chitcpd_poll_init - Initializes the daemon's interest lists
+ *
+ * si: Server info
+ *
+ * Returns: Nothing
+ */
+void chitcpd_poll_init(serverinfo_t *si);
+
+
+/*
+ * chitcpd_poll_free - Frees the daemon's interest lists
+ *
+ * si: Server info
+ *
+ * Returns: Nothing
+ */
+void chitcpd_poll_free(serverinfo_t *si);
+
+
+/*
+ * chitcpd_socket_events - Returns the events that are currently
+ *                         signalled on a socket
+ *
+ * These are the same as in poll(2): POLLIN if accept() or recv() would
+ * not block, POLLOUT if send() would not block, and POLLHUP if the
+ * socket is not connected.
+ *
+ * entry: Socket entry
+ *
+ * Returns: POLLIN, POLLOUT and/or POLLHUP
+ */
+uint32_t chitcpd_socket_events(chisocketentry_t *entry);
+
+
+/*
+ * chitcpd_poll_notify - Wakes up the interest lists a socket is in
+ *
+ * Must be called whenever the events returned by chitcpd_socket_events
+ * may have changed. It can be called while holding the socket's locks.
+ *
+ * si: Server info
+ *
+ * entry: Socket entry
+ *
+ * Returns: Nothing
+ */
+void chitcpd_poll_notify(serverinfo_t *si, chisocketentry_t *entry);
+
+
+/*
+ * chitcpd_poll_buffer_notify - Same as chitcpd_poll_notify, for use
+ *                              with circular_buffer_set_notify
+ *
+ * arg: Socket entry
+ *
+ * Returns: Nothing
+ */
+void chitcpd_poll_buffer_notify(void *arg);
+
+
+/*
+ * chitcpd_poll_forget - Removes a socket from all the interest lists
+ *
+ * Must be called before the socket's resources are freed.
+ *
+ * si: Server info
+ *
+ * entry: Socket entry
+ *
+ * Returns: Nothing
+ */
+void chitcpd_poll_forget(serverinfo_t *si, chisocketentry_t *entry);
+
+
+/*
+ * chitcpd_poll_wakeup_all - Wakes up all the threads waiting for events
+ *
+ * Used when the daemon is stopping (the waits then fail with EINTR).
+ *
+ * si: Server info
+ *
+ * Returns: Nothing
+ */
+void chitcpd_poll_wakeup_all(serverinfo_t *si);
+
+
+/*
+ * chitcpd_poll - Waits for events on a set of sockets
+ *
+ * Same as poll(2). Invalid sockets are returned with POLLNVAL.
+ *
+ * si: Server info
+ *
+ * fds: Sockets, and the events to wait for. Their revents
+ *      are set to the events that are signalled.
+ *
+ * nfds: Number of sockets
+ *
+ * timeout: Milliseconds to wait (-1 to wait indefinitely)
+ *
+ * nready: Set to the number of sockets with events
+ *
+ * Returns: 0 on success, or an errno value (ENOMEM, EINTR)
+ */
+int chitcpd_poll(serverinfo_t *si, chitcpd_poll_event_t *fds, int nfds, int timeout, int *nready);
+
+
+/*
+ * chitcpd_epoll_create - Creates an epoll instance
+ *
+ * si: Server info
+ *
+ * epfd: Set to the descriptor of the instance
+ *
+ * Returns: 0 on success, or an errno value (ENOMEM)
+ */
+int chitcpd_epoll_create(serverinfo_t *si, int *epfd);
+
+
+/*
+ * chitcpd_epoll_ctl - Adds, modifies or removes a socket from
+ *                     an epoll instance's interest list
+ *
+ * si: Server info
+ *
+ * epfd: Epoll instance
+ *
+ * op: EPOLL_CTL_ADD, EPOLL_CTL_MOD or EPOLL_CTL_DEL
+ *
+ * sockfd: Socket
+ *
+ * events: Events to wait for (POLLIN and/or POLLOUT; POLLHUP is
+ *         always returned). Flags outside CHITCPD_EPOLL_EVENTS
+ *         are rejected with EINVAL.
+ *
+ * data: Returned along with the socket's events
+ *
+ * Returns: 0 on success, or an errno value (EBADF, EEXIST,
+ *          ENOENT, EINVAL, ENOMEM)
+ */
+int chitcpd_epoll_ctl(serverinfo_t *si, int epfd, int op, int sockfd, uint32_t events, uint64_t data);
+
+
+/*
+ * chitcpd_epoll_wait - Waits for events in an epoll instance
+ *
+ * Same as epoll_wait(2), with level-triggered events. If there are
+ * more ready sockets than maxevents, the ones that are returned are
+ * moved to the end of the ready list, so they don't starve the others.
+ *
+ * si: Server info
+ *
+ * epfd: Epoll instance
+ *
+ * events: Set to the sockets with events
+ *
+ * maxevents: Maximum number of sockets to return
+ *
+ * timeout: Milliseconds to wait (-1 to wait indefinitely)
+ *
+ * nready: Set to the number of sockets returned
+ *
+ * Returns: 0 on success, or an errno value (EBADF, EINVAL, EINTR)
+ */
+int chitcpd_epoll_wait(serverinfo_t *si, int epfd, chitcpd_poll_event_t *events, int maxevents, int timeout, int *nready);
+
+
+/*
+ * chitcpd_epoll_close - Closes an epoll instance
+ *
+ * Threads waiting on the instance return EBADF.
+ *
+ * si: Server info
+ *
+ * epfd: Epoll instance
+ *
+ * Returns: 0 on success, or an errno value (EBADF)
+ */
+int chitcpd_epoll_close(serverinfo_t *si, int epfd);
+
+
+/*
+ * chitcpd_epoll_set_owner - Sets the thread that owns an epoll instance
+ *
+ * si: Server info
+ *
+ * epfd: Epoll instance
+ *
+ * owner: Thread
+ *
+ * Returns: Nothing
+ */
+void chitcpd_epoll_set_owner(serverinfo_t *si, int epfd, pthread_t owner);
+
+
+/*
+ * chitcpd_epoll_close_owned - Closes the epoll instances owned by a thread
+ *
+ * si: Server info
+ *
+ * owner: Thread
+ *
+ * Returns: Number of instances closed
+ */
+int chitcpd_epoll_close_owned(serverinfo_t *si, pthread_t owner);
+
+
+#endif /* READINESS_H_ */
@@ -70,8 +70,14 @@
 
 #include "server.h"
 #include "connection.h"
+#include "framing.h"
+#include "epoll_rx.h"
+#include "uring.h"
 #include "handlers.h"
 #include "breakpoint.h"
+#include "pcap.h"
+#include "metrics.h"
+#include "readiness.h"
 #include "protobuf-wrapper.h"
 #include "chitcp/utils.h"
 #include "chitcp/chitcpd.h"
@@ -86,6 +92,7 @@ int chitcpd_server_start_thread(serverinfo_t *si);
 void* chitcpd_server_thread_func(void *args);
 int chitcpd_server_start_network_thread(serverinfo_t *si);
 void* chitcpd_server_network_thread_func(void *args);
+void* chitcpd_server_network_udp_thread_func(void *args);
 
 /* Arguments to the server thread */
 typedef struct server_thread_args
@@ -99,17 +106,6 @@ typedef struct network_thread_args
     serverinfo_t *si;
 } network_thread_args_t;
 
-/* Header for pcap file if necessary. */
-typedef struct pcap_hdr {
-        uint32_t magic_number;   /* magic number */
-        uint16_t version_major;  /* major version number */
-        uint16_t version_minor;  /* minor version number */
-        int32_t  thiszone;       /* GMT to local correction */
-        uint32_t sigfigs;        /* accuracy of timestamps */
-        uint32_t snaplen;        /* max length of captured packets, in octets */
-        uint32_t network;        /* data link type */
-} pcap_hdr_t;
-
 
 /*
  * chitcpd_server_init - Starts the chiTCP daemon
@@ -126,6 +122,8 @@ typedef struct pcap_hdr {
  */
 int chitcpd_server_init(serverinfo_t *si)
 {
+    int rc;
+
     /* TODO: Make this configurable */
     si->chisocket_table_size = DEFAULT_MAX_SOCKETS;
     si->port_table_size = DEFAULT_MAX_PORTS;
@@ -134,6 +132,12 @@ int chitcpd_server_init(serverinfo_t *si)
 
     si->latency = 0.0;
 
+    if(si->tx_queue_limit == 0)
+        si->tx_queue_limit = DEFAULT_TX_QUEUE_LIMIT;
+
+    if(si->connection_stripes == 0)
+        si->connection_stripes = DEFAULT_CONNECTION_STRIPES;
+
     /* Initialize chisocket table */
     pthread_mutex_init(&si->lock_chisocket_table, NULL);
     si->chisocket_table = calloc(si->chisocket_table_size, sizeof(chisocketentry_t));
@@ -147,9 +151,13 @@ int chitcpd_server_init(serverinfo_t *si)
     for(int i=0; i< si->chisocket_table_size; i++)
     {
         pthread_mutex_init(&si->chisocket_table[i].lock_debug_monitor, NULL);
+        si->chisocket_table[i].si = si;
         si->chisocket_table[i].available = TRUE;
     }
 
+    /* Initialize interest lists */
+    chitcpd_poll_init(si);
+
 
     /* Initialize connection table */
     pthread_mutex_init(&si->lock_connection_table, NULL);
@@ -162,7 +170,12 @@ int chitcpd_server_init(serverinfo_t *si)
     }
 
     for(int i=0; i< si->connection_table_size; i++)
+    {
+        pthread_mutex_init(&si->connection_table[i].lock_tx, NULL);
+        pthread_cond_init(&si->connection_table[i].cv_tx, NULL);
+        pthread_cond_init(&si->connection_table[i].cv_tx_space, NULL);
         si->connection_table[i].available = TRUE;
+    }
 
     /* Initialize port table */
     /* This is an array of pointers, and they are all set to NULL */
@@ -187,28 +200,24 @@ int chitcpd_server_init(serverinfo_t *si)
        in said file. */
     if (si->libpcap_file_name != NULL)
     {
-        si->libpcap_file = fopen(si->libpcap_file_name, "wb");
-        if (si->libpcap_file == NULL)
+        chitcpd_pcap_options_t opts = {
+            .filename = si->libpcap_file_name,
+            .snaplen = si->libpcap_snaplen,
+            .rotate_bytes = si->libpcap_rotate_bytes,
+            .rotate_seconds = si->libpcap_rotate_seconds,
+            .use_mmap = si->libpcap_mmap,
+        };
+
+        rc = chitcpd_pcap_open(&si->libpcap, &opts);
+        if (rc != CHITCP_OK)
         {
-            perror("Could not open libpcap file for writing");
-            return CHITCP_ENOMEM;
+            fprintf(stderr, "Could not open libpcap file %s for writing\n", si->libpcap_file_name);
+            return rc;
         }
-
-        chilog(INFO, "Logging to libpcap file %s", si->libpcap_file_name);
-        /* Write the libpcap header */
-        pcap_hdr_t pcap_header;
-        pcap_header.magic_number = 0xa1b23c4d;
-        pcap_header.version_major = 2;
-        pcap_header.version_minor = 4;
-        pcap_header.thiszone = 0;
-        pcap_header.sigfigs = 0;
-        pcap_header.snaplen = 65535;
-        pcap_header.network = 101;
-        fwrite(&pcap_header, sizeof(pcap_hdr_t), 1, si->libpcap_file);
     }
     else
     {
-        si->libpcap_file = NULL;
+        si->libpcap = NULL;
     }
 
     si->state = CHITCPD_STATE_READY;
@@ -264,6 +273,16 @@ int chitcpd_server_start(serverinfo_t *si)
         return CHITCP_ETHREAD;
     }
 
+    /* Start metrics thread */
+    if(si->metrics_addr != NULL)
+    {
+        rc = chitcpd_metrics_start(si);
+        if(rc != CHITCP_OK)
+        {
+            return rc;
+        }
+    }
+
     pthread_mutex_lock(&si->lock_state);
     si->state = CHITCPD_STATE_RUNNING;
     pthread_cond_broadcast(&si->cv_state);
@@ -317,6 +336,10 @@ int chitcpd_server_stop(serverinfo_t *si)
 
     chilog(DEBUG, "chiTCP daemon is now in STOPPING state.");
 
+    /* Threads waiting in chisocket_poll/epoll_wait would otherwise
+     * hold up the shutdown of their handler threads */
+    chitcpd_poll_wakeup_all(si);
+
     chilog(DEBUG, "Stopping network thread...");
 
 #ifdef __APPLE__
@@ -324,7 +347,9 @@ int chitcpd_server_stop(serverinfo_t *si)
 #else
     rc = shutdown(si->network_socket, SHUT_RDWR);
 #endif
-    if(rc != 0)
+    /* Shutting down an unconnected UDP socket fails with ENOTCONN,
+     * but it still wakes up the network thread */
+    if(rc != 0 && !(si->transport == CHITCPD_TRANSPORT_UDP && errno == ENOTCONN))
         return CHITCP_ESOCKET;
 
     pthread_join(si->network_thread, NULL);
@@ -341,8 +366,16 @@ int chitcpd_server_stop(serverinfo_t *si)
 
     pthread_join(si->server_thread, NULL);
 
-    if (si->libpcap_file != NULL) {
-        fclose(si->libpcap_file);
+    if (si->metrics_addr != NULL)
+    {
+        chilog(DEBUG, "Stopping metrics thread...");
+        chitcpd_metrics_stop(si);
+    }
+
+    if (si->libpcap != NULL)
+    {
+        chitcpd_pcap_close(si->libpcap);
+        si->libpcap = NULL;
     }
 
     pthread_mutex_lock(&si->lock_state);
@@ -359,6 +392,22 @@ int chitcpd_server_stop(serverinfo_t *si)
 
 int chitcpd_server_free(serverinfo_t *si)
 {
+    unsigned long cksum_drops = atomic_load(&si->cksum_drops);
+    if (cksum_drops > 0)
+        chilog(INFO, "Dropped %lu packets with bad checksums", cksum_drops);
+
+    for(int i=0; i < si->connection_table_size; i++)
+    {
+        pthread_mutex_destroy(&si->connection_table[i].lock_tx);
+        pthread_cond_destroy(&si->connection_table[i].cv_tx);
+        pthread_cond_destroy(&si->connection_table[i].cv_tx_space);
+    }
+
+    chitcpd_poll_free(si);
+
+    for(int i=0; i < si->chisocket_table_size; i++)
+        free(si->chisocket_table[i].trace);
+
     free(si->chisocket_table);
     free(si->connection_table);
     free(si->port_table);
@@ -637,7 +686,9 @@ void* chitcpd_server_thread_func(void *args)
 
         /* We don't want to shutdown the handler's socket if an operation is
          * in progress. The handler thread may have read a command, but
-         * not sent a response back yet */
+         * not sent a response back yet (pipelined requests don't take
+         * this lock; the handler thread interrupts and joins the workers
+         * handling them before freeing its sockets) */
         pthread_mutex_lock(&ht->handler_lock);
         shutdown(ht->handler_socket, SHUT_RDWR);
         pthread_mutex_unlock(&ht->handler_lock);
@@ -678,13 +729,26 @@ int chitcpd_server_start_network_thread(serverinfo_t *si)
     server_addr.sin_addr.s_addr = INADDR_ANY;  // Bind to any address
 
     /* Create the socket */
-    si->network_socket = socket(PF_INET, SOCK_STREAM, IPPROTO_TCP);
+    if(si->transport == CHITCPD_TRANSPORT_UDP)
+        si->network_socket = socket(PF_INET, SOCK_DGRAM, IPPROTO_UDP);
+    else
+        si->network_socket = socket(PF_INET, SOCK_STREAM, IPPROTO_TCP);
     if(si->network_socket  == -1)
     {
         perror("Could not open network socket");
         return CHITCP_ESOCKET;
     }
 
+    /* With UDP, we need to know which of our addresses each datagram
+     * was sent to (a TCP connection gives us this through getsockname) */
+    if(si->transport == CHITCPD_TRANSPORT_UDP &&
+       setsockopt(si->network_socket, IPPROTO_IP, IP_PKTINFO, &yes, sizeof(int)) == -1)
+    {
+        perror("Socket setsockopt() failed");
+        close(si->network_socket);
+        return CHITCP_ESOCKET;
+    }
+
     /* Make port immediately available after we close the socket */
     if(setsockopt(si->network_socket, SOL_SOCKET, SO_REUSEADDR, &yes, sizeof(int)) == -1)
     {
@@ -702,19 +766,52 @@ int chitcpd_server_start_network_thread(serverinfo_t *si)
     }
 
     /* Start listening */
-    if(listen(si->network_socket, 5) == -1)
+    if(si->transport == CHITCPD_TRANSPORT_TCP && listen(si->network_socket, 5) == -1)
     {
         perror("Network socket listen() failed");
         close(si->network_socket);
         return CHITCP_ESOCKET;
     }
 
+    /* Start the epoll receive threads, if the epoll-based network layer
+     * is used. Note that, with the UDP transport, the network thread
+     * receives all the packets, so there is nothing for them to do. */
+    if(si->transport == CHITCPD_TRANSPORT_UDP)
+        si->epoll_rx_nthreads = 0;
+
+    if(si->epoll_rx_nthreads > 0 && chitcpd_epoll_rx_start(si) != CHITCP_OK)
+    {
+        close(si->network_socket);
+        return CHITCP_ETHREAD;
+    }
+
+    /* Same with the io_uring receive thread. If io_uring is not available,
+     * we fall back to the regular sockets code. */
+#ifdef CHITCPD_HAVE_LIBURING
+    if(si->use_uring && si->transport == CHITCPD_TRANSPORT_TCP && si->epoll_rx_nthreads == 0)
+    {
+        int rc = chitcpd_uring_rx_start(si);
+        if(rc == CHITCP_EINIT)
+            chilog(WARNING, "io_uring is not available. Using one thread per connection instead.");
+        else if(rc != CHITCP_OK)
+        {
+            close(si->network_socket);
+            return rc;
+        }
+    }
+#else
+    if(si->use_uring)
+        chilog(WARNING, "chitcpd was built without io_uring support. Using one thread per connection instead.");
+#endif
+
     /* Create arguments to network thread */
     network_thread_args_t *nta = malloc(sizeof(network_thread_args_t));
     nta->si = si;
 
     /* Create network thread */
-    if (pthread_create(&si->network_thread, NULL, chitcpd_server_network_thread_func, nta) < 0)
+    if (pthread_create(&si->network_thread, NULL,
+                       si->transport == CHITCPD_TRANSPORT_UDP? chitcpd_server_network_udp_thread_func : chitcpd_server_network_thread_func,
+                       nta) < 0)
     {
         perror("Could not create network thread");
         free(nta);
@@ -774,38 +871,35 @@ void* chitcpd_server_network_thread_func(void *args)
         chitcp_addr_str((struct sockaddr *) &client_addr, addr_str, sizeof(addr_str));
         chilog(INFO, "TCP connection received from %s", addr_str);
 
-        /* Check whether the connection already exists. */
-        connection = chitcpd_get_connection(si, (struct sockaddr *) &client_addr);
-        if (connection != NULL)
+        /* If this is a loopback connection, there is already an entry in
+         * the connection table (created by chitcpd_create_connection), but
+         * we need to update its receive socket and create its connection
+         * thread. */
+        if(chitcp_addr_is_loopback((struct sockaddr *) &client_addr))
         {
-            /* If this is a loopback connection, there is already an entry in
-             * the connection table, but we need to update its receive socket
-             * and create its connection thread. */
-           if(chitcp_addr_is_loopback((struct sockaddr *) &client_addr))
-           {
-               connection->realsocket_recv = realsocket;
-
-               if(chitcpd_create_connection_thread(si, connection) != CHITCP_OK)
-               {
-                   perror("Could not create connection thread.");
-                   // TODO: Perform orderly shutdown
-                   pthread_exit(NULL);
-               }
-
-               continue;
-           }
-           else
-           /* Otherwise, this is an error. The peer chiTCP daemon tried to create
-            * a second connection, which shouldn't happen. */
+            connection = chitcpd_get_unpaired_connection(si, (struct sockaddr *) &client_addr);
+
+            if (connection != NULL)
             {
-                perror("Peer chiTCP daemon tried to establish more than one connection.");
-                close(realsocket);
-                close(si->server_socket);
-                // TODO: Perform orderly shutdown instead of just exiting
-                pthread_exit(NULL);
+                connection->realsocket_recv = realsocket;
+
+                if(chitcpd_create_connection_thread(si, connection) != CHITCP_OK)
+                {
+                    perror("Could not create connection thread.");
+                    // TODO: Perform orderly shutdown
+                    pthread_exit(NULL);
+                }
+
+                continue;
             }
         }
 
+        /* Note that a peer chiTCP daemon may open several connections to
+         * us (see si->connection_stripes), so there may already be
+         * connections to this peer. */
+        if (chitcpd_get_connection(si, (struct sockaddr *) &client_addr) != NULL)
+            chilog(DEBUG, "Adding another connection to %s", addr_str);
+
         /* If this is not a loopback connection, we need to add an entry
          * for this connection */
         connection = chitcpd_add_connection(si, realsocket, realsocket, (struct sockaddr*) &client_addr);
@@ -832,10 +926,184 @@ void* chitcpd_server_network_thread_func(void *args)
         connection = &si->connection_table[i];
         if(!connection->available)
         {
+            chitcpd_close_connection_tx(connection);
             shutdown(connection->realsocket_recv, SHUT_RDWR);
             if (connection->realsocket_recv != connection->realsocket_send)
                 shutdown(connection->realsocket_send, SHUT_RDWR);
-            pthread_join(connection->thread, NULL);
+            if (si->epoll_rx_nthreads == 0 && si->uring_rx == NULL)
+                pthread_join(connection->thread, NULL);
+            pthread_join(connection->writer_thread, NULL);
+        }
+    }
+
+    chitcpd_epoll_rx_stop(si);
+#ifdef CHITCPD_HAVE_LIBURING
+    chitcpd_uring_rx_stop(si);
+#endif
+
+    chilog(DEBUG, "Network thread is exiting.");
+
+    pthread_exit(NULL);
+}
+
+
+/* Number of datagrams received with a single recvmmsg() call */
+#define UDP_RECV_BATCH (32)
+
+/*
+ * chitcpd_server_network_udp_thread_func - Network thread function (UDP transport)
+ *
+ * With the UDP transport, there are no connection threads. This thread
+ * receives all the datagrams sent to the daemon's network socket (several
+ * at a time, with recvmmsg), demultiplexes them by their source address
+ * (adding an entry to the connection table the first time a peer
+ * daemon sends us a datagram), and hands the chiTCP packet in each
+ * datagram to chitcpd_recv_tcp_packet.
+ *
+ * args: arguments (a serverinfo_t variable in network_thread_args_t)
+ *
+ * Returns: Nothing.
+ *
+ */
+void* chitcpd_server_network_udp_thread_func(void *args)
+{
+    network_thread_args_t *nta;
+    serverinfo_t *si;
+    tcpconnentry_t* connection;
+    char addr_str[100];
+    uint8_t *bufs;
+    struct mmsghdr msgs[UDP_RECV_BATCH];
+    struct iovec iovs[UDP_RECV_BATCH];
+    struct sockaddr_storage src_addrs[UDP_RECV_BATCH];
+    uint8_t cmsgbufs[UDP_RECV_BATCH][CMSG_SPACE(sizeof(struct in_pktinfo))];
+    struct sockaddr_storage local_addr;
+    struct cmsghdr *cmsg;
+    chitcphdr_t chitcp_header;
+    tcp_packet_t *packet;
+    int n, nbytes;
+
+    set_thread_name(pthread_self(), "network_server");
+
+    /* Unpack arguments */
+    nta = (network_thread_args_t *) args;
+    si = nta->si;
+
+    bufs = malloc(UDP_RECV_BATCH * FRAME_MAX_SIZE);
+    if(bufs == NULL)
+    {
+        perror("Could not allocate datagram buffers");
+        pthread_exit(NULL);
+    }
+
+    for(;;)
+    {
+        memset(msgs, 0, sizeof(msgs));
+        for(int i=0; i < UDP_RECV_BATCH; i++)
+        {
+            iovs[i].iov_base = bufs + i * FRAME_MAX_SIZE;
+            iovs[i].iov_len = FRAME_MAX_SIZE;
+            msgs[i].msg_hdr.msg_iov = &iovs[i];
+            msgs[i].msg_hdr.msg_iovlen = 1;
+            msgs[i].msg_hdr.msg_name = &src_addrs[i];
+            msgs[i].msg_hdr.msg_namelen = sizeof(struct sockaddr_storage);
+            msgs[i].msg_hdr.msg_control = cmsgbufs[i];
+            msgs[i].msg_hdr.msg_controllen = sizeof(cmsgbufs[i]);
+        }
+
+        /* Block until there is at least one datagram, and then
+         * take as many as are available (up to UDP_RECV_BATCH) */
+        n = recvmmsg(si->network_socket, msgs, UDP_RECV_BATCH, MSG_WAITFORONE, NULL);
+
+        if(si->state == CHITCPD_STATE_STOPPING)
+            break;
+
+        if(n == -1)
+        {
+            if(errno != EINTR)
+                perror("Could not recvmmsg() on network socket");
+            continue;
+        }
+
+        for(int i=0; i < n; i++)
+        {
+            struct sockaddr *src_addr = (struct sockaddr *) &src_addrs[i];
+
+            chitcp_addr_str(src_addr, addr_str, sizeof(addr_str));
+
+            if(msgs[i].msg_hdr.msg_flags & MSG_TRUNC)
+            {
+                chilog(WARNING, "Dropping truncated datagram from %s", addr_str);
+                continue;
+            }
+
+            /* Find the local address the datagram was sent to */
+            memset(&local_addr, 0, sizeof(struct sockaddr_storage));
+            local_addr.ss_family = AF_INET;
+            for(cmsg = CMSG_FIRSTHDR(&msgs[i].msg_hdr); cmsg != NULL; cmsg = CMSG_NXTHDR(&msgs[i].msg_hdr, cmsg))
+            {
+                if(cmsg->cmsg_level == IPPROTO_IP && cmsg->cmsg_type == IP_PKTINFO)
+                {
+                    struct in_pktinfo *pktinfo = (struct in_pktinfo *) CMSG_DATA(cmsg);
+                    ((struct sockaddr_in *) &local_addr)->sin_addr = pktinfo->ipi_addr;
+                }
+            }
+            chitcp_set_addr_port((struct sockaddr *) &local_addr, si->server_port);
+
+            /* Each datagram must contain exactly one chiTCP packet */
+            nbytes = chitcpd_frame_decode(iovs[i].iov_base, msgs[i].msg_len, &chitcp_header, &packet);
+
+            if(nbytes <= 0 || (unsigned int) nbytes != msgs[i].msg_len)
+            {
+                if(nbytes > 0)
+                {
+                    chitcp_tcp_packet_free(packet);
+                    free(packet);
+                }
+                chilog(WARNING, "Dropping malformed datagram from %s (%u bytes)", addr_str, msgs[i].msg_len);
+                continue;
+            }
+
+            /* Demultiplex the peer chiTCP daemon by its address */
+            connection = chitcpd_get_connection(si, src_addr);
+            if(connection == NULL)
+            {
+                chilog(INFO, "UDP datagram received from new peer %s", addr_str);
+                connection = chitcpd_add_connection(si, si->network_socket, si->network_socket, src_addr);
+
+                if (!connection)
+                {
+                    chilog(ERROR, "Could not add peer %s to the connection table", addr_str);
+                    chitcp_tcp_packet_free(packet);
+                    free(packet);
+                    continue;
+                }
+            }
+
+            chilog(TRACE, "Received a chiTCP header.");
+            chilog_chitcp(TRACE, (uint8_t *)&chitcp_header, LOG_INBOUND);
+            chilog_tcp(TRACE, packet, LOG_INBOUND);
+
+            if(chitcpd_recv_tcp_packet(si, packet, (struct sockaddr*) &local_addr, src_addr) != CHITCP_OK)
+            {
+                chilog(WARNING, "Received a packet but did not find a socket to deliver it to (in real TCP, a ICMP message would be sent back to peer)");
+                atomic_fetch_add_explicit(&si->metrics.packets_no_socket, 1, memory_order_relaxed);
+                chitcp_tcp_packet_free(packet);
+                free(packet);
+            }
+        }
+    }
+
+    free(bufs);
+
+    /* Stop all the writer threads. There are no connection
+     * threads with the UDP transport. */
+    for(int i=0; i < si->connection_table_size; i++)
+    {
+        connection = &si->connection_table[i];
+        if(!connection->available)
+        {
+            chitcpd_close_connection_tx(connection);
+            pthread_join(connection->writer_thread, NULL);
         }
     }
 
@@ -47,7 +47,10 @@
 #include "chitcp/debug_api.h"
 #include "chitcp/log.h"
 #include "chitcp/chitcpd.h"
+#include "chitcp/pool.h"
 #include "breakpoint.h"
+#include "trace.h"
+#include "readiness.h"
 
 
 
@@ -78,6 +81,9 @@ int chitcpd_tcp_packet_create(chisocketentry_t *entry, tcp_packet_t *packet, con
     int packet_len;
 
     packet_len = chitcp_tcp_packet_init(packet, payload, payload_len);
+    if (packet_len < 0)
+        return packet_len;
+
     chitcpd_set_header_ports(entry, TCP_PACKET_HEADER(packet));
 
     return packet_len;
@@ -89,13 +95,18 @@ void chitcpd_update_tcp_state(serverinfo_t *si, chisocketentry_t *entry, tcp_sta
     chilog(MINIMAL, "[S%i] %s -> %s", SOCKET_NO(si, entry), tcp_str(entry->tcp_state), tcp_str(newstate));
 
     pthread_mutex_lock(&entry->lock_tcp_state);
+    tcp_state_t oldstate = entry->tcp_state;
     entry->tcp_state = newstate;
+    chitcpd_trace_add(entry, TRACE_STATE, 0, oldstate, NULL);
+    chitcp_shm_set_state(&entry->shm, newstate);
     pthread_cond_broadcast(&entry->cv_tcp_state);
 
     chitcpd_debug_breakpoint(si, ptr_to_fd(si, entry), DBG_EVT_TCP_STATE_CHANGE, -1);
 
     pthread_mutex_unlock(&entry->lock_tcp_state);
 
+    chitcpd_poll_notify(si, entry);
+
     if (newstate == CLOSED && entry->actpas_type == SOCKET_ACTIVE)
     {
         active_chisocket_state_t *socket_state = &entry->socket_state.active;
@@ -142,6 +153,8 @@ int chitcpd_allocate_socket(serverinfo_t *si, int *socket_index)
         if(si->chisocket_table[i].available)
         {
             si->chisocket_table[i].available = FALSE;
+            si->chisocket_table[i].id = si->chisocket_next_id++;
+            chitcpd_stats_reset(&si->chisocket_table[i].stats);
 
             entry = &si->chisocket_table[i];
             *socket_index = i;
@@ -163,9 +176,24 @@ int chitcpd_allocate_socket(serverinfo_t *si, int *socket_index)
 
         entry->actpas_type = SOCKET_UNINITIALIZED;
         entry->tcp_state = CLOSED;
+        entry->nonblocking = FALSE;
+        atomic_store(&entry->interrupted, FALSE);
 
         entry->withheld_packets = NULL;
 
+        entry->shm.header = NULL;
+        entry->shm.fd = -1;
+
+        entry->poll_items = NULL;
+        atomic_store(&entry->poll_nitems, 0);
+
+        /* Traces are kept when sockets are freed (see serverinfo.h). If
+         * the trace cannot be allocated, the socket is simply not traced */
+        if(entry->trace != NULL)
+            chitcpd_trace_reset(entry->trace);
+        else
+            entry->trace = calloc(1, sizeof(chitcpd_trace_t));
+
         pthread_mutex_init(&entry->lock_withheld_packets, NULL);
         pthread_mutex_init(&entry->lock_tcp_state, NULL);
         pthread_cond_init(&entry->cv_tcp_state, NULL);
@@ -176,12 +204,48 @@ int chitcpd_allocate_socket(serverinfo_t *si, int *socket_index)
     return ret;
 }
 
+/* See serverinfo.h */
+void chitcpd_interrupt_socket_entry(serverinfo_t *si, chisocketentry_t *entry)
+{
+    atomic_store(&entry->interrupted, TRUE);
+
+    if(entry->actpas_type == SOCKET_PASSIVE)
+    {
+        passive_chisocket_state_t *socket_state = &entry->socket_state.passive;
+
+        pthread_mutex_lock(&socket_state->lock_pending_connections);
+        pthread_cond_broadcast(&socket_state->cv_pending_connections);
+        pthread_mutex_unlock(&socket_state->lock_pending_connections);
+    }
+    else if(entry->actpas_type == SOCKET_ACTIVE)
+    {
+        tcp_data_t *tcp_data = &entry->socket_state.active.tcp_data;
+
+        /* If the TCP thread hasn't initialized the buffers yet,
+         * nobody can be blocked on them */
+        if(tcp_data->send.state != NULL && tcp_data->recv.state != NULL)
+        {
+            circular_buffer_close(&tcp_data->send);
+            circular_buffer_close(&tcp_data->recv);
+        }
+    }
+
+    pthread_mutex_lock(&entry->lock_tcp_state);
+    pthread_cond_broadcast(&entry->cv_tcp_state);
+    pthread_mutex_unlock(&entry->lock_tcp_state);
+
+    chitcpd_poll_forget(si, entry);
+}
+
 /* See serverinfo.h */
 int chitcpd_free_socket_entry(serverinfo_t *si, chisocketentry_t *entry)
 {
     uint16_t port;
     struct sockaddr *addr;
 
+    /* Nobody can check the socket's readiness from now on */
+    chitcpd_poll_forget(si, entry);
+
     if(entry->actpas_type == SOCKET_PASSIVE)
     {
         chilog(TRACE, "Freeing entry for passive socket %i", SOCKET_NO(si, entry));
@@ -211,12 +275,18 @@ int chitcpd_free_socket_entry(serverinfo_t *si, chisocketentry_t *entry)
         pthread_cond_destroy(&socket_state->cv_event);
     }
 
+    /* The buffers have been closed by tcp_data_free. The client may
+     * still have the region mapped, so this only releases our mapping */
+    chitcp_shm_unmap(&entry->shm);
+
     withheld_tcp_packet_list_t *elt, *tmp;
 
     DL_FOREACH_SAFE(entry->withheld_packets,elt,tmp)
     {
         DL_DELETE(entry->withheld_packets,elt);
-        free(elt);
+        chitcp_tcp_packet_free(elt->packet);
+        free(elt->packet);
+        chitcp_pool_free(elt);
     }
 
     pthread_mutex_destroy(&entry->lock_withheld_packets);
@@ -234,8 +304,12 @@ int chitcpd_free_socket_entry(serverinfo_t *si, chisocketentry_t *entry)
     if ((port = chitcp_ntohs(chitcp_get_addr_port(addr))) >= 0)
         si->port_table[port] = NULL;
 
+    /* The trace outlives the socket (see serverinfo.h) */
+    chitcpd_trace_t *trace = entry->trace;
+
     memset(entry, 0, sizeof(chisocketentry_t));
 
+    entry->trace = trace;
     entry->available = TRUE;
 
     chilog(TRACE, "Finished freeing entry for socket %i", SOCKET_NO(si, entry));
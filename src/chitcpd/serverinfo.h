@@ -46,19 +46,56 @@
 #include <sys/socket.h>
 #include <netinet/in.h>
 #include <pthread.h>
+#include <stdatomic.h>
 
 #include "tcp.h"
+#include "stats.h"
+#include "metrics.h"
 #include "chitcp/types.h"
 #include "chitcp/packet.h"
 #include "chitcp/debug_api.h"
+#include "chitcp/shm.h"
 
 #define DEFAULT_MAX_SOCKETS (1024u)
 #define DEFAULT_MAX_PORTS (65536u)
 #define DEFAULT_MAX_CONNECTIONS (1024u)
 #define DEFAULT_EPHEMERAL_PORT_START (49152u)
+#define DEFAULT_TX_QUEUE_LIMIT (1024u * 1024u)
+#define DEFAULT_CONNECTION_STRIPES (1u)
+
+/* Checksum offload flags. If the transport between daemons is trusted,
+ * computing and/or verifying TCP checksums can be skipped. */
+#define CHITCPD_CKSUM_OFFLOAD_TX (1 << 0)  /* Don't compute checksums of outgoing packets */
+#define CHITCPD_CKSUM_OFFLOAD_RX (1 << 1)  /* Don't verify checksums of incoming packets */
 
 typedef struct chisocketentry chisocketentry_t;
 
+/* A chiTCP packet (chiTCP header followed by a TCP packet)
+ * waiting in a connection's transmit queue. If possible, the
+ * chiTCP header is prepended in place to the TCP packet, and the
+ * frame holds a reference to the packet's buffer. Otherwise, the
+ * frame is copied to inline_data. */
+typedef struct tx_frame
+{
+    size_t length;
+    uint8_t *data;
+
+    /* Packet buffer that data points into (NULL if data
+     * points to inline_data) */
+    uint8_t *buffer;
+
+#ifndef NDEBUG
+    /* Checksum of the frame when it was queued, to catch packets that
+     * are modified while they are in the queue (see chitcp_tcp_packet_clone) */
+    uint16_t cksum;
+#endif
+
+    struct tx_frame *prev;
+    struct tx_frame *next;
+
+    uint8_t inline_data[];
+} tx_frame_t;
+
 /* Represents single TCP connection between chiTCP daemons */
 typedef struct tcpconnentry
 {
@@ -71,13 +108,34 @@ typedef struct tcpconnentry
     /* Real TCP sockets associated with this connection.
      * Note that, when two peers are distinct, these sockets
      * will have the same value. When connecting to the
-     * loopback address, they'll have different values. */
+     * loopback address, they'll have different values.
+     * With the UDP transport, both are the daemon's network
+     * socket (and there is no connection thread, since the
+     * network thread receives all the datagrams). */
     socket_t realsocket_send;
     socket_t realsocket_recv;
 
+    /* Transmit queue. The TCP threads append packets to this queue,
+     * and a single writer thread sends them through realsocket_send
+     * (so packets sent by different TCP threads are never interleaved).
+     * tx_queue_bytes is the total size of the queued frames. */
+    pthread_t writer_thread;
+    tx_frame_t *tx_queue;
+    size_t tx_queue_bytes;
+    bool_t tx_closed;
+    pthread_mutex_t lock_tx;
+    pthread_cond_t cv_tx;
+    pthread_cond_t cv_tx_space;
+
     /* Peer chiTCP daemon */
     struct sockaddr_storage peer_addr;
 
+    /* Our address, as seen by the peer (i.e., the local address that
+     * the peer's chitcpd_recv_tcp_packet gets for this connection).
+     * It is used in the pseudo-header of the TCP checksum, instead of
+     * the socket's local address (which may be the ANY address) */
+    struct sockaddr_storage local_addr;
+
 } tcpconnentry_t;
 
 
@@ -163,6 +221,10 @@ typedef struct chisocketentry
     /* Is this entry available? */
     bool_t available;
 
+    /* Number of sockets allocated before this one. Unlike the socket
+     * number, it is never reused. */
+    uint64_t id;
+
     /* Socket domain
      * Only AF_INET and AF_INET6 are supported. */
     int domain;
@@ -179,6 +241,9 @@ typedef struct chisocketentry
     struct sockaddr_storage local_addr;
     struct sockaddr_storage remote_addr;
 
+    /* Performance counters (see stats.h) */
+    chitcpd_socket_stats_t stats;
+
     /* TCP state (CLOSED, SYN_SENT, LISTEN, etc.) */
     tcp_state_t tcp_state;
     pthread_mutex_t lock_tcp_state;
@@ -187,6 +252,15 @@ typedef struct chisocketentry
     /* Socket type: active or passive */
     socket_type_t actpas_type;
 
+    /* Non-blocking mode (O_NONBLOCK): ACCEPT, CONNECT, SEND and
+     * RECV return EAGAIN (or EINPROGRESS) instead of blocking */
+    bool_t nonblocking;
+
+    /* Set when the client that created the socket has disconnected.
+     * Requests that are blocked on the socket give up (with EINTR), so
+     * the socket can be freed (see chitcpd_interrupt_socket_entry) */
+    atomic_bool interrupted;
+
     /* Thread that created this entry */
     pthread_t creator_thread;
 
@@ -199,6 +273,27 @@ typedef struct chisocketentry
     pthread_mutex_t lock_debug_monitor;
     int event_flags;
 
+    /* Binary trace of the socket's segments and TCB transitions
+     * (see trace.h). The trace belongs to the slot in the socket table,
+     * not to the socket: it is reset when the slot is reused, and only
+     * freed with the table, so threads that still hold a pointer to a
+     * freed socket can keep adding records to it */
+    _Atomic(struct chitcpd_trace *) trace;
+
+    /* Shared-memory region with the socket's buffers, if the client
+     * requested shared-memory mode (otherwise, shm.header is NULL).
+     * See chitcp/shm.h */
+    chitcp_shm_t shm;
+
+    /* Items for this socket in the daemon's interest lists (see
+     * readiness.h), which are protected by the daemon's lock_poll.
+     * poll_nitems can be read without the lock, to skip notifying
+     * sockets that are not in any list. The daemon is also needed
+     * to notify changes in the buffers. */
+    struct chitcpd_poll_item *poll_items;
+    atomic_uint poll_nitems;
+    struct serverinfo *si;
+
     union
     {
         active_chisocket_state_t active;
@@ -222,11 +317,20 @@ typedef struct chisocketentry
  *
  * payload_len: Size of the payload in number of bytes.
  *
- * Returns: the size in bytes of the TCP packet.
+ * Returns: the size in bytes of the TCP packet, or CHITCP_ENOMEM if
+ *          the packet could not be allocated.
  *
  */
 int chitcpd_tcp_packet_create(chisocketentry_t *entry, tcp_packet_t *packet, const uint8_t* payload, uint16_t payload_len);
 
+/* Transport used to carry chiTCP packets between chiTCP daemons */
+typedef enum
+{
+    CHITCPD_TRANSPORT_TCP                         = 0,  /* chiTCP packets are framed in a TCP stream */
+    CHITCPD_TRANSPORT_UDP                         = 1,  /* Each chiTCP packet is sent in its own UDP datagram */
+} chitcpd_transport_t;
+
+
 /* State of the chiTCP daemon */
 typedef enum
 {
@@ -246,6 +350,7 @@ typedef struct packet_delivery_list_entry
     chisocketentry_t *entry;
     tcp_packet_t* tcp_packet;
     struct timespec delivery_time;
+    uint64_t received;  /* When the packet was queued (see chitcpd_stats_clock) */
     char* log_prefix;
     struct sockaddr_storage local_addr;
     struct sockaddr_storage remote_addr;
@@ -255,6 +360,24 @@ typedef struct packet_delivery_list_entry
 } packet_delivery_list_entry_t;
 
 
+/* A network receive thread, when the epoll-based network layer
+ * is used (see epoll_rx.c) */
+typedef struct epoll_rx_thread
+{
+    pthread_t thread;
+    int epoll_fd;
+
+    /* Written to when the thread has to exit */
+    int wakeup_fd;
+
+    /* Connections handled by this thread (nconns is the length
+     * of the list; both are protected by lock_conns) */
+    struct epoll_rx_conn *conns;
+    unsigned int nconns;
+    pthread_mutex_t lock_conns;
+} epoll_rx_thread_t;
+
+
 /* The serverinfo_t struct is a singleton data structure that contains
  * all the state for the chiTCP daemon. It is often the first parameter
  * in most chitcpd_* functions. */
@@ -277,7 +400,9 @@ typedef struct serverinfo
     socket_t server_socket;
 
     /* This is the thread that listens on a TCP port for
-     * incoming chiTCP packets */
+     * incoming chiTCP packets (or, if the UDP transport is used,
+     * that receives the chiTCP packets on a UDP port) */
+    chitcpd_transport_t transport;
     pthread_t network_thread;
     socket_t network_socket;
 
@@ -294,10 +419,51 @@ typedef struct serverinfo
     tcpconnentry_t *connection_table;
     pthread_mutex_t lock_connection_table;
 
+    /* Maximum number of bytes that can be waiting in a connection's
+     * transmit queue. A TCP thread that sends a packet through
+     * a connection with a full queue will block until the queue
+     * is drained below this limit. */
+    size_t tx_queue_limit;
+
+    /* If epoll_rx_nthreads is greater than zero, the TCP connections
+     * to other chiTCP daemons do not get their own connection thread.
+     * Instead, they are multiplexed with epoll by this many threads
+     * (see epoll_rx.c). New connections are assigned to the threads
+     * in round-robin order (epoll_rx_next is the next thread) */
+    uint16_t epoll_rx_nthreads;
+    uint16_t epoll_rx_next;
+    epoll_rx_thread_t *epoll_rx_threads;
+
+    /* If use_uring is TRUE (and chitcpd was built with liburing),
+     * the connections to other chiTCP daemons are handled with
+     * io_uring (see uring.c). uring_rx is the state of the io_uring
+     * receive thread. */
+    bool_t use_uring;
+    struct uring_rx *uring_rx;
+
+    /* Number of TCP connections to open to each peer chiTCP daemon.
+     * chiTCP sockets are spread across these connections by hashing
+     * their 4-tuple (so each socket always uses the same connection) */
+    uint16_t connection_stripes;
+
+    /* Checksum offload flags (CHITCPD_CKSUM_OFFLOAD_*), and number
+     * of incoming packets dropped because of a bad checksum */
+    int cksum_offload;
+    atomic_ulong cksum_drops;
+
+    /* Daemon-wide counters and histograms (see metrics.h). If metrics_addr
+     * is not NULL, they are served (together with other gauges) by the
+     * metrics thread on the TCP port or UNIX socket it specifies. */
+    chitcpd_metrics_t metrics;
+    char *metrics_addr;
+    pthread_t metrics_thread;
+    socket_t metrics_socket;
+
     /* Socket table */
     uint16_t chisocket_table_size;
     chisocketentry_t *chisocket_table;
     pthread_mutex_t lock_chisocket_table;
+    uint64_t chisocket_next_id;
 
     /* Table of pointers to socket entries.
      * If an entry is NULL, the port is available.
@@ -307,9 +473,20 @@ typedef struct serverinfo
     uint16_t ephemeral_port_start;
     chisocketentry_t **port_table;
 
-    /* The libcap file that this server is logging to. */
+    /* Epoll instances created by the clients, with the interest
+     * lists of chisocket_epoll_* (see readiness.h) */
+    struct chitcpd_epoll *epolls;
+    int epoll_next_fd;
+    pthread_mutex_t lock_poll;
+
+    /* The libcap file that this server is logging to, and how it
+     * is written (see pcap.h) */
     const char *libpcap_file_name;
-    FILE *libpcap_file;
+    uint32_t libpcap_snaplen;
+    uint64_t libpcap_rotate_bytes;
+    unsigned int libpcap_rotate_seconds;
+    bool_t libpcap_mmap;
+    struct chitcpd_pcap *libpcap;
 
 } serverinfo_t;
 
@@ -359,6 +536,26 @@ void chitcpd_timeout(serverinfo_t *si, chisocketentry_t *entry, tcp_timer_type_t
 int chitcpd_allocate_socket(serverinfo_t *si, int *socket_entry);
 
 
+/*
+ * chitcpd_interrupt_socket_entry - Wakes up the requests blocked on a socket
+ *
+ * Once a socket is interrupted, requests on it don't block anymore:
+ * ACCEPT, CONNECT, CLOSE and WAIT_FOR_STATE fail with EINTR, SEND and
+ * RECV return right away (the socket's buffers are closed), and the
+ * socket is removed from all the interest lists (so POLL reports it as
+ * POLLNVAL). Used when a client disconnects while some of its requests
+ * are still being handled, before freeing its sockets.
+ *
+ * si: Server info
+ *
+ * entry: Pointer to entry in socket table.
+ *
+ * Returns: Nothing
+ *
+ */
+void chitcpd_interrupt_socket_entry(serverinfo_t *si, chisocketentry_t *entry);
+
+
 /*
  * chitcpd_free_socket_entry - Free resources allocated to a socket
  *
@@ -0,0 +1,135 @@
+/*
+ *  chiTCP - A simple, testable TCP stack
+ *
+ *  Per-socket performance counters
+ *
+ *  see stats.h for descriptions of functions, parameters, and return values.
+ *
+ */
+
+
+/*
+ *  Copyright (c) 2013-2014, The University of Chicago
+ *  All rights reserved.
+ *
+ *  Redistribution and use in source and binary forms, with or without
+ *  modification, are permitted provided that the following conditions are met:
+ *
+ *  - Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ *
+ *  - Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ *  - Neither the name of The University of Chicago nor the names of its
+ *    contributors may be used to endorse or promote products derived from this
+ *    software without specific prior written permission.
+ *
+ *  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ *  AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ *  IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ *  ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ *  LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ *  CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ *  SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ *  INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ *  CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ *  ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ *  POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+#include <string.h>
+
+#include "stats.h"
+
+/* Sequence number comparisons (modulo 2^32) */
+#define SEQ_LT(a, b) ((int32_t) ((a) - (b)) < 0)
+#define SEQ_GT(a, b) ((int32_t) ((a) - (b)) > 0)
+#define SEQ_GEQ(a, b) ((int32_t) ((a) - (b)) >= 0)
+
+
+/* See stats.h */
+void chitcpd_stats_reset(chitcpd_socket_stats_t *stats)
+{
+    memset(stats, 0, sizeof(chitcpd_socket_stats_t));
+}
+
+/* See stats.h */
+void chitcpd_stats_segment_sent(chitcpd_socket_stats_t *stats, tcp_data_t *tcp_data, tcp_packet_t *packet)
+{
+    uint32_t seq = SEG_SEQ(packet);
+    uint32_t len = SEG_LEN(packet);
+    uint32_t payload_len = TCP_PAYLOAD_LEN(packet);
+
+    CHITCPD_STATS_ADD(stats, segs_sent, 1);
+    CHITCPD_STATS_ADD(stats, bytes_sent, payload_len);
+
+    if (payload_len > 0 && tcp_data->SND_WND == 0)
+        CHITCPD_STATS_ADD(stats, zero_window_probes, 1);
+
+    /* Pure ACKs don't consume sequence numbers, and are never retransmitted */
+    if (len == 0)
+        return;
+
+    if (stats->snd_max_valid && SEQ_LT(seq, stats->snd_max))
+    {
+        CHITCPD_STATS_ADD(stats, retransmits, 1);
+
+        /* An ACK for a retransmitted segment could be for any of its
+         * transmissions, so it can't be used to measure the RTT */
+        if (stats->rtt_timing && SEQ_LT(seq, stats->rtt_seq))
+            stats->rtt_timing = FALSE;
+    }
+    else if (!stats->rtt_timing)
+    {
+        stats->rtt_timing = TRUE;
+        stats->rtt_seq = seq + len;
+        stats->rtt_start = chitcpd_stats_clock();
+    }
+
+    if (!stats->snd_max_valid || SEQ_GT(seq + len, stats->snd_max))
+    {
+        stats->snd_max = seq + len;
+        stats->snd_max_valid = TRUE;
+    }
+}
+
+/* See stats.h */
+void chitcpd_stats_segment_arrived(chitcpd_socket_stats_t *stats, tcp_data_t *tcp_data, tcp_state_t state, tcp_packet_t *packet)
+{
+    tcphdr_t *header = TCP_PACKET_HEADER(packet);
+    uint32_t payload_len = TCP_PAYLOAD_LEN(packet);
+    bool_t synchronized = state != CLOSED && state != LISTEN && state != SYN_SENT;
+
+    if (synchronized && payload_len > 0 && SEQ_GT(SEG_SEQ(packet), tcp_data->RCV_NXT))
+        CHITCPD_STATS_ADD(stats, out_of_order, 1);
+
+    if (!header->ack)
+        return;
+
+    if (synchronized && payload_len == 0 && !header->syn && !header->fin &&
+        SEG_ACK(packet) == tcp_data->SND_UNA && tcp_data->SND_UNA != tcp_data->SND_NXT &&
+        SEG_WND(packet) == stats->last_wnd)
+        CHITCPD_STATS_ADD(stats, dup_acks, 1);
+    stats->last_wnd = SEG_WND(packet);
+
+    if (stats->rtt_timing && SEQ_GEQ(SEG_ACK(packet), stats->rtt_seq))
+    {
+        uint64_t rtt = chitcpd_stats_clock() - stats->rtt_start;
+        uint64_t srtt = CHITCPD_STATS_GET(stats, srtt_ns);
+        uint64_t min = CHITCPD_STATS_GET(stats, rtt_min_ns);
+
+        stats->rtt_timing = FALSE;
+
+        /* SRTT <- 7/8 * SRTT + 1/8 * R' (RFC 6298) */
+        srtt = (srtt == 0)? rtt : srtt - srtt / 8 + rtt / 8;
+
+        atomic_store_explicit(&stats->rtt_last_ns, rtt, memory_order_relaxed);
+        atomic_store_explicit(&stats->srtt_ns, srtt, memory_order_relaxed);
+        if (min == 0 || rtt < min)
+            atomic_store_explicit(&stats->rtt_min_ns, rtt, memory_order_relaxed);
+        CHITCPD_STATS_ADD(stats, rtt_samples, 1);
+    }
+}
@@ -0,0 +1,181 @@
+/*
+ *  chiTCP - A simple, testable TCP stack
+ *
+ *  Per-socket performance counters
+ *
+ *  The counters are updated by the threads that handle a socket (its TCP
+ *  thread, the threads that deliver packets to it, and the handler threads
+ *  of the application using it) with relaxed atomic operations, so they can
+ *  be read at any time (e.g., by the GET_SOCKET_STATS handler) without
+ *  taking any locks. The counters are independent of the TCP implementation
+ *  in tcp.c: retransmissions, duplicate ACKs, etc. are detected by looking
+ *  at the segments that are sent and received.
+ *
+ */
+
+
+/*
+ *  Copyright (c) 2013-2014, The University of Chicago
+ *  All rights reserved.
+ *
+ *  Redistribution and use in source and binary forms, with or without
+ *  modification, are permitted provided that the following conditions are met:
+ *
+ *  - Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ *
+ *  - Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ *  - Neither the name of The University of Chicago nor the names of its
+ *    contributors may be used to endorse or promote products derived from this
+ *    software without specific prior written permission.
+ *
+ *  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ *  AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ *  IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ *  ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ *  LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ *  CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ *  SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ *  INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ *  CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ *  ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ *  POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+#ifndef STATS_H_
+#define STATS_H_
+
+#include <stdint.h>
+#include <stdatomic.h>
+#include <time.h>
+#include "tcp.h"
+#include "chitcp/packet.h"
+#include "chitcp/types.h"
+
+/* Counters of a socket */
+typedef struct chitcpd_socket_stats
+{
+    /* Segments, and bytes of payload, sent and received */
+    atomic_uint_least64_t segs_sent;
+    atomic_uint_least64_t segs_rcvd;
+    atomic_uint_least64_t bytes_sent;
+    atomic_uint_least64_t bytes_rcvd;
+
+    /* Segments that contained sequence numbers that had already been sent */
+    atomic_uint_least64_t retransmits;
+
+    /* ACKs that did not acknowledge anything new while there was data in
+     * flight (and did not carry data or update the window, see RFC 5681) */
+    atomic_uint_least64_t dup_acks;
+
+    /* Segments with data sent while the peer's window was zero */
+    atomic_uint_least64_t zero_window_probes;
+
+    /* Segments that arrived ahead of RCV.NXT */
+    atomic_uint_least64_t out_of_order;
+
+    /* Time spent by send() and recv() waiting on the socket's buffers
+     * (in nanoseconds) */
+    atomic_uint_least64_t send_blocked_ns;
+    atomic_uint_least64_t recv_blocked_ns;
+
+    /* Round-trip time (in nanoseconds), measured by timing one
+     * segment at a time, and ignoring retransmitted segments
+     * (Karn's algorithm). SRTT is smoothed as in RFC 6298. */
+    atomic_uint_least64_t rtt_samples;
+    atomic_uint_least64_t rtt_last_ns;
+    atomic_uint_least64_t rtt_min_ns;
+    atomic_uint_least64_t srtt_ns;
+
+    /* The following fields are only accessed by the socket's TCP thread */
+    bool_t snd_max_valid;
+    uint32_t snd_max;       /* Highest sequence number sent (plus one) */
+    bool_t rtt_timing;
+    uint32_t rtt_seq;       /* ACK that will end the RTT measurement */
+    uint64_t rtt_start;
+    uint16_t last_wnd;      /* Last window advertised by the peer */
+} chitcpd_socket_stats_t;
+
+/* Adds n to a counter */
+#define CHITCPD_STATS_ADD(stats, counter, n) \
+    atomic_fetch_add_explicit(&(stats)->counter, (n), memory_order_relaxed)
+
+/* Reads a counter */
+#define CHITCPD_STATS_GET(stats, counter) \
+    atomic_load_explicit(&(stats)->counter, memory_order_relaxed)
+
+
+/*
+ * chitcpd_stats_clock - Returns the time used to measure blocked time, RTTs,
+ *                       and latencies (see metrics.h)
+ *
+ * CLOCK_MONOTONIC_RAW is not slewed by NTP (so short intervals are not
+ * stretched or shrunk), and is read without a system call on Linux.
+ *
+ * Returns: A monotonic time, in nanoseconds
+ */
+static inline uint64_t chitcpd_stats_clock(void)
+{
+    struct timespec ts;
+
+#ifdef CLOCK_MONOTONIC_RAW
+    clock_gettime(CLOCK_MONOTONIC_RAW, &ts);
+#else
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+#endif
+
+    return (uint64_t) ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+
+/*
+ * chitcpd_stats_reset - Resets a socket's counters
+ *
+ * stats: Counters
+ *
+ * Returns: nothing
+ */
+void chitcpd_stats_reset(chitcpd_socket_stats_t *stats);
+
+
+/*
+ * chitcpd_stats_segment_sent - Updates a socket's counters with a segment it sent
+ *
+ * Must be called from the socket's TCP thread.
+ *
+ * stats: Counters
+ *
+ * tcp_data: The socket's TCP data
+ *
+ * packet: Segment
+ *
+ * Returns: nothing
+ */
+void chitcpd_stats_segment_sent(chitcpd_socket_stats_t *stats, tcp_data_t *tcp_data, tcp_packet_t *packet);
+
+
+/*
+ * chitcpd_stats_segment_arrived - Updates a socket's counters with a segment
+ *                                 that is about to be processed
+ *
+ * Must be called from the socket's TCP thread, before the segment updates
+ * the socket's TCP data. (Segments are counted as received when they are
+ * delivered to the socket, not here).
+ *
+ * stats: Counters
+ *
+ * tcp_data: The socket's TCP data
+ *
+ * state: The socket's TCP state
+ *
+ * packet: Segment
+ *
+ * Returns: nothing
+ */
+void chitcpd_stats_segment_arrived(chitcpd_socket_stats_t *stats, tcp_data_t *tcp_data, tcp_state_t state, tcp_packet_t *packet);
+
+#endif /* STATS_H_ */
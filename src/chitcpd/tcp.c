@@ -383,6 +383,9 @@ int chitcpd_tcp_handle_packet(serverinfo_t *si, chisocketentry_t *entry)
     }
 
     chilog(DEBUG, "Processing TCP packet");
+
+    /* Update the socket's counters before the packet changes the TCP data */
+    chitcpd_stats_segment_arrived(&entry->stats, tcp_data, entry->tcp_state, packet);
     chilog_tcp(DEBUG, packet, LOG_INBOUND);
 
     /* Implement section 3.10.7 of RFC 9293 below */
@@ -118,7 +118,11 @@ static inline char *tcp_event_str (tcp_event_type_t evt)
 
 /* TCP data. Roughly corresponds to the variables and buffers
  * one would expect in a Transmission Control Block (as
- * specified in RFC 9293). */
+ * specified in RFC 9293).
+ *
+ * If you keep the packets you send with chitcpd_send_tcp_packet
+ * (e.g., to retransmit them), don't modify them without calling
+ * chitcp_tcp_packet_unshare first (see chitcp_tcp_packet_clone). */
 typedef struct tcp_data
 {
     /* Queue with pending packets received from the network */
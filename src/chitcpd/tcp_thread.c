@@ -65,6 +65,8 @@
 #include "chitcp/chitcpd.h"
 #include "chitcp/utils.h"
 #include "breakpoint.h"
+#include "trace.h"
+#include "readiness.h"
 
 /* Dispatch table */
 
@@ -147,15 +149,23 @@ void chitcpd_dispatch_tcp(serverinfo_t *si, chisocketentry_t *entry, tcp_event_t
     int rc;
     tcp_state_t state = entry->tcp_state;
     active_chisocket_state_t *socket_state = &entry->socket_state.active;
+    uint64_t start;
 
     chilog(DEBUG, ">>> Handling event %s on state %s", tcp_event_str(event), tcp_str(state));
     chilog(DEBUG, ">>> TCP data BEFORE handling:");
-    chilog_tcp_data(DEBUG, &socket_state->tcp_data, state);
+    if(CHILOG_ENABLED(DEBUG))
+        chilog_tcp_data(DEBUG, &socket_state->tcp_data, state);
 
+    start = chitcpd_stats_clock();
     rc = tcp_state_handlers[state](si, entry, event);
+    if(event < CHITCPD_METRICS_TCP_EVENTS)
+        chitcpd_histogram_add(&si->metrics.tcp_event[event], chitcpd_stats_clock() - start);
+
+    chitcpd_trace_add(entry, TRACE_TCP_EVENT, event, state, NULL);
 
     chilog(DEBUG, "<<< TCP data AFTER handling:");
-    chilog_tcp_data(DEBUG, &socket_state->tcp_data, entry->tcp_state);
+    if(CHILOG_ENABLED(DEBUG))
+        chilog_tcp_data(DEBUG, &socket_state->tcp_data, entry->tcp_state);
     if(state != entry->tcp_state)
     {
         chilog(DEBUG, "<<< Finished handling event %s on state %s", tcp_event_str(event), tcp_str(state));
@@ -228,9 +238,19 @@ void* chitcpd_tcp_thread_func(void *args)
     tcp_data_t *tcp_data = &socket_state->tcp_data;
     int done = FALSE;
 
-    /* Initialize buffers */
-    circular_buffer_init(&tcp_data->send, TCP_BUFFER_SIZE);
-    circular_buffer_init(&tcp_data->recv, TCP_BUFFER_SIZE);
+    /* Initialize buffers. In shared-memory mode, they are placed in the
+     * region mapped by the client (if that fails, the client will simply
+     * keep sending its data in SEND and RECV requests) */
+    if (entry->shm.header == NULL ||
+        chitcp_shm_init_buffers(&entry->shm, &tcp_data->send, &tcp_data->recv) != CHITCP_OK)
+    {
+        circular_buffer_init(&tcp_data->send, TCP_BUFFER_SIZE);
+        circular_buffer_init(&tcp_data->recv, TCP_BUFFER_SIZE);
+    }
+
+    /* Changes in the buffers can make the socket readable or writable */
+    circular_buffer_set_notify(&tcp_data->send, chitcpd_poll_buffer_notify, entry);
+    circular_buffer_set_notify(&tcp_data->recv, chitcpd_poll_buffer_notify, entry);
 
     chilog(DEBUG, "TCP thread running");
 
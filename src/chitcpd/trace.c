@@ -0,0 +1,391 @@
+/*
+ *  chiTCP - A simple, testable TCP stack
+ *
+ *  Binary trace of the segments and TCB transitions of each socket
+ *
+ *  see trace.h for descriptions of functions, parameters, and return values.
+ *
+ */
+
+
+/*
+ *  Copyright (c) 2013-2014, The University of Chicago
+ *  All rights reserved.
+ *
+ *  Redistribution and use in source and binary forms, with or without
+ *  modification, are permitted provided that the following conditions are met:
+ *
+ *  - Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ *
+ *  - Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ *  - Neither the name of The University of Chicago nor the names of its
+ *    contributors may be used to endorse or promote products derived from this
+ *    software without specific prior written permission.
+ *
+ *  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ *  AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ *  IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ *  ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ *  LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ *  CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ *  SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ *  INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ *  CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ *  ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ *  POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <arpa/inet.h>
+
+#include "trace.h"
+#include "chitcp/log.h"
+#include "chitcp/types.h"
+
+
+/* See trace.h */
+void chitcpd_trace_add(chisocketentry_t *entry, chitcpd_trace_type_t type, tcp_event_type_t event, tcp_state_t state, tcp_packet_t *packet)
+{
+    chitcpd_trace_t *trace = entry->trace;
+    chitcpd_trace_record_t *rec;
+    struct timespec ts;
+    uint64_t n;
+
+    if(trace == NULL)
+        return;
+
+    n = atomic_fetch_add_explicit(&trace->next, 1, memory_order_relaxed);
+
+    /* Mark the slot as being written */
+    atomic_store_explicit(&trace->slots[n % CHITCPD_TRACE_RECORDS].stamp, 0, memory_order_relaxed);
+    atomic_thread_fence(memory_order_release);
+
+    rec = &trace->slots[n % CHITCPD_TRACE_RECORDS].record;
+    memset(rec, 0, sizeof(chitcpd_trace_record_t));
+
+    clock_gettime(CLOCK_REALTIME, &ts);
+    rec->timestamp = (uint64_t) ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+    rec->number = (uint32_t) n;
+    rec->type = type;
+    rec->event = event;
+    rec->state = state;
+    rec->new_state = entry->tcp_state;
+
+    if(entry->actpas_type == SOCKET_ACTIVE)
+    {
+        tcp_data_t *tcp_data = &entry->socket_state.active.tcp_data;
+
+        rec->ISS = tcp_data->ISS;
+        rec->IRS = tcp_data->IRS;
+        rec->SND_UNA = tcp_data->SND_UNA;
+        rec->SND_NXT = tcp_data->SND_NXT;
+        rec->RCV_NXT = tcp_data->RCV_NXT;
+        rec->SND_WND = tcp_data->SND_WND;
+        rec->RCV_WND = tcp_data->RCV_WND;
+
+        /* The buffers are initialized by the TCP thread, so segments can
+         * arrive for an active socket before they exist */
+        if(tcp_data->send.state != NULL && tcp_data->recv.state != NULL)
+        {
+            rec->snd_buf_count = circular_buffer_count(&tcp_data->send);
+            rec->snd_buf_capacity = circular_buffer_capacity(&tcp_data->send);
+            rec->rcv_buf_count = circular_buffer_count(&tcp_data->recv);
+            rec->rcv_buf_capacity = circular_buffer_capacity(&tcp_data->recv);
+        }
+        rec->closing = tcp_data->closing;
+
+        /* Only the TCP thread removes pending packets, so it is the only
+         * one that can safely walk the list */
+        if(type == TRACE_TCP_EVENT)
+        {
+            pthread_mutex_lock(&tcp_data->lock_pending_packets);
+            rec->pending_packets = chitcp_packet_list_size(tcp_data->pending_packets);
+            pthread_mutex_unlock(&tcp_data->lock_pending_packets);
+        }
+    }
+
+    if(packet != NULL)
+    {
+        tcphdr_t *header = TCP_PACKET_HEADER(packet);
+
+        rec->seg_seq = SEG_SEQ(packet);
+        rec->seg_ack = SEG_ACK(packet);
+        rec->seg_wnd = SEG_WND(packet);
+        rec->seg_len = TCP_PAYLOAD_LEN(packet);
+        rec->seg_flags = (header->fin ? TRACE_FLAG_FIN : 0) |
+                         (header->syn ? TRACE_FLAG_SYN : 0) |
+                         (header->rst ? TRACE_FLAG_RST : 0) |
+                         (header->psh ? TRACE_FLAG_PSH : 0) |
+                         (header->ack ? TRACE_FLAG_ACK : 0) |
+                         (header->urg ? TRACE_FLAG_URG : 0) |
+                         (header->ece ? TRACE_FLAG_ECE : 0) |
+                         (header->cwr ? TRACE_FLAG_CWR : 0);
+    }
+
+    atomic_store_explicit(&trace->slots[n % CHITCPD_TRACE_RECORDS].stamp, n + 1, memory_order_release);
+}
+
+
+/* See trace.h */
+void chitcpd_trace_reset(chitcpd_trace_t *trace)
+{
+    atomic_store_explicit(&trace->first, atomic_load_explicit(&trace->next, memory_order_relaxed), memory_order_release);
+}
+
+
+/* See trace.h */
+uint8_t *chitcpd_trace_dump(chitcpd_trace_t *trace, int sockfd, size_t *len)
+{
+    chitcpd_trace_header_t *header;
+    chitcpd_trace_record_t *records;
+    uint64_t total, first, reset, stamp;
+    uint32_t nrecords = 0;
+    uint8_t *dump;
+
+    dump = calloc(1, sizeof(chitcpd_trace_header_t) + CHITCPD_TRACE_RECORDS * sizeof(chitcpd_trace_record_t));
+    if(dump == NULL)
+        return NULL;
+
+    header = (chitcpd_trace_header_t *) dump;
+    records = (chitcpd_trace_record_t *) (dump + sizeof(chitcpd_trace_header_t));
+
+    reset = atomic_load_explicit(&trace->first, memory_order_acquire);
+    total = atomic_load_explicit(&trace->next, memory_order_acquire);
+    first = total > CHITCPD_TRACE_RECORDS ? total - CHITCPD_TRACE_RECORDS : 0;
+    if(first < reset)
+        first = reset;
+
+    for(uint64_t n = first; n < total; n++)
+    {
+        int slot = n % CHITCPD_TRACE_RECORDS;
+
+        /* Skip records that are still being written, or that have
+         * been overwritten while we were copying them */
+        stamp = atomic_load_explicit(&trace->slots[slot].stamp, memory_order_acquire);
+        if(stamp != n + 1)
+            continue;
+        memcpy(&records[nrecords], &trace->slots[slot].record, sizeof(chitcpd_trace_record_t));
+        atomic_thread_fence(memory_order_acquire);
+        if(atomic_load_explicit(&trace->slots[slot].stamp, memory_order_relaxed) != stamp)
+            continue;
+
+        nrecords++;
+    }
+
+    memcpy(header->magic, CHITCPD_TRACE_MAGIC, sizeof(header->magic));
+    header->version = CHITCPD_TRACE_VERSION;
+    header->record_size = sizeof(chitcpd_trace_record_t);
+    header->sockfd = sockfd;
+    header->nrecords = nrecords;
+    header->total = total - reset;
+
+    *len = sizeof(chitcpd_trace_header_t) + nrecords * sizeof(chitcpd_trace_record_t);
+
+    return dump;
+}
+
+
+/* See trace.h */
+int chitcpd_trace_dump_all(serverinfo_t *si, const char *filename)
+{
+    FILE *f;
+    uint8_t **dumps;
+    size_t *lens;
+    int ndumps = 0, ret = CHITCP_OK;
+
+    dumps = calloc(si->chisocket_table_size, sizeof(uint8_t *));
+    lens = calloc(si->chisocket_table_size, sizeof(size_t));
+    if(dumps == NULL || lens == NULL)
+    {
+        free(dumps);
+        free(lens);
+        return CHITCP_ENOMEM;
+    }
+
+    /* Take a snapshot of the traces, so we don't hold up the allocation
+     * of sockets while we write to the file */
+    pthread_mutex_lock(&si->lock_chisocket_table);
+    for(int i = 0; i < si->chisocket_table_size; i++)
+    {
+        chisocketentry_t *entry = &si->chisocket_table[i];
+
+        if(entry->available || entry->trace == NULL)
+            continue;
+
+        dumps[ndumps] = chitcpd_trace_dump(entry->trace, i, &lens[ndumps]);
+        if(dumps[ndumps] != NULL)
+            ndumps++;
+    }
+    pthread_mutex_unlock(&si->lock_chisocket_table);
+
+    f = fopen(filename, "wb");
+    if(f == NULL)
+    {
+        perror("Could not open trace file for writing");
+        ret = CHITCP_EINIT;
+    }
+    else
+    {
+        for(int i = 0; i < ndumps && ret == CHITCP_OK; i++)
+            if(fwrite(dumps[i], 1, lens[i], f) != lens[i])
+                ret = CHITCP_EINIT;
+
+        if(fclose(f) != 0)
+            ret = CHITCP_EINIT;
+
+        if(ret != CHITCP_OK)
+            perror("Could not write to trace file");
+    }
+
+    for(int i = 0; i < ndumps; i++)
+        free(dumps[i]);
+    free(dumps);
+    free(lens);
+
+    if(ret == CHITCP_OK)
+        chilog(INFO, "Wrote the traces of %i sockets to %s", ndumps, filename);
+
+    return ret;
+}
+
+
+static const char *trace_state_str(uint8_t state)
+{
+    if(!IS_VALID_TCP_STATE(state))
+        return "UNKNOWN";
+    return tcp_str(state);
+}
+
+
+static const char *trace_event_str(uint8_t event)
+{
+    if(event < APPLICATION_CONNECT || event > CLEANUP)
+        return "UNKNOWN";
+    return tcp_event_str(event);
+}
+
+
+static void trace_print_timestamp(FILE *f, uint64_t timestamp)
+{
+    time_t sec = timestamp / 1000000000ULL;
+    struct tm tm;
+    char buf[16];
+
+    if(localtime_r(&sec, &tm) == NULL || strftime(buf, sizeof(buf), "%H:%M:%S", &tm) == 0)
+        strcpy(buf, "??:??:??");
+    fprintf(f, "[%s.%09u] ", buf, (unsigned int) (timestamp % 1000000000ULL));
+}
+
+
+/* Same format as chilog_tcp_data */
+static void trace_print_tcp_data(FILE *f, const chitcpd_trace_record_t *rec)
+{
+    fprintf(f, "   ······················································\n");
+    fprintf(f, "                         %s\n", trace_state_str(rec->new_state));
+    fprintf(f, "\n");
+    fprintf(f, "            ISS:  %10u           IRS:  %10u\n", rec->ISS, rec->IRS);
+    fprintf(f, "        SND.UNA:  %10u \n", rec->SND_UNA);
+    fprintf(f, "        SND.NXT:  %10u       RCV.NXT:  %10u \n", rec->SND_NXT, rec->RCV_NXT);
+    fprintf(f, "        SND.WND:  %10u       RCV.WND:  %10u \n", rec->SND_WND, rec->RCV_WND);
+    fprintf(f, "    Send Buffer: %4u / %4u   Recv Buffer: %4u / %4u\n", rec->snd_buf_count, rec->snd_buf_capacity, rec->rcv_buf_count, rec->rcv_buf_capacity);
+    fprintf(f, "\n");
+    fprintf(f, "       Pending packets: %4u    Closing? %s\n", rec->pending_packets, rec->closing?"YES":"NO");
+    fprintf(f, "   ······················································\n");
+}
+
+
+/* Same format as chilog_tcp_minimal (without the addresses) */
+static void trace_print_segment(FILE *f, int sockfd, const char *prefix, const chitcpd_trace_record_t *rec)
+{
+    char flags[9];
+
+    snprintf(flags, sizeof(flags), "%s%s%s%s%s%s%s%s",
+            rec->seg_flags & TRACE_FLAG_CWR ? "W":"",
+            rec->seg_flags & TRACE_FLAG_ECE ? "E":"",
+            rec->seg_flags & TRACE_FLAG_URG ? "U":"",
+            rec->seg_flags & TRACE_FLAG_PSH ? "P":"",
+            rec->seg_flags & TRACE_FLAG_RST ? "R":"",
+            rec->seg_flags & TRACE_FLAG_SYN ? "S":"",
+            rec->seg_flags & TRACE_FLAG_FIN ? "F":"",
+            rec->seg_flags & TRACE_FLAG_ACK ? ".":"");
+    if(flags[0] == '\0')
+        strcpy(flags, "none");
+
+    fprintf(f, "[S%i] %s: Flags [%s],", sockfd, prefix, flags);
+    if(rec->seg_len)
+        fprintf(f, " seq %u:%u,", rec->seg_seq, rec->seg_seq + rec->seg_len);
+    else
+        fprintf(f, " seq %u,", rec->seg_seq);
+    if(rec->seg_flags & TRACE_FLAG_ACK)
+        fprintf(f, " ack %u,", rec->seg_ack);
+    fprintf(f, " win %u, length %u\n", rec->seg_wnd, rec->seg_len);
+}
+
+
+/* See trace.h */
+int chitcpd_trace_print(FILE *f, const uint8_t *dump, size_t len)
+{
+    chitcpd_trace_header_t header;
+    chitcpd_trace_record_t rec;
+
+    while(len > 0)
+    {
+        if(len < sizeof(header))
+            return CHITCP_EINVAL;
+        memcpy(&header, dump, sizeof(header));
+        if(memcmp(header.magic, CHITCPD_TRACE_MAGIC, sizeof(header.magic)) ||
+           header.version != CHITCPD_TRACE_VERSION ||
+           header.record_size != sizeof(chitcpd_trace_record_t))
+            return CHITCP_EINVAL;
+        dump += sizeof(header);
+        len -= sizeof(header);
+
+        if(len < (size_t) header.nrecords * sizeof(rec))
+            return CHITCP_EINVAL;
+
+        fprintf(f, "Socket S%i: %u records", header.sockfd, header.nrecords);
+        if(header.total > header.nrecords)
+            fprintf(f, " (%llu older records were overwritten or skipped)", (unsigned long long) (header.total - header.nrecords));
+        fprintf(f, "\n");
+
+        for(uint32_t i = 0; i < header.nrecords; i++)
+        {
+            memcpy(&rec, dump, sizeof(rec));
+            dump += sizeof(rec);
+            len -= sizeof(rec);
+
+            trace_print_timestamp(f, rec.timestamp);
+            switch(rec.type)
+            {
+            case TRACE_TCP_EVENT:
+                fprintf(f, "[S%i] Handled event %s on state %s\n", header.sockfd, trace_event_str(rec.event), trace_state_str(rec.state));
+                trace_print_tcp_data(f, &rec);
+                break;
+            case TRACE_STATE:
+                fprintf(f, "[S%i] %s -> %s\n", header.sockfd, trace_state_str(rec.state), trace_state_str(rec.new_state));
+                break;
+            case TRACE_SEG_SENT:
+                trace_print_segment(f, header.sockfd, MINLOG_SEND, &rec);
+                break;
+            case TRACE_SEG_RCVD:
+                trace_print_segment(f, header.sockfd, MINLOG_RCVD, &rec);
+                break;
+            case TRACE_SEG_DROPPED:
+                trace_print_segment(f, header.sockfd, "DROP", &rec);
+                break;
+            default:
+                fprintf(f, "[S%i] Unknown record type %u\n", header.sockfd, rec.type);
+                break;
+            }
+        }
+    }
+
+    return CHITCP_OK;
+}
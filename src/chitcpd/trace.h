@@ -0,0 +1,233 @@
+/*
+ *  chiTCP - A simple, testable TCP stack
+ *
+ *  Binary trace of the segments and TCB transitions of each socket
+ *
+ */
+
+
+/*
+ *  Copyright (c) 2013-2014, The University of Chicago
+ *  All rights reserved.
+ *
+ *  Redistribution and use in source and binary forms, with or without
+ *  modification, are permitted provided that the following conditions are met:
+ *
+ *  - Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ *
+ *  - Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ *  - Neither the name of The University of Chicago nor the names of its
+ *    contributors may be used to endorse or promote products derived from this
+ *    software without specific prior written permission.
+ *
+ *  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ *  AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ *  IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ *  ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ *  LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ *  CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ *  SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ *  INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ *  CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ *  ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ *  POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+#ifndef TRACE_H_
+#define TRACE_H_
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdatomic.h>
+#include "serverinfo.h"
+#include "tcp.h"
+
+/* Number of records kept for each socket (must be a power of two) */
+#define CHITCPD_TRACE_RECORDS (256)
+
+/* Types of trace records */
+typedef enum
+{
+    TRACE_TCP_EVENT   = 1,  /* An event was handled by the TCP thread */
+    TRACE_STATE       = 2,  /* The socket's TCP state changed */
+    TRACE_SEG_SENT    = 3,  /* A segment was sent */
+    TRACE_SEG_RCVD    = 4,  /* A segment was received */
+    TRACE_SEG_DROPPED = 5,  /* A segment was dropped by a debug monitor */
+} chitcpd_trace_type_t;
+
+/* A trace record. Records are always 64 bytes, and are dumped as-is
+ * (in the daemon's byte order) */
+typedef struct chitcpd_trace_record
+{
+    uint64_t timestamp;     /* Nanoseconds since the Epoch */
+
+    uint32_t number;        /* Position of the record in the socket's trace */
+
+    /* Transmission control block */
+    uint32_t ISS;
+    uint32_t IRS;
+    uint32_t SND_UNA;
+    uint32_t SND_NXT;
+    uint32_t RCV_NXT;
+
+    /* Segment (for TRACE_SEG_* records) */
+    uint32_t seg_seq;
+    uint32_t seg_ack;
+    uint16_t seg_wnd;
+    uint16_t seg_len;
+
+    uint16_t SND_WND;
+    uint16_t RCV_WND;
+    uint16_t snd_buf_count;
+    uint16_t snd_buf_capacity;
+    uint16_t rcv_buf_count;
+    uint16_t rcv_buf_capacity;
+    uint16_t pending_packets;
+
+    uint8_t type;           /* chitcpd_trace_type_t */
+    uint8_t event;          /* tcp_event_type_t, for TRACE_TCP_EVENT */
+    uint8_t state;          /* TCP state (before the event or transition) */
+    uint8_t new_state;      /* TCP state (after the event or transition) */
+    uint8_t seg_flags;      /* CWR, ECE, URG, ACK, PSH, RST, SYN, FIN */
+    uint8_t closing;
+} chitcpd_trace_record_t;
+
+_Static_assert(sizeof(chitcpd_trace_record_t) == 64, "trace records must be 64 bytes");
+
+/* Segment flags in chitcpd_trace_record_t.seg_flags */
+#define TRACE_FLAG_FIN (1 << 0)
+#define TRACE_FLAG_SYN (1 << 1)
+#define TRACE_FLAG_RST (1 << 2)
+#define TRACE_FLAG_PSH (1 << 3)
+#define TRACE_FLAG_ACK (1 << 4)
+#define TRACE_FLAG_URG (1 << 5)
+#define TRACE_FLAG_ECE (1 << 6)
+#define TRACE_FLAG_CWR (1 << 7)
+
+/* A socket's trace. Any thread can add records to it without taking a
+ * lock: each writer claims a slot by incrementing "next", and marks the
+ * slot with the record's position once the record has been written, so
+ * readers can skip records that are being (over)written. Records before
+ * "first" belong to a previous socket (see chitcpd_trace_reset) */
+typedef struct chitcpd_trace
+{
+    _Atomic uint64_t next;
+    _Atomic uint64_t first;
+    struct
+    {
+        _Atomic uint64_t stamp;
+        chitcpd_trace_record_t record;
+    } slots[CHITCPD_TRACE_RECORDS];
+} chitcpd_trace_t;
+
+/* Header of a trace dump. A dump file may contain several dumps (one
+ * for each socket), one after the other. */
+#define CHITCPD_TRACE_MAGIC "CHITRACE"
+#define CHITCPD_TRACE_VERSION (1)
+
+typedef struct chitcpd_trace_header
+{
+    char magic[8];
+    uint16_t version;
+    uint16_t record_size;
+    int32_t sockfd;
+    uint32_t nrecords;      /* Number of records in this dump */
+    uint32_t reserved;
+    uint64_t total;         /* Number of records added to the trace
+                             * since it was last reset */
+} chitcpd_trace_header_t;
+
+
+/*
+ * chitcpd_trace_add - Adds a record to a socket's trace
+ *
+ * The record is filled in with the socket's current TCB (if the socket
+ * is active), and with the header of the packet (if any).
+ *
+ * entry: Socket entry
+ *
+ * type: Type of record
+ *
+ * event: TCP event (only for TRACE_TCP_EVENT)
+ *
+ * state: TCP state before the event or transition. The state after the
+ *        event or transition is taken from the socket entry.
+ *
+ * packet: Segment (only for TRACE_SEG_* records; NULL otherwise)
+ *
+ * Returns: nothing
+ */
+void chitcpd_trace_add(chisocketentry_t *entry, chitcpd_trace_type_t type, tcp_event_type_t event, tcp_state_t state, tcp_packet_t *packet);
+
+
+/*
+ * chitcpd_trace_reset - Discards the records in a trace
+ *
+ * Used when a trace is reused for a new socket. Records that are still
+ * being added for the previous socket may end up in the trace, but
+ * the trace itself remains valid.
+ *
+ * trace: Trace
+ *
+ * Returns: nothing
+ */
+void chitcpd_trace_reset(chitcpd_trace_t *trace);
+
+
+/*
+ * chitcpd_trace_dump - Creates a dump of a socket's trace
+ *
+ * trace: Trace
+ *
+ * sockfd: Socket number (stored in the dump's header)
+ *
+ * len: Set to the size of the dump, in bytes
+ *
+ * Returns: A buffer with the dump (a header followed by the records, oldest
+ *          first), which must be freed by the caller, or NULL if it could not
+ *          be allocated.
+ */
+uint8_t *chitcpd_trace_dump(chitcpd_trace_t *trace, int sockfd, size_t *len);
+
+
+/*
+ * chitcpd_trace_dump_all - Writes the traces of all the sockets to a file
+ *
+ * si: Server info
+ *
+ * filename: Name of the file
+ *
+ * Returns:
+ *  - CHITCP_OK: The traces were written to the file
+ *  - CHITCP_ENOMEM: Could not allocate memory for the dumps
+ *  - CHITCP_EINIT: Could not open or write to the file
+ */
+int chitcpd_trace_dump_all(serverinfo_t *si, const char *filename);
+
+
+/*
+ * chitcpd_trace_print - Prints the records in a trace dump
+ *
+ * Events are printed in the same format as chilog_tcp_data, and
+ * segments in the same format as chilog_tcp_minimal.
+ *
+ * f: File to print to
+ *
+ * dump: Trace dump (as returned by chitcpd_trace_dump)
+ *
+ * len: Size of the dump (the dump may contain several dumps, one after
+ *      the other)
+ *
+ * Returns:
+ *  - CHITCP_OK: The dump was printed
+ *  - CHITCP_EINVAL: The dump is malformed or truncated
+ */
+int chitcpd_trace_print(FILE *f, const uint8_t *dump, size_t len);
+
+
+#endif /* TRACE_H_ */
@@ -0,0 +1,140 @@
+/*
+ *  chiTCP - A simple, testable TCP stack
+ *
+ *  chitcpd-trace: Prints the binary traces dumped by chitcpd
+ *
+ *  The traces can be read from files (written by chitcpd when it
+ *  receives SIGUSR1) or obtained from a running chitcpd.
+ *
+ */
+
+
+/*
+ *  Copyright (c) 2013-2014, The University of Chicago
+ *  All rights reserved.
+ *
+ *  Redistribution and use in source and binary forms, with or without
+ *  modification, are permitted provided that the following conditions are met:
+ *
+ *  - Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ *
+ *  - Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ *  - Neither the name of The University of Chicago nor the names of its
+ *    contributors may be used to endorse or promote products derived from this
+ *    software without specific prior written permission.
+ *
+ *  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ *  AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ *  IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ *  ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ *  LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ *  CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ *  SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ *  INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ *  CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ *  ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ *  POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <errno.h>
+#include <string.h>
+
+#include "chitcp/debug_api.h"
+#include "chitcp/types.h"
+#include "trace.h"
+
+
+static int print_file(const char *filename)
+{
+    FILE *f;
+    uint8_t *dump = NULL, *newdump;
+    size_t len = 0, size = 0, n;
+    int rc;
+
+    if ((f = fopen(filename, "rb")) == NULL)
+    {
+        perror(filename);
+        return CHITCP_ENOENT;
+    }
+
+    do
+    {
+        if (len == size)
+        {
+            size = size ? size * 2 : 65536;
+            if ((newdump = realloc(dump, size)) == NULL)
+            {
+                free(dump);
+                fclose(f);
+                return CHITCP_ENOMEM;
+            }
+            dump = newdump;
+        }
+        n = fread(dump + len, 1, size - len, f);
+        len += n;
+    }
+    while (n > 0);
+
+    fclose(f);
+
+    if ((rc = chitcpd_trace_print(stdout, dump, len)) != CHITCP_OK)
+        fprintf(stderr, "%s: Not a chitcpd trace, or truncated trace\n", filename);
+
+    free(dump);
+    return rc;
+}
+
+
+int main(int argc, char *argv[])
+{
+    int opt, sockfd = -1, rc = CHITCP_OK;
+
+    while ((opt = getopt(argc, argv, "s:h")) != -1)
+        switch (opt)
+        {
+        case 's':
+            sockfd = atoi(optarg);
+            break;
+        case 'h':
+            printf("Usage: chitcpd-trace (-s SOCKET | FILE...)\n");
+            exit(0);
+        default:
+            printf("ERROR: Unknown option -%c\n", opt);
+            exit(-1);
+        }
+
+    if (sockfd >= 0)
+    {
+        size_t len;
+        uint8_t *dump = chitcpd_get_socket_trace(sockfd, &len);
+
+        if (dump == NULL)
+        {
+            perror("Could not get the socket's trace from chitcpd");
+            exit(-1);
+        }
+        rc = chitcpd_trace_print(stdout, dump, len);
+        free(dump);
+    }
+    else if (optind == argc)
+    {
+        printf("Usage: chitcpd-trace (-s SOCKET | FILE...)\n");
+        exit(-1);
+    }
+    else
+    {
+        for (int i = optind; i < argc; i++)
+            if (print_file(argv[i]) != CHITCP_OK)
+                rc = -1;
+    }
+
+    return rc == CHITCP_OK ? 0 : -1;
+}
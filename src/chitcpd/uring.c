@@ -0,0 +1,709 @@
+/*
+ *  chiTCP - A simple, testable TCP stack
+ *
+ *  io_uring backend for the network layer.
+ *
+ *  When chitcpd is built with liburing and run with -i, the connections
+ *  to other chiTCP daemons do not get their own connection thread.
+ *  Instead, a single thread receives from all of them using multishot
+ *  receive requests, which place the received bytes in buffers taken
+ *  from a ring of buffers registered with the kernel. Once armed, a
+ *  multishot receive keeps producing completions without any further
+ *  system calls, so receiving costs (at most) one io_uring_enter()
+ *  per batch of completions, instead of one recv() per read.
+ *
+ *  On the sending side, each connection's writer thread has its own
+ *  io_uring instance, and submits all the frames it takes from the
+ *  transmit queue as a chain of linked sendmsg requests.
+ *
+ *  If io_uring cannot be set up at run time (e.g., on an older kernel),
+ *  chitcpd falls back to the regular sockets code.
+ *
+ */
+
+
+/*
+ *  Copyright (c) 2013-2014, The University of Chicago
+ *  All rights reserved.
+ *
+ *  Redistribution and use in source and binary forms, with or without
+ *  modification, are permitted provided that the following conditions are met:
+ *
+ *  - Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ *
+ *  - Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ *  - Neither the name of The University of Chicago nor the names of its
+ *    contributors may be used to endorse or promote products derived from this
+ *    software without specific prior written permission.
+ *
+ *  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ *  AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ *  IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ *  ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ *  LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ *  CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ *  SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ *  INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ *  CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ *  ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ *  POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+#ifdef CHITCPD_HAVE_LIBURING
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <limits.h>
+#include <errno.h>
+#include <sys/eventfd.h>
+#include "uring.h"
+#include "connection.h"
+#include "framing.h"
+#include "chitcp/log.h"
+#include "chitcp/utils.h"
+#include "chitcp/utlist.h"
+
+/* Per-connection state kept by the receive thread */
+typedef struct uring_rx_conn
+{
+    tcpconnentry_t *connection;
+    frame_reader_t reader;
+
+    /* Addresses of the real TCP connection */
+    struct sockaddr_storage local_addr;
+    struct sockaddr_storage peer_addr;
+
+    struct uring_rx_conn *prev;
+    struct uring_rx_conn *next;
+} uring_rx_conn_t;
+
+/* State of the io_uring receive thread */
+struct uring_rx
+{
+    struct io_uring ring;
+    struct io_uring_buf_ring *buf_ring;
+    uint8_t *bufs;
+    pthread_t thread;
+
+    /* Written to when there are new connections, or
+     * when the thread has to exit */
+    int wakeup_fd;
+    uint64_t wakeup_val;
+
+    /* Connections that are being received from, and connections
+     * that have been added but not handed to io_uring yet */
+    uring_rx_conn_t *conns;
+    uring_rx_conn_t *pending;
+    pthread_mutex_t lock_pending;
+};
+
+
+/*
+ * chitcpd_uring_get_sqe - Get a submission queue entry
+ *
+ * If the submission queue is full, the queued requests are
+ * submitted to make room.
+ *
+ * rx: Receive thread state
+ *
+ * Returns: A submission queue entry, or NULL if none could be obtained.
+ *
+ */
+static struct io_uring_sqe *chitcpd_uring_get_sqe(struct uring_rx *rx)
+{
+    struct io_uring_sqe *sqe = io_uring_get_sqe(&rx->ring);
+    int ret;
+
+    if (sqe == NULL)
+    {
+        ret = io_uring_submit(&rx->ring);
+        if (ret < 0)
+            chilog(ERROR, "io_uring_submit() failed: %s", strerror(-ret));
+        else
+            sqe = io_uring_get_sqe(&rx->ring);
+    }
+
+    return sqe;
+}
+
+
+/*
+ * chitcpd_uring_arm_wakeup - Submit a read on the wakeup eventfd
+ *
+ * rx: Receive thread state
+ *
+ * Returns:
+ *  - CHITCP_OK: The read was queued
+ *  - CHITCP_ENOMEM: There was no room in the submission queue
+ *
+ */
+static int chitcpd_uring_arm_wakeup(struct uring_rx *rx)
+{
+    struct io_uring_sqe *sqe = chitcpd_uring_get_sqe(rx);
+
+    if (sqe == NULL)
+        return CHITCP_ENOMEM;
+
+    io_uring_prep_read(sqe, rx->wakeup_fd, &rx->wakeup_val, sizeof(uint64_t), 0);
+    io_uring_sqe_set_data(sqe, NULL);
+
+    return CHITCP_OK;
+}
+
+
+/*
+ * chitcpd_uring_arm_recv - Submit a multishot receive on a connection
+ *
+ * rx: Receive thread state
+ *
+ * rxc: Connection state
+ *
+ * Returns:
+ *  - CHITCP_OK: The receive was queued
+ *  - CHITCP_ENOMEM: There was no room in the submission queue
+ *
+ */
+static int chitcpd_uring_arm_recv(struct uring_rx *rx, uring_rx_conn_t *rxc)
+{
+    struct io_uring_sqe *sqe = chitcpd_uring_get_sqe(rx);
+
+    if (sqe == NULL)
+        return CHITCP_ENOMEM;
+
+    /* The buffer is picked by the kernel from the buffer ring */
+    io_uring_prep_recv_multishot(sqe, rxc->connection->realsocket_recv, NULL, 0, 0);
+    sqe->flags |= IOSQE_BUFFER_SELECT;
+    sqe->buf_group = URING_RX_BGID;
+    io_uring_sqe_set_data(sqe, rxc);
+
+    return CHITCP_OK;
+}
+
+
+/*
+ * chitcpd_uring_rx_release - Stop receiving on a connection
+ *
+ * Closes the connection's receive socket, and frees its state.
+ * There must be no receive armed on the connection.
+ *
+ * rx: Receive thread state
+ *
+ * rxc: Connection state
+ *
+ * Returns: Nothing.
+ *
+ */
+static void chitcpd_uring_rx_release(struct uring_rx *rx, uring_rx_conn_t *rxc)
+{
+    close(rxc->connection->realsocket_recv);
+    DL_DELETE(rx->conns, rxc);
+    chitcpd_frame_reader_free(&rxc->reader);
+    free(rxc);
+}
+
+
+/*
+ * chitcpd_uring_rearm_recv - Submit a receive on a connection again
+ *
+ * If it can't be submitted, the connection is released (since
+ * there will be no more completions for it).
+ *
+ * rx: Receive thread state
+ *
+ * rxc: Connection state
+ *
+ * Returns: Nothing.
+ *
+ */
+static void chitcpd_uring_rearm_recv(struct uring_rx *rx, uring_rx_conn_t *rxc)
+{
+    if (chitcpd_uring_arm_recv(rx, rxc) != CHITCP_OK)
+    {
+        chilog(ERROR, "Could not submit a receive on fd %d. Closing it.", rxc->connection->realsocket_recv);
+        chitcpd_uring_rx_release(rx, rxc);
+    }
+}
+
+
+/*
+ * chitcpd_uring_rx_thread_func - io_uring receive thread function
+ *
+ * args: arguments (serverinfo_t)
+ *
+ * Returns: Nothing.
+ *
+ */
+static void* chitcpd_uring_rx_thread_func(void *args)
+{
+    serverinfo_t *si = (serverinfo_t *) args;
+    struct uring_rx *rx = si->uring_rx;
+    set_thread_name(pthread_self(), "network-uring");
+
+    struct io_uring_cqe *cqe;
+    uring_rx_conn_t *rxc, *tmp;
+    unsigned int head, ncqes;
+    int mask = io_uring_buf_ring_mask(URING_RX_NBUFS);
+    uint16_t bid;
+    int ret;
+    bool_t done = FALSE;
+
+    if (chitcpd_uring_arm_wakeup(rx) != CHITCP_OK)
+    {
+        chilog(ERROR, "Could not submit a read on the io_uring wakeup eventfd");
+        pthread_exit(NULL);
+    }
+
+    while (!done)
+    {
+        /* A single io_uring_enter() both submits any new requests and
+         * waits for at least one completion */
+        ret = io_uring_submit_and_wait(&rx->ring, 1);
+        if (ret < 0 && ret != -EINTR)
+        {
+            chilog(ERROR, "io_uring_submit_and_wait() failed: %s", strerror(-ret));
+            break;
+        }
+
+        ncqes = 0;
+        io_uring_for_each_cqe(&rx->ring, head, cqe)
+        {
+            ncqes++;
+            rxc = (uring_rx_conn_t *) io_uring_cqe_get_data(cqe);
+
+            if (rxc == NULL)
+            {
+                /* Wakeup: exit, or start receiving on the new connections */
+                if (si->state == CHITCPD_STATE_STOPPING)
+                {
+                    done = TRUE;
+                    continue;
+                }
+
+                pthread_mutex_lock(&rx->lock_pending);
+                DL_FOREACH_SAFE(rx->pending, rxc, tmp)
+                {
+                    DL_DELETE(rx->pending, rxc);
+                    DL_APPEND(rx->conns, rxc);
+                    chitcpd_uring_rearm_recv(rx, rxc);
+                }
+                pthread_mutex_unlock(&rx->lock_pending);
+
+                /* Without the read on the eventfd, we would never find
+                 * out about new connections, or that we have to exit */
+                if (chitcpd_uring_arm_wakeup(rx) != CHITCP_OK)
+                {
+                    chilog(ERROR, "Could not submit a read on the io_uring wakeup eventfd");
+                    done = TRUE;
+                }
+                continue;
+            }
+
+            if (cqe->res > 0)
+            {
+                /* Copy the bytes to the connection's frame reader, and
+                 * give the buffer back to the kernel right away */
+                bid = cqe->flags >> IORING_CQE_BUFFER_SHIFT;
+                ret = chitcpd_frame_reader_append(&rxc->reader, rx->bufs + bid * URING_RX_BUF_SIZE, cqe->res);
+                io_uring_buf_ring_add(rx->buf_ring, rx->bufs + bid * URING_RX_BUF_SIZE, URING_RX_BUF_SIZE, bid, mask, 0);
+                io_uring_buf_ring_advance(rx->buf_ring, 1);
+
+                if (ret == CHITCP_OK && si->state != CHITCPD_STATE_STOPPING)
+                    ret = chitcpd_recv_frames(si, &rxc->reader, (struct sockaddr*) &rxc->local_addr, (struct sockaddr*) &rxc->peer_addr);
+
+                if (ret != CHITCP_OK && (cqe->flags & IORING_CQE_F_MORE))
+                {
+                    /* Stop receiving. The final completion of the
+                     * multishot receive will release the connection. */
+                    shutdown(rxc->connection->realsocket_recv, SHUT_RD);
+                }
+                else if (ret != CHITCP_OK)
+                {
+                    /* The receive is no longer armed, so there won't
+                     * be another completion to release it */
+                    chitcpd_uring_rx_release(rx, rxc);
+                }
+                else if (!(cqe->flags & IORING_CQE_F_MORE))
+                {
+                    /* The kernel stopped the multishot receive (this can
+                     * happen at any time), so we just submit it again */
+                    chitcpd_uring_rearm_recv(rx, rxc);
+                }
+            }
+            else if (cqe->res == -ENOBUFS)
+            {
+                /* We ran out of buffers. The receive is no longer armed,
+                 * but we have now returned the buffers we had used */
+                chitcpd_uring_rearm_recv(rx, rxc);
+            }
+            else if (!(cqe->flags & IORING_CQE_F_MORE))
+            {
+                /* The peer closed the connection, or an error happened */
+                if (cqe->res < 0)
+                    chilog(ERROR, "Socket recv() failed on fd %d: %s", rxc->connection->realsocket_recv,
+                            strerror(-cqe->res));
+
+                chitcpd_uring_rx_release(rx, rxc);
+            }
+        }
+        io_uring_cq_advance(&rx->ring, ncqes);
+    }
+
+    pthread_exit(NULL);
+}
+
+
+/* See uring.h */
+int chitcpd_uring_rx_start(serverinfo_t *si)
+{
+    struct uring_rx *rx;
+    int ret;
+
+    rx = calloc(1, sizeof(struct uring_rx));
+    if (rx == NULL)
+        return CHITCP_ENOMEM;
+
+    ret = io_uring_queue_init(URING_RX_ENTRIES, &rx->ring, 0);
+    if (ret < 0)
+    {
+        chilog(WARNING, "Could not set up io_uring: %s", strerror(-ret));
+        free(rx);
+        return CHITCP_EINIT;
+    }
+
+    rx->buf_ring = io_uring_setup_buf_ring(&rx->ring, URING_RX_NBUFS, URING_RX_BGID, 0, &ret);
+    if (rx->buf_ring == NULL)
+    {
+        chilog(WARNING, "Could not set up io_uring buffer ring: %s", strerror(-ret));
+        io_uring_queue_exit(&rx->ring);
+        free(rx);
+        return CHITCP_EINIT;
+    }
+
+    rx->bufs = malloc(URING_RX_NBUFS * URING_RX_BUF_SIZE);
+    rx->wakeup_fd = eventfd(0, EFD_CLOEXEC);
+    if (rx->bufs == NULL || rx->wakeup_fd == -1)
+    {
+        free(rx->bufs);
+        io_uring_free_buf_ring(&rx->ring, rx->buf_ring, URING_RX_NBUFS, URING_RX_BGID);
+        io_uring_queue_exit(&rx->ring);
+        free(rx);
+        return CHITCP_ENOMEM;
+    }
+
+    /* Hand all the buffers to the kernel */
+    for (int i = 0; i < URING_RX_NBUFS; i++)
+        io_uring_buf_ring_add(rx->buf_ring, rx->bufs + i * URING_RX_BUF_SIZE, URING_RX_BUF_SIZE, i,
+                              io_uring_buf_ring_mask(URING_RX_NBUFS), i);
+    io_uring_buf_ring_advance(rx->buf_ring, URING_RX_NBUFS);
+
+    pthread_mutex_init(&rx->lock_pending, NULL);
+    si->uring_rx = rx;
+
+    if (pthread_create(&rx->thread, NULL, chitcpd_uring_rx_thread_func, si) != 0)
+    {
+        perror("Could not create io_uring receive thread");
+        si->uring_rx = NULL;
+        close(rx->wakeup_fd);
+        free(rx->bufs);
+        io_uring_free_buf_ring(&rx->ring, rx->buf_ring, URING_RX_NBUFS, URING_RX_BGID);
+        io_uring_queue_exit(&rx->ring);
+        free(rx);
+        return CHITCP_ETHREAD;
+    }
+
+    return CHITCP_OK;
+}
+
+
+/* See uring.h */
+int chitcpd_uring_rx_add_connection(serverinfo_t *si, tcpconnentry_t *connection)
+{
+    struct uring_rx *rx = si->uring_rx;
+    uring_rx_conn_t *rxc;
+    socklen_t lsize, psize;
+    uint64_t one = 1;
+
+    rxc = calloc(1, sizeof(uring_rx_conn_t));
+    if (rxc == NULL)
+        return CHITCP_ENOMEM;
+
+    if (chitcpd_frame_reader_init(&rxc->reader, FRAME_READER_BUFFER_SIZE) != CHITCP_OK)
+    {
+        free(rxc);
+        return CHITCP_ENOMEM;
+    }
+
+    rxc->connection = connection;
+
+    /* Get the local and peer addresses */
+    lsize = psize = sizeof(struct sockaddr_storage);
+    getsockname(connection->realsocket_recv, (struct sockaddr*) &rxc->local_addr, &lsize);
+    getpeername(connection->realsocket_recv, (struct sockaddr*) &rxc->peer_addr, &psize);
+
+    /* Only the receive thread submits requests to its ring, so we just
+     * add the connection to the pending list and wake up the thread */
+    pthread_mutex_lock(&rx->lock_pending);
+    DL_APPEND(rx->pending, rxc);
+    pthread_mutex_unlock(&rx->lock_pending);
+
+    if (write(rx->wakeup_fd, &one, sizeof(uint64_t)) != sizeof(uint64_t))
+        chilog(WARNING, "Could not wake up io_uring receive thread");
+
+    return CHITCP_OK;
+}
+
+
+/* See uring.h */
+int chitcpd_uring_rx_stop(serverinfo_t *si)
+{
+    struct uring_rx *rx = si->uring_rx;
+    uring_rx_conn_t *rxc, *tmp;
+    uint64_t one = 1;
+
+    if (rx == NULL)
+        return CHITCP_OK;
+
+    if (write(rx->wakeup_fd, &one, sizeof(uint64_t)) != sizeof(uint64_t))
+        chilog(WARNING, "Could not wake up io_uring receive thread");
+    pthread_join(rx->thread, NULL);
+
+    /* This cancels any requests that are still armed */
+    io_uring_free_buf_ring(&rx->ring, rx->buf_ring, URING_RX_NBUFS, URING_RX_BGID);
+    io_uring_queue_exit(&rx->ring);
+
+    DL_CONCAT(rx->conns, rx->pending);
+    DL_FOREACH_SAFE(rx->conns, rxc, tmp)
+    {
+        DL_DELETE(rx->conns, rxc);
+        chitcpd_frame_reader_free(&rxc->reader);
+        free(rxc);
+    }
+
+    close(rx->wakeup_fd);
+    free(rx->bufs);
+    pthread_mutex_destroy(&rx->lock_pending);
+    free(rx);
+    si->uring_rx = NULL;
+
+    return CHITCP_OK;
+}
+
+
+/* See uring.h */
+int chitcpd_uring_tx_init(chitcpd_uring_tx_t *tx)
+{
+    int ret;
+
+    memset(tx, 0, sizeof(chitcpd_uring_tx_t));
+
+    ret = io_uring_queue_init(URING_TX_ENTRIES, &tx->ring, 0);
+    if (ret < 0)
+    {
+        chilog(WARNING, "Could not set up io_uring: %s", strerror(-ret));
+        return CHITCP_EINIT;
+    }
+
+    return CHITCP_OK;
+}
+
+
+/* See uring.h */
+void chitcpd_uring_tx_free(chitcpd_uring_tx_t *tx)
+{
+    io_uring_queue_exit(&tx->ring);
+    free(tx->iov);
+    free(tx->msgs);
+    free(tx->expected);
+}
+
+
+/*
+ * chitcpd_uring_tx_reserve - Make room for a batch in a writer's arrays
+ *
+ * tx: io_uring state
+ *
+ * nframes: Number of frames in the batch
+ *
+ * Returns:
+ *  - CHITCP_OK: The arrays have room for the batch
+ *  - CHITCP_ENOMEM: Could not allocate memory
+ *
+ */
+static int chitcpd_uring_tx_reserve(chitcpd_uring_tx_t *tx, int nframes)
+{
+    int nmsgs = (nframes + IOV_MAX - 1) / IOV_MAX;
+    void *p;
+
+    if (nframes <= tx->capacity)
+        return CHITCP_OK;
+
+    /* The arrays are updated one at a time, so capacity (which
+     * is only updated at the end) never overstates their size */
+    if ((p = realloc(tx->iov, nframes * sizeof(struct iovec))) == NULL)
+        return CHITCP_ENOMEM;
+    tx->iov = p;
+    if ((p = realloc(tx->msgs, nmsgs * sizeof(struct msghdr))) == NULL)
+        return CHITCP_ENOMEM;
+    tx->msgs = p;
+    if ((p = realloc(tx->expected, nmsgs * sizeof(size_t))) == NULL)
+        return CHITCP_ENOMEM;
+    tx->expected = p;
+
+    tx->capacity = nframes;
+
+    return CHITCP_OK;
+}
+
+
+/*
+ * chitcpd_uring_tx_drain - Reap the completions of a writer's requests
+ *
+ * tx: io_uring state
+ *
+ * Returns: 0 if there are no requests left in flight, or -1 if waiting
+ *          for a completion failed (the requests that are still in flight
+ *          remain in tx->inflight).
+ *
+ */
+static int chitcpd_uring_tx_drain(chitcpd_uring_tx_t *tx)
+{
+    struct io_uring_cqe *cqe;
+    int ret;
+
+    while (tx->inflight > 0)
+    {
+        ret = io_uring_wait_cqe(&tx->ring, &cqe);
+        if (ret == -EINTR)
+            continue;
+        if (ret < 0)
+        {
+            chilog(ERROR, "io_uring_wait_cqe() failed: %s", strerror(-ret));
+            return -1;
+        }
+
+        io_uring_cqe_seen(&tx->ring, cqe);
+        tx->inflight--;
+    }
+
+    return 0;
+}
+
+
+/* See uring.h */
+ssize_t chitcpd_uring_send_frames(chitcpd_uring_tx_t *tx, socket_t realsocket, tx_frame_t *frames)
+{
+    struct io_uring *ring = &tx->ring;
+    struct io_uring_sqe *sqe, *last;
+    struct io_uring_cqe *cqe;
+    struct iovec *iov;
+    struct msghdr *msgs;
+    tx_frame_t *frame;
+    size_t *expected;
+    int nframes = 0, nmsgs, nsubmitted = 0, i, j, ret;
+    ssize_t nwritten = 0;
+    bool_t failed = FALSE;
+
+    DL_COUNT(frames, frame, nframes);
+    if (nframes == 0)
+        return 0;
+
+    /* Don't mistake the completions of an earlier batch for ours (and
+     * don't touch the arrays while the kernel may still be using them) */
+    if (chitcpd_uring_tx_drain(tx) == -1)
+        return -1;
+
+    if (chitcpd_uring_tx_reserve(tx, nframes) != CHITCP_OK)
+        return -1;
+
+    nmsgs = (nframes + IOV_MAX - 1) / IOV_MAX;
+    iov = tx->iov;
+    msgs = tx->msgs;
+    expected = tx->expected;
+    memset(msgs, 0, nmsgs * sizeof(struct msghdr));
+    memset(expected, 0, nmsgs * sizeof(size_t));
+
+    i = 0;
+    DL_FOREACH(frames, frame)
+    {
+        iov[i].iov_base = frame->data;
+        iov[i].iov_len = frame->length;
+        expected[i / IOV_MAX] += frame->length;
+        i++;
+    }
+
+    while (nsubmitted < nmsgs && !failed)
+    {
+        /* Queue as many sendmsg requests as fit in the ring, linked
+         * so that they are performed in order. MSG_WAITALL makes
+         * the kernel retry short sends, instead of completing the
+         * request with fewer bytes than requested. */
+        last = NULL;
+        for (j = 0; nsubmitted + j < nmsgs && (sqe = io_uring_get_sqe(ring)) != NULL; j++)
+        {
+            i = nsubmitted + j;
+            msgs[i].msg_iov = iov + i * IOV_MAX;
+            msgs[i].msg_iovlen = (i == nmsgs - 1)? nframes - i * IOV_MAX : IOV_MAX;
+            io_uring_prep_sendmsg(sqe, realsocket, &msgs[i], MSG_WAITALL | MSG_NOSIGNAL);
+            sqe->flags |= IOSQE_IO_LINK;
+            last = sqe;
+        }
+
+        /* The chain ends with the last request we submit */
+        if (last != NULL)
+            last->flags &= ~IOSQE_IO_LINK;
+
+        ret = io_uring_submit_and_wait(ring, j);
+        if (ret < 0)
+        {
+            chilog(ERROR, "io_uring_submit_and_wait() failed: %s", strerror(-ret));
+            failed = TRUE;
+            break;
+        }
+        tx->inflight += j;
+
+        for (i = 0; i < j; i++)
+        {
+            while ((ret = io_uring_wait_cqe(ring, &cqe)) == -EINTR)
+                ;
+            if (ret < 0)
+            {
+                /* The remaining completions are reaped below (or, if
+                 * that fails too, on the next call) */
+                chilog(ERROR, "io_uring_wait_cqe() failed: %s", strerror(-ret));
+                failed = TRUE;
+                break;
+            }
+
+            if (cqe->res < 0 || (size_t) cqe->res != expected[nsubmitted + i])
+            {
+                chilog(ERROR, "io_uring sendmsg() failed on fd %d: %s", realsocket,
+                        cqe->res < 0? strerror(-cqe->res) : "short write");
+                failed = TRUE;
+            }
+            else
+                nwritten += cqe->res;
+
+            io_uring_cqe_seen(ring, cqe);
+            tx->inflight--;
+        }
+
+        nsubmitted += j;
+    }
+
+    if (failed)
+    {
+        chitcpd_uring_tx_drain(tx);
+        return -1;
+    }
+
+    return nwritten;
+}
+
+#endif /* CHITCPD_HAVE_LIBURING */
@@ -0,0 +1,178 @@
+/*
+ *  chiTCP - A simple, testable TCP stack
+ *
+ *  See uring.c
+ *
+ */
+
+
+/*
+ *  Copyright (c) 2013-2014, The University of Chicago
+ *  All rights reserved.
+ *
+ *  Redistribution and use in source and binary forms, with or without
+ *  modification, are permitted provided that the following conditions are met:
+ *
+ *  - Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ *
+ *  - Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ *  - Neither the name of The University of Chicago nor the names of its
+ *    contributors may be used to endorse or promote products derived from this
+ *    software without specific prior written permission.
+ *
+ *  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ *  AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ *  IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ *  ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ *  LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ *  CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ *  SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ *  INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ *  CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ *  ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ *  POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+#ifndef URING_H_
+#define URING_H_
+
+#ifdef CHITCPD_HAVE_LIBURING
+
+#include <liburing.h>
+#include "serverinfo.h"
+
+/* Number of buffers in the provided buffer ring used for receiving,
+ * and size of each buffer. Must be a power of two. */
+#define URING_RX_NBUFS (256)
+#define URING_RX_BUF_SIZE (16 * 1024)
+
+/* Buffer group ID of the provided buffer ring */
+#define URING_RX_BGID (0)
+
+/* Number of entries in the receive ring and in each writer's ring */
+#define URING_RX_ENTRIES (256)
+#define URING_TX_ENTRIES (64)
+
+/* io_uring state of a connection's writer thread (see
+ * chitcpd_uring_send_frames). The arrays passed to the sendmsg requests
+ * are kept from one batch to the next, and only grow when a batch has
+ * more frames than any previous one. */
+typedef struct chitcpd_uring_tx
+{
+    struct io_uring ring;
+
+    struct iovec *iov;       /* One per frame */
+    struct msghdr *msgs;     /* One per IOV_MAX frames */
+    size_t *expected;        /* Bytes sent by each message */
+    int capacity;            /* Number of frames that fit in iov */
+
+    /* Requests whose completions haven't been reaped yet (because
+     * waiting for them failed). They are reaped before sending
+     * anything else, so they aren't taken for new completions. */
+    unsigned int inflight;
+} chitcpd_uring_tx_t;
+
+/*
+ * chitcpd_uring_rx_start - Start the io_uring receive thread
+ *
+ * Sets up an io_uring instance with a ring of provided buffers, and
+ * starts a thread that receives from every connection with multishot
+ * receives into those buffers.
+ *
+ * si: Server info
+ *
+ * Returns:
+ *  - CHITCP_OK: The thread has started correctly
+ *  - CHITCP_ENOMEM: Could not allocate memory
+ *  - CHITCP_EINIT: Could not set up io_uring (e.g., because the kernel
+ *                  is too old). The caller should fall back to the
+ *                  sockets code.
+ *  - CHITCP_ETHREAD: Could not create the thread
+ *
+ */
+int chitcpd_uring_rx_start(serverinfo_t *si);
+
+
+/*
+ * chitcpd_uring_rx_add_connection - Start receiving packets on a connection
+ *
+ * Hands the connection's realsocket_recv over to the io_uring receive
+ * thread. This replaces creating a connection thread for the connection.
+ *
+ * si: Server info
+ *
+ * connection: Connection entry
+ *
+ * Returns:
+ *  - CHITCP_OK: The connection has been handed over
+ *  - CHITCP_ENOMEM: Could not allocate memory
+ *
+ */
+int chitcpd_uring_rx_add_connection(serverinfo_t *si, tcpconnentry_t *connection);
+
+
+/*
+ * chitcpd_uring_rx_stop - Stop the io_uring receive thread
+ *
+ * si: Server info
+ *
+ * Returns:
+ *  - CHITCP_OK: The thread has stopped
+ *
+ */
+int chitcpd_uring_rx_stop(serverinfo_t *si);
+
+
+/*
+ * chitcpd_uring_tx_init - Set up io_uring for a writer thread
+ *
+ * tx: io_uring state (owned by the calling thread)
+ *
+ * Returns:
+ *  - CHITCP_OK: io_uring was set up correctly
+ *  - CHITCP_EINIT: Could not set up io_uring. The caller should
+ *                  fall back to sendmsg().
+ *
+ */
+int chitcpd_uring_tx_init(chitcpd_uring_tx_t *tx);
+
+
+/*
+ * chitcpd_uring_tx_free - Free the io_uring state of a writer thread
+ *
+ * tx: io_uring state
+ *
+ * Returns: Nothing.
+ *
+ */
+void chitcpd_uring_tx_free(chitcpd_uring_tx_t *tx);
+
+
+/*
+ * chitcpd_uring_send_frames - Send a list of frames with io_uring
+ *
+ * The frames are sent with one IORING_OP_SENDMSG request per IOV_MAX
+ * frames. The requests are linked (so they are performed in order) and
+ * submitted together, so the whole list usually costs a single
+ * io_uring_enter() call.
+ *
+ * tx: io_uring state of the calling thread (see chitcpd_uring_tx_init)
+ *
+ * realsocket: Socket to send the frames on
+ *
+ * frames: Frames to send
+ *
+ * Returns: Number of bytes sent, or -1 if not all the frames
+ *          could be sent.
+ *
+ */
+ssize_t chitcpd_uring_send_frames(chitcpd_uring_tx_t *tx, socket_t realsocket, tx_frame_t *frames);
+
+#endif /* CHITCPD_HAVE_LIBURING */
+
+#endif /* URING_H_ */
@@ -40,33 +40,127 @@
 #include <stdio.h>
 #include <string.h>
 #include <stdlib.h>
+#include <errno.h>
 
 #include "chitcp/buffer.h"
 
+/* Locking functions that recover a shared buffer's robust lock
+ * if the process holding it died. The buffer's state is still
+ * consistent enough to be used (at worst, some data is lost) */
+static inline void buffer_lock(circular_buffer_t *buf)
+{
+    if (pthread_mutex_lock(&buf->state->lock) == EOWNERDEAD)
+        pthread_mutex_consistent(&buf->state->lock);
+}
+
+static inline void buffer_wait(circular_buffer_t *buf, pthread_cond_t *cv)
+{
+    if (pthread_cond_wait(cv, &buf->state->lock) == EOWNERDEAD)
+        pthread_mutex_consistent(&buf->state->lock);
+}
+
+/* Checks that the positions in a buffer's state are within its capacity.
+ * This can only fail if another process sharing the buffer has
+ * overwritten its state. */
+static inline bool_t buffer_valid(circular_buffer_t *buf)
+{
+    circular_buffer_state_t *s = buf->state;
+
+    return s->start <= buf->maxsize && s->end <= buf->maxsize && s->count <= buf->maxsize;
+}
+
+/* Notifies a change in the buffer's contents (without holding the lock) */
+static inline void buffer_notify(circular_buffer_t *buf)
+{
+    if (buf->notify != NULL)
+        buf->notify(buf->notify_arg);
+}
+
+static void buffer_init_state(circular_buffer_state_t *s, uint32_t maxsize)
+{
+    s->start = 0;
+    s->end = 0;
+    s->count = 0;
+    s->seq_initial = 0;
+    s->seq_start = 0;
+    s->seq_end = 0;
+    s->maxsize = maxsize;
+    s->closed = FALSE;
+}
+
 int circular_buffer_init(circular_buffer_t *buf, uint32_t maxsize)
 {
     buf->data = malloc(maxsize);
-    buf->start = 0;
-    buf->end = 0;
-    buf->count = 0;
-    buf->seq_initial = 0;
-    buf->seq_start = 0;
-    buf->seq_end = 0;
+    buf->state = &buf->local_state;
+    buf->maxsize = maxsize;
+    buf->shared = FALSE;
+    buf->notify = NULL;
+    buffer_init_state(buf->state, maxsize);
+
+    pthread_mutex_init(&buf->state->lock, NULL);
+    pthread_cond_init(&buf->state->cv_notempty, NULL);
+    pthread_cond_init(&buf->state->cv_notfull, NULL);
+
+    return CHITCP_OK;
+}
+
+size_t circular_buffer_shared_size(uint32_t maxsize)
+{
+    return CIRCULAR_BUFFER_DATA_OFFSET + maxsize;
+}
+
+int circular_buffer_init_shared(circular_buffer_t *buf, void *mem, uint32_t maxsize)
+{
+    pthread_mutexattr_t mattr;
+    pthread_condattr_t cattr;
+    int rc = 0;
+
+    buf->state = (circular_buffer_state_t *) mem;
+    buf->data = (uint8_t *) mem + CIRCULAR_BUFFER_DATA_OFFSET;
     buf->maxsize = maxsize;
-    buf->closed = FALSE;
+    buf->shared = TRUE;
+    buf->notify = NULL;
+    buffer_init_state(buf->state, maxsize);
+
+    pthread_mutexattr_init(&mattr);
+    rc |= pthread_mutexattr_setpshared(&mattr, PTHREAD_PROCESS_SHARED);
+    rc |= pthread_mutexattr_setrobust(&mattr, PTHREAD_MUTEX_ROBUST);
+    rc |= pthread_mutex_init(&buf->state->lock, &mattr);
+    pthread_mutexattr_destroy(&mattr);
+
+    pthread_condattr_init(&cattr);
+    rc |= pthread_condattr_setpshared(&cattr, PTHREAD_PROCESS_SHARED);
+    rc |= pthread_cond_init(&buf->state->cv_notempty, &cattr);
+    rc |= pthread_cond_init(&buf->state->cv_notfull, &cattr);
+    pthread_condattr_destroy(&cattr);
+
+    return rc? CHITCP_EINIT : CHITCP_OK;
+}
+
+int circular_buffer_attach(circular_buffer_t *buf, void *mem, size_t memsize)
+{
+    circular_buffer_state_t *s = (circular_buffer_state_t *) mem;
+
+    if (memsize < CIRCULAR_BUFFER_DATA_OFFSET || s->maxsize == 0 ||
+        s->maxsize > memsize - CIRCULAR_BUFFER_DATA_OFFSET)
+        return CHITCP_EINVAL;
 
-    pthread_mutex_init(&buf->lock, NULL);
-    pthread_cond_init(&buf->cv_notempty, NULL);
-    pthread_cond_init(&buf->cv_notfull, NULL);
+    buf->state = s;
+    buf->data = (uint8_t *) mem + CIRCULAR_BUFFER_DATA_OFFSET;
+    buf->maxsize = s->maxsize;
+    buf->shared = TRUE;
+    buf->notify = NULL;
 
     return CHITCP_OK;
 }
 
 int circular_buffer_set_seq_initial(circular_buffer_t *buf, uint32_t seq_initial)
 {
-    buf->seq_initial = seq_initial;
-    buf->seq_start = seq_initial;
-    buf->seq_end = seq_initial + buf->end;
+    circular_buffer_state_t *s = buf->state;
+
+    s->seq_initial = seq_initial;
+    s->seq_start = seq_initial;
+    s->seq_end = seq_initial + s->end;
 
     return CHITCP_OK;
 }
@@ -74,101 +168,123 @@ int circular_buffer_set_seq_initial(circular_buffer_t *buf, uint32_t seq_initial
 
 int circular_buffer_write(circular_buffer_t *buf, uint8_t *data, uint32_t len, bool_t blocking)
 {
+    circular_buffer_state_t *s = buf->state;
+    uint32_t maxsize = buf->maxsize;
+
     if(len <= 0)
         return CHITCP_EINVAL;
 
-    pthread_mutex_lock(&buf->lock);
-    if(buf->count + len > buf->maxsize && !blocking)
+    buffer_lock(buf);
+    if(!buffer_valid(buf))
     {
-        pthread_mutex_unlock(&buf->lock);
+        pthread_mutex_unlock(&s->lock);
+        return CHITCP_EINVAL;
+    }
+
+    if(s->count + len > maxsize && !blocking)
+    {
+        pthread_mutex_unlock(&s->lock);
         return CHITCP_EWOULDBLOCK;
     }
 
     int written = 0;
 
     /* We don't allow writes that are larger than the size of the buffer */
-    if (len > buf->maxsize)
-        len = buf->maxsize;
+    if (len > maxsize)
+        len = maxsize;
 
     while (written < len)
     {
-        while(buf->count == buf->maxsize)
-            pthread_cond_wait(&buf->cv_notfull, &buf->lock);
+        while(s->count == maxsize && !s->closed)
+            buffer_wait(buf, &s->cv_notfull);
 
-        if(buf->closed)
+        if(s->closed || !buffer_valid(buf))
         {
-            pthread_mutex_unlock(&buf->lock);
+            pthread_mutex_unlock(&s->lock);
+            if (written > 0)
+                buffer_notify(buf);
             return written;
         }
 
         int towrite;
 
-        if (len - written < buf->maxsize - buf->count)
+        if (len - written < maxsize - s->count)
             towrite = len - written;
         else
-            towrite = buf->maxsize - buf->count;
+            towrite = maxsize - s->count;
 
-        if(buf->end + towrite > buf->maxsize)
+        if(s->end + towrite > maxsize)
         {
-            int to_max = buf->maxsize - buf->end;
+            int to_max = maxsize - s->end;
             int after_max = towrite - to_max;
 
-            memcpy(buf->data + buf->end, data + written, to_max);
+            memcpy(buf->data + s->end, data + written, to_max);
             memcpy(buf->data, data + written + to_max, after_max);
 
-            buf->end = after_max;
+            s->end = after_max;
         }
         else
         {
-            memcpy(buf->data + buf->end, data + written, towrite);
-            buf->end += towrite;
+            memcpy(buf->data + s->end, data + written, towrite);
+            s->end += towrite;
         }
 
         written += towrite;
-        buf->count += towrite;
-        buf->seq_end += towrite;
+        s->count += towrite;
+        s->seq_end += towrite;
     }
 
-    pthread_cond_signal(&buf->cv_notempty);
-    pthread_mutex_unlock(&buf->lock);
+    pthread_cond_signal(&s->cv_notempty);
+    pthread_mutex_unlock(&s->lock);
+
+    buffer_notify(buf);
 
     return written;
 }
 
 int __circular_buffer_read(circular_buffer_t *buf, uint8_t *dst, uint32_t len, uint32_t offset, bool_t blocking, bool_t peeking)
 {
+    circular_buffer_state_t *s = buf->state;
+    uint32_t maxsize = buf->maxsize;
+
     if(len <= 0)
         return CHITCP_EINVAL;
 
-    pthread_mutex_lock(&buf->lock);
-    if(buf->count == 0 && !blocking)
+    buffer_lock(buf);
+    if(s->count == 0 && !s->closed && !blocking)
     {
-        pthread_mutex_unlock(&buf->lock);
+        pthread_mutex_unlock(&s->lock);
         return CHITCP_EWOULDBLOCK;
     }
 
-    while(buf->count == 0 && !buf->closed)
-        pthread_cond_wait(&buf->cv_notempty, &buf->lock);
+    while(s->count == 0 && !s->closed)
+        buffer_wait(buf, &s->cv_notempty);
+
+    if(!buffer_valid(buf) || offset > s->count)
+    {
+        pthread_mutex_unlock(&s->lock);
+        return CHITCP_EINVAL;
+    }
 
-    if(buf->closed && buf->count == 0)
+    if(s->closed && s->count == 0)
     {
-        pthread_mutex_unlock(&buf->lock);
+        pthread_mutex_unlock(&s->lock);
         return 0;
     }
 
     int toread;
-    int start = (buf->start + offset) % buf->maxsize;
+    int start = (s->start + offset) % maxsize;
 
     /* We're not going to read more than the number
      * of bytes stored in the buffer */
-    if(len < (buf->count - offset))
+    if(len < (s->count - offset))
         toread = len;
     else
-        toread = buf->count - offset;
+        toread = s->count - offset;
 
-    if(start + toread > buf->maxsize)
+    if(start + toread > maxsize)
     {
-        int to_max = buf->maxsize - start;
+        int to_max = maxsize - start;
         int after_max = toread - to_max;
 
         if(dst)
@@ -188,13 +304,16 @@ int __circular_buffer_read(circular_buffer_t *buf, uint8_t *dst, uint32_t len, u
 
     if(!peeking)
     {
-        buf->start = start;
-        buf->count -= toread;
-        buf->seq_start += toread;
+        s->start = start;
+        s->count -= toread;
+        s->seq_start += toread;
     }
 
-    pthread_cond_signal(&buf->cv_notfull);
-    pthread_mutex_unlock(&buf->lock);
+    pthread_cond_signal(&s->cv_notfull);
+    pthread_mutex_unlock(&s->lock);
+
+    if(!peeking)
+        buffer_notify(buf);
 
     return toread;
 }
@@ -211,25 +330,26 @@ int circular_buffer_peek(circular_buffer_t *buf, uint8_t *dst, uint32_t len, boo
 
 int circular_buffer_peek_at(circular_buffer_t *buf, uint8_t *dst, uint32_t at, uint32_t len)
 {
+    circular_buffer_state_t *s = buf->state;
     uint32_t offset;
 
     /* Check that the sequence number is valid */
-    if (at < buf->seq_start || at >= buf->seq_end)
+    if (at < s->seq_start || at >= s->seq_end)
         return CHITCP_EINVAL;
 
-    offset = at - buf->seq_start;
+    offset = at - s->seq_start;
 
     return __circular_buffer_read(buf, dst, len, offset, FALSE, TRUE);
 }
 
 int circular_buffer_first(circular_buffer_t *buf)
 {
-    return buf->seq_start;
+    return buf->state->seq_start;
 }
 
 int circular_buffer_next(circular_buffer_t *buf)
 {
-    return buf->seq_end;
+    return buf->state->seq_end;
 }
 
 int circular_buffer_capacity(circular_buffer_t *buf)
@@ -239,30 +359,37 @@ int circular_buffer_capacity(circular_buffer_t *buf)
 
 int circular_buffer_count(circular_buffer_t *buf)
 {
-    return buf->count;
+    return buf->state->count;
+}
+
+bool_t circular_buffer_closed(circular_buffer_t *buf)
+{
+    return buf->state->closed;
 }
 
 int circular_buffer_available(circular_buffer_t *buf)
 {
-    return buf->maxsize - buf->count;
+    return buf->maxsize - buf->state->count;
 }
 
 int circular_buffer_dump(circular_buffer_t *buf)
 {
+    circular_buffer_state_t *s = buf->state;
+
     printf("# # # # # # # # # # # # # # # # #\n");
 
     printf("maxsize: %i\n", buf->maxsize);
-    printf("count: %i\n", buf->count);
+    printf("count: %i\n", s->count);
 
-    printf("start: %i\n", buf->start);
-    printf("end: %i\n", buf->end);
+    printf("start: %i\n", s->start);
+    printf("end: %i\n", s->end);
 
     for(int i=0; i<buf->maxsize; i++)
     {
         printf("data[%i] = %i", i, buf->data[i]);
-        if(i==buf->start)
+        if(i==s->start)
             printf("  <<< START");
-        if(i==buf->end)
+        if(i==s->end)
             printf("  <<< END");
         printf("\n");
     }
@@ -271,24 +398,38 @@ int circular_buffer_dump(circular_buffer_t *buf)
     return CHITCP_OK;
 }
 
+int circular_buffer_set_notify(circular_buffer_t *buf, circular_buffer_notify_t notify, void *arg)
+{
+    buf->notify_arg = arg;
+    buf->notify = notify;
+
+    return CHITCP_OK;
+}
+
 int circular_buffer_close(circular_buffer_t *buf)
 {
-    pthread_mutex_lock(&buf->lock);
-    buf->closed = TRUE;
-    pthread_cond_broadcast(&buf->cv_notempty);
-    pthread_cond_broadcast(&buf->cv_notfull);
-    pthread_mutex_unlock(&buf->lock);
+    buffer_lock(buf);
+    buf->state->closed = TRUE;
+    pthread_cond_broadcast(&buf->state->cv_notempty);
+    pthread_cond_broadcast(&buf->state->cv_notfull);
+    pthread_mutex_unlock(&buf->state->lock);
+
+    buffer_notify(buf);
 
     return CHITCP_OK;
 }
 
 int circular_buffer_free(circular_buffer_t *buf)
 {
+    /* The other process may still be using a shared buffer,
+     * so we can only close it */
+    if (buf->shared)
+        return circular_buffer_close(buf);
+
     free(buf->data);
-    pthread_mutex_destroy(&buf->lock);
-    pthread_cond_destroy(&buf->cv_notfull);
-    pthread_cond_destroy(&buf->cv_notempty);
+    pthread_mutex_destroy(&buf->state->lock);
+    pthread_cond_destroy(&buf->state->cv_notfull);
+    pthread_cond_destroy(&buf->state->cv_notempty);
 
     return CHITCP_OK;
 }
-
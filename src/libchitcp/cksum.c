@@ -0,0 +1,310 @@
+/*
+ *  chiTCP - A simple, testable TCP stack
+ *
+ *  Internet checksum
+ *
+ *  See cksum.h for details
+ */
+
+
+/*
+ *  Copyright (c) 2013-2014, The University of Chicago
+ *  All rights reserved.
+ *
+ *  Redistribution and use in source and binary forms, with or without
+ *  modification, are permitted provided that the following conditions are met:
+ *
+ *  - Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ *
+ *  - Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ *  - Neither the name of The University of Chicago nor the names of its
+ *    contributors may be used to endorse or promote products derived from this
+ *    software without specific prior written permission.
+ *
+ *  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ *  AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ *  IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ *  ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ *  LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ *  CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ *  SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ *  INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ *  CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ *  ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ *  POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+#include <stdint.h>
+#include <string.h>
+#include <pthread.h>
+
+#include "chitcp/cksum.h"
+#include "chitcp/types.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#define CKSUM_X86
+#include <immintrin.h>
+#endif
+
+/* Inputs shorter than this are always summed with the generic
+ * implementation, since they're not worth setting up vectors for */
+#define CKSUM_VECTOR_MIN (64)
+
+/* Number of iterations after which the 32-bit lanes of the vector
+ * accumulators must be added to the 64-bit sum (each iteration adds
+ * at most 2 * 0xFFFF to each lane, and the AVX2 version adds two
+ * accumulators together before flushing them) */
+#define CKSUM_VECTOR_FLUSH (8192)
+
+/* Implementations add the data (as native 16-bit words) to a 64-bit
+ * sum. Since the one's complement sum does not depend on byte order
+ * (RFC 1071, section 2.B), the folded sum is the checksum in network
+ * byte order. */
+typedef uint64_t (*cksum_func_t)(const uint8_t *data, size_t len, uint64_t sum);
+
+static uint64_t cksum_generic(const uint8_t *data, size_t len, uint64_t sum)
+{
+    uint32_t w32;
+    uint16_t w16;
+
+    /* 32-bit words are added to the 64-bit accumulator, which
+     * will not overflow for any realistic input */
+    while (len >= 16)
+    {
+        uint32_t w[4];
+        memcpy(w, data, 16);
+        sum += (uint64_t) w[0] + w[1] + w[2] + w[3];
+        data += 16;
+        len -= 16;
+    }
+
+    while (len >= 4)
+    {
+        memcpy(&w32, data, 4);
+        sum += w32;
+        data += 4;
+        len -= 4;
+    }
+
+    if (len >= 2)
+    {
+        memcpy(&w16, data, 2);
+        sum += w16;
+        data += 2;
+        len -= 2;
+    }
+
+    /* An odd byte is padded with a zero byte */
+    if (len > 0)
+    {
+        uint8_t last[2] = {data[0], 0};
+        memcpy(&w16, last, 2);
+        sum += w16;
+    }
+
+    return sum;
+}
+
+#ifdef CKSUM_X86
+__attribute__((target("sse2")))
+static uint64_t cksum_sse2(const uint8_t *data, size_t len, uint64_t sum)
+{
+    const __m128i zero = _mm_setzero_si128();
+    uint32_t lanes[4];
+
+    while (len >= 32)
+    {
+        /* Two accumulators, to avoid waiting on a single dependency chain */
+        __m128i acc0 = zero, acc1 = zero;
+        size_t n = len / 32;
+
+        if (n > CKSUM_VECTOR_FLUSH)
+            n = CKSUM_VECTOR_FLUSH;
+
+        for (size_t i = 0; i < n; i++)
+        {
+            __m128i v0 = _mm_loadu_si128((const __m128i *) data);
+            __m128i v1 = _mm_loadu_si128((const __m128i *) (data + 16));
+
+            /* Zero-extend the 16-bit words to 32 bits, and add them */
+            acc0 = _mm_add_epi32(acc0, _mm_unpacklo_epi16(v0, zero));
+            acc1 = _mm_add_epi32(acc1, _mm_unpackhi_epi16(v0, zero));
+            acc0 = _mm_add_epi32(acc0, _mm_unpacklo_epi16(v1, zero));
+            acc1 = _mm_add_epi32(acc1, _mm_unpackhi_epi16(v1, zero));
+            data += 32;
+        }
+        len -= n * 32;
+
+        _mm_storeu_si128((__m128i *) lanes, acc0);
+        sum += (uint64_t) lanes[0] + lanes[1] + lanes[2] + lanes[3];
+        _mm_storeu_si128((__m128i *) lanes, acc1);
+        sum += (uint64_t) lanes[0] + lanes[1] + lanes[2] + lanes[3];
+    }
+
+    return cksum_generic(data, len, sum);
+}
+
+__attribute__((target("avx2")))
+static uint64_t cksum_avx2(const uint8_t *data, size_t len, uint64_t sum)
+{
+    const __m256i zero = _mm256_setzero_si256();
+    uint32_t lanes[8];
+
+    while (len >= 64)
+    {
+        __m256i acc0 = zero, acc1 = zero;
+        size_t n = len / 64;
+
+        if (n > CKSUM_VECTOR_FLUSH)
+            n = CKSUM_VECTOR_FLUSH;
+
+        for (size_t i = 0; i < n; i++)
+        {
+            __m256i v0 = _mm256_loadu_si256((const __m256i *) data);
+            __m256i v1 = _mm256_loadu_si256((const __m256i *) (data + 32));
+
+            acc0 = _mm256_add_epi32(acc0, _mm256_unpacklo_epi16(v0, zero));
+            acc1 = _mm256_add_epi32(acc1, _mm256_unpackhi_epi16(v0, zero));
+            acc0 = _mm256_add_epi32(acc0, _mm256_unpacklo_epi16(v1, zero));
+            acc1 = _mm256_add_epi32(acc1, _mm256_unpackhi_epi16(v1, zero));
+            data += 64;
+        }
+        len -= n * 64;
+
+        _mm256_storeu_si256((__m256i *) lanes, _mm256_add_epi32(acc0, acc1));
+        for (int i = 0; i < 8; i++)
+            sum += lanes[i];
+    }
+
+    return cksum_generic(data, len, sum);
+}
+#endif
+
+static cksum_func_t cksum_func = cksum_generic;
+static cksum_impl_t cksum_impl = CKSUM_IMPL_GENERIC;
+static pthread_once_t cksum_once = PTHREAD_ONCE_INIT;
+
+static void cksum_init()
+{
+#ifdef CKSUM_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2"))
+    {
+        cksum_func = cksum_avx2;
+        cksum_impl = CKSUM_IMPL_AVX2;
+    }
+    else if (__builtin_cpu_supports("sse2"))
+    {
+        cksum_func = cksum_sse2;
+        cksum_impl = CKSUM_IMPL_SSE2;
+    }
+#endif
+}
+
+/* Folds a 64-bit sum into 32 bits */
+static inline uint32_t cksum_fold64(uint64_t sum)
+{
+    sum = (sum & 0xffffffff) + (sum >> 32);
+    sum = (sum & 0xffffffff) + (sum >> 32);
+    return (uint32_t) sum;
+}
+
+/* See cksum.h */
+uint32_t chitcp_cksum_partial(const void *data, size_t len, uint32_t sum)
+{
+    if (len < CKSUM_VECTOR_MIN)
+        return cksum_fold64(cksum_generic(data, len, sum));
+
+    pthread_once(&cksum_once, cksum_init);
+
+    return cksum_fold64(cksum_func(data, len, sum));
+}
+
+/* See cksum.h */
+uint16_t chitcp_cksum_fold(uint32_t sum)
+{
+    sum = (sum & 0xffff) + (sum >> 16);
+    sum = (sum & 0xffff) + (sum >> 16);
+
+    return (uint16_t) ~sum;
+}
+
+/* See cksum.h */
+uint16_t chitcp_cksum(const void *data, size_t len)
+{
+    return chitcp_cksum_fold(chitcp_cksum_partial(data, len, 0));
+}
+
+/* See cksum.h */
+uint16_t chitcp_cksum_update16(uint16_t cksum, uint16_t old, uint16_t new)
+{
+    uint32_t sum = (uint16_t) ~cksum + (uint16_t) ~old + new;
+
+    return chitcp_cksum_fold(sum);
+}
+
+/* See cksum.h */
+uint16_t chitcp_cksum_update32(uint16_t cksum, uint32_t old, uint32_t new)
+{
+    uint32_t sum = (uint16_t) ~cksum;
+
+    sum += (uint16_t) ~(old >> 16) + (uint16_t) ~(old & 0xffff);
+    sum += (new >> 16) + (new & 0xffff);
+
+    return chitcp_cksum_fold(sum);
+}
+
+/* See cksum.h */
+int chitcp_cksum_set_impl(cksum_impl_t impl)
+{
+    pthread_once(&cksum_once, cksum_init);
+
+    switch (impl)
+    {
+    case CKSUM_IMPL_AUTO:
+        cksum_init();
+        return CHITCP_OK;
+    case CKSUM_IMPL_GENERIC:
+        cksum_func = cksum_generic;
+        break;
+#ifdef CKSUM_X86
+    case CKSUM_IMPL_SSE2:
+        if (!__builtin_cpu_supports("sse2"))
+            return CHITCP_EINVAL;
+        cksum_func = cksum_sse2;
+        break;
+    case CKSUM_IMPL_AVX2:
+        if (!__builtin_cpu_supports("avx2"))
+            return CHITCP_EINVAL;
+        cksum_func = cksum_avx2;
+        break;
+#endif
+    default:
+        return CHITCP_EINVAL;
+    }
+
+    cksum_impl = impl;
+
+    return CHITCP_OK;
+}
+
+/* See cksum.h */
+const char *chitcp_cksum_impl_str()
+{
+    pthread_once(&cksum_once, cksum_init);
+
+    switch (cksum_impl)
+    {
+    case CKSUM_IMPL_SSE2:
+        return "sse2";
+    case CKSUM_IMPL_AVX2:
+        return "avx2";
+    default:
+        return "generic";
+    }
+}
@@ -51,6 +51,7 @@
 #include <sys/un.h>
 #include "daemon_api.h"
 #include "chitcp/chitcpd.h"
+#include "chitcp/utlist.h"
 
 static pthread_once_t daemon_socket_key_init = PTHREAD_ONCE_INIT;
 static pthread_key_t daemon_socket_key;
@@ -60,14 +61,214 @@ static void create_daemon_socket_key()
     pthread_key_create(&daemon_socket_key, NULL);
 }
 
+/* A request sent through the multiplexed connection, whose
+ * thread is waiting for the response */
+typedef struct mux_request
+{
+    uint64_t id;
+    bool_t done;
+    ChitcpdMsg *resp;
+    int fd;
+    pthread_cond_t cv;
+
+    struct mux_request *prev;
+    struct mux_request *next;
+} mux_request_t;
+
+/* If the CHITCPD_PIPELINE environment variable is set (to anything other
+ * than "0"), all the threads share a single connection to the daemon
+ * (instead of opening one connection per thread), and tag their requests
+ * with a request ID. The daemon handles these requests concurrently, so
+ * a thread blocked in a request (e.g., a RECV with no data) doesn't hold
+ * up the other threads.
+ *
+ * The responses are read by whichever waiting thread gets there first
+ * (the "reader"), which hands each response to the thread that sent
+ * the request. When the reader gets its own response, another waiting
+ * thread becomes the reader. */
+static struct
+{
+    pthread_once_t init;
+    bool_t enabled;
+    int sockfd;  /* or the error returned when connecting */
+
+    uint64_t next_id;
+    mux_request_t *pending;
+    bool_t reading;
+    int failed;  /* Error that made the connection unusable (or 0) */
+    pthread_mutex_t lock;
+
+    pthread_mutex_t lock_send;
+} mux = { .init = PTHREAD_ONCE_INIT,
+          .lock = PTHREAD_MUTEX_INITIALIZER,
+          .lock_send = PTHREAD_MUTEX_INITIALIZER };
+
+static int chitcpd_init_connection(int daemon_socket)
+{
+    ChitcpdMsg msg = CHITCPD_MSG__INIT;
+    ChitcpdInitArgs ia = CHITCPD_INIT_ARGS__INIT;
+    ChitcpdMsg *resp_p;
+    int rc;
+
+    /* Send INIT message */
+    msg.code = CHITCPD_MSG_CODE__INIT;
+    msg.init_args = &ia;
+    msg.init_args->connection_type = CHITCPD_CONNECTION_TYPE__COMMAND_CONNECTION;
+
+    rc = chitcpd_send_command(daemon_socket, &msg, &resp_p);
+    if (rc < 0)
+        return rc;
+
+    /* Unpack response */
+    assert(resp_p->resp != NULL);
+    rc = resp_p->resp->ret;
+    errno = resp_p->resp->error_code;
+    chitcpd_msg__free_unpacked(resp_p, NULL);
+
+    return rc;
+}
+
+static void mux_init()
+{
+    char *env = getenv("CHITCPD_PIPELINE");
+    int sockfd, rc;
+
+    if (env == NULL || env[0] == '\0' || strcmp(env, "0") == 0)
+        return;
+
+    /* The INIT message itself is not tagged (it is handled
+     * before the daemon starts dispatching requests) */
+    sockfd = chitcpd_connect();
+    if (sockfd >= 0 && (rc = chitcpd_init_connection(sockfd)) < 0)
+    {
+        close(sockfd);
+        sockfd = rc;
+    }
+
+    mux.sockfd = sockfd;
+    mux.enabled = TRUE;
+}
+
+/* Wakes up all the waiting threads after the connection has failed
+ * (called with mux.lock held) */
+static void mux_fail(int rc)
+{
+    mux_request_t *r;
+
+    mux.failed = rc;
+    DL_FOREACH(mux.pending, r)
+        pthread_cond_signal(&r->cv);
+}
+
+/* chitcpd_send_command on the multiplexed connection */
+static int mux_send_command(const ChitcpdMsg *req, ChitcpdMsg **resp_p, int *fd)
+{
+    mux_request_t r = { .done = FALSE, .resp = NULL, .fd = -1 };
+    ChitcpdMsg tagged = *req;
+    ChitcpdMsg *resp;
+    mux_request_t *p;
+    int rc, rfd;
+
+    pthread_mutex_lock(&mux.lock);
+    if (mux.failed)
+    {
+        rc = mux.failed;
+        pthread_mutex_unlock(&mux.lock);
+        return rc;
+    }
+    r.id = mux.next_id++;
+    pthread_cond_init(&r.cv, NULL);
+    DL_APPEND(mux.pending, &r);
+    pthread_mutex_unlock(&mux.lock);
+
+    tagged.has_request_id = TRUE;
+    tagged.request_id = r.id;
+
+    pthread_mutex_lock(&mux.lock_send);
+    rc = chitcpd_send_msg(mux.sockfd, &tagged);
+    pthread_mutex_unlock(&mux.lock_send);
+
+    pthread_mutex_lock(&mux.lock);
+    if (rc < 0 && !mux.failed)
+        mux_fail(rc);
+
+    while (!r.done && !mux.failed)
+    {
+        if (mux.reading)
+        {
+            pthread_cond_wait(&r.cv, &mux.lock);
+            continue;
+        }
+
+        /* Nobody is reading responses, so we become the reader */
+        mux.reading = TRUE;
+        pthread_mutex_unlock(&mux.lock);
+        rc = chitcpd_recv_msg_fd(mux.sockfd, &resp, &rfd);
+        pthread_mutex_lock(&mux.lock);
+        mux.reading = FALSE;
+
+        if (rc < 0)
+        {
+            mux_fail(rc);
+            break;
+        }
+
+        DL_FOREACH(mux.pending, p)
+        {
+            if (resp->has_request_id && p->id == resp->request_id)
+                break;
+        }
+
+        if (p == NULL)
+        {
+            /* A response to a request we never sent means we can no
+             * longer trust the stream, so we treat it like a malformed
+             * message (see chitcpd_recv_msg_fd) */
+            chitcpd_msg__free_unpacked(resp, NULL);
+            if (rfd >= 0)
+                close(rfd);
+            errno = EPROTO;
+            mux_fail(-2);
+            break;
+        }
+
+        p->resp = resp;
+        p->fd = rfd;
+        p->done = TRUE;
+        pthread_cond_signal(&p->cv);
+    }
+
+    DL_DELETE(mux.pending, &r);
+
+    /* If nobody is reading responses, another waiting thread takes over */
+    if (!mux.reading && mux.pending != NULL)
+        pthread_cond_signal(&mux.pending->cv);
+
+    rc = r.done? CHITCP_OK : mux.failed;
+    pthread_mutex_unlock(&mux.lock);
+    pthread_cond_destroy(&r.cv);
+
+    if (rc != CHITCP_OK)
+        return rc;
+
+    *resp_p = r.resp;
+    if (fd)
+        *fd = r.fd;
+    else if (r.fd >= 0)
+        close(r.fd);
+
+    return CHITCP_OK;
+}
+
 int chitcpd_get_socket()
 {
     void *daemon_socket_ptr;
     int daemon_socket;
     int rc;
-    ChitcpdMsg msg = CHITCPD_MSG__INIT;
-    ChitcpdInitArgs ia = CHITCPD_INIT_ARGS__INIT;
-    ChitcpdMsg *resp_p;
+
+    pthread_once(&mux.init, mux_init);
+    if (mux.enabled)
+        return mux.sockfd;
 
     pthread_once(&daemon_socket_key_init, create_daemon_socket_key);
 
@@ -87,21 +288,7 @@ int chitcpd_get_socket()
         if(daemon_socket < 0)
             return daemon_socket;
 
-        /* Send INIT message */
-        msg.code = CHITCPD_MSG_CODE__INIT;
-        msg.init_args = &ia;
-        msg.init_args->connection_type = CHITCPD_CONNECTION_TYPE__COMMAND_CONNECTION;
-
-        rc = chitcpd_send_command(daemon_socket, &msg, &resp_p);
-        if (rc < 0)
-            return rc;
-
-        /* Unpack response */
-        assert(resp_p->resp != NULL);
-        rc = resp_p->resp->ret;
-        errno = resp_p->resp->error_code;
-        chitcpd_msg__free_unpacked(resp_p, NULL);
-
+        rc = chitcpd_init_connection(daemon_socket);
         if (rc < 0)
             return rc;
 
@@ -144,7 +331,25 @@ int chitcpd_send_command(int sockfd, const ChitcpdMsg *req, ChitcpdMsg **resp_p)
 {
     int r; /* return value */
 
-    r = chitcpd_send_and_recv_msg(sockfd, req, resp_p);
+    if (mux.enabled && sockfd == mux.sockfd)
+        r = mux_send_command(req, resp_p, NULL);
+    else
+        r = chitcpd_send_and_recv_msg(sockfd, req, resp_p);
+    if (r == -1)
+        fprintf(stderr, "Daemon socket disconnected\n");
+
+    return r;
+}
+
+/* See daemon_api.h */
+int chitcpd_send_command_fd(int sockfd, const ChitcpdMsg *req, ChitcpdMsg **resp_p, int *fd)
+{
+    int r; /* return value */
+
+    if (mux.enabled && sockfd == mux.sockfd)
+        r = mux_send_command(req, resp_p, fd);
+    else
+        r = chitcpd_send_and_recv_msg_fd(sockfd, req, resp_p, fd);
     if (r == -1)
         fprintf(stderr, "Daemon socket disconnected\n");
 
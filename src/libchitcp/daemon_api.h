@@ -51,6 +51,19 @@
     errno = EPROTO; \
     return -1; }
 
+/*
+ * chitcpd_get_socket - Get the connection to the local chiTCP daemon
+ *
+ * Each thread gets its own connection (created on the first call),
+ * unless the CHITCPD_PIPELINE environment variable is set. In that case,
+ * all the threads share a single connection, and chitcpd_send_command
+ * tags their requests so the daemon can handle them concurrently (with
+ * at most CHITCPD_HANDLER_MAX_WORKERS of them being handled at a time;
+ * beyond that, requests fail with EAGAIN).
+ *
+ * Returns: The socket descriptor of the connection to the daemon.
+ *          A negative value if there was an error connecting to the daemon.
+ */
 int chitcpd_get_socket();
 
 /*
@@ -82,4 +95,17 @@ int chitcpd_connect();
  */
 int chitcpd_send_command(int sockfd, const ChitcpdMsg *req, ChitcpdMsg **resp_p);
 
+/*
+ * chitcpd_send_command_fd - Send a command to the local chiTCP daemon,
+ *                           and receive the file descriptor passed
+ *                           with the response (if any)
+ *
+ * Same as chitcpd_send_command, except for:
+ *
+ * fd: Output parameter to return the file descriptor passed with the
+ *     response, or -1 if there was none. The caller must close it.
+ *
+ */
+int chitcpd_send_command_fd(int sockfd, const ChitcpdMsg *req, ChitcpdMsg **resp_p, int *fd);
+
 #endif /* DAEMON_API_H_ */
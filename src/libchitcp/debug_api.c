@@ -596,3 +596,175 @@ int chitcpd_wait_for_state(int sockfd, tcp_state_t tcp_state)
 
     return ret;
 }
+
+uint8_t *chitcpd_get_socket_trace(int sockfd, size_t *len)
+{
+    ChitcpdMsg req = CHITCPD_MSG__INIT;
+    ChitcpdGetSocketTraceArgs gsta = CHITCPD_GET_SOCKET_TRACE_ARGS__INIT;
+    ChitcpdMsg *resp_p;
+    uint8_t *ret;
+    int rc;
+
+    int daemon_socket = chitcpd_get_socket();
+    if (daemon_socket < 0)
+        return NULL;
+
+    /* Create request */
+    req.code = CHITCPD_MSG_CODE__GET_SOCKET_TRACE;
+    req.get_socket_trace_args = &gsta;
+
+    gsta.sockfd = sockfd;
+
+    rc = chitcpd_send_command(daemon_socket, &req, &resp_p);
+
+    if (rc != CHITCP_OK)
+    {
+        perror("chitcpd_get_socket_trace: Error when sending command to chiTCP daemon");
+        return NULL;
+    }
+
+    /* Unpack response */
+    assert(resp_p->resp != NULL);
+    if (resp_p->resp->ret != CHITCP_OK || !resp_p->resp->has_trace)
+    {
+        errno = resp_p->resp->error_code;
+        chitcpd_msg__free_unpacked(resp_p, NULL);
+        return NULL;
+    }
+
+    ret = malloc(resp_p->resp->trace.len);
+    if (ret != NULL)
+    {
+        memcpy(ret, resp_p->resp->trace.data, resp_p->resp->trace.len);
+        *len = resp_p->resp->trace.len;
+    }
+
+    chitcpd_msg__free_unpacked(resp_p, NULL);
+
+    return ret;
+}
+
+debug_socket_stats_t *chitcpd_get_socket_stats(int sockfd)
+{
+    ChitcpdMsg req = CHITCPD_MSG__INIT;
+    ChitcpdGetSocketStatsArgs gssa = CHITCPD_GET_SOCKET_STATS_ARGS__INIT;
+    ChitcpdMsg *resp_p;
+    ChitcpdSocketStats *stats;
+    debug_socket_stats_t *ret;
+    int rc;
+
+    int daemon_socket = chitcpd_get_socket();
+    if (daemon_socket < 0)
+        return NULL;
+
+    /* Create request */
+    req.code = CHITCPD_MSG_CODE__GET_SOCKET_STATS;
+    req.get_socket_stats_args = &gssa;
+
+    gssa.sockfd = sockfd;
+
+    rc = chitcpd_send_command(daemon_socket, &req, &resp_p);
+
+    if (rc != CHITCP_OK)
+    {
+        perror("chitcpd_get_socket_stats: Error when sending command to chiTCP daemon");
+        return NULL;
+    }
+
+    /* Unpack response */
+    assert(resp_p->resp != NULL);
+    if (resp_p->resp->ret != CHITCP_OK || resp_p->resp->socket_stats == NULL)
+    {
+        errno = resp_p->resp->error_code;
+        chitcpd_msg__free_unpacked(resp_p, NULL);
+        return NULL;
+    }
+
+    ret = malloc(sizeof(debug_socket_stats_t));
+    if (ret != NULL)
+    {
+        stats = resp_p->resp->socket_stats;
+        ret->segs_sent = stats->segs_sent;
+        ret->segs_rcvd = stats->segs_rcvd;
+        ret->bytes_sent = stats->bytes_sent;
+        ret->bytes_rcvd = stats->bytes_rcvd;
+        ret->retransmits = stats->retransmits;
+        ret->dup_acks = stats->dup_acks;
+        ret->zero_window_probes = stats->zero_window_probes;
+        ret->out_of_order = stats->out_of_order;
+        ret->send_blocked_ns = stats->send_blocked_ns;
+        ret->recv_blocked_ns = stats->recv_blocked_ns;
+        ret->rtt_samples = stats->rtt_samples;
+        ret->rtt_last_ns = stats->rtt_last_ns;
+        ret->rtt_min_ns = stats->rtt_min_ns;
+        ret->srtt_ns = stats->srtt_ns;
+    }
+
+    chitcpd_msg__free_unpacked(resp_p, NULL);
+
+    return ret;
+}
+
+int chitcpd_get_latency(bool_t reset, debug_latency_t **latencies)
+{
+    ChitcpdMsg req = CHITCPD_MSG__INIT;
+    ChitcpdGetLatencyArgs gla = CHITCPD_GET_LATENCY_ARGS__INIT;
+    ChitcpdMsg *resp_p;
+    debug_latency_t *ret;
+    int n, rc;
+
+    int daemon_socket = chitcpd_get_socket();
+    if (daemon_socket < 0)
+        return -1;
+
+    /* Create request */
+    req.code = CHITCPD_MSG_CODE__GET_LATENCY;
+    req.get_latency_args = &gla;
+
+    gla.reset = reset;
+
+    rc = chitcpd_send_command(daemon_socket, &req, &resp_p);
+
+    if (rc != CHITCP_OK)
+    {
+        perror("chitcpd_get_latency: Error when sending command to chiTCP daemon");
+        return -1;
+    }
+
+    /* Unpack response */
+    assert(resp_p->resp != NULL);
+    if (resp_p->resp->ret != CHITCP_OK)
+    {
+        errno = resp_p->resp->error_code;
+        chitcpd_msg__free_unpacked(resp_p, NULL);
+        return -1;
+    }
+
+    n = resp_p->resp->n_latency;
+    ret = calloc(n > 0 ? n : 1, sizeof(debug_latency_t));
+    if (ret == NULL)
+    {
+        chitcpd_msg__free_unpacked(resp_p, NULL);
+        errno = ENOMEM;
+        return -1;
+    }
+
+    for (int i = 0; i < n; i++)
+    {
+        ChitcpdLatency *latency = resp_p->resp->latency[i];
+
+        strncpy(ret[i].group, latency->group, sizeof(ret[i].group) - 1);
+        strncpy(ret[i].name, latency->name, sizeof(ret[i].name) - 1);
+        ret[i].count = latency->count;
+        ret[i].mean_ns = latency->mean_ns;
+        ret[i].p50_ns = latency->p50_ns;
+        ret[i].p99_ns = latency->p99_ns;
+        ret[i].p999_ns = latency->p999_ns;
+        ret[i].max_ns = latency->max_ns;
+    }
+
+    chitcpd_msg__free_unpacked(resp_p, NULL);
+
+    *latencies = ret;
+    return n;
+}
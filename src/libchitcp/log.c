@@ -40,77 +40,272 @@
  */
 
 #include <stdio.h>
+#include <stdlib.h>
 #include <stdarg.h>
+#include <stdalign.h>
+#include <stdatomic.h>
+#include <stdbool.h>
 #include <string.h>
 #include <time.h>
 #include <pthread.h> /* for pthread_self */
 
 #include "chitcp/log.h"
 #include "chitcp/addr.h"
+#include "chitcp/types.h"
+#include "chitcp/utils.h"
 
 
 /* Logging level. Set by default to print just errors */
-static int loglevel = ERROR;
+int chilog_loglevel = ERROR;
 
 
-void chitcp_setloglevel(loglevel_t level)
-{
-    loglevel = level;
-}
+/*
+ * Asynchronous logging
+ *
+ * Each thread that logs a message while asynchronous logging is enabled
+ * gets its own single-producer single-consumer ring of fixed-size records.
+ * The producer (the thread) advances the head, and the consumer (the
+ * logging thread) advances the tail, so neither side ever takes a lock.
+ * The list of rings is only modified when a thread logs its first message
+ * and when the logging thread frees the ring of a thread that has exited,
+ * so it is protected by a mutex.
+ */
+
+/* Size of a record, including the timestamp, level, and thread name */
+#define LOG_RECORD_SIZE (512)
 
+/* Maximum number of records written by the logging thread before it
+ * checks again whether it has to stop (and releases the list of rings) */
+#define LOG_MAX_BATCH (4096)
 
-void chilog(loglevel_t level, char *fmt, ...)
+/* How often the logging thread wakes up if no one wakes it up */
+#define LOG_WAKEUP_INTERVAL_MS (100)
+
+typedef struct log_record
 {
     struct timespec ts;
-    struct tm *tm;
-    char timefmt[64], buf[80], *levelstr;
-    va_list argptr;
+    loglevel_t level;
+    char threadname[16];
+    char msg[LOG_RECORD_SIZE - sizeof(struct timespec) - sizeof(loglevel_t) - 16];
+} log_record_t;
 
-    if(level > loglevel)
-        return;
+typedef struct log_ring
+{
+    /* Written by the producer */
+    alignas(64) _Atomic size_t head;
+    char threadname[16];
 
+    /* Written by the consumer */
+    alignas(64) _Atomic size_t tail;
+
+    /* Set when the producer thread exits */
+    atomic_bool orphaned;
+
+    size_t mask;
+    struct log_ring *next;
+    log_record_t records[];
+} log_ring_t;
+
+static atomic_bool async_enabled = false;
+static bool async_running = false;
+static pthread_mutex_t async_ctl_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_t async_thread;
+static pthread_mutex_t async_wake_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t async_wake_cv = PTHREAD_COND_INITIALIZER;
+static atomic_bool async_wakeup = false;
+static atomic_bool async_stopping = false;
+static atomic_ulong async_dropped = 0;
+
+static pthread_mutex_t rings_lock = PTHREAD_MUTEX_INITIALIZER;
+static log_ring_t *rings = NULL;
+static size_t rings_size = CHILOG_ASYNC_DEFAULT_RING_SIZE;
+
+static pthread_key_t ring_key;
+static pthread_once_t ring_key_once = PTHREAD_ONCE_INIT;
+static pthread_once_t atexit_once = PTHREAD_ONCE_INIT;
+static _Thread_local log_ring_t *my_ring = NULL;
+
+
+void chitcp_setloglevel(loglevel_t level)
+{
+    chilog_loglevel = level;
+}
 
-    clock_gettime(CLOCK_REALTIME, &ts);
-    if((tm = localtime(&ts.tv_sec)) != NULL)
-    {
-            strftime(timefmt, sizeof(timefmt), "%H:%M:%S.%%09u", tm);
-            snprintf(buf, sizeof(buf), timefmt, ts.tv_nsec);
-    }
 
+static const char *chilog_levelstr(loglevel_t level)
+{
     switch(level)
     {
     case CRITICAL:
-        levelstr = "CRITIC";
-        break;
+        return "CRITIC";
     case ERROR:
-        levelstr = "ERROR";
-        break;
+        return "ERROR";
     case WARNING:
-        levelstr = "WARN";
-        break;
+        return "WARN";
     case MINIMAL:
-        levelstr = "MINIMAL";
-        break;
+        return "MINIMAL";
     case INFO:
-        levelstr = "INFO";
-        break;
+        return "INFO";
     case DEBUG:
-        levelstr = "DEBUG";
-        break;
+        return "DEBUG";
     case TRACE:
-        levelstr = "TRACE";
-        break;
+        return "TRACE";
     default:
-        levelstr = "UNKNOWN";
-        break;
+        return "UNKNOWN";
     }
+}
+
+
+/* Takes the stdout lock to keep a multi-line message together. There is
+ * nothing to lock in asynchronous mode (and each thread's messages come
+ * out in order anyway) */
+static bool chilog_lock()
+{
+    if(atomic_load_explicit(&async_enabled, memory_order_relaxed))
+        return false;
+
+    flockfile(stdout);
+    return true;
+}
+
+
+static void chilog_unlock(bool locked)
+{
+    if(locked)
+        funlockfile(stdout);
+}
+
+
+static void ring_orphan(void *arg)
+{
+    log_ring_t *ring = arg;
+
+    /* The logging thread will free the ring once it is empty. If this
+     * thread logs anything else on its way out, it will get a new ring */
+    my_ring = NULL;
+    atomic_store_explicit(&ring->orphaned, true, memory_order_release);
+}
+
+
+static void ring_key_create()
+{
+    pthread_key_create(&ring_key, ring_orphan);
+}
+
+
+static log_ring_t *ring_get()
+{
+    log_ring_t *ring;
+    size_t size;
+
+    if(my_ring)
+        return my_ring;
+
+    pthread_once(&ring_key_once, ring_key_create);
+
+    pthread_mutex_lock(&rings_lock);
+    size = rings_size;
+    ring = calloc(1, sizeof(log_ring_t) + size * sizeof(log_record_t));
+    if(ring)
+    {
+        ring->mask = size - 1;
+        pthread_getname_np(pthread_self(), ring->threadname, sizeof(ring->threadname));
+        ring->next = rings;
+        rings = ring;
+    }
+    pthread_mutex_unlock(&rings_lock);
+
+    if(ring)
+    {
+        pthread_setspecific(ring_key, ring);
+        my_ring = ring;
+    }
+
+    return ring;
+}
+
+
+/* Returns false if the message could not be handed over to the logging
+ * thread (and has to be printed synchronously) */
+static bool chilog_async(loglevel_t level, char *fmt, va_list argptr)
+{
+    log_ring_t *ring;
+    log_record_t *rec;
+    size_t head, tail;
+    int n;
+
+    if((ring = ring_get()) == NULL)
+        return false;
+
+    head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+    tail = atomic_load_explicit(&ring->tail, memory_order_acquire);
+    if(head - tail > ring->mask)
+    {
+        atomic_fetch_add_explicit(&async_dropped, 1, memory_order_relaxed);
+        return true;
+    }
+
+    rec = &ring->records[head & ring->mask];
+    clock_gettime(CLOCK_REALTIME, &rec->ts);
+    rec->level = level;
+    memcpy(rec->threadname, ring->threadname, sizeof(rec->threadname));
+    n = vsnprintf(rec->msg, sizeof(rec->msg), fmt, argptr);
+    if(n >= (int) sizeof(rec->msg))
+        memcpy(rec->msg + sizeof(rec->msg) - 4, "...", 4);
+
+    atomic_store_explicit(&ring->head, head + 1, memory_order_release);
+
+    /* Only the first message after the logging thread has drained the
+     * rings has to wake it up */
+    if(!atomic_load_explicit(&async_wakeup, memory_order_relaxed) &&
+       !atomic_exchange(&async_wakeup, true))
+    {
+        pthread_mutex_lock(&async_wake_lock);
+        pthread_cond_signal(&async_wake_cv);
+        pthread_mutex_unlock(&async_wake_lock);
+    }
+
+    return true;
+}
+
+
+void (chilog)(loglevel_t level, char *fmt, ...)
+{
+    struct timespec ts;
+    struct tm tm;
+    char timefmt[64], buf[80];
+    const char *levelstr;
+    va_list argptr;
+
+    if(level > chilog_loglevel)
+        return;
+
+    if(atomic_load_explicit(&async_enabled, memory_order_relaxed))
+    {
+        bool queued;
+
+        va_start(argptr, fmt);
+        queued = chilog_async(level, fmt, argptr);
+        va_end(argptr);
+        if(queued)
+            return;
+    }
+
+    clock_gettime(CLOCK_REALTIME, &ts);
+    if(localtime_r(&ts.tv_sec, &tm) != NULL)
+    {
+            strftime(timefmt, sizeof(timefmt), "%H:%M:%S.%%09u", &tm);
+            snprintf(buf, sizeof(buf), timefmt, ts.tv_nsec);
+    }
+
+    levelstr = chilog_levelstr(level);
 
     /* Get the thread's name. */
     char threadname[16];
     pthread_getname_np(pthread_self(), threadname, 16);
 
     flockfile(stdout);
-    if (loglevel == MINIMAL)
+    if (chilog_loglevel == MINIMAL)
         printf("[%s] %16s ", buf, threadname);
     else
         printf("[%s] %7s %16s ", buf, levelstr, threadname);
@@ -122,6 +317,285 @@ void chilog(loglevel_t level, char *fmt, ...)
     fflush(stdout);
 }
 
+
+/* Output buffer of the logging thread */
+typedef struct log_output
+{
+    char buf[65536];
+    size_t len;
+
+    /* localtime is only called when the second changes */
+    time_t sec;
+    char secstr[16];
+} log_output_t;
+
+
+static void log_output_flush(log_output_t *out)
+{
+    if(out->len > 0)
+    {
+        fwrite(out->buf, 1, out->len, stdout);
+        fflush(stdout);
+        out->len = 0;
+    }
+}
+
+
+static void log_output_record(log_output_t *out, const struct timespec *ts, loglevel_t level, const char *threadname, const char *msg)
+{
+    char *p;
+    size_t avail;
+    int n;
+
+    if(sizeof(out->buf) - out->len < LOG_RECORD_SIZE + 64)
+        log_output_flush(out);
+
+    if(ts->tv_sec != out->sec || out->secstr[0] == '\0')
+    {
+        struct tm tm;
+
+        out->sec = ts->tv_sec;
+        if(localtime_r(&ts->tv_sec, &tm) == NULL ||
+           strftime(out->secstr, sizeof(out->secstr), "%H:%M:%S", &tm) == 0)
+            strcpy(out->secstr, "??:??:??");
+    }
+
+    p = out->buf + out->len;
+    avail = sizeof(out->buf) - out->len;
+    if (chilog_loglevel == MINIMAL)
+        n = snprintf(p, avail, "[%s.%09lu] %16.16s %s\n", out->secstr, (unsigned long) ts->tv_nsec, threadname, msg);
+    else
+        n = snprintf(p, avail, "[%s.%09lu] %7s %16.16s %s\n", out->secstr, (unsigned long) ts->tv_nsec, chilog_levelstr(level), threadname, msg);
+
+    if(n > 0)
+        out->len += ((size_t) n < avail) ? (size_t) n : avail - 1;
+}
+
+
+static bool timespec_lt(const struct timespec *a, const struct timespec *b)
+{
+    return a->tv_sec < b->tv_sec || (a->tv_sec == b->tv_sec && a->tv_nsec < b->tv_nsec);
+}
+
+
+/* Writes out pending records, oldest first. Returns the number of records
+ * that were written. */
+static int chilog_async_drain(log_output_t *out, unsigned long *reported)
+{
+    log_ring_t *ring, *best, **prev;
+    log_record_t *rec, *bestrec = NULL;
+    unsigned long dropped;
+    size_t head, tail;
+    int nrecords = 0;
+
+    pthread_mutex_lock(&rings_lock);
+
+    while(nrecords < LOG_MAX_BATCH)
+    {
+        best = NULL;
+        for(ring = rings; ring; ring = ring->next)
+        {
+            tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+            head = atomic_load_explicit(&ring->head, memory_order_acquire);
+            if(tail == head)
+                continue;
+
+            rec = &ring->records[tail & ring->mask];
+            if(!best || timespec_lt(&rec->ts, &bestrec->ts))
+            {
+                best = ring;
+                bestrec = rec;
+            }
+        }
+
+        if(!best)
+            break;
+
+        log_output_record(out, &bestrec->ts, bestrec->level, bestrec->threadname, bestrec->msg);
+        tail = atomic_load_explicit(&best->tail, memory_order_relaxed);
+        atomic_store_explicit(&best->tail, tail + 1, memory_order_release);
+        nrecords++;
+    }
+
+    dropped = atomic_load_explicit(&async_dropped, memory_order_relaxed);
+    if(dropped != *reported)
+    {
+        struct timespec ts;
+
+        clock_gettime(CLOCK_REALTIME, &ts);
+        char msg[80];
+        snprintf(msg, sizeof(msg), "Dropped %lu log messages (%lu in total)", dropped - *reported, dropped);
+        log_output_record(out, &ts, WARNING, "chilog", msg);
+        *reported = dropped;
+    }
+
+    log_output_flush(out);
+
+    /* Free the rings of threads that have exited, once they are empty */
+    prev = &rings;
+    while((ring = *prev) != NULL)
+    {
+        if(atomic_load_explicit(&ring->orphaned, memory_order_acquire) &&
+           atomic_load_explicit(&ring->tail, memory_order_relaxed) ==
+           atomic_load_explicit(&ring->head, memory_order_acquire))
+        {
+            *prev = ring->next;
+            free(ring);
+        }
+        else
+            prev = &ring->next;
+    }
+
+    pthread_mutex_unlock(&rings_lock);
+
+    return nrecords;
+}
+
+
+static void *chilog_async_thread(void *args)
+{
+    log_output_t *out = args;
+    unsigned long reported = 0;
+    struct timespec deadline;
+    bool stopping;
+    int nrecords;
+
+    set_thread_name(pthread_self(), "chilog");
+
+    for(;;)
+    {
+        stopping = atomic_load(&async_stopping);
+
+        /* Any message logged after this point will wake us up */
+        atomic_store(&async_wakeup, false);
+        nrecords = chilog_async_drain(out, &reported);
+
+        if(nrecords == LOG_MAX_BATCH)
+            continue;
+        if(stopping)
+            break;
+
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        deadline.tv_nsec += LOG_WAKEUP_INTERVAL_MS * 1000000L;
+        if(deadline.tv_nsec >= 1000000000L)
+        {
+            deadline.tv_sec++;
+            deadline.tv_nsec -= 1000000000L;
+        }
+        pthread_mutex_lock(&async_wake_lock);
+        while(!atomic_load(&async_wakeup) && !atomic_load(&async_stopping))
+            if(pthread_cond_timedwait(&async_wake_cv, &async_wake_lock, &deadline) != 0)
+                break;
+        pthread_mutex_unlock(&async_wake_lock);
+    }
+
+    free(out);
+    return NULL;
+}
+
+
+static void chilog_async_atexit()
+{
+    chilog_async_stop();
+}
+
+
+static void chilog_async_register_atexit()
+{
+    atexit(chilog_async_atexit);
+}
+
+
+/* See log.h */
+int chilog_async_start(unsigned int ring_size)
+{
+    log_output_t *out;
+    size_t size = 1;
+
+    if(ring_size == 0)
+        ring_size = CHILOG_ASYNC_DEFAULT_RING_SIZE;
+    while(size < ring_size)
+        size <<= 1;
+
+    pthread_mutex_lock(&async_ctl_lock);
+    if(async_running)
+    {
+        pthread_mutex_unlock(&async_ctl_lock);
+        return CHITCP_EINVAL;
+    }
+
+    pthread_mutex_lock(&rings_lock);
+    rings_size = size;
+    pthread_mutex_unlock(&rings_lock);
+
+    out = calloc(1, sizeof(log_output_t));
+    if(!out)
+    {
+        pthread_mutex_unlock(&async_ctl_lock);
+        return CHITCP_ENOMEM;
+    }
+
+    atomic_store(&async_dropped, 0);
+    atomic_store(&async_stopping, false);
+    atomic_store(&async_wakeup, false);
+    if(pthread_create(&async_thread, NULL, chilog_async_thread, out) != 0)
+    {
+        free(out);
+        pthread_mutex_unlock(&async_ctl_lock);
+        return CHITCP_ETHREAD;
+    }
+
+    pthread_once(&atexit_once, chilog_async_register_atexit);
+
+    async_running = true;
+    atomic_store(&async_enabled, true);
+    pthread_mutex_unlock(&async_ctl_lock);
+
+    return CHITCP_OK;
+}
+
+
+/* See log.h */
+int chilog_async_stop()
+{
+    pthread_mutex_lock(&async_ctl_lock);
+    if(!async_running)
+    {
+        pthread_mutex_unlock(&async_ctl_lock);
+        return CHITCP_EINVAL;
+    }
+
+    atomic_store(&async_enabled, false);
+    pthread_mutex_lock(&async_wake_lock);
+    atomic_store(&async_stopping, true);
+    pthread_cond_signal(&async_wake_cv);
+    pthread_mutex_unlock(&async_wake_lock);
+    pthread_join(async_thread, NULL);
+
+    async_running = false;
+    pthread_mutex_unlock(&async_ctl_lock);
+
+    return CHITCP_OK;
+}
+
+
+/* See log.h */
+unsigned long chilog_async_dropped()
+{
+    return atomic_load(&async_dropped);
+}
+
+
+/* See log.h */
+void chilog_set_thread_name(const char *name)
+{
+    if(my_ring)
+    {
+        strncpy(my_ring->threadname, name, sizeof(my_ring->threadname) - 1);
+        my_ring->threadname[sizeof(my_ring->threadname) - 1] = '\0';
+    }
+}
+
 static char* srcdst_str(struct sockaddr *src, struct sockaddr *dst, char *buf, int len)
 {
     char ipsrc[INET6_ADDRSTRLEN], ipdst[INET6_ADDRSTRLEN];
@@ -140,9 +614,9 @@ static char* srcdst_str(struct sockaddr *src, struct sockaddr *dst, char *buf, i
     return buf;
 }
 
-void chilog_tcp_minimal(struct sockaddr *src, struct sockaddr *dst, int sockfd, tcp_packet_t *packet, char* prefix)
+void (chilog_tcp_minimal)(struct sockaddr *src, struct sockaddr *dst, int sockfd, tcp_packet_t *packet, char* prefix)
 {
-    if(loglevel != MINIMAL)
+    if(chilog_loglevel != MINIMAL)
         return;
 
     tcphdr_t *header = (tcphdr_t*) packet->raw;
@@ -183,16 +657,16 @@ void chilog_tcp_minimal(struct sockaddr *src, struct sockaddr *dst, int sockfd,
                     sockfd, prefix, srcdst, flags, seqstr, ackstr, chitcp_ntohs(header->win), payload_len);
 }
 
-void chilog_tcp(loglevel_t level, tcp_packet_t *packet, char prefix)
+void (chilog_tcp)(loglevel_t level, tcp_packet_t *packet, char prefix)
 {
-    if(level > loglevel)
+    if(level > chilog_loglevel)
         return;
 
     tcphdr_t *header = (tcphdr_t*) packet->raw;
     uint8_t *payload = TCP_PAYLOAD_START(packet);
     uint16_t payload_len = TCP_PAYLOAD_LEN(packet);
 
-    flockfile(stdout);
+    bool locked = chilog_lock();
     chilog(level, "   ######################################################################");
 
     chilog(level, "%c  Src: %u  Dest: %u  Seq: %u  Ack: %u  Doff: %u  Win: %u",
@@ -224,28 +698,28 @@ void chilog_tcp(loglevel_t level, tcp_packet_t *packet, char prefix)
         chilog(level, "%c  No Payload", prefix);
     }
     chilog(level, "   ######################################################################");
-    funlockfile(stdout);
+    chilog_unlock(locked);
 }
 
 
-void chilog_chitcp(loglevel_t level, uint8_t *packet, char prefix)
+void (chilog_chitcp)(loglevel_t level, uint8_t *packet, char prefix)
 {
-    if(level > loglevel)
+    if(level > chilog_loglevel)
         return;
 
     chitcphdr_t *header = (chitcphdr_t*) packet;
 
-    flockfile(stdout);
+    bool locked = chilog_lock();
     chilog(level, "   ======================================================================");
     chilog(level, "%c  Payload length: %i", prefix, chitcp_ntohs(header->payload_len));
     chilog(level, "%c  Protocol: %i", prefix, header->proto);
     chilog(level, "   ======================================================================");
-    funlockfile(stdout);
+    chilog_unlock(locked);
 }
 
 
 // Based on http://stackoverflow.com/questions/7775991/how-to-get-hexdump-of-a-structure-data
-void chilog_hex (loglevel_t level, void *data, int len)
+void (chilog_hex) (loglevel_t level, void *data, int len)
 {
     int i;
     char buf[12];
@@ -47,6 +47,8 @@
 #include "chitcp/types.h"
 #include "chitcp/packet.h"
 #include "chitcp/log.h"
+#include "chitcp/pool.h"
+#include "chitcp/cksum.h"
 
 /* See packet.h */
 uint16_t chitcp_ntohs(uint16_t netshort)
@@ -72,15 +74,34 @@ uint32_t chitcp_htonl(uint32_t hostlong)
     return htonl(hostlong);
 }
 
+/* See packet.h */
+int chitcp_tcp_packet_alloc(tcp_packet_t *packet, size_t headroom, size_t length)
+{
+    uint8_t *buffer = chitcp_pool_alloc(headroom + length);
+
+    if (buffer == NULL)
+        return CHITCP_ENOMEM;
+
+    packet->raw = buffer + headroom;
+    packet->length = length;
+    packet->headroom = headroom;
+
+    return CHITCP_OK;
+}
+
 /* See packet.h */
 int chitcp_tcp_packet_init(tcp_packet_t *packet, const uint8_t* payload, uint16_t payload_len)
 {
     tcphdr_t *header;
 
-    packet->length = TCP_HEADER_NOOPTIONS_SIZE + payload_len;
-    packet->raw = calloc(packet->length, 1);
+    if (chitcp_tcp_packet_alloc(packet, TCP_PACKET_HEADROOM, TCP_HEADER_NOOPTIONS_SIZE + payload_len) != CHITCP_OK)
+        return CHITCP_ENOMEM;
+
     header = (tcphdr_t*) packet->raw;
 
+    /* The payload is copied below, so we only need to zero out the header */
+    memset(header, 0, TCP_HEADER_NOOPTIONS_SIZE);
+
     // No TCP options
     header->doff = TCP_HEADER_NOOPTIONS_SIZE / sizeof(uint32_t);
 
@@ -93,7 +114,62 @@ int chitcp_tcp_packet_init(tcp_packet_t *packet, const uint8_t* payload, uint16_
 /* See packet.h */
 void chitcp_tcp_packet_free(tcp_packet_t *packet)
 {
-    free((void *) packet->raw);
+    chitcp_pool_free(TCP_PACKET_BUFFER(packet));
+}
+
+/* See packet.h */
+int chitcp_tcp_packet_clone(tcp_packet_t *dst, const tcp_packet_t *src)
+{
+    chitcp_pool_ref(TCP_PACKET_BUFFER(src));
+    dst->raw = src->raw;
+    dst->length = src->length;
+    dst->headroom = src->headroom;
+
+    return dst->length;
+}
+
+/* See packet.h */
+int chitcp_tcp_packet_unshare(tcp_packet_t *packet)
+{
+    tcp_packet_t copy;
+
+    if (chitcp_pool_refcount(TCP_PACKET_BUFFER(packet)) == 1)
+        return CHITCP_OK;
+
+    if (chitcp_tcp_packet_alloc(&copy, packet->headroom, packet->length) != CHITCP_OK)
+        return CHITCP_ENOMEM;
+
+    memcpy(copy.raw, packet->raw, packet->length);
+    chitcp_tcp_packet_free(packet);
+    *packet = copy;
+
+    return CHITCP_OK;
+}
+
+/* See packet.h */
+uint8_t *chitcp_tcp_packet_push(tcp_packet_t *packet, size_t len)
+{
+    if (len > packet->headroom)
+        return NULL;
+
+    packet->raw -= len;
+    packet->length += len;
+    packet->headroom -= len;
+
+    return packet->raw;
+}
+
+/* See packet.h */
+uint8_t *chitcp_tcp_packet_pull(tcp_packet_t *packet, size_t len)
+{
+    if (len > packet->length)
+        return NULL;
+
+    packet->raw += len;
+    packet->length -= len;
+    packet->headroom += len;
+
+    return packet->raw;
 }
 
 
@@ -105,9 +181,10 @@ int chitcp_packet_list_destroy(tcp_packet_list_t **pl)
 
     DL_FOREACH_SAFE(*pl,elt,tmp)
     {
+        chitcp_tcp_packet_free(elt->packet);
         free(elt->packet);
         DL_DELETE(*pl,elt);
-        free(elt);
+        chitcp_pool_free(elt);
     }
 
     return CHITCP_OK;
@@ -116,7 +193,7 @@ int chitcp_packet_list_destroy(tcp_packet_list_t **pl)
 /* See packet.h */
 int chitcp_packet_list_prepend(tcp_packet_list_t **pl, tcp_packet_t *packet)
 {
-    tcp_packet_list_t *elt = calloc(1, sizeof(tcp_packet_list_t));
+    tcp_packet_list_t *elt = chitcp_pool_calloc(1, sizeof(tcp_packet_list_t));
 
     elt->packet = packet;
 
@@ -128,7 +205,7 @@ int chitcp_packet_list_prepend(tcp_packet_list_t **pl, tcp_packet_t *packet)
 /* See packet.h */
 int chitcp_packet_list_append(tcp_packet_list_t **pl, tcp_packet_t *packet)
 {
-    tcp_packet_list_t *elt = calloc(1, sizeof(tcp_packet_list_t));
+    tcp_packet_list_t *elt = chitcp_pool_calloc(1, sizeof(tcp_packet_list_t));
 
     elt->packet = packet;
 
@@ -140,7 +217,10 @@ int chitcp_packet_list_append(tcp_packet_list_t **pl, tcp_packet_t *packet)
 /* See packet.h */
 int chitcp_packet_list_pop_head(tcp_packet_list_t **pl)
 {
-    DL_DELETE(*pl,*pl);
+    tcp_packet_list_t *elt = *pl;
+
+    DL_DELETE(*pl,elt);
+    chitcp_pool_free(elt);
 
     return CHITCP_OK;
 }
@@ -154,4 +234,75 @@ int chitcp_packet_list_size(tcp_packet_list_t *pl)
     DL_COUNT(pl, elt, count);
 
     return count;
-}
\ No newline at end of file
+}
+
+/* Returns the IPv4 address in addr (including IPv4-mapped IPv6
+ * addresses), or NULL if it is not an IPv4 address */
+static const struct in_addr *tcp_checksum_addr4(const struct sockaddr *addr)
+{
+    const struct sockaddr_in6 *addr6 = (const struct sockaddr_in6 *) addr;
+
+    if (addr->sa_family == AF_INET)
+        return &((const struct sockaddr_in *) addr)->sin_addr;
+    else if (addr->sa_family == AF_INET6 && IN6_IS_ADDR_V4MAPPED(&addr6->sin6_addr))
+        return (const struct in_addr *) &addr6->sin6_addr.s6_addr[12];
+    else
+        return NULL;
+}
+
+/* Sums the pseudo-header for a TCP packet of the given length */
+static uint32_t tcp_checksum_pseudo_header(const struct sockaddr *src, const struct sockaddr *dst, size_t length)
+{
+    const struct in_addr *src4 = tcp_checksum_addr4(src), *dst4 = tcp_checksum_addr4(dst);
+    uint8_t pseudo[40];
+
+    memset(pseudo, 0, sizeof(pseudo));
+
+    if (src4 != NULL && dst4 != NULL)
+    {
+        /* Source address, destination address, zero, protocol, TCP length */
+        uint16_t len = chitcp_htons(length);
+        memcpy(pseudo, src4, 4);
+        memcpy(pseudo + 4, dst4, 4);
+        pseudo[9] = IPPROTO_TCP;
+        memcpy(pseudo + 10, &len, 2);
+        return chitcp_cksum_partial(pseudo, 12, 0);
+    }
+    else if (src->sa_family == AF_INET6 && dst->sa_family == AF_INET6)
+    {
+        /* Source address, destination address, TCP length, zero, next header */
+        uint32_t len = chitcp_htonl(length);
+        memcpy(pseudo, &((const struct sockaddr_in6 *) src)->sin6_addr, 16);
+        memcpy(pseudo + 16, &((const struct sockaddr_in6 *) dst)->sin6_addr, 16);
+        memcpy(pseudo + 32, &len, 4);
+        pseudo[39] = IPPROTO_TCP;
+        return chitcp_cksum_partial(pseudo, 40, 0);
+    }
+    else
+        return 0;
+}
+
+/* See packet.h */
+uint16_t chitcp_tcp_checksum(const tcp_packet_t *packet, const struct sockaddr *src, const struct sockaddr *dst)
+{
+    uint32_t sum = tcp_checksum_pseudo_header(src, dst, packet->length);
+
+    /* Take out the current value of the checksum field, so we don't
+     * have to zero it out (one's complement subtraction is addition
+     * of the complement) */
+    sum += (uint16_t) ~TCP_PACKET_HEADER(packet)->sum;
+
+    sum = chitcp_cksum_partial(packet->raw, packet->length, sum);
+
+    return chitcp_cksum_fold(sum);
+}
+
+/* See packet.h */
+bool_t chitcp_tcp_checksum_valid(const tcp_packet_t *packet, const struct sockaddr *src, const struct sockaddr *dst)
+{
+    uint32_t sum = tcp_checksum_pseudo_header(src, dst, packet->length);
+
+    sum = chitcp_cksum_partial(packet->raw, packet->length, sum);
+
+    return chitcp_cksum_fold(sum) == 0;
+}
@@ -0,0 +1,316 @@
+/*
+ *  chiTCP - A simple, testable TCP stack
+ *
+ *  Per-thread memory pools for packets
+ *
+ *  See pool.h for details
+ */
+
+
+/*
+ *  Copyright (c) 2013-2014, The University of Chicago
+ *  All rights reserved.
+ *
+ *  Redistribution and use in source and binary forms, with or without
+ *  modification, are permitted provided that the following conditions are met:
+ *
+ *  - Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ *
+ *  - Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ *  - Neither the name of The University of Chicago nor the names of its
+ *    contributors may be used to endorse or promote products derived from this
+ *    software without specific prior written permission.
+ *
+ *  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ *  AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ *  IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ *  ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ *  LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ *  CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ *  SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ *  INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ *  CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ *  ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ *  POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdalign.h>
+#include <stdatomic.h>
+#include <stddef.h>
+#include <pthread.h>
+
+#include "chitcp/pool.h"
+
+/* Size (in bytes) of the data in each size class */
+static const size_t pool_class_size[POOL_NCLASSES] =
+{
+    128,                 /* Header-only segments, list nodes, etc. */
+    512,                 /* Bookkeeping structs, small segments */
+    POOL_MAX_CLASS_SIZE  /* MSS-sized segments */
+};
+
+/* Size class of blocks that were malloc'd directly */
+#define POOL_CLASS_LARGE (POOL_NCLASSES)
+
+struct pool;
+
+/* Header that precedes every block returned by chitcp_pool_alloc */
+typedef struct pool_block
+{
+    struct pool *owner;         /* NULL if the block was malloc'd directly */
+    struct pool_block *next;    /* Next block in a free list */
+    unsigned int class;
+    atomic_uint refcount;
+} pool_block_t;
+
+/* The data is placed right after the header, with the same
+ * alignment guarantees as malloc */
+#define POOL_HEADER_SIZE \
+    ((sizeof(pool_block_t) + alignof(max_align_t) - 1) & ~(alignof(max_align_t) - 1))
+
+#define BLOCK_DATA(b) ((void *) ((uint8_t *) (b) + POOL_HEADER_SIZE))
+#define DATA_BLOCK(p) ((pool_block_t *) ((uint8_t *) (p) - POOL_HEADER_SIZE))
+
+typedef struct pool
+{
+    /* Only accessed by the thread that owns the pool */
+    pool_block_t *free[POOL_NCLASSES];
+
+    /* Blocks freed by other threads */
+    _Atomic(pool_block_t *) remote_free[POOL_NCLASSES];
+
+    /* Next pool in the list of pools without an owner */
+    struct pool *next_orphan;
+} pool_t;
+
+static _Thread_local pool_t *thread_pool = NULL;
+
+/* Pools whose thread has exited */
+static pool_t *orphans = NULL;
+static pthread_mutex_t lock_orphans = PTHREAD_MUTEX_INITIALIZER;
+
+/* Memory used by the pools (see chitcp_pool_stats) */
+static atomic_ulong pool_class_blocks[POOL_NCLASSES];
+static atomic_ulong pool_large_blocks;
+static atomic_ulong pool_count;
+
+/* Used to find out when a thread exits */
+static pthread_key_t pool_key;
+static pthread_once_t pool_key_once = PTHREAD_ONCE_INIT;
+
+
+/* Called when a thread that has a pool exits */
+static void pool_orphan(void *args)
+{
+    pool_t *pool = (pool_t *) args;
+
+    pthread_mutex_lock(&lock_orphans);
+    pool->next_orphan = orphans;
+    orphans = pool;
+    pthread_mutex_unlock(&lock_orphans);
+}
+
+static void pool_key_create()
+{
+    pthread_key_create(&pool_key, pool_orphan);
+}
+
+/* Returns the calling thread's pool, creating (or adopting) one if necessary */
+static pool_t *pool_get()
+{
+    pool_t *pool;
+
+    if (thread_pool != NULL)
+        return thread_pool;
+
+    pthread_once(&pool_key_once, pool_key_create);
+
+    pthread_mutex_lock(&lock_orphans);
+    pool = orphans;
+    if (pool != NULL)
+        orphans = pool->next_orphan;
+    pthread_mutex_unlock(&lock_orphans);
+
+    if (pool == NULL)
+    {
+        pool = calloc(1, sizeof(pool_t));
+        if (pool == NULL)
+            return NULL;
+        for (int i = 0; i < POOL_NCLASSES; i++)
+            atomic_init(&pool->remote_free[i], NULL);
+        atomic_fetch_add_explicit(&pool_count, 1, memory_order_relaxed);
+    }
+
+    pool->next_orphan = NULL;
+    pthread_setspecific(pool_key, pool);
+    thread_pool = pool;
+
+    return pool;
+}
+
+/* Allocates a new chunk of blocks for a size class, and
+ * returns them as a list */
+static pool_block_t *pool_grow(pool_t *pool, unsigned int class)
+{
+    size_t block_size = POOL_HEADER_SIZE + pool_class_size[class];
+    uint8_t *chunk;
+    pool_block_t *block, *list = NULL;
+
+    chunk = malloc(block_size * POOL_CHUNK_BLOCKS);
+    if (chunk == NULL)
+        return NULL;
+
+    atomic_fetch_add_explicit(&pool_class_blocks[class], POOL_CHUNK_BLOCKS, memory_order_relaxed);
+
+    for (int i = POOL_CHUNK_BLOCKS - 1; i >= 0; i--)
+    {
+        block = (pool_block_t *) (chunk + i * block_size);
+        block->owner = pool;
+        block->class = class;
+        block->next = list;
+        list = block;
+    }
+
+    return list;
+}
+
+/* See pool.h */
+void *chitcp_pool_alloc(size_t size)
+{
+    pool_t *pool;
+    pool_block_t *block;
+    unsigned int class;
+
+    for (class = 0; class < POOL_NCLASSES; class++)
+        if (size <= pool_class_size[class])
+            break;
+
+    pool = class < POOL_NCLASSES? pool_get() : NULL;
+
+    if (pool == NULL)
+    {
+        block = malloc(POOL_HEADER_SIZE + size);
+        if (block == NULL)
+            return NULL;
+        block->owner = NULL;
+        block->class = POOL_CLASS_LARGE;
+        atomic_init(&block->refcount, 1);
+        atomic_fetch_add_explicit(&pool_large_blocks, 1, memory_order_relaxed);
+        return BLOCK_DATA(block);
+    }
+
+    block = pool->free[class];
+
+    /* If we've run out of blocks, take back the ones
+     * freed by other threads (if any) */
+    if (block == NULL)
+        block = atomic_exchange_explicit(&pool->remote_free[class], NULL, memory_order_acquire);
+
+    if (block == NULL)
+        block = pool_grow(pool, class);
+
+    if (block == NULL)
+        return NULL;
+
+    pool->free[class] = block->next;
+    atomic_init(&block->refcount, 1);
+
+    return BLOCK_DATA(block);
+}
+
+/* See pool.h */
+void *chitcp_pool_calloc(size_t nmemb, size_t size)
+{
+    void *ptr;
+
+    if (size != 0 && nmemb > SIZE_MAX / size)
+        return NULL;
+
+    ptr = chitcp_pool_alloc(nmemb * size);
+    if (ptr != NULL)
+        memset(ptr, 0, nmemb * size);
+
+    return ptr;
+}
+
+/* See pool.h */
+void chitcp_pool_free(void *ptr)
+{
+    pool_block_t *block;
+    pool_t *owner;
+
+    if (ptr == NULL)
+        return;
+
+    block = DATA_BLOCK(ptr);
+
+    /* If we hold the only reference, nobody else can take a new one,
+     * so we can skip the atomic decrement */
+    if (atomic_load_explicit(&block->refcount, memory_order_acquire) != 1 &&
+        atomic_fetch_sub_explicit(&block->refcount, 1, memory_order_acq_rel) != 1)
+        return;
+
+    owner = block->owner;
+
+    if (owner == NULL)
+    {
+        atomic_fetch_sub_explicit(&pool_large_blocks, 1, memory_order_relaxed);
+        free(block);
+    }
+    else if (owner == thread_pool)
+    {
+        block->next = owner->free[block->class];
+        owner->free[block->class] = block;
+    }
+    else
+    {
+        /* Only the owner removes blocks from this list, and it always
+         * takes the entire list, so a simple CAS loop is enough */
+        block->next = atomic_load_explicit(&owner->remote_free[block->class], memory_order_relaxed);
+        while (!atomic_compare_exchange_weak_explicit(&owner->remote_free[block->class], &block->next, block,
+                                                      memory_order_release, memory_order_relaxed))
+            ;
+    }
+}
+
+/* See pool.h */
+void *chitcp_pool_ref(void *ptr)
+{
+    atomic_fetch_add_explicit(&DATA_BLOCK(ptr)->refcount, 1, memory_order_relaxed);
+
+    return ptr;
+}
+
+/* See pool.h */
+unsigned int chitcp_pool_refcount(const void *ptr)
+{
+    return atomic_load_explicit(&DATA_BLOCK(ptr)->refcount, memory_order_acquire);
+}
+
+/* See pool.h */
+void chitcp_pool_stats(chitcp_pool_stats_t *stats)
+{
+    pool_t *pool;
+
+    for (int i = 0; i < POOL_NCLASSES; i++)
+    {
+        stats->class_size[i] = pool_class_size[i];
+        stats->class_blocks[i] = atomic_load_explicit(&pool_class_blocks[i], memory_order_relaxed);
+    }
+    stats->large_blocks = atomic_load_explicit(&pool_large_blocks, memory_order_relaxed);
+    stats->pools = atomic_load_explicit(&pool_count, memory_order_relaxed);
+
+    stats->orphan_pools = 0;
+    pthread_mutex_lock(&lock_orphans);
+    for (pool = orphans; pool != NULL; pool = pool->next_orphan)
+        stats->orphan_pools++;
+    pthread_mutex_unlock(&lock_orphans);
+}
@@ -0,0 +1,180 @@
+/*
+ *  chiTCP - A simple, testable TCP stack
+ *
+ *  Shared-memory socket buffers
+ *
+ *  see chitcp/shm.h for descriptions of functions, parameters, and return values.
+ *
+ */
+
+/*
+ *  Copyright (c) 2013-2014, The University of Chicago
+ *  All rights reserved.
+ *
+ *  Redistribution and use in source and binary forms, with or without
+ *  modification, are permitted provided that the following conditions are met:
+ *
+ *  - Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ *
+ *  - Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ *  - Neither the name of The University of Chicago nor the names of its
+ *    contributors may be used to endorse or promote products derived from this
+ *    software without specific prior written permission.
+ *
+ *  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ *  AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ *  IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ *  ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ *  LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ *  CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ *  SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ *  INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ *  CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ *  ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ *  POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "chitcp/shm.h"
+#include "chitcp/log.h"
+
+/* Offsets of the buffers are aligned to cache lines, so the daemon
+ * and the client don't share lines between the two buffers */
+#define SHM_ALIGN(x) (((x) + 63) & ~((size_t) 63))
+
+/* See shm.h */
+int chitcp_shm_create(chitcp_shm_t *shm, uint32_t bufsize, tcp_state_t tcp_state)
+{
+    size_t bufspace = SHM_ALIGN(circular_buffer_shared_size(bufsize));
+    size_t pagesize = sysconf(_SC_PAGESIZE);
+    size_t size = SHM_ALIGN(sizeof(chitcp_shm_header_t)) + 2 * bufspace;
+    void *mem;
+    int fd;
+
+    size = (size + pagesize - 1) / pagesize * pagesize;
+
+    fd = memfd_create("chitcp-socket", MFD_CLOEXEC);
+    if (fd == -1)
+    {
+        chilog(ERROR, "Could not create shared memory: %s", strerror(errno));
+        return CHITCP_EINIT;
+    }
+
+    if (ftruncate(fd, size) == -1)
+    {
+        chilog(ERROR, "Could not size shared memory: %s", strerror(errno));
+        close(fd);
+        return CHITCP_EINIT;
+    }
+
+    mem = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (mem == MAP_FAILED)
+    {
+        chilog(ERROR, "Could not map shared memory: %s", strerror(errno));
+        close(fd);
+        return CHITCP_EINIT;
+    }
+
+    shm->fd = fd;
+    shm->size = size;
+    shm->header = (chitcp_shm_header_t *) mem;
+
+    shm->header->magic = CHITCP_SHM_MAGIC;
+    shm->header->size = size;
+    shm->header->bufsize = bufsize;
+    shm->header->send_offset = SHM_ALIGN(sizeof(chitcp_shm_header_t));
+    shm->header->recv_offset = shm->header->send_offset + bufspace;
+    atomic_init(&shm->header->tcp_state, tcp_state);
+    atomic_init(&shm->header->ready, false);
+
+    return CHITCP_OK;
+}
+
+/* See shm.h */
+int chitcp_shm_map(chitcp_shm_t *shm, int fd)
+{
+    struct stat st;
+    chitcp_shm_header_t *header;
+    void *mem;
+
+    if (fstat(fd, &st) == -1 || st.st_size < sizeof(chitcp_shm_header_t))
+        return CHITCP_EINVAL;
+
+    mem = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (mem == MAP_FAILED)
+        return CHITCP_EINIT;
+
+    header = (chitcp_shm_header_t *) mem;
+    if (header->magic != CHITCP_SHM_MAGIC || header->size != st.st_size)
+    {
+        munmap(mem, st.st_size);
+        return CHITCP_EINVAL;
+    }
+
+    shm->fd = fd;
+    shm->size = st.st_size;
+    shm->header = header;
+
+    return CHITCP_OK;
+}
+
+/* See shm.h */
+int chitcp_shm_unmap(chitcp_shm_t *shm)
+{
+    if (shm->header == NULL)
+        return CHITCP_OK;
+
+    munmap(shm->header, shm->size);
+    close(shm->fd);
+    shm->header = NULL;
+    shm->fd = -1;
+
+    return CHITCP_OK;
+}
+
+/* See shm.h */
+int chitcp_shm_init_buffers(chitcp_shm_t *shm, circular_buffer_t *send, circular_buffer_t *recv)
+{
+    uint8_t *mem = (uint8_t *) shm->header;
+    uint32_t bufsize = shm->header->bufsize;
+
+    if (circular_buffer_init_shared(send, mem + shm->header->send_offset, bufsize) != CHITCP_OK ||
+        circular_buffer_init_shared(recv, mem + shm->header->recv_offset, bufsize) != CHITCP_OK)
+        return CHITCP_EINIT;
+
+    atomic_store_explicit(&shm->header->ready, true, memory_order_release);
+
+    return CHITCP_OK;
+}
+
+/* See shm.h */
+int chitcp_shm_attach_buffers(chitcp_shm_t *shm, circular_buffer_t *send, circular_buffer_t *recv)
+{
+    uint8_t *mem = (uint8_t *) shm->header;
+    uint32_t send_offset = shm->header->send_offset;
+    uint32_t recv_offset = shm->header->recv_offset;
+
+    if (!atomic_load_explicit(&shm->header->ready, memory_order_acquire))
+        return CHITCP_EWOULDBLOCK;
+
+    if (send_offset < sizeof(chitcp_shm_header_t) || recv_offset <= send_offset ||
+        recv_offset >= shm->size)
+        return CHITCP_EINVAL;
+
+    if (circular_buffer_attach(send, mem + send_offset, recv_offset - send_offset) != CHITCP_OK ||
+        circular_buffer_attach(recv, mem + recv_offset, shm->size - recv_offset) != CHITCP_OK)
+        return CHITCP_EINVAL;
+
+    return CHITCP_OK;
+}
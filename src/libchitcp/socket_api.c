@@ -50,11 +50,334 @@
 #include <string.h>
 #include <stdlib.h> /* for malloc */
 #include <errno.h>
+#include <fcntl.h>
+#include <stdarg.h>
+#include <pthread.h>
 
 #include "chitcp/socket.h"
 #include "chitcp/types.h"
+#include "chitcp/shm.h"
+#include "chitcp/utlist.h"
 #include "daemon_api.h"
 
+/* A socket in shared-memory mode. The buffers are attached once
+ * the daemon has initialized them (when the socket is connected).
+ * The entry is only freed once it has been removed from the list
+ * and it is no longer being used by a send() or recv() */
+typedef struct shm_socket
+{
+    int sockfd;
+    chitcp_shm_t shm;
+    bool_t attached;
+    circular_buffer_t send;
+    circular_buffer_t recv;
+
+    /* Copy of the socket's O_NONBLOCK flag (the daemon's copy is
+     * updated by chisocket_fcntl, which also updates this one) */
+    bool_t nonblocking;
+
+    int refcount;
+    bool_t removed;
+
+    struct shm_socket *prev;
+    struct shm_socket *next;
+} shm_socket_t;
+
+static shm_socket_t *shm_sockets = NULL;
+static pthread_mutex_t lock_shm_sockets = PTHREAD_MUTEX_INITIALIZER;
+
+static void shm_socket_remove(int sockfd);
+
+static bool_t shm_enabled()
+{
+    char *env = getenv("CHITCPD_SHM");
+
+    return env != NULL && env[0] != '\0' && strcmp(env, "0") != 0;
+}
+
+/* Maps the region passed by the daemon for a new socket (and takes
+ * ownership of its descriptor). If that fails, the socket simply
+ * doesn't use shared memory. */
+static void shm_socket_add(int sockfd, int fd, bool_t nonblocking)
+{
+    shm_socket_t *s = calloc(1, sizeof(shm_socket_t));
+
+    if (s == NULL || chitcp_shm_map(&s->shm, fd) != CHITCP_OK)
+    {
+        close(fd);
+        free(s);
+        return;
+    }
+
+    s->sockfd = sockfd;
+    s->nonblocking = nonblocking;
+
+    /* The daemon may have reused the number of a socket we didn't close */
+    shm_socket_remove(sockfd);
+
+    pthread_mutex_lock(&lock_shm_sockets);
+    DL_APPEND(shm_sockets, s);
+    pthread_mutex_unlock(&lock_shm_sockets);
+}
+
+static void shm_socket_release(shm_socket_t *s)
+{
+    chitcp_shm_unmap(&s->shm);
+    free(s);
+}
+
+/* Returns the shared-memory entry of a socket (which must be returned
+ * with shm_socket_put), or NULL if its buffers are not in shared memory
+ * (or have not been initialized yet) */
+static shm_socket_t *shm_socket_get(int sockfd)
+{
+    shm_socket_t *s;
+
+    pthread_mutex_lock(&lock_shm_sockets);
+    DL_FOREACH(shm_sockets, s)
+    {
+        if (s->sockfd == sockfd)
+            break;
+    }
+
+    if (s != NULL && !s->attached)
+        s->attached = chitcp_shm_attach_buffers(&s->shm, &s->send, &s->recv) == CHITCP_OK;
+
+    if (s != NULL && s->attached)
+        s->refcount++;
+    else
+        s = NULL;
+    pthread_mutex_unlock(&lock_shm_sockets);
+
+    return s;
+}
+
+static void shm_socket_put(shm_socket_t *s)
+{
+    bool_t release;
+
+    pthread_mutex_lock(&lock_shm_sockets);
+    release = --s->refcount == 0 && s->removed;
+    pthread_mutex_unlock(&lock_shm_sockets);
+
+    if (release)
+        shm_socket_release(s);
+}
+
+static void shm_socket_remove(int sockfd)
+{
+    shm_socket_t *s;
+    bool_t release = FALSE;
+
+    pthread_mutex_lock(&lock_shm_sockets);
+    DL_FOREACH(shm_sockets, s)
+    {
+        if (s->sockfd == sockfd)
+        {
+            DL_DELETE(shm_sockets, s);
+            s->removed = TRUE;
+            release = s->refcount == 0;
+            break;
+        }
+    }
+    pthread_mutex_unlock(&lock_shm_sockets);
+
+    if (release)
+        shm_socket_release(s);
+}
+
+/* Updates the O_NONBLOCK flag of a socket in shared-memory mode
+ * (whether or not its buffers have been attached) */
+static void shm_socket_set_nonblocking(int sockfd, bool_t nonblocking)
+{
+    shm_socket_t *s;
+
+    pthread_mutex_lock(&lock_shm_sockets);
+    DL_FOREACH(shm_sockets, s)
+    {
+        if (s->sockfd == sockfd)
+        {
+            s->nonblocking = nonblocking;
+            break;
+        }
+    }
+    pthread_mutex_unlock(&lock_shm_sockets);
+}
+
+/* Tells the daemon that data has been written to the send buffer
+ * and/or read from the receive buffer of a socket in shared-memory mode */
+static int shm_notify(int sockfd, bool_t sent, bool_t received)
+{
+    ChitcpdMsg req = CHITCPD_MSG__INIT;
+    ChitcpdShmNotifyArgs na = CHITCPD_SHM_NOTIFY_ARGS__INIT;
+    ChitcpdMsg *resp_p;
+    int daemon_socket;
+    int rc, ret, error_code;
+
+    daemon_socket = chitcpd_get_socket();
+    if (daemon_socket < 0)
+        CHITCPD_FAIL("Error when connecting to chiTCP daemon.");
+
+    req.code = CHITCPD_MSG_CODE__SHM_NOTIFY;
+    req.shm_notify_args = &na;
+
+    na.sockfd = sockfd;
+    na.sent = sent;
+    na.received = received;
+
+    rc = chitcpd_send_command(daemon_socket, &req, &resp_p);
+
+    if(rc != CHITCP_OK)
+        CHITCPD_FAIL("Error when communicating with chiTCP daemon.");
+
+    /* Unpack response */
+    assert(resp_p->resp != NULL);
+    ret = resp_p->resp->ret;
+    error_code = resp_p->resp->error_code;
+
+    chitcpd_msg__free_unpacked(resp_p, NULL);
+
+    ret = (error_code? -1 : ret);
+    if(error_code) errno = error_code;
+
+    return ret;
+}
+
+/* chisocket_send() in shared-memory mode. The checks are the
+ * same ones done by the daemon's SEND handler, but using the copy
+ * of the TCP state in the shared-memory region */
+static ssize_t shm_send(shm_socket_t *s, const void *buf, size_t buf_len, int flags)
+{
+    tcp_state_t tcp_state;
+    int nbytes;
+
+    if (buf_len <= 0)
+    {
+        errno = EINVAL;
+        return -1;
+    }
+
+    tcp_state = chitcp_shm_get_state(&s->shm);
+    if (tcp_state == LISTEN)
+    {
+        errno = EOPNOTSUPP;
+        return -1;
+    }
+    if (tcp_state != SYN_SENT    && tcp_state != SYN_RCVD   &&
+        tcp_state != ESTABLISHED && tcp_state != CLOSE_WAIT    )
+    {
+        errno = ENOTCONN;
+        return -1;
+    }
+
+    if (s->nonblocking || (flags & MSG_DONTWAIT))
+    {
+        /* Only write as much as fits in the buffer (like the SEND handler) */
+        int available = circular_buffer_available(&s->send);
+
+        if (available > 0)
+            nbytes = circular_buffer_write(&s->send, (uint8_t *) buf, MIN(buf_len, available), BUFFER_NONBLOCKING);
+        else
+            nbytes = CHITCP_EWOULDBLOCK;
+    }
+    else
+        nbytes = circular_buffer_write(&s->send, (uint8_t *) buf, buf_len, BUFFER_BLOCKING);
+
+    if (nbytes == CHITCP_EWOULDBLOCK)
+    {
+        errno = EAGAIN;
+        return -1;
+    }
+    if (nbytes < 0)
+    {
+        errno = EINVAL;
+        return -1;
+    }
+
+    /* If the socket is still being synchronized, the TCP
+     * thread doesn't have to be notified */
+    tcp_state = chitcp_shm_get_state(&s->shm);
+    if ((tcp_state == ESTABLISHED || tcp_state == CLOSE_WAIT) &&
+        shm_notify(s->sockfd, TRUE, FALSE) < 0)
+        return -1;
+
+    return nbytes;
+}
+
+/* chisocket_recv() in shared-memory mode (see shm_send). The flags
+ * are handled like in the RECV handler. */
+static ssize_t shm_recv(shm_socket_t *s, void *buf, size_t len, int flags)
+{
+    tcp_state_t tcp_state;
+    bool_t blocking, peek, waitall;
+    int nbytes, rc;
+
+    if (len <= 0)
+    {
+        errno = EINVAL;
+        return -1;
+    }
+
+    tcp_state = chitcp_shm_get_state(&s->shm);
+    if (tcp_state == CLOSED)
+    {
+        errno = ENOTCONN;
+        return -1;
+    }
+    if (tcp_state == LAST_ACK || tcp_state == TIME_WAIT || tcp_state == CLOSING)
+        return 0;
+
+    blocking = !s->nonblocking && !(flags & MSG_DONTWAIT);
+    peek = (flags & MSG_PEEK) != 0;
+    waitall = blocking && !peek && (flags & MSG_WAITALL);
+
+    /* Unless we're waiting for all the data, we can't read more
+     * than the buffer holds */
+    if (!waitall && len > circular_buffer_capacity(&s->recv))
+        len = circular_buffer_capacity(&s->recv);
+
+    /* This call may block if there is no data to receive.
+     * It returns zero if the buffer has been closed. */
+    nbytes = 0;
+    do
+    {
+        if (peek)
+            rc = circular_buffer_peek(&s->recv, buf, len, blocking);
+        else
+            rc = circular_buffer_read(&s->recv, (uint8_t *) buf + nbytes, MIN(len - nbytes, circular_buffer_capacity(&s->recv)), blocking);
+
+        if (rc <= 0)
+            break;
+
+        nbytes += rc;
+
+        /* Let the TCP thread know there is space in the receive buffer
+         * (unless the connection has not been synchronized yet) */
+        tcp_state = chitcp_shm_get_state(&s->shm);
+        if (!peek &&
+            (tcp_state == ESTABLISHED ||
+             tcp_state == FIN_WAIT_1  || tcp_state == FIN_WAIT_2) &&
+            shm_notify(s->sockfd, FALSE, TRUE) < 0)
+            return -1;
+    } while (waitall && nbytes < len);
+
+    if (nbytes > 0)
+        return nbytes;
+
+    if (rc == CHITCP_EWOULDBLOCK)
+    {
+        errno = EAGAIN;
+        return -1;
+    }
+    if (rc < 0)
+    {
+        errno = EINVAL;
+        return -1;
+    }
+
+    return 0;
+}
+
 int chisocket_socket(int domain, int type, int protocol)
 {
     ChitcpdMsg req = CHITCPD_MSG__INIT;
@@ -63,6 +386,7 @@ int chisocket_socket(int domain, int type, int protocol)
     int ret, error_code;
     int daemon_socket;
     int rc;
+    int shm_fd;
 
     daemon_socket = chitcpd_get_socket();
     if (daemon_socket < 0)
@@ -75,8 +399,9 @@ int chisocket_socket(int domain, int type, int protocol)
     sa.domain = domain;
     sa.type = type;
     sa.protocol = protocol;
+    sa.has_shm = sa.shm = shm_enabled();
 
-    rc = chitcpd_send_command(daemon_socket, &req, &resp_p);
+    rc = chitcpd_send_command_fd(daemon_socket, &req, &resp_p, &shm_fd);
 
     if(rc != CHITCP_OK)
         CHITCPD_FAIL("Error when communicating with chiTCP daemon.");
@@ -91,6 +416,14 @@ int chisocket_socket(int domain, int type, int protocol)
     ret = (error_code? -1 : ret);
     if(error_code) errno = error_code;
 
+    if (shm_fd >= 0)
+    {
+        if (ret >= 0)
+            shm_socket_add(ret, shm_fd, (type & SOCK_NONBLOCK) != 0);
+        else
+            close(shm_fd);
+    }
+
     return ret;
 }
 
@@ -221,6 +554,7 @@ int chisocket_accept(int sockfd, struct sockaddr *addr, socklen_t *addrlen)
     int daemon_socket;
     int rc, ret, error_code;
     int len; /* the minimum of ADDRLEN and the return length from chitcpd */
+    int shm_fd;
 
     daemon_socket = chitcpd_get_socket();
     if (daemon_socket < 0)
@@ -234,7 +568,7 @@ int chisocket_accept(int sockfd, struct sockaddr *addr, socklen_t *addrlen)
     /* NOTE: we do not send addrlen to chitcpd; if truncation must be
      * performed, it is done below, in this function. */
 
-    rc = chitcpd_send_command(daemon_socket, &req, &resp_p);
+    rc = chitcpd_send_command_fd(daemon_socket, &req, &resp_p, &shm_fd);
 
     if(rc != CHITCP_OK)
         CHITCPD_FAIL("Error when communicating with chiTCP daemon.");
@@ -258,6 +592,14 @@ int chisocket_accept(int sockfd, struct sockaddr *addr, socklen_t *addrlen)
     ret = (error_code? -1 : ret);
     if(error_code) errno = error_code;
 
+    if (shm_fd >= 0)
+    {
+        if (ret >= 0)
+            shm_socket_add(ret, shm_fd, FALSE);
+        else
+            close(shm_fd);
+    }
+
     return ret;
 }
 
@@ -293,6 +635,9 @@ int chisocket_close(int sockfd)
     ret = (error_code? -1 : ret);
     if(error_code) errno = error_code;
 
+    if (ret == 0)
+        shm_socket_remove(sockfd);
+
     return ret;
 }
 
@@ -304,6 +649,15 @@ ssize_t chisocket_send(int sockfd, const void *buf, size_t buf_len, int flags)
     int daemon_socket;
     int rc, ret, error_code;
     uint8_t *newbuf;
+    shm_socket_t *shm_socket;
+
+    /* In shared-memory mode, we write directly to the send buffer */
+    if ((shm_socket = shm_socket_get(sockfd)) != NULL)
+    {
+        ret = shm_send(shm_socket, buf, buf_len, flags);
+        shm_socket_put(shm_socket);
+        return ret;
+    }
 
     daemon_socket = chitcpd_get_socket();
     if (daemon_socket < 0)
@@ -358,6 +712,15 @@ ssize_t chisocket_recv(int sockfd, void *buf, size_t len, int flags)
     ChitcpdMsg *resp_p;
     int daemon_socket;
     int rc, ret, error_code;
+    shm_socket_t *shm_socket;
+
+    /* In shared-memory mode, we read directly from the receive buffer */
+    if ((shm_socket = shm_socket_get(sockfd)) != NULL)
+    {
+        ret = shm_recv(shm_socket, buf, len, flags);
+        shm_socket_put(shm_socket);
+        return ret;
+    }
 
     daemon_socket = chitcpd_get_socket();
     if (daemon_socket < 0)
@@ -395,3 +758,416 @@ ssize_t chisocket_recv(int sockfd, void *buf, size_t len, int flags)
 
     return ret;
 }
+
+/* A request in a batch, along with its arguments */
+typedef struct batch_request
+{
+    ChitcpdMsg msg;
+    union
+    {
+        ChitcpdSendArgs sa;
+        ChitcpdRecvArgs ra;
+        ChitcpdCloseArgs ca;
+    } args;
+} batch_request_t;
+
+int chisocket_batch(chisocket_op_t *ops, size_t nops)
+{
+    ChitcpdMsg req = CHITCPD_MSG__INIT;
+    ChitcpdBatchArgs ba = CHITCPD_BATCH_ARGS__INIT;
+    ChitcpdMsg *resp_p;
+    batch_request_t *batch;
+    ChitcpdMsg **requests;
+    int daemon_socket;
+    int rc, ret, error_code;
+
+    if (nops == 0)
+        return 0;
+
+    batch = calloc(nops, sizeof(batch_request_t));
+    requests = calloc(nops, sizeof(ChitcpdMsg *));
+    if (!batch || !requests)
+    {
+        free(batch);
+        free(requests);
+        errno = ENOMEM;
+        return -1;
+    }
+
+    /* Create the requests */
+    for (size_t i = 0; i < nops; i++)
+    {
+        batch_request_t *r = &batch[i];
+
+        r->msg = (ChitcpdMsg) CHITCPD_MSG__INIT;
+        requests[i] = &r->msg;
+
+        switch (ops[i].op)
+        {
+        case CHISOCKET_OP_SEND:
+            r->args.sa = (ChitcpdSendArgs) CHITCPD_SEND_ARGS__INIT;
+            r->args.sa.sockfd = ops[i].sockfd;
+            r->args.sa.buf.data = ops[i].buffer;
+            r->args.sa.buf.len = ops[i].length;
+            r->args.sa.flags = ops[i].flags;
+            r->msg.code = CHITCPD_MSG_CODE__SEND;
+            r->msg.send_args = &r->args.sa;
+            break;
+        case CHISOCKET_OP_RECV:
+            r->args.ra = (ChitcpdRecvArgs) CHITCPD_RECV_ARGS__INIT;
+            r->args.ra.sockfd = ops[i].sockfd;
+            r->args.ra.len = ops[i].length;
+            r->args.ra.flags = ops[i].flags;
+            r->msg.code = CHITCPD_MSG_CODE__RECV;
+            r->msg.recv_args = &r->args.ra;
+            break;
+        case CHISOCKET_OP_CLOSE:
+            r->args.ca = (ChitcpdCloseArgs) CHITCPD_CLOSE_ARGS__INIT;
+            r->args.ca.sockfd = ops[i].sockfd;
+            r->msg.code = CHITCPD_MSG_CODE__CLOSE;
+            r->msg.close_args = &r->args.ca;
+            break;
+        default:
+            free(batch);
+            free(requests);
+            errno = EINVAL;
+            return -1;
+        }
+    }
+
+    daemon_socket = chitcpd_get_socket();
+    if (daemon_socket < 0)
+    {
+        free(batch);
+        free(requests);
+        CHITCPD_FAIL("Error when connecting to chiTCP daemon.");
+    }
+
+    req.code = CHITCPD_MSG_CODE__BATCH;
+    req.batch_args = &ba;
+
+    ba.n_requests = nops;
+    ba.requests = requests;
+
+    rc = chitcpd_send_command(daemon_socket, &req, &resp_p);
+
+    free(batch);
+    free(requests);
+
+    if(rc != CHITCP_OK)
+        CHITCPD_FAIL("Error when communicating with chiTCP daemon.");
+
+    /* Unpack response */
+    assert(resp_p->resp != NULL);
+    error_code = resp_p->resp->error_code;
+
+    if (!error_code && resp_p->resp->n_batch != nops)
+    {
+        chitcpd_msg__free_unpacked(resp_p, NULL);
+        CHITCPD_FAIL("Daemon returned the wrong number of responses.");
+    }
+
+    for (size_t i = 0; i < resp_p->resp->n_batch; i++)
+    {
+        ChitcpdResp *r = resp_p->resp->batch[i];
+
+        ops[i].error = r->error_code;
+        ops[i].ret = (r->error_code? -1 : r->ret);
+
+        if (r->error_code)
+            continue;
+
+        if (ops[i].op == CHISOCKET_OP_RECV && r->ret != 0)
+        {
+            assert(r->has_buf
+                   && r->buf.len == r->ret
+                   && r->ret <= ops[i].length);
+            memcpy(ops[i].buffer, r->buf.data, r->ret);
+        }
+        else if (ops[i].op == CHISOCKET_OP_CLOSE && r->ret == 0)
+            shm_socket_remove(ops[i].sockfd);
+    }
+
+    chitcpd_msg__free_unpacked(resp_p, NULL);
+
+    ret = (error_code? -1 : 0);
+    if(error_code) errno = error_code;
+
+    return ret;
+}
+
+int chisocket_poll(struct pollfd *fds, nfds_t nfds, int timeout)
+{
+    ChitcpdMsg req = CHITCPD_MSG__INIT;
+    ChitcpdPollArgs pa = CHITCPD_POLL_ARGS__INIT;
+    ChitcpdMsg *resp_p;
+    ChitcpdPollEvent *events;
+    ChitcpdPollEvent **event_ptrs;
+    int daemon_socket;
+    int rc, ret, error_code;
+
+    events = calloc(nfds > 0? nfds : 1, sizeof(ChitcpdPollEvent));
+    event_ptrs = calloc(nfds > 0? nfds : 1, sizeof(ChitcpdPollEvent *));
+    if (!events || !event_ptrs)
+    {
+        free(events);
+        free(event_ptrs);
+        errno = ENOMEM;
+        return -1;
+    }
+
+    for (nfds_t i = 0; i < nfds; i++)
+    {
+        chitcpd_poll_event__init(&events[i]);
+        events[i].sockfd = fds[i].fd;
+        events[i].events = fds[i].events;
+        event_ptrs[i] = &events[i];
+    }
+
+    daemon_socket = chitcpd_get_socket();
+    if (daemon_socket < 0)
+    {
+        free(events);
+        free(event_ptrs);
+        CHITCPD_FAIL("Error when connecting to chiTCP daemon.");
+    }
+
+    req.code = CHITCPD_MSG_CODE__POLL;
+    req.poll_args = &pa;
+
+    pa.n_fds = nfds;
+    pa.fds = event_ptrs;
+    pa.timeout = timeout;
+
+    rc = chitcpd_send_command(daemon_socket, &req, &resp_p);
+
+    free(events);
+    free(event_ptrs);
+
+    if(rc != CHITCP_OK)
+        CHITCPD_FAIL("Error when communicating with chiTCP daemon.");
+
+    /* Unpack response */
+    assert(resp_p->resp != NULL);
+    ret = resp_p->resp->ret;
+    error_code = resp_p->resp->error_code;
+
+    if (!error_code)
+    {
+        assert(resp_p->resp->n_events == nfds);
+        for (nfds_t i = 0; i < nfds; i++)
+            fds[i].revents = resp_p->resp->events[i]->revents;
+    }
+
+    chitcpd_msg__free_unpacked(resp_p, NULL);
+
+    ret = (error_code? -1 : ret);
+    if(error_code) errno = error_code;
+
+    return ret;
+}
+
+int chisocket_epoll_create(void)
+{
+    ChitcpdMsg req = CHITCPD_MSG__INIT;
+    ChitcpdMsg *resp_p;
+    int daemon_socket;
+    int rc, ret, error_code;
+
+    daemon_socket = chitcpd_get_socket();
+    if (daemon_socket < 0)
+        CHITCPD_FAIL("Error when connecting to chiTCP daemon.");
+
+    req.code = CHITCPD_MSG_CODE__EPOLL_CREATE;
+
+    rc = chitcpd_send_command(daemon_socket, &req, &resp_p);
+
+    if(rc != CHITCP_OK)
+        CHITCPD_FAIL("Error when communicating with chiTCP daemon.");
+
+    /* Unpack response */
+    assert(resp_p->resp != NULL);
+    ret = resp_p->resp->ret;
+    error_code = resp_p->resp->error_code;
+
+    chitcpd_msg__free_unpacked(resp_p, NULL);
+
+    ret = (error_code? -1 : ret);
+    if(error_code) errno = error_code;
+
+    return ret;
+}
+
+int chisocket_epoll_ctl(int epfd, int op, int sockfd, struct epoll_event *event)
+{
+    ChitcpdMsg req = CHITCPD_MSG__INIT;
+    ChitcpdEpollCtlArgs ca = CHITCPD_EPOLL_CTL_ARGS__INIT;
+    ChitcpdMsg *resp_p;
+    int daemon_socket;
+    int rc, ret, error_code;
+
+    if (event == NULL && op != EPOLL_CTL_DEL)
+    {
+        errno = EFAULT;
+        return -1;
+    }
+
+    daemon_socket = chitcpd_get_socket();
+    if (daemon_socket < 0)
+        CHITCPD_FAIL("Error when connecting to chiTCP daemon.");
+
+    req.code = CHITCPD_MSG_CODE__EPOLL_CTL;
+    req.epoll_ctl_args = &ca;
+
+    ca.epfd = epfd;
+    ca.op = op;
+    ca.sockfd = sockfd;
+    ca.events = event? event->events : 0;
+    ca.data = event? event->data.u64 : 0;
+
+    rc = chitcpd_send_command(daemon_socket, &req, &resp_p);
+
+    if(rc != CHITCP_OK)
+        CHITCPD_FAIL("Error when communicating with chiTCP daemon.");
+
+    /* Unpack response */
+    assert(resp_p->resp != NULL);
+    ret = resp_p->resp->ret;
+    error_code = resp_p->resp->error_code;
+
+    chitcpd_msg__free_unpacked(resp_p, NULL);
+
+    ret = (error_code? -1 : ret);
+    if(error_code) errno = error_code;
+
+    return ret;
+}
+
+int chisocket_epoll_wait(int epfd, struct epoll_event *events, int maxevents, int timeout)
+{
+    ChitcpdMsg req = CHITCPD_MSG__INIT;
+    ChitcpdEpollWaitArgs wa = CHITCPD_EPOLL_WAIT_ARGS__INIT;
+    ChitcpdMsg *resp_p;
+    int daemon_socket;
+    int rc, ret, error_code;
+
+    daemon_socket = chitcpd_get_socket();
+    if (daemon_socket < 0)
+        CHITCPD_FAIL("Error when connecting to chiTCP daemon.");
+
+    req.code = CHITCPD_MSG_CODE__EPOLL_WAIT;
+    req.epoll_wait_args = &wa;
+
+    wa.epfd = epfd;
+    wa.maxevents = maxevents;
+    wa.timeout = timeout;
+
+    rc = chitcpd_send_command(daemon_socket, &req, &resp_p);
+
+    if(rc != CHITCP_OK)
+        CHITCPD_FAIL("Error when communicating with chiTCP daemon.");
+
+    /* Unpack response */
+    assert(resp_p->resp != NULL);
+    ret = resp_p->resp->ret;
+    error_code = resp_p->resp->error_code;
+
+    if (!error_code)
+    {
+        assert(resp_p->resp->n_events == ret && ret <= maxevents);
+        for (int i = 0; i < ret; i++)
+        {
+            events[i].events = resp_p->resp->events[i]->revents;
+            events[i].data.u64 = resp_p->resp->events[i]->data;
+        }
+    }
+
+    chitcpd_msg__free_unpacked(resp_p, NULL);
+
+    ret = (error_code? -1 : ret);
+    if(error_code) errno = error_code;
+
+    return ret;
+}
+
+int chisocket_epoll_close(int epfd)
+{
+    ChitcpdMsg req = CHITCPD_MSG__INIT;
+    ChitcpdEpollCloseArgs ca = CHITCPD_EPOLL_CLOSE_ARGS__INIT;
+    ChitcpdMsg *resp_p;
+    int daemon_socket;
+    int rc, ret, error_code;
+
+    daemon_socket = chitcpd_get_socket();
+    if (daemon_socket < 0)
+        CHITCPD_FAIL("Error when connecting to chiTCP daemon.");
+
+    req.code = CHITCPD_MSG_CODE__EPOLL_CLOSE;
+    req.epoll_close_args = &ca;
+
+    ca.epfd = epfd;
+
+    rc = chitcpd_send_command(daemon_socket, &req, &resp_p);
+
+    if(rc != CHITCP_OK)
+        CHITCPD_FAIL("Error when communicating with chiTCP daemon.");
+
+    /* Unpack response */
+    assert(resp_p->resp != NULL);
+    ret = resp_p->resp->ret;
+    error_code = resp_p->resp->error_code;
+
+    chitcpd_msg__free_unpacked(resp_p, NULL);
+
+    ret = (error_code? -1 : ret);
+    if(error_code) errno = error_code;
+
+    return ret;
+}
+
+int chisocket_fcntl(int sockfd, int cmd, ...)
+{
+    ChitcpdMsg req = CHITCPD_MSG__INIT;
+    ChitcpdFcntlArgs fa = CHITCPD_FCNTL_ARGS__INIT;
+    ChitcpdMsg *resp_p;
+    int daemon_socket;
+    int rc, ret, error_code;
+    va_list ap;
+
+    daemon_socket = chitcpd_get_socket();
+    if (daemon_socket < 0)
+        CHITCPD_FAIL("Error when connecting to chiTCP daemon.");
+
+    req.code = CHITCPD_MSG_CODE__FCNTL;
+    req.fcntl_args = &fa;
+
+    fa.sockfd = sockfd;
+    fa.cmd = cmd;
+    if (cmd == F_SETFL)
+    {
+        va_start(ap, cmd);
+        fa.has_arg = TRUE;
+        fa.arg = va_arg(ap, int);
+        va_end(ap);
+    }
+
+    rc = chitcpd_send_command(daemon_socket, &req, &resp_p);
+
+    if(rc != CHITCP_OK)
+        CHITCPD_FAIL("Error when communicating with chiTCP daemon.");
+
+    /* Unpack response */
+    assert(resp_p->resp != NULL);
+    ret = resp_p->resp->ret;
+    error_code = resp_p->resp->error_code;
+
+    chitcpd_msg__free_unpacked(resp_p, NULL);
+
+    ret = (error_code? -1 : ret);
+    if(error_code) errno = error_code;
+
+    if (ret == 0 && cmd == F_SETFL)
+        shm_socket_set_nonblocking(sockfd, (fa.arg & O_NONBLOCK) != 0);
+
+    return ret;
+}
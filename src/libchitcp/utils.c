@@ -46,6 +46,8 @@
 #include "chitcp/socket.h"
 #include "chitcp/types.h"
 #include "chitcp/packet.h"
+#include "chitcp/cksum.h"
+#include "chitcp/log.h"
 
 const char *tcp_str(tcp_state_t state);
 
@@ -68,27 +70,9 @@ const char *tcp_state_names[] =
 /* See utils.h */
 uint16_t cksum (const void *_data, int len)
 {
-      const uint8_t *data = _data;
-      uint32_t sum;
+    uint16_t sum = chitcp_cksum(_data, len);
 
-      for (sum = 0;len >= 2; data += 2, len -= 2)
-      {
-        sum += data[0] << 8 | data[1];
-      }
-
-      if (len > 0)
-      {
-        sum += data[0] << 8;
-      }
-
-      while (sum > 0xffff)
-      {
-        sum = (sum >> 16) + (sum & 0xffff);
-      }
-
-      sum = htons (~sum);
-
-      return sum ? sum : 0xffff;
+    return sum ? sum : 0xffff;
 }
 
 
@@ -176,4 +160,7 @@ void set_thread_name(pthread_t thread, const char *name)
     #else
     pthread_setname_np(thread, name);
     #endif
+
+    if (pthread_equal(pthread_self(), thread))
+        chilog_set_thread_name(name);
 }
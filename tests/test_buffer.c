@@ -1,8 +1,11 @@
 #include "chitcp/buffer.h"
+#include "chitcp/shm.h"
 #include <assert.h>
 #include <stdio.h>
 #include <string.h>
 #include <pthread.h>
+#include <unistd.h>
+#include <sys/wait.h>
 #include <criterion/criterion.h>
 
 uint8_t numbers[16] = {10,20,30,40,50,60,70,80,90,100,110,120,130,140,150,160};
@@ -306,3 +309,147 @@ Test(buffer, concurrency_1)
     pthread_join(producer_thread, NULL);
     circular_buffer_free(&buf);
 }
+
+Test(buffer, shared_across_processes)
+{
+    int rc, status;
+    chitcp_shm_t shm;
+    circular_buffer_t send, recv;
+    uint8_t tmp[26];
+    pid_t pid;
+
+    rc = chitcp_shm_create(&shm, 8, ESTABLISHED);
+    cr_assert_eq(rc, CHITCP_OK);
+    rc = chitcp_shm_attach_buffers(&shm, &send, &recv);
+    cr_assert_eq(rc, CHITCP_EWOULDBLOCK);
+    rc = chitcp_shm_init_buffers(&shm, &send, &recv);
+    cr_assert_eq(rc, CHITCP_OK);
+
+    pid = fork();
+    if (pid == 0)
+    {
+        /* Child: map the region again (as a client would) and write
+         * more than fits in the buffer, so the write has to block until
+         * the parent reads */
+        chitcp_shm_t client;
+        circular_buffer_t csend, crecv;
+
+        if (chitcp_shm_map(&client, dup(shm.fd)) != CHITCP_OK ||
+            chitcp_shm_attach_buffers(&client, &csend, &crecv) != CHITCP_OK ||
+            chitcp_shm_get_state(&client) != ESTABLISHED)
+            _exit(1);
+
+        if (circular_buffer_write(&csend, numbers, 8, BUFFER_BLOCKING) != 8 ||
+            circular_buffer_write(&csend, numbers + 8, 8, BUFFER_BLOCKING) != 8)
+            _exit(2);
+
+        chitcp_shm_unmap(&client);
+        _exit(0);
+    }
+    cr_assert_gt(pid, 0);
+
+    for (int nread = 0; nread < 16; nread += rc)
+    {
+        rc = circular_buffer_read(&send, tmp + nread, 16 - nread, BUFFER_BLOCKING);
+        cr_assert_gt(rc, 0);
+    }
+    cr_assert_eq(memcmp(numbers, tmp, 16), 0);
+
+    waitpid(pid, &status, 0);
+    cr_assert(WIFEXITED(status));
+    cr_assert_eq(WEXITSTATUS(status), 0);
+
+    circular_buffer_free(&send);
+    circular_buffer_free(&recv);
+    chitcp_shm_unmap(&shm);
+}
+
+Test(buffer, shared_attach_invalid)
+{
+    int rc;
+    circular_buffer_t buf, attached;
+    uint8_t mem[CIRCULAR_BUFFER_DATA_OFFSET + 8];
+
+    circular_buffer_init_shared(&buf, mem, 8);
+
+    /* The buffer doesn't fit in the memory */
+    rc = circular_buffer_attach(&attached, mem, sizeof(mem) - 1);
+    cr_assert_eq(rc, CHITCP_EINVAL);
+
+    rc = circular_buffer_attach(&attached, mem, sizeof(mem));
+    cr_assert_eq(rc, CHITCP_OK);
+    cr_assert_eq(circular_buffer_capacity(&attached), 8);
+
+    /* A corrupted state is detected instead of overflowing the data */
+    buf.state->end = 100;
+    rc = circular_buffer_write(&attached, numbers, 4, BUFFER_NONBLOCKING);
+    cr_assert_eq(rc, CHITCP_EINVAL);
+
+    circular_buffer_free(&buf);
+}
+
+static void count_notify(void *arg)
+{
+    (*(int *) arg)++;
+}
+
+Test(buffer, notify)
+{
+    int rc, notified = 0;
+    circular_buffer_t buf;
+    uint8_t tmp[8];
+
+    circular_buffer_init(&buf, 8);
+    circular_buffer_set_notify(&buf, count_notify, &notified);
+
+    rc = circular_buffer_write(&buf, numbers, 4, BUFFER_NONBLOCKING);
+    cr_assert_eq(rc, 4);
+    cr_assert_eq(notified, 1);
+
+    /* Peeking doesn't change the contents of the buffer */
+    rc = circular_buffer_peek(&buf, tmp, 4, BUFFER_NONBLOCKING);
+    cr_assert_eq(rc, 4);
+    cr_assert_eq(notified, 1);
+
+    rc = circular_buffer_read(&buf, tmp, 4, BUFFER_NONBLOCKING);
+    cr_assert_eq(rc, 4);
+    cr_assert_eq(notified, 2);
+
+    /* Neither does an operation that would block */
+    rc = circular_buffer_read(&buf, tmp, 4, BUFFER_NONBLOCKING);
+    cr_assert_eq(rc, CHITCP_EWOULDBLOCK);
+    cr_assert_eq(notified, 2);
+
+    cr_assert_not(circular_buffer_closed(&buf));
+    circular_buffer_close(&buf);
+    cr_assert(circular_buffer_closed(&buf));
+    cr_assert_eq(notified, 3);
+
+    circular_buffer_free(&buf);
+}
+
+Test(buffer, read_closed_nonblocking)
+{
+    int rc;
+    circular_buffer_t buf;
+    uint8_t tmp[8];
+
+    circular_buffer_init(&buf, 8);
+
+    rc = circular_buffer_write(&buf, numbers, 2, BUFFER_NONBLOCKING);
+    cr_assert_eq(rc, 2);
+    circular_buffer_close(&buf);
+
+    /* The data in a closed buffer can still be read... */
+    rc = circular_buffer_read(&buf, tmp, 8, BUFFER_NONBLOCKING);
+    cr_assert_eq(rc, 2);
+
+    /* ...and then the end of the data is reported, instead of
+     * CHITCP_EWOULDBLOCK (nothing will be written to it) */
+    rc = circular_buffer_read(&buf, tmp, 8, BUFFER_NONBLOCKING);
+    cr_assert_eq(rc, 0);
+    rc = circular_buffer_peek(&buf, tmp, 8, BUFFER_NONBLOCKING);
+    cr_assert_eq(rc, 0);
+
+    circular_buffer_free(&buf);
+}
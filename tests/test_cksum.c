@@ -0,0 +1,267 @@
+#include "chitcp/cksum.h"
+#include "chitcp/utils.h"
+#include "chitcp/types.h"
+#include "chitcp/packet.h"
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <arpa/inet.h>
+#include <criterion/criterion.h>
+
+#define MAX_LEN (65536 + 64)
+
+static cksum_impl_t impls[] = {CKSUM_IMPL_GENERIC, CKSUM_IMPL_SSE2, CKSUM_IMPL_AVX2};
+
+/* Straightforward implementation of RFC 1071, used as a reference */
+static uint16_t cksum_reference(const uint8_t *data, size_t len)
+{
+    uint32_t sum = 0;
+
+    for (; len >= 2; data += 2, len -= 2)
+        sum += data[0] << 8 | data[1];
+    if (len > 0)
+        sum += data[0] << 8;
+    while (sum > 0xffff)
+        sum = (sum >> 16) + (sum & 0xffff);
+
+    return htons(~sum);
+}
+
+static uint8_t *random_data(size_t len)
+{
+    uint8_t *data = malloc(len);
+
+    srand(23300);
+    for (size_t i = 0; i < len; i++)
+        data[i] = rand();
+
+    return data;
+}
+
+Test(cksum, implementations)
+{
+    uint8_t *data = random_data(MAX_LEN);
+    size_t lens[] = {0, 1, 2, 3, 20, 31, 32, 33, 63, 64, 65, 127, 576, 1500, 4095, 65535, 65536};
+
+    for (int i = 0; i < sizeof(impls) / sizeof(cksum_impl_t); i++)
+    {
+        if (chitcp_cksum_set_impl(impls[i]) != CHITCP_OK)
+            continue;
+
+        for (int j = 0; j < sizeof(lens) / sizeof(size_t); j++)
+            for (int offset = 0; offset < 4; offset++)
+                cr_assert_eq(chitcp_cksum(data + offset, lens[j]), cksum_reference(data + offset, lens[j]),
+                             "%s: wrong checksum for %zu bytes at offset %i",
+                             chitcp_cksum_impl_str(), lens[j], offset);
+    }
+
+    free(data);
+}
+
+Test(cksum, all_ones)
+{
+    /* Worst case for the accumulators: every word is 0xFFFF */
+    uint8_t *data = malloc(MAX_LEN);
+    memset(data, 0xFF, MAX_LEN);
+
+    for (int i = 0; i < sizeof(impls) / sizeof(cksum_impl_t); i++)
+        if (chitcp_cksum_set_impl(impls[i]) == CHITCP_OK)
+            cr_assert_eq(chitcp_cksum(data, MAX_LEN), cksum_reference(data, MAX_LEN));
+
+    free(data);
+}
+
+Test(cksum, partial)
+{
+    uint8_t *data = random_data(1500);
+
+    uint32_t sum = chitcp_cksum_partial(data, 12, 0);
+    sum = chitcp_cksum_partial(data + 12, 500, sum);
+    sum = chitcp_cksum_partial(data + 512, 987, sum);
+
+    cr_assert_eq(chitcp_cksum_fold(sum), cksum_reference(data, 1499));
+
+    free(data);
+}
+
+Test(cksum, legacy)
+{
+    uint8_t ones[20];
+    uint8_t *data = random_data(100);
+
+    /* cksum() never returns zero */
+    cr_assert_eq(cksum(data, 100), cksum_reference(data, 100));
+    memset(ones, 0xFF, sizeof(ones));
+    cr_assert_eq(cksum(ones, sizeof(ones)), 0xffff);
+
+    free(data);
+}
+
+Test(cksum, verify)
+{
+    uint8_t *data = random_data(64);
+    uint16_t sum;
+
+    /* Including the checksum in the data makes the sum zero */
+    memset(data + 16, 0, 2);
+    sum = chitcp_cksum(data, 64);
+    memcpy(data + 16, &sum, 2);
+    cr_assert_eq(chitcp_cksum(data, 64), 0);
+
+    free(data);
+}
+
+Test(cksum, incremental)
+{
+    uint8_t *data = random_data(60);
+    uint16_t sum, old16, new16 = htons(4096);
+    uint32_t old32, new32 = htonl(0xDEADBEEF);
+
+    memset(data + 16, 0, 2);
+    sum = chitcp_cksum(data, 60);
+
+    /* Rewrite a 16-bit field (e.g., the window) */
+    memcpy(&old16, data + 14, 2);
+    memcpy(data + 14, &new16, 2);
+    sum = chitcp_cksum_update16(sum, old16, new16);
+    cr_assert_eq(sum, chitcp_cksum(data, 60));
+
+    /* Rewrite a 32-bit field (e.g., the ACK number) */
+    memcpy(&old32, data + 8, 4);
+    memcpy(data + 8, &new32, 4);
+    sum = chitcp_cksum_update32(sum, old32, new32);
+    cr_assert_eq(sum, chitcp_cksum(data, 60));
+
+    free(data);
+}
+
+static void set_addr4(struct sockaddr_storage *ss, const char *addr, uint16_t port)
+{
+    struct sockaddr_in *sin = (struct sockaddr_in *) ss;
+
+    memset(ss, 0, sizeof(*ss));
+    sin->sin_family = AF_INET;
+    sin->sin_port = htons(port);
+    inet_pton(AF_INET, addr, &sin->sin_addr);
+}
+
+static void set_addr6(struct sockaddr_storage *ss, const char *addr, uint16_t port)
+{
+    struct sockaddr_in6 *sin6 = (struct sockaddr_in6 *) ss;
+
+    memset(ss, 0, sizeof(*ss));
+    sin6->sin6_family = AF_INET6;
+    sin6->sin6_port = htons(port);
+    inet_pton(AF_INET6, addr, &sin6->sin6_addr);
+}
+
+static void create_packet(tcp_packet_t *packet, size_t payload_len)
+{
+    uint8_t *payload = random_data(payload_len);
+    tcphdr_t *header;
+
+    chitcp_tcp_packet_init(packet, payload, payload_len);
+    header = TCP_PACKET_HEADER(packet);
+    header->source = htons(23300);
+    header->dest = htons(80);
+    header->seq = htonl(1000);
+    header->ack_seq = htonl(2000);
+    header->ack = 1;
+    header->win = htons(4096);
+
+    free(payload);
+}
+
+Test(cksum, tcp_ipv4)
+{
+    struct sockaddr_storage src, dst;
+    tcp_packet_t packet;
+    uint8_t *pseudo;
+    uint16_t sum;
+
+    set_addr4(&src, "192.168.1.1", 23300);
+    set_addr4(&dst, "10.0.0.2", 80);
+    create_packet(&packet, 37);
+
+    /* Compare against a sum over an explicitly built pseudo-header */
+    pseudo = calloc(1, 12 + packet.length);
+    memcpy(pseudo, &((struct sockaddr_in *) &src)->sin_addr, 4);
+    memcpy(pseudo + 4, &((struct sockaddr_in *) &dst)->sin_addr, 4);
+    pseudo[9] = 6; /* TCP */
+    pseudo[10] = packet.length >> 8;
+    pseudo[11] = packet.length & 0xFF;
+    memcpy(pseudo + 12, packet.raw, packet.length);
+
+    sum = chitcp_tcp_checksum(&packet, (struct sockaddr *) &src, (struct sockaddr *) &dst);
+    cr_assert_eq(sum, chitcp_cksum(pseudo, 12 + packet.length));
+
+    TCP_PACKET_HEADER(&packet)->sum = sum;
+    cr_assert(chitcp_tcp_checksum_valid(&packet, (struct sockaddr *) &src, (struct sockaddr *) &dst));
+
+    /* The checksum field does not affect the computed checksum */
+    cr_assert_eq(chitcp_tcp_checksum(&packet, (struct sockaddr *) &src, (struct sockaddr *) &dst), sum);
+
+    /* Changing one of the addresses must be detected */
+    set_addr4(&dst, "10.0.0.3", 80);
+    cr_assert_not(chitcp_tcp_checksum_valid(&packet, (struct sockaddr *) &src, (struct sockaddr *) &dst));
+
+    free(pseudo);
+    chitcp_tcp_packet_free(&packet);
+}
+
+Test(cksum, tcp_ipv6)
+{
+    struct sockaddr_storage src, dst;
+    tcp_packet_t packet;
+    uint8_t *pseudo;
+    uint16_t sum;
+
+    set_addr6(&src, "2001:db8::1", 23300);
+    set_addr6(&dst, "2001:db8:ffff::2", 80);
+    create_packet(&packet, 101);
+
+    pseudo = calloc(1, 40 + packet.length);
+    memcpy(pseudo, &((struct sockaddr_in6 *) &src)->sin6_addr, 16);
+    memcpy(pseudo + 16, &((struct sockaddr_in6 *) &dst)->sin6_addr, 16);
+    pseudo[34] = packet.length >> 8;
+    pseudo[35] = packet.length & 0xFF;
+    pseudo[39] = 6; /* TCP */
+    memcpy(pseudo + 40, packet.raw, packet.length);
+
+    sum = chitcp_tcp_checksum(&packet, (struct sockaddr *) &src, (struct sockaddr *) &dst);
+    cr_assert_eq(sum, chitcp_cksum(pseudo, 40 + packet.length));
+
+    TCP_PACKET_HEADER(&packet)->sum = sum;
+    cr_assert(chitcp_tcp_checksum_valid(&packet, (struct sockaddr *) &src, (struct sockaddr *) &dst));
+
+    /* Corrupting the payload must be detected */
+    packet.raw[packet.length - 1] ^= 0x40;
+    cr_assert_not(chitcp_tcp_checksum_valid(&packet, (struct sockaddr *) &src, (struct sockaddr *) &dst));
+
+    free(pseudo);
+    chitcp_tcp_packet_free(&packet);
+}
+
+Test(cksum, tcp_v4mapped)
+{
+    struct sockaddr_storage src4, dst4, src6, dst6;
+    tcp_packet_t packet;
+    uint16_t sum;
+
+    set_addr4(&src4, "127.0.0.1", 23300);
+    set_addr4(&dst4, "127.0.0.1", 80);
+    set_addr6(&src6, "::ffff:127.0.0.1", 23300);
+    set_addr6(&dst6, "::ffff:127.0.0.1", 80);
+    create_packet(&packet, 10);
+
+    /* A v4-mapped address produces the same checksum as the IPv4 address,
+     * so both ends agree regardless of how their sockets were bound */
+    sum = chitcp_tcp_checksum(&packet, (struct sockaddr *) &src4, (struct sockaddr *) &dst4);
+    cr_assert_eq(chitcp_tcp_checksum(&packet, (struct sockaddr *) &src6, (struct sockaddr *) &dst6), sum);
+    cr_assert_eq(chitcp_tcp_checksum(&packet, (struct sockaddr *) &src4, (struct sockaddr *) &dst6), sum);
+
+    TCP_PACKET_HEADER(&packet)->sum = sum;
+    cr_assert(chitcp_tcp_checksum_valid(&packet, (struct sockaddr *) &src6, (struct sockaddr *) &dst4));
+
+    chitcp_tcp_packet_free(&packet);
+}
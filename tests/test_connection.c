@@ -0,0 +1,352 @@
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <errno.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <arpa/inet.h>
+#include <sys/socket.h>
+#include <criterion/criterion.h>
+#include "connection.h"
+#include "chitcp/addr.h"
+#include "chitcp/packet.h"
+
+/* Finds a non-loopback address of this host (the one used to reach
+ * a TEST-NET-1 address), and skips the test if there is none */
+static void find_local_addr(struct sockaddr_storage *addr)
+{
+    struct sockaddr_in testnet;
+    int s, rc;
+
+    memset(&testnet, 0, sizeof(testnet));
+    testnet.sin_family = AF_INET;
+    testnet.sin_port = htons(9);
+    inet_pton(AF_INET, "192.0.2.1", &testnet.sin_addr);
+
+    s = socket(AF_INET, SOCK_DGRAM, 0);
+    rc = chitcpd_connection_local_addr(s, (struct sockaddr *) &testnet, addr);
+    close(s);
+
+    if (rc != CHITCP_OK || chitcp_addr_is_loopback((struct sockaddr *) addr))
+        cr_skip_test("This host has no non-loopback address");
+}
+
+static void create_packet(tcp_packet_t *packet)
+{
+    uint8_t payload[33];
+    tcphdr_t *header;
+
+    memset(payload, 0x5A, sizeof(payload));
+    chitcp_tcp_packet_init(packet, payload, sizeof(payload));
+    header = TCP_PACKET_HEADER(packet);
+    header->source = htons(23300);
+    header->dest = htons(80);
+    header->seq = htonl(1000);
+    header->syn = 1;
+    header->win = htons(4096);
+}
+
+/* The checksum of a packet sent on a connection (from a socket whose
+ * local address is the ANY address) must be valid for the receiver,
+ * which uses the addresses of its end of the real connection */
+static void check_checksum(struct sockaddr_storage *sender_local, struct sockaddr *sender_peer,
+                           struct sockaddr_storage *receiver_local, struct sockaddr_storage *receiver_peer)
+{
+    struct sockaddr_storage any;
+    tcp_packet_t packet;
+
+    create_packet(&packet);
+
+    TCP_PACKET_HEADER(&packet)->sum = chitcp_tcp_checksum(&packet, (struct sockaddr *) sender_local, sender_peer);
+    cr_assert(chitcp_tcp_checksum_valid(&packet, (struct sockaddr *) receiver_peer, (struct sockaddr *) receiver_local));
+
+    memset(&any, 0, sizeof(any));
+    any.ss_family = AF_INET;
+    TCP_PACKET_HEADER(&packet)->sum = chitcp_tcp_checksum(&packet, (struct sockaddr *) &any, sender_peer);
+    cr_assert_not(chitcp_tcp_checksum_valid(&packet, (struct sockaddr *) receiver_peer, (struct sockaddr *) receiver_local));
+
+    chitcp_tcp_packet_free(&packet);
+}
+
+Test(connection, local_addr_tcp)
+{
+    struct sockaddr_storage addr, sender_local, receiver_local, receiver_peer;
+    socklen_t size = sizeof(addr);
+    int server, client, accepted;
+
+    find_local_addr(&addr);
+
+    /* Connection to our own non-loopback address */
+    server = socket(AF_INET, SOCK_STREAM, 0);
+    chitcp_set_addr_port((struct sockaddr *) &addr, 0);
+    cr_assert_eq(bind(server, (struct sockaddr *) &addr, sizeof(struct sockaddr_in)), 0);
+    cr_assert_eq(listen(server, 1), 0);
+    getsockname(server, (struct sockaddr *) &addr, &size);
+
+    client = socket(AF_INET, SOCK_STREAM, 0);
+    cr_assert_eq(connect(client, (struct sockaddr *) &addr, sizeof(struct sockaddr_in)), 0);
+    accepted = accept(server, NULL, NULL);
+    cr_assert_neq(accepted, -1);
+
+    cr_assert_eq(chitcpd_connection_local_addr(client, (struct sockaddr *) &addr, &sender_local), CHITCP_OK);
+    size = sizeof(receiver_local);
+    getsockname(accepted, (struct sockaddr *) &receiver_local, &size);
+    size = sizeof(receiver_peer);
+    getpeername(accepted, (struct sockaddr *) &receiver_peer, &size);
+
+    cr_assert_eq(chitcp_addr_cmp((struct sockaddr *) &sender_local, (struct sockaddr *) &receiver_peer), 0);
+    check_checksum(&sender_local, (struct sockaddr *) &addr, &receiver_local, &receiver_peer);
+
+    close(accepted);
+    close(client);
+    close(server);
+}
+
+Test(connection, local_addr_udp)
+{
+    struct sockaddr_storage addr, sender_local, receiver_peer;
+    struct sockaddr_in any;
+    socklen_t size = sizeof(addr);
+    int sender, receiver;
+    char c = 'x';
+
+    find_local_addr(&addr);
+
+    /* The receiver is bound to our non-loopback address, and the
+     * sender to the ANY address (like the UDP transport's network socket) */
+    receiver = socket(AF_INET, SOCK_DGRAM, 0);
+    chitcp_set_addr_port((struct sockaddr *) &addr, 0);
+    cr_assert_eq(bind(receiver, (struct sockaddr *) &addr, sizeof(struct sockaddr_in)), 0);
+    getsockname(receiver, (struct sockaddr *) &addr, &size);
+
+    sender = socket(AF_INET, SOCK_DGRAM, 0);
+    memset(&any, 0, sizeof(any));
+    any.sin_family = AF_INET;
+    cr_assert_eq(bind(sender, (struct sockaddr *) &any, sizeof(any)), 0);
+
+    cr_assert_eq(chitcpd_connection_local_addr(sender, (struct sockaddr *) &addr, &sender_local), CHITCP_OK);
+    cr_assert_not(chitcp_addr_is_any((struct sockaddr *) &sender_local));
+
+    /* The receiver sees the datagram coming from that address */
+    cr_assert_eq(sendto(sender, &c, 1, 0, (struct sockaddr *) &addr, sizeof(struct sockaddr_in)), 1);
+    size = sizeof(receiver_peer);
+    cr_assert_eq(recvfrom(receiver, &c, 1, 0, (struct sockaddr *) &receiver_peer, &size), 1);
+
+    cr_assert_eq(chitcp_addr_cmp((struct sockaddr *) &sender_local, (struct sockaddr *) &receiver_peer), 0);
+    check_checksum(&sender_local, (struct sockaddr *) &addr, &addr, &receiver_peer);
+
+    close(sender);
+    close(receiver);
+}
+
+/* The transmit queue tests send packets on a connection whose real
+ * socket is a SOCK_SEQPACKET socket pair, so every sendmsg() made by
+ * the writer thread can be read back as a separate record */
+#define FRAME_LEN (sizeof(chitcphdr_t) + sizeof(tcphdr_t) + sizeof(uint32_t))
+
+static serverinfo_t tx_si;
+static chisocketentry_t tx_sock;
+static tcpconnentry_t tx_conn;
+static int tx_pair[2];
+
+static void tx_setup(void)
+{
+    struct sockaddr_in loopback;
+
+    memset(&loopback, 0, sizeof(loopback));
+    loopback.sin_family = AF_INET;
+    loopback.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+    memset(&tx_si, 0, sizeof(tx_si));
+    memset(&tx_sock, 0, sizeof(tx_sock));
+    memset(&tx_conn, 0, sizeof(tx_conn));
+
+    tx_si.chisocket_table = &tx_sock;
+    tx_si.chisocket_table_size = 1;
+    tx_si.tx_queue_limit = DEFAULT_TX_QUEUE_LIMIT;
+
+    memcpy(&tx_sock.local_addr, &loopback, sizeof(loopback));
+    memcpy(&tx_sock.remote_addr, &loopback, sizeof(loopback));
+    tx_sock.actpas_type = SOCKET_ACTIVE;
+    tx_sock.socket_state.active.realtcpconn = &tx_conn;
+
+    cr_assert_eq(socketpair(AF_UNIX, SOCK_SEQPACKET, 0, tx_pair), 0);
+    tx_conn.available = FALSE;
+    tx_conn.realsocket_send = tx_conn.realsocket_recv = tx_pair[0];
+    memcpy(&tx_conn.local_addr, &loopback, sizeof(loopback));
+    memcpy(&tx_conn.peer_addr, &loopback, sizeof(loopback));
+    pthread_mutex_init(&tx_conn.lock_tx, NULL);
+    pthread_cond_init(&tx_conn.cv_tx, NULL);
+    pthread_cond_init(&tx_conn.cv_tx_space, NULL);
+
+    cr_assert_eq(chitcpd_create_connection_writer_thread(&tx_si, &tx_conn), CHITCP_OK);
+}
+
+static void tx_teardown(void)
+{
+    chitcpd_close_connection_tx(&tx_conn);
+    shutdown(tx_pair[1], SHUT_RDWR);
+    pthread_join(tx_conn.writer_thread, NULL);
+    close(tx_pair[0]);
+    close(tx_pair[1]);
+}
+
+static void tx_send(uint32_t seq)
+{
+    tcp_packet_t packet;
+    tcphdr_t *header;
+
+    chitcp_tcp_packet_init(&packet, (uint8_t *) &seq, sizeof(seq));
+    header = TCP_PACKET_HEADER(&packet);
+    header->source = htons(23300);
+    header->dest = htons(80);
+    header->seq = htonl(seq);
+    header->ack = 1;
+
+    cr_assert_eq(chitcpd_send_tcp_packet(&tx_si, &tx_sock, &packet), sizeof(tcphdr_t) + sizeof(seq));
+    chitcp_tcp_packet_free(&packet);
+}
+
+/* Fills up the socket pair with records of our own, so the writer
+ * thread blocks in the next sendmsg() it makes. Returns the number
+ * of records. */
+static int tx_block(void)
+{
+    uint8_t junk[FRAME_LEN];
+    int n = 0;
+
+    memset(junk, 0, sizeof(junk));
+    while (send(tx_pair[0], junk, sizeof(junk), MSG_DONTWAIT) == sizeof(junk))
+        n++;
+    cr_assert(errno == EAGAIN || errno == EWOULDBLOCK);
+
+    return n;
+}
+
+static void tx_unblock(int n)
+{
+    uint8_t junk[FRAME_LEN];
+
+    for (int i = 0; i < n; i++)
+        cr_assert_eq(recv(tx_pair[1], junk, sizeof(junk), 0), sizeof(junk));
+}
+
+/* Waits until the writer thread has taken all the frames in the queue */
+static void tx_wait_dequeued(void)
+{
+    bool_t empty = FALSE;
+
+    for (int i = 0; i < 1000 && !empty; i++)
+    {
+        pthread_mutex_lock(&tx_conn.lock_tx);
+        empty = tx_conn.tx_queue == NULL;
+        pthread_mutex_unlock(&tx_conn.lock_tx);
+        if (!empty)
+            usleep(1000);
+    }
+
+    cr_assert(empty);
+}
+
+/* Reads one record (the frames sent with a single sendmsg()), and checks
+ * that it contains nframes frames, starting with sequence number seq */
+static void tx_recv(uint32_t seq, int nframes)
+{
+    uint8_t buf[16 * FRAME_LEN];
+    tcphdr_t *header;
+
+    cr_assert_eq(recv(tx_pair[1], buf, sizeof(buf), 0), nframes * FRAME_LEN);
+
+    for (int i = 0; i < nframes; i++)
+    {
+        header = (tcphdr_t *) (buf + i * FRAME_LEN + sizeof(chitcphdr_t));
+        cr_assert_eq(ntohl(header->seq), seq + i);
+    }
+}
+
+/* The frames queued while the writer thread is busy are all sent
+ * with the next sendmsg() */
+Test(connection, tx_coalesce, .init = tx_setup, .fini = tx_teardown, .timeout = 10)
+{
+    int n;
+
+    n = tx_block();
+    tx_send(0);
+    tx_wait_dequeued();
+
+    for (uint32_t seq = 1; seq <= 4; seq++)
+        tx_send(seq);
+
+    tx_unblock(n);
+    tx_recv(0, 1);
+    tx_recv(1, 4);
+}
+
+typedef struct tx_send_args
+{
+    uint32_t seq;
+    atomic_bool done;
+} tx_send_args_t;
+
+static void *tx_send_thread(void *arg)
+{
+    tx_send_args_t *args = arg;
+
+    tx_send(args->seq);
+    atomic_store(&args->done, true);
+
+    return NULL;
+}
+
+/* A TCP thread that sends a packet when the transmit queue is full
+ * blocks until the writer thread has made room for it */
+Test(connection, tx_queue_limit, .init = tx_setup, .fini = tx_teardown, .timeout = 10)
+{
+    uint8_t buf[16 * FRAME_LEN];
+    tx_send_args_t args;
+    pthread_t thread;
+    size_t nbytes = 0;
+    tcphdr_t *header;
+    ssize_t rc;
+    int n;
+
+    /* The queue fills up with the frame the writer thread is
+     * trying to send, and the two frames after it */
+    tx_si.tx_queue_limit = 3 * FRAME_LEN;
+
+    n = tx_block();
+    tx_send(0);
+    tx_wait_dequeued();
+    tx_send(1);
+    tx_send(2);
+
+    args.seq = 3;
+    atomic_init(&args.done, false);
+    cr_assert_eq(pthread_create(&thread, NULL, tx_send_thread, &args), 0);
+    usleep(20000);
+    cr_assert_not(atomic_load(&args.done));
+    pthread_mutex_lock(&tx_conn.lock_tx);
+    cr_assert_eq(tx_conn.tx_queue_bytes, 3 * FRAME_LEN);
+    pthread_mutex_unlock(&tx_conn.lock_tx);
+
+    tx_unblock(n);
+    pthread_join(thread, NULL);
+    cr_assert(atomic_load(&args.done));
+
+    /* All the frames were sent, in order (the last one may or may
+     * not have been sent with the two before it) */
+    while (nbytes < 4 * FRAME_LEN)
+    {
+        rc = recv(tx_pair[1], buf + nbytes, sizeof(buf) - nbytes, 0);
+        cr_assert_gt(rc, 0);
+        nbytes += rc;
+    }
+    cr_assert_eq(nbytes, 4 * FRAME_LEN);
+
+    for (int i = 0; i < 4; i++)
+    {
+        header = (tcphdr_t *) (buf + i * FRAME_LEN + sizeof(chitcphdr_t));
+        cr_assert_eq(ntohl(header->seq), i);
+    }
+}
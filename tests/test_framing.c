@@ -0,0 +1,150 @@
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <criterion/criterion.h>
+#include "chitcp/packet.h"
+#include "framing.h"
+
+/* Writes a chiTCP frame containing a TCP header with the given sequence
+ * number and no payload, and returns its size */
+static size_t make_frame(uint8_t *buf, uint32_t seq)
+{
+    chitcphdr_t header;
+    tcphdr_t tcp;
+
+    memset(&header, 0, sizeof(chitcphdr_t));
+    header.payload_len = chitcp_htons(TCP_HEADER_NOOPTIONS_SIZE);
+    header.proto = CHITCP_PROTO_TCP;
+
+    memset(&tcp, 0, sizeof(tcphdr_t));
+    tcp.seq = chitcp_htonl(seq);
+    tcp.doff = TCP_HEADER_NOOPTIONS_SIZE / sizeof(uint32_t);
+
+    memcpy(buf, &header, sizeof(chitcphdr_t));
+    memcpy(buf + sizeof(chitcphdr_t), &tcp, sizeof(tcphdr_t));
+
+    return sizeof(chitcphdr_t) + TCP_HEADER_NOOPTIONS_SIZE;
+}
+
+static void check_packet(tcp_packet_t *packet, uint32_t seq)
+{
+    cr_assert_eq(packet->length, TCP_HEADER_NOOPTIONS_SIZE);
+    cr_assert_eq(SEG_SEQ(packet), seq);
+    chitcp_tcp_packet_free(packet);
+    free(packet);
+}
+
+Test(framing, decode_incomplete)
+{
+    uint8_t buf[FRAME_MAX_SIZE];
+    chitcphdr_t header;
+    tcp_packet_t *packet;
+    size_t len;
+
+    len = make_frame(buf, 1000);
+
+    cr_assert_eq(chitcpd_frame_decode(buf, sizeof(chitcphdr_t) - 1, &header, &packet), 0);
+    cr_assert_eq(chitcpd_frame_decode(buf, len - 1, &header, &packet), 0);
+    cr_assert_eq(chitcpd_frame_decode(buf, len, &header, &packet), len);
+    check_packet(packet, 1000);
+}
+
+Test(framing, decode_bad_proto)
+{
+    uint8_t buf[FRAME_MAX_SIZE];
+    chitcphdr_t header;
+    tcp_packet_t *packet;
+    size_t len;
+
+    len = make_frame(buf, 1000);
+    ((chitcphdr_t *) buf)->proto = CHITCP_PROTO_RAW;
+
+    cr_assert_eq(chitcpd_frame_decode(buf, len, &header, &packet), CHITCP_EINVAL);
+    cr_assert_eq(header.proto, CHITCP_PROTO_RAW);
+}
+
+Test(framing, several_frames_per_recv)
+{
+    int sv[2];
+    uint8_t buf[3 * FRAME_MAX_SIZE];
+    frame_reader_t fr;
+    chitcphdr_t header;
+    tcp_packet_t *packet;
+    size_t len = 0;
+
+    cr_assert_eq(socketpair(AF_UNIX, SOCK_STREAM, 0, sv), 0);
+    cr_assert_eq(chitcpd_frame_reader_init(&fr, FRAME_READER_BUFFER_SIZE), CHITCP_OK);
+
+    for (int i = 0; i < 3; i++)
+        len += make_frame(buf + len, 1000 + i);
+    cr_assert_eq(send(sv[0], buf, len, 0), len);
+
+    cr_assert_eq(chitcpd_frame_reader_fill(&fr, sv[1], 0), len);
+    for (int i = 0; i < 3; i++)
+    {
+        cr_assert_eq(chitcpd_frame_reader_next(&fr, &header, &packet), CHITCP_OK);
+        check_packet(packet, 1000 + i);
+    }
+    cr_assert_eq(chitcpd_frame_reader_next(&fr, &header, &packet), CHITCP_ENOENT);
+
+    chitcpd_frame_reader_free(&fr);
+    close(sv[0]);
+    close(sv[1]);
+}
+
+Test(framing, frame_split_across_recvs)
+{
+    int sv[2];
+    uint8_t buf[FRAME_MAX_SIZE];
+    frame_reader_t fr;
+    chitcphdr_t header;
+    tcp_packet_t *packet;
+    size_t len;
+
+    cr_assert_eq(socketpair(AF_UNIX, SOCK_STREAM, 0, sv), 0);
+    cr_assert_eq(chitcpd_frame_reader_init(&fr, FRAME_READER_BUFFER_SIZE), CHITCP_OK);
+
+    len = make_frame(buf, 2000);
+
+    cr_assert_eq(send(sv[0], buf, 5, 0), 5);
+    cr_assert_eq(chitcpd_frame_reader_fill(&fr, sv[1], 0), 5);
+    cr_assert_eq(chitcpd_frame_reader_next(&fr, &header, &packet), CHITCP_ENOENT);
+
+    cr_assert_eq(send(sv[0], buf + 5, len - 5, 0), len - 5);
+    cr_assert_eq(chitcpd_frame_reader_fill(&fr, sv[1], 0), len - 5);
+    cr_assert_eq(chitcpd_frame_reader_next(&fr, &header, &packet), CHITCP_OK);
+    check_packet(packet, 2000);
+
+    chitcpd_frame_reader_free(&fr);
+    close(sv[0]);
+    close(sv[1]);
+}
+
+Test(framing, append)
+{
+    uint8_t buf[2 * FRAME_MAX_SIZE];
+    frame_reader_t fr;
+    chitcphdr_t header;
+    tcp_packet_t *packet;
+    size_t len;
+
+    cr_assert_eq(chitcpd_frame_reader_init(&fr, FRAME_MAX_SIZE), CHITCP_OK);
+
+    len = make_frame(buf, 3000);
+    len += make_frame(buf + len, 3001);
+
+    cr_assert_eq(chitcpd_frame_reader_append(&fr, buf, len - 1), CHITCP_OK);
+    cr_assert_eq(chitcpd_frame_reader_next(&fr, &header, &packet), CHITCP_OK);
+    check_packet(packet, 3000);
+    cr_assert_eq(chitcpd_frame_reader_next(&fr, &header, &packet), CHITCP_ENOENT);
+
+    cr_assert_eq(chitcpd_frame_reader_append(&fr, buf + len - 1, 1), CHITCP_OK);
+    cr_assert_eq(chitcpd_frame_reader_next(&fr, &header, &packet), CHITCP_OK);
+    check_packet(packet, 3001);
+
+    /* More than fits in the buffer */
+    cr_assert_eq(chitcpd_frame_reader_append(&fr, buf, FRAME_MAX_SIZE + 1), CHITCP_ENOMEM);
+
+    chitcpd_frame_reader_free(&fr);
+}
@@ -0,0 +1,546 @@
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <arpa/inet.h>
+#include <sys/socket.h>
+#include <criterion/criterion.h>
+#include "chitcp/chitcpd.h"
+#include "chitcp/buffer.h"
+#include "serverinfo.h"
+#include "server.h"
+#include "handlers.h"
+#include "protobuf-wrapper.h"
+
+/* The request handlers are only called through chitcpd_handler_dispatch,
+ * so they are not declared in handlers.h */
+#define HANDLER_FUNCTION(NAME) int chitcpd_handle_ ## NAME (serverinfo_t *si, ChitcpdMsg *req_msg, ChitcpdResp *resp)
+
+HANDLER_FUNCTION(CHITCPD_MSG_CODE__SOCKET);
+HANDLER_FUNCTION(CHITCPD_MSG_CODE__LISTEN);
+HANDLER_FUNCTION(CHITCPD_MSG_CODE__ACCEPT);
+HANDLER_FUNCTION(CHITCPD_MSG_CODE__CONNECT);
+HANDLER_FUNCTION(CHITCPD_MSG_CODE__SEND);
+HANDLER_FUNCTION(CHITCPD_MSG_CODE__RECV);
+HANDLER_FUNCTION(CHITCPD_MSG_CODE__FCNTL);
+HANDLER_FUNCTION(CHITCPD_MSG_CODE__BATCH);
+
+#define BUFFER_SIZE (8)
+
+static serverinfo_t *si;
+static chisocketentry_t *active;
+static tcp_data_t *tcp_data;
+static uint8_t data[12] = {1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12};
+
+/* The daemon is initialized but not started, so the handlers are called
+ * directly. Socket 0 is an established active socket with 8-byte buffers
+ * (which are written and read by the tests instead of a TCP thread) */
+static void setup(void)
+{
+    int sockfd;
+
+    si = calloc(1, sizeof(serverinfo_t));
+    cr_assert_eq(chitcpd_server_init(si), CHITCP_OK);
+    si->state = CHITCPD_STATE_RUNNING;
+
+    cr_assert_eq(chitcpd_allocate_socket(si, &sockfd), CHITCP_OK);
+    cr_assert_eq(sockfd, 0);
+    active = &si->chisocket_table[0];
+    active->actpas_type = SOCKET_ACTIVE;
+    active->tcp_state = ESTABLISHED;
+    pthread_mutex_init(&active->socket_state.active.lock_event, NULL);
+    pthread_cond_init(&active->socket_state.active.cv_event, NULL);
+    tcp_data = &active->socket_state.active.tcp_data;
+    circular_buffer_init(&tcp_data->send, BUFFER_SIZE);
+    circular_buffer_init(&tcp_data->recv, BUFFER_SIZE);
+}
+
+static void teardown(void)
+{
+    circular_buffer_free(&tcp_data->send);
+    circular_buffer_free(&tcp_data->recv);
+    chitcpd_server_free(si);
+    free(si);
+}
+
+/* Returns the value of ret in the response, and its error code in *error */
+static int do_send(int sockfd, uint8_t *buf, int len, int flags, int *error)
+{
+    ChitcpdMsg msg = CHITCPD_MSG__INIT;
+    ChitcpdSendArgs args = CHITCPD_SEND_ARGS__INIT;
+    ChitcpdResp resp = CHITCPD_RESP__INIT;
+
+    msg.code = CHITCPD_MSG_CODE__SEND;
+    msg.send_args = &args;
+    args.sockfd = sockfd;
+    args.buf.data = buf;
+    args.buf.len = len;
+    args.flags = flags;
+
+    cr_assert_eq(chitcpd_handle_CHITCPD_MSG_CODE__SEND(si, &msg, &resp), CHITCP_OK);
+    *error = resp.error_code;
+
+    return resp.ret;
+}
+
+/* Also copies the received data to buf */
+static int do_recv(int sockfd, uint8_t *buf, int len, int flags, int *error)
+{
+    ChitcpdMsg msg = CHITCPD_MSG__INIT;
+    ChitcpdRecvArgs args = CHITCPD_RECV_ARGS__INIT;
+    ChitcpdResp resp = CHITCPD_RESP__INIT;
+
+    msg.code = CHITCPD_MSG_CODE__RECV;
+    msg.recv_args = &args;
+    args.sockfd = sockfd;
+    args.len = len;
+    args.flags = flags;
+
+    cr_assert_eq(chitcpd_handle_CHITCPD_MSG_CODE__RECV(si, &msg, &resp), CHITCP_OK);
+    *error = resp.error_code;
+    if (resp.has_buf)
+    {
+        cr_assert_eq(resp.buf.len, resp.ret);
+        memcpy(buf, resp.buf.data, resp.buf.len);
+    }
+    free(resp.buf.data);
+
+    return resp.ret;
+}
+
+static int do_fcntl(int sockfd, int cmd, bool_t has_arg, int arg, int *error)
+{
+    ChitcpdMsg msg = CHITCPD_MSG__INIT;
+    ChitcpdFcntlArgs args = CHITCPD_FCNTL_ARGS__INIT;
+    ChitcpdResp resp = CHITCPD_RESP__INIT;
+
+    msg.code = CHITCPD_MSG_CODE__FCNTL;
+    msg.fcntl_args = &args;
+    args.sockfd = sockfd;
+    args.cmd = cmd;
+    args.has_arg = has_arg;
+    args.arg = arg;
+
+    cr_assert_eq(chitcpd_handle_CHITCPD_MSG_CODE__FCNTL(si, &msg, &resp), CHITCP_OK);
+    *error = resp.error_code;
+
+    return resp.ret;
+}
+
+/* Creates a socket with the given type (and flags) */
+static int do_socket(int type)
+{
+    ChitcpdMsg msg = CHITCPD_MSG__INIT;
+    ChitcpdSocketArgs args = CHITCPD_SOCKET_ARGS__INIT;
+    ChitcpdResp resp = CHITCPD_RESP__INIT;
+
+    msg.code = CHITCPD_MSG_CODE__SOCKET;
+    msg.socket_args = &args;
+    args.domain = AF_INET;
+    args.type = type;
+
+    cr_assert_eq(chitcpd_handle_CHITCPD_MSG_CODE__SOCKET(si, &msg, &resp), CHITCP_OK);
+    cr_assert_geq(resp.ret, 0);
+
+    return resp.ret;
+}
+
+/* Simulates the TCP thread, which moves the data that arrives
+ * through the network to the receive buffer, a few bytes at a time */
+static void *recv_later(void *args)
+{
+    for (int i = 0; i < 10; i += 2)
+    {
+        usleep(10000);
+        circular_buffer_write(&tcp_data->recv, data + i, 2, BUFFER_BLOCKING);
+    }
+
+    return NULL;
+}
+
+Test(handlers, fcntl, .init = setup, .fini = teardown)
+{
+    int error;
+
+    cr_assert_eq(do_fcntl(0, F_GETFL, FALSE, 0, &error), O_RDWR);
+    cr_assert_eq(do_fcntl(0, F_SETFL, TRUE, O_NONBLOCK, &error), 0);
+    cr_assert(active->nonblocking);
+    cr_assert_eq(do_fcntl(0, F_GETFL, FALSE, 0, &error), O_RDWR | O_NONBLOCK);
+    cr_assert_eq(do_fcntl(0, F_SETFL, TRUE, 0, &error), 0);
+    cr_assert(!active->nonblocking);
+    cr_assert_eq(do_fcntl(0, F_GETFL, FALSE, 0, &error), O_RDWR);
+
+    cr_assert_eq(do_fcntl(0, F_SETFL, FALSE, 0, &error), -1);
+    cr_assert_eq(error, EINVAL);
+    cr_assert_eq(do_fcntl(0, F_SETFD, TRUE, FD_CLOEXEC, &error), -1);
+    cr_assert_eq(error, EINVAL);
+    cr_assert_eq(do_fcntl(3, F_GETFL, FALSE, 0, &error), -1);
+    cr_assert_eq(error, EBADF);
+}
+
+Test(handlers, socket_nonblock, .init = setup, .fini = teardown)
+{
+    int sockfd, error;
+
+    sockfd = do_socket(SOCK_STREAM | SOCK_NONBLOCK);
+
+    cr_assert_eq(si->chisocket_table[sockfd].type, SOCK_STREAM);
+    cr_assert_eq(do_fcntl(sockfd, F_GETFL, FALSE, 0, &error), O_RDWR | O_NONBLOCK);
+}
+
+Test(handlers, recv_nonblocking, .init = setup, .fini = teardown)
+{
+    uint8_t buf[BUFFER_SIZE];
+    int error;
+
+    cr_assert_eq(do_recv(0, buf, 4, MSG_DONTWAIT, &error), -1);
+    cr_assert_eq(error, EAGAIN);
+
+    active->nonblocking = TRUE;
+    cr_assert_eq(do_recv(0, buf, 4, 0, &error), -1);
+    cr_assert_eq(error, EAGAIN);
+
+    circular_buffer_write(&tcp_data->recv, data, 2, BUFFER_BLOCKING);
+    cr_assert_eq(do_recv(0, buf, 4, 0, &error), 2);
+    cr_assert_eq(memcmp(buf, data, 2), 0);
+}
+
+Test(handlers, send_nonblocking, .init = setup, .fini = teardown)
+{
+    int error;
+
+    /* Only what fits in the buffer is sent */
+    active->nonblocking = TRUE;
+    cr_assert_eq(do_send(0, data, 12, 0, &error), BUFFER_SIZE);
+    cr_assert(active->socket_state.active.flags.app_send);
+
+    cr_assert_eq(do_send(0, data, 12, 0, &error), -1);
+    cr_assert_eq(error, EAGAIN);
+
+    active->nonblocking = FALSE;
+    cr_assert_eq(do_send(0, data, 12, MSG_DONTWAIT, &error), -1);
+    cr_assert_eq(error, EAGAIN);
+}
+
+Test(handlers, recv_peek, .init = setup, .fini = teardown)
+{
+    uint8_t buf[BUFFER_SIZE];
+    int error;
+
+    circular_buffer_write(&tcp_data->recv, data, 3, BUFFER_BLOCKING);
+
+    /* Peeking doesn't remove the data, so the TCP thread is not notified */
+    cr_assert_eq(do_recv(0, buf, BUFFER_SIZE, MSG_PEEK, &error), 3);
+    cr_assert_eq(memcmp(buf, data, 3), 0);
+    cr_assert(!active->socket_state.active.flags.app_recv);
+
+    memset(buf, 0, sizeof(buf));
+    cr_assert_eq(do_recv(0, buf, BUFFER_SIZE, 0, &error), 3);
+    cr_assert_eq(memcmp(buf, data, 3), 0);
+    cr_assert(active->socket_state.active.flags.app_recv);
+}
+
+Test(handlers, recv_waitall, .init = setup, .fini = teardown)
+{
+    uint8_t buf[10];
+    pthread_t thread;
+    int error;
+
+    /* More data than fits in the buffer */
+    cr_assert_eq(pthread_create(&thread, NULL, recv_later, NULL), 0);
+    cr_assert_eq(do_recv(0, buf, 10, MSG_WAITALL, &error), 10);
+    pthread_join(thread, NULL);
+    cr_assert_eq(memcmp(buf, data, 10), 0);
+}
+
+Test(handlers, recv_waitall_closed, .init = setup, .fini = teardown)
+{
+    uint8_t buf[10];
+    int error;
+
+    /* If the peer closes the connection, we get what was received */
+    circular_buffer_write(&tcp_data->recv, data, 3, BUFFER_BLOCKING);
+    circular_buffer_close(&tcp_data->recv);
+    active->tcp_state = CLOSE_WAIT;
+
+    cr_assert_eq(do_recv(0, buf, 10, MSG_WAITALL, &error), 3);
+    cr_assert_eq(memcmp(buf, data, 3), 0);
+    cr_assert_eq(do_recv(0, buf, 10, MSG_WAITALL, &error), 0);
+    cr_assert_eq(error, 0);
+}
+
+Test(handlers, accept_nonblocking, .init = setup, .fini = teardown)
+{
+    ChitcpdMsg msg = CHITCPD_MSG__INIT;
+    ChitcpdListenArgs listen_args = CHITCPD_LISTEN_ARGS__INIT;
+    ChitcpdAcceptArgs accept_args = CHITCPD_ACCEPT_ARGS__INIT;
+    ChitcpdResp resp = CHITCPD_RESP__INIT;
+    int sockfd;
+
+    sockfd = do_socket(SOCK_STREAM | SOCK_NONBLOCK);
+
+    msg.code = CHITCPD_MSG_CODE__LISTEN;
+    msg.listen_args = &listen_args;
+    listen_args.sockfd = sockfd;
+    listen_args.backlog = 5;
+    chitcpd_handle_CHITCPD_MSG_CODE__LISTEN(si, &msg, &resp);
+    cr_assert_eq(resp.ret, 0);
+
+    msg.code = CHITCPD_MSG_CODE__ACCEPT;
+    msg.listen_args = NULL;
+    msg.accept_args = &accept_args;
+    accept_args.sockfd = sockfd;
+    chitcpd_handle_CHITCPD_MSG_CODE__ACCEPT(si, &msg, &resp);
+    cr_assert_eq(resp.ret, -1);
+    cr_assert_eq(resp.error_code, EAGAIN);
+}
+
+Test(handlers, connect_nonblocking, .init = setup, .fini = teardown)
+{
+    ChitcpdMsg msg = CHITCPD_MSG__INIT;
+    ChitcpdConnectArgs args = CHITCPD_CONNECT_ARGS__INIT;
+    ChitcpdResp resp = CHITCPD_RESP__INIT;
+    struct sockaddr_in addr;
+    tcpconnentry_t *connection;
+    chisocketentry_t *entry;
+    int sockfd;
+
+    /* We pretend to be connected to the peer's daemon (so no connection
+     * is actually opened) */
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = chitcp_htons(GET_CHITCPD_PORT);
+    inet_pton(AF_INET, "192.0.2.1", &addr.sin_addr);
+    connection = &si->connection_table[0];
+    connection->available = FALSE;
+    memcpy(&connection->peer_addr, &addr, sizeof(addr));
+
+    sockfd = do_socket(SOCK_STREAM | SOCK_NONBLOCK);
+    entry = &si->chisocket_table[sockfd];
+
+    addr.sin_port = chitcp_htons(7);
+    msg.code = CHITCPD_MSG_CODE__CONNECT;
+    msg.connect_args = &args;
+    args.sockfd = sockfd;
+    args.addr.data = (uint8_t *) &addr;
+    args.addr.len = sizeof(addr);
+
+    /* The handshake is started, but we don't wait for it */
+    chitcpd_handle_CHITCPD_MSG_CODE__CONNECT(si, &msg, &resp);
+    cr_assert_eq(resp.ret, -1);
+    cr_assert_eq(resp.error_code, EINPROGRESS);
+    cr_assert_eq(entry->actpas_type, SOCKET_ACTIVE);
+    cr_assert_eq(entry->socket_state.active.realtcpconn, connection);
+
+    /* Entering CLOSED makes the socket's TCP thread free it and exit */
+    chitcpd_update_tcp_state(si, entry, CLOSED);
+    pthread_join(entry->socket_state.active.tcp_thread, NULL);
+    cr_assert(entry->available);
+}
+
+/* Sends a pipelined RECV on socket 0 through a handler's connection */
+static void send_pipelined_recv(int fd, uint64_t request_id)
+{
+    ChitcpdMsg msg = CHITCPD_MSG__INIT;
+    ChitcpdRecvArgs args = CHITCPD_RECV_ARGS__INIT;
+
+    msg.code = CHITCPD_MSG_CODE__RECV;
+    msg.recv_args = &args;
+    msg.has_request_id = TRUE;
+    msg.request_id = request_id;
+    args.sockfd = 0;
+    args.len = BUFFER_SIZE;
+
+    cr_assert_eq(chitcpd_send_msg(fd, &msg), CHITCP_OK);
+}
+
+Test(handlers, pipeline_full, .init = setup, .fini = teardown, .timeout = 10)
+{
+    pthread_mutex_t handler_lock = PTHREAD_MUTEX_INITIALIZER;
+    handler_thread_args_t *ha;
+    pthread_t dispatch;
+    ChitcpdMsg *resp;
+    int sv[2];
+
+    cr_assert_eq(socketpair(AF_UNIX, SOCK_STREAM, 0, sv), 0);
+    ha = calloc(1, sizeof(handler_thread_args_t));
+    ha->si = si;
+    ha->client_socket = sv[1];
+    ha->handler_lock = &handler_lock;
+    strcpy(ha->thread_name, "test-handler");
+    cr_assert_eq(pthread_create(&dispatch, NULL, chitcpd_handler_dispatch, ha), 0);
+
+    /* Every worker blocks in a RECV (there is no data to receive)... */
+    for (uint64_t i = 0; i <= CHITCPD_HANDLER_MAX_WORKERS; i++)
+        send_pipelined_recv(sv[0], i);
+
+    /* ...so the next request fails, instead of waiting for one of them */
+    cr_assert_eq(chitcpd_recv_msg(sv[0], &resp), CHITCP_OK);
+    cr_assert(resp->has_request_id);
+    cr_assert_eq(resp->request_id, CHITCPD_HANDLER_MAX_WORKERS);
+    cr_assert_eq(resp->resp->ret, -1);
+    cr_assert_eq(resp->resp->error_code, EAGAIN);
+    chitcpd_msg__free_unpacked(resp, NULL);
+
+    /* The blocked requests still get their responses */
+    chitcpd_interrupt_socket_entry(si, active);
+    for (int i = 0; i < CHITCPD_HANDLER_MAX_WORKERS; i++)
+    {
+        cr_assert_eq(chitcpd_recv_msg(sv[0], &resp), CHITCP_OK);
+        cr_assert_lt(resp->request_id, CHITCPD_HANDLER_MAX_WORKERS);
+        chitcpd_msg__free_unpacked(resp, NULL);
+    }
+
+    close(sv[0]);
+    pthread_join(dispatch, NULL);
+}
+
+static void fcntl_msg(ChitcpdMsg *msg, ChitcpdFcntlArgs *args, int sockfd, int cmd, int arg)
+{
+    chitcpd_msg__init(msg);
+    chitcpd_fcntl_args__init(args);
+    msg->code = CHITCPD_MSG_CODE__FCNTL;
+    msg->fcntl_args = args;
+    args->sockfd = sockfd;
+    args->cmd = cmd;
+    args->has_arg = cmd == F_SETFL;
+    args->arg = arg;
+}
+
+static void socket_msg(ChitcpdMsg *msg, ChitcpdSocketArgs *args, bool_t shm)
+{
+    chitcpd_msg__init(msg);
+    chitcpd_socket_args__init(args);
+    msg->code = CHITCPD_MSG_CODE__SOCKET;
+    msg->socket_args = args;
+    args->domain = AF_INET;
+    args->type = SOCK_STREAM;
+    args->has_shm = shm;
+    args->shm = shm;
+}
+
+/* Runs a batch, which must produce one response per request */
+static void run_batch(ChitcpdMsg **reqs, size_t n, ChitcpdResp *resp)
+{
+    ChitcpdMsg msg = CHITCPD_MSG__INIT;
+    ChitcpdBatchArgs args = CHITCPD_BATCH_ARGS__INIT;
+
+    msg.code = CHITCPD_MSG_CODE__BATCH;
+    msg.batch_args = &args;
+    args.n_requests = n;
+    args.requests = reqs;
+
+    chitcpd_resp__init(resp);
+    cr_assert_eq(chitcpd_handle_CHITCPD_MSG_CODE__BATCH(si, &msg, resp), CHITCP_OK);
+    cr_assert_eq(resp->ret, n);
+    cr_assert_eq(resp->n_batch, n);
+}
+
+static void free_batch(ChitcpdResp *resp)
+{
+    for (size_t i = 0; i < resp->n_batch; i++)
+        free(resp->batch[i]);
+    free(resp->batch);
+}
+
+Test(batch, order, .init = setup, .fini = teardown)
+{
+    ChitcpdMsg msgs[6], *reqs[6];
+    ChitcpdFcntlArgs fcntl_args[4];
+    ChitcpdSocketArgs socket_args[2];
+    ChitcpdResp resp;
+
+    fcntl_msg(&msgs[0], &fcntl_args[0], 0, F_SETFL, O_NONBLOCK);
+    fcntl_msg(&msgs[1], &fcntl_args[1], 0, F_GETFL, 0);
+    fcntl_msg(&msgs[2], &fcntl_args[2], 0, F_SETFL, 0);
+    fcntl_msg(&msgs[3], &fcntl_args[3], 0, F_GETFL, 0);
+    socket_msg(&msgs[4], &socket_args[0], FALSE);
+    socket_msg(&msgs[5], &socket_args[1], FALSE);
+    for (int i = 0; i < 6; i++)
+        reqs[i] = &msgs[i];
+
+    run_batch(reqs, 6, &resp);
+
+    /* Each request sees the effects of the ones before it */
+    cr_assert_eq(resp.batch[0]->ret, 0);
+    cr_assert_eq(resp.batch[1]->ret, O_RDWR | O_NONBLOCK);
+    cr_assert_eq(resp.batch[2]->ret, 0);
+    cr_assert_eq(resp.batch[3]->ret, O_RDWR);
+    cr_assert_eq(resp.batch[4]->ret, 1);
+    cr_assert_eq(resp.batch[5]->ret, 2);
+    free_batch(&resp);
+}
+
+Test(batch, failure, .init = setup, .fini = teardown)
+{
+    ChitcpdMsg msgs[3], *reqs[3];
+    ChitcpdFcntlArgs args[3];
+    ChitcpdResp resp;
+
+    fcntl_msg(&msgs[0], &args[0], 0, F_GETFL, 0);
+    fcntl_msg(&msgs[1], &args[1], 3, F_GETFL, 0);
+    fcntl_msg(&msgs[2], &args[2], 0, F_SETFL, O_NONBLOCK);
+    for (int i = 0; i < 3; i++)
+        reqs[i] = &msgs[i];
+
+    run_batch(reqs, 3, &resp);
+
+    /* A failed request doesn't stop the rest of the batch */
+    cr_assert_eq(resp.batch[0]->ret, O_RDWR);
+    cr_assert_eq(resp.batch[1]->ret, -1);
+    cr_assert_eq(resp.batch[1]->error_code, EBADF);
+    cr_assert_eq(resp.batch[2]->ret, 0);
+    cr_assert(active->nonblocking);
+    free_batch(&resp);
+}
+
+Test(batch, not_batchable, .init = setup, .fini = teardown)
+{
+    ChitcpdMsg msgs[4], *reqs[4];
+    ChitcpdBatchArgs batch_args = CHITCPD_BATCH_ARGS__INIT;
+    ChitcpdInitArgs init_args = CHITCPD_INIT_ARGS__INIT;
+    ChitcpdFcntlArgs fcntl_args;
+    ChitcpdResp resp;
+
+    chitcpd_msg__init(&msgs[0]);
+    msgs[0].code = CHITCPD_MSG_CODE__BATCH;
+    msgs[0].batch_args = &batch_args;
+    chitcpd_msg__init(&msgs[1]);
+    msgs[1].code = CHITCPD_MSG_CODE__INIT;
+    msgs[1].init_args = &init_args;
+    chitcpd_msg__init(&msgs[2]);
+    msgs[2].code = CHITCPD_MSG_CODE__DEBUG;
+    fcntl_msg(&msgs[3], &fcntl_args, 0, F_GETFL, 0);
+    for (int i = 0; i < 4; i++)
+        reqs[i] = &msgs[i];
+
+    run_batch(reqs, 4, &resp);
+
+    for (int i = 0; i < 3; i++)
+    {
+        cr_assert_eq(resp.batch[i]->ret, -1);
+        cr_assert_eq(resp.batch[i]->error_code, EINVAL);
+    }
+    cr_assert_eq(resp.batch[3]->ret, O_RDWR);
+    free_batch(&resp);
+}
+
+Test(batch, no_shm, .init = setup, .fini = teardown)
+{
+    ChitcpdMsg msg, *reqs[1] = { &msg };
+    ChitcpdSocketArgs args;
+    ChitcpdResp resp;
+
+    socket_msg(&msg, &args, TRUE);
+
+    run_batch(reqs, 1, &resp);
+
+    /* The client can't attach to a shared-memory region created
+     * in a batch, so none is created */
+    cr_assert_eq(resp.batch[0]->ret, 1);
+    cr_assert(!resp.batch[0]->has_shm_fd);
+    cr_assert_null(si->chisocket_table[1].shm.header);
+    free_batch(&resp);
+}
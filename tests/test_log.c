@@ -0,0 +1,185 @@
+/* Compile out everything above INFO, regardless of the build settings */
+#undef CHILOG_MAX_LEVEL
+#define CHILOG_MAX_LEVEL INFO
+
+#include "chitcp/log.h"
+#include "chitcp/utils.h"
+#include "chitcp/types.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <criterion/criterion.h>
+
+#define NTHREADS (4)
+#define NMESSAGES (500)
+
+/* Redirects stdout to a temporary file, and returns its name */
+static char *capture_stdout()
+{
+    static char path[] = "/tmp/chilog-test-XXXXXX";
+    int fd = mkstemp(path);
+
+    cr_assert_geq(fd, 0);
+    close(fd);
+    cr_assert_not_null(freopen(path, "w", stdout));
+
+    return path;
+}
+
+/* Counts the lines in the file that contain the given string */
+static int count_lines(const char *path, const char *str)
+{
+    char line[1024];
+    int n = 0;
+    FILE *f = fopen(path, "r");
+
+    cr_assert_not_null(f);
+    while (fgets(line, sizeof(line), f))
+        if (strstr(line, str))
+            n++;
+    fclose(f);
+
+    return n;
+}
+
+static void *log_func(void *args)
+{
+    int id = *((int *) args);
+    int nmessages = *((int *) args + 1);
+
+    for (int i = 0; i < nmessages; i++)
+        chilog(INFO, "worker %i message %i", id, i);
+
+    return NULL;
+}
+
+Test(log, async_threads)
+{
+    char *path = capture_stdout();
+    pthread_t threads[NTHREADS];
+    int args[NTHREADS][2];
+    char line[1024];
+    int next[NTHREADS] = {0};
+    FILE *f;
+
+    chitcp_setloglevel(INFO);
+    cr_assert_eq(chilog_async_start(NMESSAGES), CHITCP_OK);
+    cr_assert_eq(chilog_async_start(NMESSAGES), CHITCP_EINVAL);
+
+    for (int i = 0; i < NTHREADS; i++)
+    {
+        args[i][0] = i;
+        args[i][1] = NMESSAGES;
+        pthread_create(&threads[i], NULL, log_func, args[i]);
+    }
+    for (int i = 0; i < NTHREADS; i++)
+        pthread_join(threads[i], NULL);
+
+    cr_assert_eq(chilog_async_stop(), CHITCP_OK);
+    cr_assert_eq(chilog_async_stop(), CHITCP_EINVAL);
+    cr_assert_eq(chilog_async_dropped(), 0);
+    fflush(stdout);
+
+    /* Every message is there, and each thread's messages are in order */
+    f = fopen(path, "r");
+    cr_assert_not_null(f);
+    while (fgets(line, sizeof(line), f))
+    {
+        int id, i;
+        char *msg = strstr(line, "worker ");
+
+        cr_assert_not_null(msg);
+        cr_assert_not_null(strstr(line, "INFO"));
+        cr_assert_eq(sscanf(msg, "worker %i message %i", &id, &i), 2);
+        cr_assert_eq(i, next[id]);
+        next[id]++;
+    }
+    fclose(f);
+
+    for (int i = 0; i < NTHREADS; i++)
+        cr_assert_eq(next[i], NMESSAGES);
+
+    unlink(path);
+}
+
+Test(log, async_overflow)
+{
+    char *path = capture_stdout();
+    pthread_t thread;
+    int args[2] = {0, 10000};
+    unsigned long dropped;
+
+    chitcp_setloglevel(INFO);
+    cr_assert_eq(chilog_async_start(4), CHITCP_OK);
+    pthread_create(&thread, NULL, log_func, args);
+    pthread_join(thread, NULL);
+    cr_assert_eq(chilog_async_stop(), CHITCP_OK);
+    fflush(stdout);
+
+    /* Every message was either written or counted as dropped */
+    dropped = chilog_async_dropped();
+    cr_assert_eq(count_lines(path, "worker 0 message") + dropped, 10000);
+    if (dropped > 0)
+        cr_assert_geq(count_lines(path, "Dropped"), 1);
+
+    unlink(path);
+}
+
+Test(log, async_thread_name)
+{
+    char *path = capture_stdout();
+
+    chitcp_setloglevel(INFO);
+    cr_assert_eq(chilog_async_start(0), CHITCP_OK);
+
+    set_thread_name(pthread_self(), "before");
+    chilog(INFO, "first message");
+    set_thread_name(pthread_self(), "after");
+    chilog(INFO, "second message");
+    chilog(TRACE, "not logged");
+
+    cr_assert_eq(chilog_async_stop(), CHITCP_OK);
+
+    /* Back to synchronous logging */
+    chilog(INFO, "third message");
+    fflush(stdout);
+
+    cr_assert_eq(count_lines(path, "before first message"), 1);
+    cr_assert_eq(count_lines(path, "after second message"), 1);
+    cr_assert_eq(count_lines(path, "after third message"), 1);
+    cr_assert_eq(count_lines(path, "not logged"), 0);
+
+    unlink(path);
+}
+
+static int evaluated = 0;
+
+static int side_effect()
+{
+    return ++evaluated;
+}
+
+Test(log, lazy_arguments)
+{
+    capture_stdout();
+
+    /* Above CHILOG_MAX_LEVEL: compiled out, even if the level is enabled */
+    chitcp_setloglevel(TRACE);
+    cr_assert_not(CHILOG_ENABLED(DEBUG));
+    chilog(DEBUG, "%i", side_effect());
+    chilog_hex(TRACE, NULL, side_effect());
+    cr_assert_eq(evaluated, 0);
+
+    /* Above the current level: arguments are not evaluated */
+    chitcp_setloglevel(WARNING);
+    cr_assert_not(CHILOG_ENABLED(INFO));
+    chilog(INFO, "%i", side_effect());
+    cr_assert_eq(evaluated, 0);
+
+    chitcp_setloglevel(INFO);
+    cr_assert(CHILOG_ENABLED(INFO));
+    chilog(INFO, "%i", side_effect());
+    cr_assert_eq(evaluated, 1);
+}
@@ -0,0 +1,188 @@
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <criterion/criterion.h>
+#include "serverinfo.h"
+#include "metrics.h"
+
+static serverinfo_t *si;
+
+static void setup(void)
+{
+    si = calloc(1, sizeof(serverinfo_t));
+    si->chisocket_table_size = 8;
+    si->chisocket_table = calloc(si->chisocket_table_size, sizeof(chisocketentry_t));
+    for (int i = 0; i < si->chisocket_table_size; i++)
+        si->chisocket_table[i].available = TRUE;
+    si->connection_table_size = 4;
+    si->connection_table = calloc(si->connection_table_size, sizeof(tcpconnentry_t));
+    for (int i = 0; i < si->connection_table_size; i++)
+        si->connection_table[i].available = TRUE;
+    pthread_mutex_init(&si->lock_chisocket_table, NULL);
+    pthread_mutex_init(&si->lock_connection_table, NULL);
+    pthread_mutex_init(&si->lock_delivery, NULL);
+    si->state = CHITCPD_STATE_RUNNING;
+}
+
+static void teardown(void)
+{
+    free(si->chisocket_table);
+    free(si->connection_table);
+    free(si);
+}
+
+static char *write_metrics()
+{
+    char *out;
+    size_t len;
+    FILE *f = open_memstream(&out, &len);
+
+    cr_assert_eq(chitcpd_metrics_write(si, f), CHITCP_OK);
+    fclose(f);
+
+    return out;
+}
+
+Test(metrics, histogram_buckets)
+{
+    uint64_t values[] = {0, 1, 63, 64, 100, 500, 1023, 1024, 1279, 1280, 1500, 2047, 2048, 1000000, 123456789,
+                         (1ULL << CHITCPD_HISTOGRAM_MAX_SHIFT) - 1};
+
+    /* Every value is below the bound of its bucket, and
+     * at or above the bound of the previous one */
+    for (int i = 0; i < sizeof(values) / sizeof(uint64_t); i++)
+    {
+        int b = chitcpd_histogram_bucket(values[i]);
+
+        cr_assert_lt(values[i], chitcpd_histogram_bound(b));
+        if (b > 0)
+            cr_assert_geq(values[i], chitcpd_histogram_bound(b - 1));
+    }
+
+    for (int b = 1; b < CHITCPD_HISTOGRAM_NBUCKETS; b++)
+        cr_assert_gt(chitcpd_histogram_bound(b), chitcpd_histogram_bound(b - 1));
+
+    cr_assert_eq(chitcpd_histogram_bucket(1ULL << CHITCPD_HISTOGRAM_MAX_SHIFT), CHITCPD_HISTOGRAM_NBUCKETS - 1);
+    cr_assert_eq(chitcpd_histogram_bucket(UINT64_MAX), CHITCPD_HISTOGRAM_NBUCKETS - 1);
+
+    /* Sub-microsecond values are told apart */
+    cr_assert_neq(chitcpd_histogram_bucket(100), chitcpd_histogram_bucket(500));
+}
+
+Test(metrics, percentiles)
+{
+    chitcpd_histogram_t *h = calloc(1, sizeof(chitcpd_histogram_t));
+    chitcpd_histogram_snapshot_t snap;
+    uint64_t p;
+
+    chitcpd_histogram_snapshot(h, &snap, FALSE);
+    cr_assert_eq(snap.count, 0);
+    cr_assert_eq(chitcpd_histogram_percentile(&snap, 50.0), 0);
+
+    /* 1000 values: 1us, 2us, ..., 1000us */
+    for (int i = 1; i <= 1000; i++)
+        chitcpd_histogram_add(h, i * 1000ULL);
+
+    chitcpd_histogram_snapshot(h, &snap, FALSE);
+    cr_assert_eq(snap.count, 1000);
+    cr_assert_eq(snap.sum, 500500000ULL);
+
+    /* The maximum is exact, unlike the percentiles */
+    cr_assert_eq(snap.max, 1000000ULL);
+
+    /* Percentiles are accurate to 1/16 of the value */
+    p = chitcpd_histogram_percentile(&snap, 50.0);
+    cr_assert(p >= 500000 - 500000 / 16 && p <= 500000 + 500000 / 16);
+    p = chitcpd_histogram_percentile(&snap, 99.0);
+    cr_assert(p >= 990000 - 990000 / 16 && p <= 990000 + 990000 / 16);
+    p = chitcpd_histogram_percentile(&snap, 99.9);
+    cr_assert(p >= 999000 - 999000 / 16 && p <= 999000 + 999000 / 16);
+    cr_assert_geq(chitcpd_histogram_percentile(&snap, 100.0), chitcpd_histogram_percentile(&snap, 99.9));
+
+    /* Resetting returns the values and empties the histogram */
+    chitcpd_histogram_snapshot(h, &snap, TRUE);
+    cr_assert_eq(snap.count, 1000);
+    chitcpd_histogram_snapshot(h, &snap, FALSE);
+    cr_assert_eq(snap.count, 0);
+    cr_assert_eq(snap.sum, 0);
+    cr_assert_eq(snap.max, 0);
+
+    free(h);
+}
+
+Test(metrics, exposition, .init = setup, .fini = teardown)
+{
+    char *out;
+
+    si->chisocket_table[0].available = FALSE;
+    si->chisocket_table[0].tcp_state = ESTABLISHED;
+    si->chisocket_table[3].available = FALSE;
+    si->chisocket_table[3].tcp_state = ESTABLISHED;
+    si->chisocket_table[5].available = FALSE;
+    si->chisocket_table[5].tcp_state = LISTEN;
+    si->connection_table[1].available = FALSE;
+    si->metrics.packets_no_socket = 3;
+
+    chitcpd_histogram_add(&si->metrics.rpc_duration, 500);
+    chitcpd_histogram_add(&si->metrics.rpc_duration, 1500000);
+    chitcpd_histogram_add(&si->metrics.rpc_duration, 1ULL << 40);
+
+    out = write_metrics();
+
+    cr_assert_not_null(strstr(out, "# TYPE chitcpd_sockets gauge\n"));
+    cr_assert_not_null(strstr(out, "chitcpd_sockets{state=\"ESTABLISHED\"} 2\n"));
+    cr_assert_not_null(strstr(out, "chitcpd_sockets{state=\"LISTEN\"} 1\n"));
+    cr_assert_not_null(strstr(out, "chitcpd_sockets{state=\"CLOSED\"} 0\n"));
+    cr_assert_not_null(strstr(out, "chitcpd_socket_table_used 3\n"));
+    cr_assert_not_null(strstr(out, "chitcpd_connection_table_used 1\n"));
+    cr_assert_not_null(strstr(out, "chitcpd_packets_no_socket_total 3\n"));
+
+    cr_assert_not_null(strstr(out, "# TYPE chitcpd_rpc_duration_seconds histogram\n"));
+    cr_assert_not_null(strstr(out, "chitcpd_rpc_duration_seconds_bucket{le=\"1.024e-06\"} 1\n"));
+    cr_assert_not_null(strstr(out, "chitcpd_rpc_duration_seconds_bucket{le=\"0.001572864\"} 2\n"));
+    cr_assert_not_null(strstr(out, "chitcpd_rpc_duration_seconds_bucket{le=\"+Inf\"} 3\n"));
+    cr_assert_not_null(strstr(out, "chitcpd_rpc_duration_seconds_count 3\n"));
+    cr_assert_not_null(strstr(out, "chitcpd_delivery_delay_seconds_count 0\n"));
+
+    free(out);
+}
+
+Test(metrics, serve, .init = setup, .fini = teardown)
+{
+    char path[] = "/tmp/chitcp-metrics-XXXXXX";
+    char buf[65536];
+    struct sockaddr_un addr;
+    size_t len = 0;
+    ssize_t n;
+    int s;
+
+    cr_assert_not_null(mkdtemp(path));
+    si->metrics_addr = malloc(strlen(path) + 16);
+    sprintf(si->metrics_addr, "%s/metrics", path);
+
+    cr_assert_eq(chitcpd_metrics_start(si), CHITCP_OK);
+
+    s = socket(AF_UNIX, SOCK_STREAM, 0);
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, si->metrics_addr);
+    cr_assert_eq(connect(s, (struct sockaddr *) &addr, sizeof(addr)), 0);
+    cr_assert_gt(send(s, "GET /metrics HTTP/1.0\r\n\r\n", 25, 0), 0);
+    while ((n = recv(s, buf + len, sizeof(buf) - 1 - len, 0)) > 0)
+        len += n;
+    buf[len] = '\0';
+    close(s);
+
+    cr_assert_eq(strncmp(buf, "HTTP/1.0 200 OK\r\n", 17), 0);
+    cr_assert_not_null(strstr(buf, "\r\n\r\n# HELP chitcpd_sockets "));
+    cr_assert_not_null(strstr(buf, "chitcpd_delivery_delay_seconds_count 0\n"));
+
+    si->state = CHITCPD_STATE_STOPPING;
+    cr_assert_eq(chitcpd_metrics_stop(si), CHITCP_OK);
+    cr_assert_neq(access(si->metrics_addr, F_OK), 0);
+
+    rmdir(path);
+    free(si->metrics_addr);
+}
@@ -0,0 +1,205 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <criterion/criterion.h>
+#include "chitcp/types.h"
+#include "daemon_api.h"
+
+#define NREQUESTS (4)
+
+/* A fake daemon, which accepts the library's multiplexed connection,
+ * answers its INIT message, waits until it has received NREQUESTS
+ * requests, and then calls "answer" (which may answer them in any
+ * order, or not at all) before closing the connection */
+typedef struct fake_daemon
+{
+    int listenfd;
+    int clientfd;
+    ChitcpdMsg *reqs[NREQUESTS];
+    void (*answer)(struct fake_daemon *d);
+    pthread_t thread;
+} fake_daemon_t;
+
+/* A thread that sends a CLOSE request through the multiplexed connection */
+typedef struct client
+{
+    int sockfd;
+    int rc;
+    int ret;
+    pthread_t thread;
+} client_t;
+
+static char sock_path[UNIX_PATH_MAX];
+static fake_daemon_t fake;
+
+static void send_resp(int fd, uint64_t request_id, bool_t tagged, int ret)
+{
+    ChitcpdMsg msg = CHITCPD_MSG__INIT;
+    ChitcpdResp resp = CHITCPD_RESP__INIT;
+
+    msg.code = CHITCPD_MSG_CODE__RESP;
+    msg.resp = &resp;
+    msg.has_request_id = tagged;
+    msg.request_id = request_id;
+    resp.ret = ret;
+
+    cr_assert_eq(chitcpd_send_msg(fd, &msg), CHITCP_OK);
+}
+
+static void *daemon_thread(void *arg)
+{
+    fake_daemon_t *d = arg;
+    ChitcpdMsg *msg;
+
+    d->clientfd = accept(d->listenfd, NULL, NULL);
+    cr_assert_geq(d->clientfd, 0);
+
+    cr_assert_eq(chitcpd_recv_msg(d->clientfd, &msg), CHITCP_OK);
+    cr_assert_eq(msg->code, CHITCPD_MSG_CODE__INIT);
+    cr_assert(!msg->has_request_id);
+    chitcpd_msg__free_unpacked(msg, NULL);
+    send_resp(d->clientfd, 0, FALSE, CHITCP_OK);
+
+    for (int i = 0; i < NREQUESTS; i++)
+    {
+        cr_assert_eq(chitcpd_recv_msg(d->clientfd, &d->reqs[i]), CHITCP_OK);
+        cr_assert(d->reqs[i]->has_request_id);
+    }
+
+    d->answer(d);
+
+    for (int i = 0; i < NREQUESTS; i++)
+        chitcpd_msg__free_unpacked(d->reqs[i], NULL);
+    close(d->clientfd);
+
+    return NULL;
+}
+
+static void *client_thread(void *arg)
+{
+    client_t *c = arg;
+    ChitcpdMsg req = CHITCPD_MSG__INIT;
+    ChitcpdCloseArgs ca = CHITCPD_CLOSE_ARGS__INIT;
+    ChitcpdMsg *resp_p;
+
+    req.code = CHITCPD_MSG_CODE__CLOSE;
+    req.close_args = &ca;
+    ca.sockfd = c->sockfd;
+
+    c->rc = chitcpd_send_command(chitcpd_get_socket(), &req, &resp_p);
+    if (c->rc == CHITCP_OK)
+    {
+        c->ret = resp_p->resp->ret;
+        chitcpd_msg__free_unpacked(resp_p, NULL);
+    }
+
+    return NULL;
+}
+
+/* Starts the fake daemon and connects to it, then sends NREQUESTS
+ * concurrent requests (each one from its own thread) and waits for
+ * all of them to finish */
+static void run(void (*answer)(fake_daemon_t *d), client_t *clients)
+{
+    struct sockaddr_un addr;
+
+    fake.answer = answer;
+    fake.listenfd = socket(AF_UNIX, SOCK_STREAM, 0);
+    cr_assert_geq(fake.listenfd, 0);
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strncpy(addr.sun_path, sock_path, sizeof(addr.sun_path) - 1);
+    cr_assert_eq(bind(fake.listenfd, (struct sockaddr *) &addr, sizeof(addr)), 0);
+    cr_assert_eq(listen(fake.listenfd, 1), 0);
+    cr_assert_eq(pthread_create(&fake.thread, NULL, daemon_thread, &fake), 0);
+
+    cr_assert_geq(chitcpd_get_socket(), 0);
+
+    for (int i = 0; i < NREQUESTS; i++)
+    {
+        clients[i].sockfd = 10 + i;
+        clients[i].rc = CHITCP_OK;
+        clients[i].ret = -1;
+        cr_assert_eq(pthread_create(&clients[i].thread, NULL, client_thread, &clients[i]), 0);
+    }
+
+    for (int i = 0; i < NREQUESTS; i++)
+        pthread_join(clients[i].thread, NULL);
+    pthread_join(fake.thread, NULL);
+    close(fake.listenfd);
+}
+
+static void setup(void)
+{
+    snprintf(sock_path, sizeof(sock_path), "/tmp/chitcp-test-mux.%d", (int) getpid());
+    unlink(sock_path);
+    setenv("CHITCPD_SOCK", sock_path, 1);
+    setenv("CHITCPD_PIPELINE", "1", 1);
+}
+
+static void teardown(void)
+{
+    unlink(sock_path);
+}
+
+/* Answers the requests in the reverse order in which they arrived,
+ * with the socket each one asked to close */
+static void answer_reversed(fake_daemon_t *d)
+{
+    for (int i = NREQUESTS - 1; i >= 0; i--)
+        send_resp(d->clientfd, d->reqs[i]->request_id, TRUE, d->reqs[i]->close_args->sockfd);
+}
+
+static void answer_none(fake_daemon_t *d)
+{
+}
+
+/* Answers a request that was never sent before answering the real ones */
+static void answer_unknown(fake_daemon_t *d)
+{
+    send_resp(d->clientfd, UINT64_MAX, TRUE, 0);
+    answer_reversed(d);
+}
+
+Test(mux, out_of_order, .init = setup, .fini = teardown)
+{
+    client_t clients[NREQUESTS];
+
+    run(answer_reversed, clients);
+
+    for (int i = 0; i < NREQUESTS; i++)
+    {
+        cr_assert_eq(clients[i].rc, CHITCP_OK);
+        cr_assert_eq(clients[i].ret, clients[i].sockfd);
+    }
+}
+
+Test(mux, disconnect_in_flight, .init = setup, .fini = teardown)
+{
+    client_t clients[NREQUESTS];
+    client_t late = { .sockfd = 42 };
+
+    run(answer_none, clients);
+
+    for (int i = 0; i < NREQUESTS; i++)
+        cr_assert_lt(clients[i].rc, 0);
+
+    /* The connection stays unusable (instead of blocking new requests) */
+    client_thread(&late);
+    cr_assert_lt(late.rc, 0);
+}
+
+Test(mux, unknown_response, .init = setup, .fini = teardown)
+{
+    client_t clients[NREQUESTS];
+
+    run(answer_unknown, clients);
+
+    for (int i = 0; i < NREQUESTS; i++)
+        cr_assert_lt(clients[i].rc, 0);
+}
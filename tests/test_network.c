@@ -0,0 +1,435 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <stdatomic.h>
+#include <arpa/inet.h>
+#include <sys/socket.h>
+#include <criterion/criterion.h>
+#include "chitcp/chitcpd.h"
+#include "chitcp/socket.h"
+#include "chitcp/addr.h"
+#include "chitcp/packet.h"
+#include "chitcp/utlist.h"
+#include "serverinfo.h"
+#include "server.h"
+#include "connection.h"
+
+#define LISTEN_PORT (80)
+
+static serverinfo_t *si;
+static char sock_path[UNIX_PATH_MAX];
+
+/* A daemon runs in the test process, with the given network layer. Its
+ * peer is itself: the packets that one of its sockets sends to the
+ * loopback address go out through the network layer, and come back in
+ * through it, just like they would between two daemons. */
+static void daemon_setup(chitcpd_transport_t transport, uint16_t epoll_rx_nthreads, uint16_t connection_stripes)
+{
+    char port[8];
+
+    /* Each test runs in its own process (possibly at the same
+     * time as other tests), so each daemon needs its own port */
+    snprintf(port, sizeof(port), "%d", 20000 + (int) getpid() % 20000);
+    setenv("CHITCPD_PORT", port, 1);
+
+    snprintf(sock_path, sizeof(sock_path), "/tmp/chitcp-test-network.%d", (int) getpid());
+    unlink(sock_path);
+    setenv("CHITCPD_SOCK", sock_path, 1);
+
+    si = calloc(1, sizeof(serverinfo_t));
+    si->server_port = chitcp_htons(GET_CHITCPD_PORT);
+    si->transport = transport;
+    si->epoll_rx_nthreads = epoll_rx_nthreads;
+    si->connection_stripes = connection_stripes;
+    chitcp_unix_socket(si->server_socket_path, UNIX_PATH_MAX);
+
+    cr_assert_eq(chitcpd_server_init(si), CHITCP_OK);
+    cr_assert_eq(chitcpd_server_start(si), CHITCP_OK);
+}
+
+static void udp_setup(void)
+{
+    daemon_setup(CHITCPD_TRANSPORT_UDP, 0, 1);
+}
+
+/* Two receive threads, and four connections to each peer, so
+ * that each thread has two connections to receive from */
+static void epoll_rx_setup(void)
+{
+    daemon_setup(CHITCPD_TRANSPORT_TCP, 2, 4);
+}
+
+static void epoll_rx_single_setup(void)
+{
+    daemon_setup(CHITCPD_TRANSPORT_TCP, 1, 1);
+}
+
+static void teardown(void)
+{
+    cr_assert_eq(chitcpd_server_stop(si), CHITCP_OK);
+    cr_assert_eq(chitcpd_server_wait(si), CHITCP_OK);
+    chitcpd_server_free(si);
+    free(si);
+    unlink(sock_path);
+}
+
+/* Creates a socket listening on LISTEN_PORT. Since tcp.c doesn't have
+ * to implement the three-way handshake, every packet sent to this port
+ * is queued as a pending connection, which lets us look at the packets
+ * exactly as they were received (and in the order they were received) */
+static chisocketentry_t *listen_socket(void)
+{
+    struct sockaddr_in addr;
+    int sockfd;
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = chitcp_htons(LISTEN_PORT);
+    addr.sin_addr.s_addr = INADDR_ANY;
+
+    sockfd = chisocket_socket(PF_INET, SOCK_STREAM, IPPROTO_TCP);
+    cr_assert_geq(sockfd, 0);
+    cr_assert_eq(chisocket_bind(sockfd, (struct sockaddr *) &addr, sizeof(addr)), 0);
+    cr_assert_eq(chisocket_listen(sockfd, 5), 0);
+
+    return &si->chisocket_table[sockfd];
+}
+
+/* Creates a socket and connects it to the listening socket. The
+ * connect() doesn't complete, but it leaves the socket with a
+ * connection to the peer daemon, which is all we need to send
+ * packets with chitcpd_send_tcp_packet */
+static chisocketentry_t *connect_socket(void)
+{
+    struct sockaddr_in addr;
+    chisocketentry_t *entry;
+    int sockfd;
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = chitcp_htons(LISTEN_PORT);
+    addr.sin_addr.s_addr = chitcp_htonl(INADDR_LOOPBACK);
+
+    sockfd = chisocket_socket(PF_INET, SOCK_STREAM | SOCK_NONBLOCK, IPPROTO_TCP);
+    cr_assert_geq(sockfd, 0);
+    cr_assert_eq(chisocket_connect(sockfd, (struct sockaddr *) &addr, sizeof(addr)), -1);
+    cr_assert_eq(errno, EINPROGRESS);
+
+    entry = &si->chisocket_table[sockfd];
+    cr_assert_not_null(entry->socket_state.active.realtcpconn);
+
+    return entry;
+}
+
+/* Creates a packet for the listening socket, with sequence
+ * number seq (and seq as the payload) */
+static void create_packet(tcp_packet_t *packet, in_port_t source, uint32_t seq)
+{
+    tcphdr_t *header;
+
+    chitcp_tcp_packet_init(packet, (uint8_t *) &seq, sizeof(seq));
+    header = TCP_PACKET_HEADER(packet);
+    header->source = source;
+    header->dest = chitcp_htons(LISTEN_PORT);
+    header->seq = chitcp_htonl(seq);
+    header->ack = 1;
+    header->win = chitcp_htons(4096);
+}
+
+/* Sends a packet from a connected socket to the listening socket */
+static void send_packet(chisocketentry_t *entry, uint32_t seq)
+{
+    tcp_packet_t packet;
+
+    create_packet(&packet, chitcp_get_addr_port((struct sockaddr *) &entry->local_addr), seq);
+    cr_assert_eq(chitcpd_send_tcp_packet(si, entry, &packet), sizeof(tcphdr_t) + sizeof(seq));
+    chitcp_tcp_packet_free(&packet);
+}
+
+/* Writes the frame that a peer daemon would send to the listening
+ * socket (from port 5000 of the loopback address) to buf.
+ * Returns the length of the frame. */
+static size_t encode_frame(uint8_t *buf, uint32_t seq)
+{
+    struct sockaddr_in loopback;
+    chitcphdr_t header;
+    tcp_packet_t packet;
+    size_t len;
+
+    memset(&loopback, 0, sizeof(loopback));
+    loopback.sin_family = AF_INET;
+    loopback.sin_addr.s_addr = chitcp_htonl(INADDR_LOOPBACK);
+
+    create_packet(&packet, chitcp_htons(5000), seq);
+    TCP_PACKET_HEADER(&packet)->sum = chitcp_tcp_checksum(&packet, (struct sockaddr *) &loopback, (struct sockaddr *) &loopback);
+
+    memset(&header, 0, sizeof(header));
+    header.payload_len = chitcp_htons(packet.length);
+    header.proto = CHITCP_PROTO_TCP;
+
+    memcpy(buf, &header, sizeof(header));
+    memcpy(buf + sizeof(header), packet.raw, packet.length);
+    len = sizeof(header) + packet.length;
+    chitcp_tcp_packet_free(&packet);
+
+    return len;
+}
+
+static int count_pending_connections(chisocketentry_t *entry)
+{
+    passive_chisocket_state_t *socket_state = &entry->socket_state.passive;
+    pending_connection_t *pending_connection;
+    int count;
+
+    pthread_mutex_lock(&socket_state->lock_pending_connections);
+    DL_COUNT(socket_state->pending_connections, pending_connection, count);
+    pthread_mutex_unlock(&socket_state->lock_pending_connections);
+
+    return count;
+}
+
+static void wait_for_pending_connections(chisocketentry_t *entry, int count)
+{
+    for (int i = 0; i < 1000 && count_pending_connections(entry) < count; i++)
+        usleep(1000);
+
+    cr_assert_eq(count_pending_connections(entry), count);
+}
+
+/* Checks that the listening socket received the packets with sequence
+ * numbers first, ..., first + count - 1 (and nothing else), in order */
+static void check_packets(chisocketentry_t *entry, uint32_t first, int count)
+{
+    pending_connection_t *pending_connection;
+    tcp_packet_t *packet;
+    uint32_t seq = first;
+
+    wait_for_pending_connections(entry, count);
+
+    pthread_mutex_lock(&entry->socket_state.passive.lock_pending_connections);
+    DL_FOREACH(entry->socket_state.passive.pending_connections, pending_connection)
+    {
+        packet = pending_connection->initial_packet;
+
+        cr_assert_eq(chitcp_ntohl(TCP_PACKET_HEADER(packet)->seq), seq);
+        cr_assert_eq(TCP_PAYLOAD_LEN(packet), sizeof(seq));
+        cr_assert_arr_eq(TCP_PAYLOAD_START(packet), &seq, sizeof(seq));
+
+        /* The packet was delivered to the address it was sent to */
+        cr_assert(chitcp_addr_is_loopback((struct sockaddr *) &pending_connection->local_addr));
+        seq++;
+    }
+    pthread_mutex_unlock(&entry->socket_state.passive.lock_pending_connections);
+
+    cr_assert_eq(atomic_load(&si->cksum_drops), 0);
+    cr_assert_eq(atomic_load(&si->metrics.packets_no_socket), 0);
+}
+
+static int count_connections(void)
+{
+    int count = 0;
+
+    pthread_mutex_lock(&si->lock_connection_table);
+    for (int i = 0; i < si->connection_table_size; i++)
+        if (!si->connection_table[i].available)
+            count++;
+    pthread_mutex_unlock(&si->lock_connection_table);
+
+    return count;
+}
+
+static unsigned int count_rx_conns(epoll_rx_thread_t *rxt)
+{
+    unsigned int count;
+
+    pthread_mutex_lock(&rxt->lock_conns);
+    count = rxt->nconns;
+    pthread_mutex_unlock(&rxt->lock_conns);
+
+    return count;
+}
+
+static void wait_for_rx_conns(epoll_rx_thread_t *rxt, unsigned int count)
+{
+    for (int i = 0; i < 1000 && count_rx_conns(rxt) != count; i++)
+        usleep(1000);
+
+    cr_assert_eq(count_rx_conns(rxt), count);
+}
+
+static void daemon_addr(struct sockaddr_in *addr)
+{
+    memset(addr, 0, sizeof(struct sockaddr_in));
+    addr->sin_family = AF_INET;
+    addr->sin_port = chitcp_htons(GET_CHITCPD_PORT);
+    addr->sin_addr.s_addr = chitcp_htonl(INADDR_LOOPBACK);
+}
+
+/* Sends a raw datagram to the daemon's network socket */
+static void send_datagram(int s, const void *data, size_t len)
+{
+    struct sockaddr_in addr;
+
+    daemon_addr(&addr);
+    cr_assert_eq(sendto(s, data, len, 0, (struct sockaddr *) &addr, sizeof(addr)), len);
+}
+
+/* Opens a connection to the daemon's network socket, like a peer
+ * daemon would, so we can control how the frames are split up */
+static int raw_connect(void)
+{
+    struct sockaddr_in addr;
+    int s;
+
+    daemon_addr(&addr);
+    s = socket(AF_INET, SOCK_STREAM, 0);
+    cr_assert_neq(s, -1);
+    cr_assert_eq(connect(s, (struct sockaddr *) &addr, sizeof(addr)), 0);
+
+    return s;
+}
+
+static void raw_send(int s, const uint8_t *data, size_t len)
+{
+    cr_assert_eq(send(s, data, len, MSG_NOSIGNAL), len);
+}
+
+/* Enough packets for several sendmmsg() and recvmmsg() calls */
+Test(udp, loopback, .init = udp_setup, .fini = teardown, .timeout = 10)
+{
+    chisocketentry_t *listener, *entry;
+
+    listener = listen_socket();
+    entry = connect_socket();
+
+    for (uint32_t seq = 0; seq < 64; seq++)
+        send_packet(entry, seq);
+
+    /* The checksums were computed with the address we send from, and
+     * verified with the address the datagrams were sent to (which we
+     * get from IP_PKTINFO), so none of them were dropped */
+    check_packets(listener, 0, 64);
+
+    /* The datagrams came from the peer we sent them to, so they were
+     * demultiplexed to the entry that connect() added to the table */
+    cr_assert_eq(count_connections(), 1);
+}
+
+/* Datagrams that don't contain exactly one chiTCP packet are dropped,
+ * without adding their sender to the connection table */
+Test(udp, malformed, .init = udp_setup, .fini = teardown, .timeout = 10)
+{
+    chisocketentry_t *listener, *entry;
+    uint8_t garbage[sizeof(chitcphdr_t) + 4];
+    chitcphdr_t *header = (chitcphdr_t *) garbage;
+    int s;
+
+    listener = listen_socket();
+    s = socket(AF_INET, SOCK_DGRAM, 0);
+    cr_assert_neq(s, -1);
+
+    /* Too short to contain a chiTCP header */
+    send_datagram(s, garbage, sizeof(chitcphdr_t) - 1);
+
+    /* The header's length doesn't match the datagram's */
+    memset(garbage, 0, sizeof(garbage));
+    header->payload_len = chitcp_htons(sizeof(tcphdr_t));
+    header->proto = CHITCP_PROTO_TCP;
+    send_datagram(s, garbage, sizeof(garbage));
+
+    /* Packets from a real peer still get through */
+    entry = connect_socket();
+    send_packet(entry, 1);
+    check_packets(listener, 1, 1);
+    cr_assert_eq(count_connections(), 1);
+
+    close(s);
+}
+
+Test(epoll_rx, loopback, .init = epoll_rx_setup, .fini = teardown, .timeout = 10)
+{
+    epoll_rx_thread_t *rxt = si->epoll_rx_threads;
+    chisocketentry_t *listener, *entry;
+
+    listener = listen_socket();
+    entry = connect_socket();
+
+    /* The network thread accepts the four connections to ourselves,
+     * and hands them to the receive threads in round-robin order */
+    wait_for_rx_conns(&rxt[0], 2);
+    wait_for_rx_conns(&rxt[1], 2);
+
+    for (uint32_t seq = 0; seq < 64; seq++)
+        send_packet(entry, seq);
+
+    check_packets(listener, 0, 64);
+}
+
+/* Frames are reassembled no matter how they are split across reads */
+Test(epoll_rx, split_frames, .init = epoll_rx_single_setup, .fini = teardown, .timeout = 10)
+{
+    chisocketentry_t *listener;
+    uint8_t buf[4 * 64];
+    size_t len;
+    int s;
+
+    listener = listen_socket();
+    s = raw_connect();
+    wait_for_rx_conns(si->epoll_rx_threads, 1);
+
+    /* A chiTCP header that arrives in two reads */
+    len = encode_frame(buf, 0);
+    raw_send(s, buf, 10);
+    usleep(20000);
+    cr_assert_eq(count_pending_connections(listener), 0);
+    raw_send(s, buf + 10, len - 10);
+    check_packets(listener, 0, 1);
+
+    /* Two frames and part of a third (including part of
+     * its TCP header) in one read, and the rest in another */
+    len = encode_frame(buf, 1);
+    len += encode_frame(buf + len, 2);
+    len += encode_frame(buf + len, 3);
+    raw_send(s, buf, len - 20);
+    check_packets(listener, 0, 3);
+    raw_send(s, buf + len - 20, 20);
+    check_packets(listener, 0, 4);
+
+    close(s);
+}
+
+/* A connection is removed from its receive thread when the peer closes
+ * it (even in the middle of a frame), without affecting the others */
+Test(epoll_rx, eof, .init = epoll_rx_single_setup, .fini = teardown, .timeout = 10)
+{
+    epoll_rx_thread_t *rxt = si->epoll_rx_threads;
+    chisocketentry_t *listener;
+    uint8_t buf[64];
+    size_t len;
+    int s1, s2;
+
+    listener = listen_socket();
+    s1 = raw_connect();
+    s2 = raw_connect();
+    wait_for_rx_conns(rxt, 2);
+
+    len = encode_frame(buf, 0);
+    raw_send(s1, buf, len);
+    check_packets(listener, 0, 1);
+    len = encode_frame(buf, 1);
+    raw_send(s2, buf, len);
+    check_packets(listener, 0, 2);
+
+    raw_send(s1, buf, len / 2);
+    close(s1);
+    wait_for_rx_conns(rxt, 1);
+
+    len = encode_frame(buf, 2);
+    raw_send(s2, buf, len);
+    check_packets(listener, 0, 3);
+
+    close(s2);
+    wait_for_rx_conns(rxt, 0);
+}
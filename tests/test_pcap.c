@@ -0,0 +1,450 @@
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <criterion/criterion.h>
+#include "chitcp/packet.h"
+#include "pcap.h"
+
+#define IP_HDR_LEN (20)
+
+static char dir[] = "/tmp/chitcp-pcap-XXXXXX";
+static char filename[128];
+static char ng_filename[128];
+static struct sockaddr_in src, dst;
+
+static void setup(void)
+{
+    cr_assert_not_null(mkdtemp(dir));
+    snprintf(filename, sizeof(filename), "%s/capture.pcap", dir);
+    snprintf(ng_filename, sizeof(ng_filename), "%s/capture.pcapng", dir);
+
+    src.sin_family = AF_INET;
+    src.sin_addr.s_addr = inet_addr("10.0.0.1");
+    dst.sin_family = AF_INET;
+    dst.sin_addr.s_addr = inet_addr("10.0.0.2");
+}
+
+static void teardown(void)
+{
+    char cmd[160];
+
+    snprintf(cmd, sizeof(cmd), "rm -rf %s", dir);
+    cr_assert_eq(system(cmd), 0);
+}
+
+/* Reads a whole file. Returns NULL if it does not exist. */
+static uint8_t *read_file(const char *name, size_t *len)
+{
+    FILE *f = fopen(name, "rb");
+    uint8_t *data;
+    long size;
+
+    if (f == NULL)
+        return NULL;
+    fseek(f, 0, SEEK_END);
+    size = ftell(f);
+    fseek(f, 0, SEEK_SET);
+    data = malloc(size + 1);
+    cr_assert_eq(fread(data, 1, size, f), (size_t) size);
+    fclose(f);
+    *len = size;
+
+    return data;
+}
+
+/* Checks the file header, and returns the number of records in
+ * the file (checking that the last record is complete) */
+static int count_records(uint8_t *data, size_t len, uint32_t snaplen)
+{
+    size_t off = 24;
+    int n = 0;
+
+    cr_assert_geq(len, 24);
+    cr_assert_eq(*(uint32_t *) data, 0xa1b23c4d);
+    cr_assert_eq(*(uint32_t *) (data + 16), snaplen);
+    cr_assert_eq(*(uint32_t *) (data + 20), 101);
+
+    while (off < len)
+    {
+        uint32_t incl_len = *(uint32_t *) (data + off + 8);
+        cr_assert_leq(incl_len, snaplen);
+        off += 16 + incl_len;
+        n++;
+    }
+    cr_assert_eq(off, len);
+
+    return n;
+}
+
+static void capture(chitcpd_pcap_t *pcap, int n, uint16_t payload_len)
+{
+    uint8_t payload[1024];
+    tcp_packet_t packet;
+
+    for (int i = 0; i < n; i++)
+    {
+        memset(payload, 'a' + i % 26, payload_len);
+        chitcp_tcp_packet_init(&packet, payload, payload_len);
+        TCP_PACKET_HEADER(&packet)->seq = chitcp_htonl(i);
+        chitcpd_pcap_packet(pcap, &packet, (struct sockaddr *) &src, (struct sockaddr *) &dst,
+                            CHITCPD_PCAP_OUTBOUND, 3, 42, ESTABLISHED);
+        /* The capture keeps its own reference to the packet */
+        chitcp_tcp_packet_free(&packet);
+    }
+}
+
+Test(pcap, records, .init = setup, .fini = teardown)
+{
+    chitcpd_pcap_options_t opts = { .filename = filename };
+    chitcpd_pcap_t *pcap;
+    uint8_t *data, *rec, *ip;
+    size_t len;
+
+    cr_assert_eq(chitcpd_pcap_open(&pcap, &opts), CHITCP_OK);
+    capture(pcap, 3, 100);
+    cr_assert_eq(chitcpd_pcap_close(pcap), CHITCP_OK);
+
+    data = read_file(filename, &len);
+    cr_assert_not_null(data);
+    cr_assert_eq(count_records(data, len, CHITCPD_PCAP_DEFAULT_SNAPLEN), 3);
+
+    /* Records are in the order the packets were captured */
+    for (int i = 0; i < 3; i++)
+    {
+        rec = data + 24 + i * (16 + IP_HDR_LEN + 20 + 100);
+        ip = rec + 16;
+        cr_assert_eq(*(uint32_t *) (rec + 8), IP_HDR_LEN + 20 + 100);
+        cr_assert_eq(*(uint32_t *) (rec + 12), IP_HDR_LEN + 20 + 100);
+        cr_assert_eq(ip[0], 0x45);
+        cr_assert_eq(ip[9], 6);
+        cr_assert_eq(ntohs(*(uint16_t *) (ip + 2)), IP_HDR_LEN + 20 + 100);
+        cr_assert_eq(*(uint32_t *) (ip + 12), src.sin_addr.s_addr);
+        cr_assert_eq(*(uint32_t *) (ip + 16), dst.sin_addr.s_addr);
+        cr_assert_eq(ntohl(((tcphdr_t *) (ip + IP_HDR_LEN))->seq), (uint32_t) i);
+        cr_assert_eq(ip[IP_HDR_LEN + 20], 'a' + i);
+    }
+
+    free(data);
+}
+
+Test(pcap, snaplen, .init = setup, .fini = teardown)
+{
+    chitcpd_pcap_options_t opts = { .filename = filename, .snaplen = 60 };
+    chitcpd_pcap_t *pcap;
+    uint8_t *data;
+    size_t len;
+
+    cr_assert_eq(chitcpd_pcap_open(&pcap, &opts), CHITCP_OK);
+    capture(pcap, 2, 500);
+    capture(pcap, 1, 10);
+    cr_assert_eq(chitcpd_pcap_close(pcap), CHITCP_OK);
+
+    data = read_file(filename, &len);
+    cr_assert_eq(count_records(data, len, 60), 3);
+
+    /* Long packets are truncated, but keep their original length */
+    cr_assert_eq(*(uint32_t *) (data + 24 + 8), 60);
+    cr_assert_eq(*(uint32_t *) (data + 24 + 12), IP_HDR_LEN + 20 + 500);
+    cr_assert_eq(*(uint32_t *) (data + 24 + 2 * (16 + 60) + 8), IP_HDR_LEN + 20 + 10);
+
+    free(data);
+}
+
+Test(pcap, rotate_size, .init = setup, .fini = teardown)
+{
+    chitcpd_pcap_options_t opts = { .filename = filename, .rotate_bytes = 1000 };
+    chitcpd_pcap_t *pcap;
+    char name[160];
+    uint8_t *data;
+    size_t len;
+    int nfiles, total = 0;
+
+    cr_assert_eq(chitcpd_pcap_open(&pcap, &opts), CHITCP_OK);
+    capture(pcap, 10, 200);
+    cr_assert_eq(chitcpd_pcap_flush(pcap), CHITCP_OK);
+    capture(pcap, 10, 200);
+    cr_assert_eq(chitcpd_pcap_close(pcap), CHITCP_OK);
+
+    /* Each record is 256 bytes, so three fit in each file */
+    for (nfiles = 0; ; nfiles++)
+    {
+        snprintf(name, sizeof(name), "%s.%i", filename, nfiles);
+        data = read_file(name, &len);
+        if (data == NULL)
+            break;
+        cr_assert_leq(len, 1000);
+        total += count_records(data, len, CHITCPD_PCAP_DEFAULT_SNAPLEN);
+        free(data);
+    }
+
+    cr_assert_eq(total, 20);
+    cr_assert_eq(nfiles, 7);
+}
+
+Test(pcap, mmap, .init = setup, .fini = teardown)
+{
+    chitcpd_pcap_options_t opts = { .filename = filename, .use_mmap = TRUE };
+    chitcpd_pcap_t *pcap;
+    uint8_t *data;
+    size_t len;
+
+    cr_assert_eq(chitcpd_pcap_open(&pcap, &opts), CHITCP_OK);
+    capture(pcap, 5, 100);
+
+    /* After a flush, the file contains every packet, and nothing else */
+    cr_assert_eq(chitcpd_pcap_flush(pcap), CHITCP_OK);
+    data = read_file(filename, &len);
+    cr_assert_eq(count_records(data, len, CHITCPD_PCAP_DEFAULT_SNAPLEN), 5);
+    free(data);
+
+    /* Enough packets to need more than one mapped window */
+    capture(pcap, 30000, 200);
+    cr_assert_eq(chitcpd_pcap_close(pcap), CHITCP_OK);
+
+    data = read_file(filename, &len);
+    cr_assert_gt(len, CHITCPD_PCAP_MMAP_WINDOW);
+    cr_assert_eq(count_records(data, len, CHITCPD_PCAP_DEFAULT_SNAPLEN), 30005);
+    free(data);
+}
+
+Test(pcap, bad_file, .init = setup, .fini = teardown)
+{
+    chitcpd_pcap_options_t opts = { .filename = "/nonexistent/capture.pcap" };
+    chitcpd_pcap_t *pcap;
+
+    cr_assert_eq(chitcpd_pcap_open(&pcap, &opts), CHITCP_EINIT);
+}
+
+Test(pcap, ipv6, .init = setup, .fini = teardown)
+{
+    chitcpd_pcap_options_t opts = { .filename = filename };
+    chitcpd_pcap_t *pcap;
+    struct sockaddr_in6 src6 = { .sin6_family = AF_INET6, .sin6_addr = IN6ADDR_LOOPBACK_INIT };
+    struct sockaddr_in6 mapped = { .sin6_family = AF_INET6 };
+    tcp_packet_t packet;
+    uint8_t *data, *ip;
+    size_t len;
+
+    inet_pton(AF_INET6, "::ffff:10.0.0.1", &mapped.sin6_addr);
+
+    cr_assert_eq(chitcpd_pcap_open(&pcap, &opts), CHITCP_OK);
+    chitcp_tcp_packet_init(&packet, (uint8_t *) "hello", 5);
+    chitcpd_pcap_packet(pcap, &packet, (struct sockaddr *) &src6, (struct sockaddr *) &src6,
+                        CHITCPD_PCAP_OUTBOUND, 0, 0, ESTABLISHED);
+    chitcpd_pcap_packet(pcap, &packet, (struct sockaddr *) &mapped, (struct sockaddr *) &mapped,
+                        CHITCPD_PCAP_INBOUND, 0, 0, ESTABLISHED);
+    chitcp_tcp_packet_free(&packet);
+    cr_assert_eq(chitcpd_pcap_close(pcap), CHITCP_OK);
+
+    data = read_file(filename, &len);
+    cr_assert_eq(count_records(data, len, CHITCPD_PCAP_DEFAULT_SNAPLEN), 2);
+
+    /* IPv6 sockets get an IPv6 header */
+    ip = data + 24 + 16;
+    cr_assert_eq(*(uint32_t *) (data + 24 + 8), 40 + 20 + 5);
+    cr_assert_eq(ip[0] >> 4, 6);
+    cr_assert_eq(ntohs(*(uint16_t *) (ip + 4)), 20 + 5);
+    cr_assert_eq(ip[6], 6);
+    cr_assert_arr_eq(ip + 8, &src6.sin6_addr, 16);
+    cr_assert_arr_eq(ip + 24, &src6.sin6_addr, 16);
+
+    /* ... unless they are using IPv4-mapped addresses */
+    ip += 40 + 20 + 5 + 16;
+    cr_assert_eq(ip[0], 0x45);
+    cr_assert_eq(*(uint32_t *) (ip + 12), src.sin_addr.s_addr);
+
+    free(data);
+}
+
+/* A pcapng block, as found by next_block */
+typedef struct block
+{
+    uint32_t type;
+    uint32_t len;
+    uint8_t *body;
+} block_t;
+
+/* Returns the next block in a pcapng file (checking that the
+ * lengths at both ends of the block match) */
+static bool next_block(uint8_t *data, size_t len, size_t *off, block_t *block)
+{
+    if (*off == len)
+        return false;
+
+    cr_assert_leq(*off + 12, len);
+    block->type = *(uint32_t *) (data + *off);
+    block->len = *(uint32_t *) (data + *off + 4);
+    block->body = data + *off + 8;
+    cr_assert_eq(block->len % 4, 0);
+    cr_assert_leq(*off + block->len, len);
+    cr_assert_eq(*(uint32_t *) (data + *off + block->len - 4), block->len);
+    *off += block->len;
+
+    return true;
+}
+
+/* Finds an option in a block's options. Returns its length,
+ * or -1 if the option is not there. */
+static int find_option(uint8_t *opts, uint8_t *end, uint16_t code, uint8_t **value)
+{
+    while (opts < end)
+    {
+        uint16_t c = *(uint16_t *) opts, l = *(uint16_t *) (opts + 2);
+        if (c == 0)
+            break;
+        if (c == code)
+        {
+            *value = opts + 4;
+            return l;
+        }
+        opts += 4 + ((l + 3) & ~3);
+    }
+
+    return -1;
+}
+
+Test(pcap, pcapng, .init = setup, .fini = teardown)
+{
+    chitcpd_pcap_options_t opts = { .filename = ng_filename, .snaplen = 50 };
+    chitcpd_pcap_t *pcap;
+    tcp_packet_t packet;
+    uint8_t payload[100] = {0}, *data, *value;
+    size_t len, off = 0;
+    block_t block;
+    int nidbs = 0, nepbs = 0, l;
+    char str[64];
+
+    struct
+    {
+        int sockfd;
+        uint64_t id;
+        chitcpd_pcap_direction_t direction;
+        tcp_state_t state;
+        uint32_t iface;
+    } packets[] = {
+        { 3, 10, CHITCPD_PCAP_OUTBOUND, SYN_SENT,    0 },
+        { 4, 11, CHITCPD_PCAP_INBOUND,  LISTEN,      1 },
+        { 3, 10, CHITCPD_PCAP_INBOUND,  ESTABLISHED, 0 },
+        { 3, 12, CHITCPD_PCAP_OUTBOUND, SYN_SENT,    2 }, /* Socket 3 was reused */
+    };
+
+    cr_assert_eq(chitcpd_pcap_open(&pcap, &opts), CHITCP_OK);
+    for (int i = 0; i < 4; i++)
+    {
+        chitcp_tcp_packet_init(&packet, payload, i * 10);
+        chitcpd_pcap_packet(pcap, &packet, (struct sockaddr *) &src, (struct sockaddr *) &dst,
+                            packets[i].direction, packets[i].sockfd, packets[i].id, packets[i].state);
+        chitcp_tcp_packet_free(&packet);
+    }
+    cr_assert_eq(chitcpd_pcap_close(pcap), CHITCP_OK);
+
+    data = read_file(ng_filename, &len);
+    cr_assert_not_null(data);
+
+    cr_assert(next_block(data, len, &off, &block));
+    cr_assert_eq(block.type, 0x0A0D0D0A);
+    cr_assert_eq(*(uint32_t *) block.body, 0x1A2B3C4D);
+
+    while (next_block(data, len, &off, &block))
+    {
+        uint8_t *end = block.body + block.len - 12;
+
+        if (block.type == 1)
+        {
+            /* Interfaces are described before their first packet */
+            cr_assert_eq(nidbs, packets[nepbs].iface);
+            cr_assert_eq(*(uint16_t *) block.body, 101);
+            cr_assert_eq(*(uint32_t *) (block.body + 4), 50);
+            l = find_option(block.body + 8, end, 2, &value);
+            snprintf(str, sizeof(str), "S%i", packets[nepbs].sockfd);
+            cr_assert_eq(l, strlen(str));
+            cr_assert_arr_eq(value, str, l);
+            l = find_option(block.body + 8, end, 9, &value);
+            cr_assert_eq(l, 1);
+            cr_assert_eq(*value, 9);
+            nidbs++;
+        }
+        else
+        {
+            uint32_t incl_len, orig_len;
+
+            cr_assert_eq(block.type, 6);
+            cr_assert_eq(*(uint32_t *) block.body, packets[nepbs].iface);
+            incl_len = *(uint32_t *) (block.body + 12);
+            orig_len = *(uint32_t *) (block.body + 16);
+            cr_assert_eq(orig_len, 20 + 20 + nepbs * 10);
+            cr_assert_eq(incl_len, orig_len < 50? orig_len : 50);
+
+            l = find_option(block.body + 20 + ((incl_len + 3) & ~3), end, 2, &value);
+            cr_assert_eq(l, 4);
+            cr_assert_eq(*(uint32_t *) value, packets[nepbs].direction);
+            l = find_option(block.body + 20 + ((incl_len + 3) & ~3), end, 1, &value);
+            snprintf(str, sizeof(str), "S%i %s", packets[nepbs].sockfd, tcp_str(packets[nepbs].state));
+            cr_assert_eq(l, strlen(str));
+            cr_assert_arr_eq(value, str, l);
+            nepbs++;
+        }
+    }
+
+    cr_assert_eq(nidbs, 3);
+    cr_assert_eq(nepbs, 4);
+
+    free(data);
+}
+
+Test(pcap, pcapng_rotate, .init = setup, .fini = teardown)
+{
+    chitcpd_pcap_options_t opts = { .filename = ng_filename, .rotate_bytes = 1000 };
+    chitcpd_pcap_t *pcap;
+    tcp_packet_t packet;
+    uint8_t payload[200] = {0}, *data;
+    char name[160];
+    size_t len, off;
+    block_t block;
+    int nfiles, nidbs, total = 0;
+
+    /* Two sockets, alternating, so each file needs two interfaces */
+    cr_assert_eq(chitcpd_pcap_open(&pcap, &opts), CHITCP_OK);
+    for (int i = 0; i < 8; i++)
+    {
+        chitcp_tcp_packet_init(&packet, payload, sizeof(payload));
+        chitcpd_pcap_packet(pcap, &packet, (struct sockaddr *) &src, (struct sockaddr *) &dst,
+                            CHITCPD_PCAP_OUTBOUND, 3 + i % 2, 10 + i % 2, ESTABLISHED);
+        chitcp_tcp_packet_free(&packet);
+    }
+    cr_assert_eq(chitcpd_pcap_close(pcap), CHITCP_OK);
+
+    for (nfiles = 0; ; nfiles++)
+    {
+        snprintf(name, sizeof(name), "%s.%i", ng_filename, nfiles);
+        data = read_file(name, &len);
+        if (data == NULL)
+            break;
+
+        /* Each file is a new section, with its own interfaces
+         * (numbered from zero), described before they are used */
+        off = 0;
+        nidbs = 0;
+        cr_assert(next_block(data, len, &off, &block));
+        cr_assert_eq(block.type, 0x0A0D0D0A);
+        while (next_block(data, len, &off, &block))
+        {
+            if (block.type == 1)
+                nidbs++;
+            else
+            {
+                cr_assert_eq(block.type, 6);
+                cr_assert_lt(*(uint32_t *) block.body, nidbs);
+                total++;
+            }
+        }
+        cr_assert_eq(nidbs, 2);
+        free(data);
+    }
+
+    cr_assert_gt(nfiles, 1);
+    cr_assert_eq(total, 8);
+}
@@ -0,0 +1,289 @@
+#include "chitcp/pool.h"
+#include "chitcp/packet.h"
+#include "chitcp/types.h"
+#include <stdint.h>
+#include <string.h>
+#include <pthread.h>
+#include <criterion/criterion.h>
+
+#define NBLOCKS (POOL_CHUNK_BLOCKS)
+
+struct remote_free_args
+{
+    void *blocks[NBLOCKS];
+    void *realloc;
+    pthread_mutex_t lock;
+    pthread_cond_t cv;
+    int allocated;
+    int freed;
+};
+
+void* owner_func(void *args)
+{
+    struct remote_free_args *rfa = (struct remote_free_args *) args;
+
+    /* Use up all the blocks in the pool */
+    for (int i = 0; i < NBLOCKS; i++)
+        rfa->blocks[i] = chitcp_pool_alloc(100);
+
+    pthread_mutex_lock(&rfa->lock);
+    rfa->allocated = 1;
+    pthread_cond_broadcast(&rfa->cv);
+    while (!rfa->freed)
+        pthread_cond_wait(&rfa->cv, &rfa->lock);
+    pthread_mutex_unlock(&rfa->lock);
+
+    /* All the blocks were freed by another thread, so
+     * we should get one of them back */
+    rfa->realloc = chitcp_pool_alloc(100);
+
+    return NULL;
+}
+
+void* alloc_free_func(void *args)
+{
+    void **block = (void **) args;
+
+    *block = chitcp_pool_alloc(64);
+    chitcp_pool_free(*block);
+
+    return NULL;
+}
+
+void* alloc_func(void *args)
+{
+    void **block = (void **) args;
+
+    *block = chitcp_pool_alloc(64);
+
+    return NULL;
+}
+
+Test(pool, reuse)
+{
+    void *p1, *p2;
+
+    p1 = chitcp_pool_alloc(100);
+    cr_assert_not_null(p1);
+    memset(p1, 0xAA, 100);
+    chitcp_pool_free(p1);
+
+    p2 = chitcp_pool_alloc(50);
+    cr_assert_eq(p1, p2, "Freed block was not reused");
+    chitcp_pool_free(p2);
+}
+
+Test(pool, size_classes)
+{
+    uint8_t *small, *mss, *large;
+
+    small = chitcp_pool_alloc(TCP_HEADER_NOOPTIONS_SIZE);
+    mss = chitcp_pool_alloc(TCP_HEADER_NOOPTIONS_SIZE + 536);
+    large = chitcp_pool_alloc(POOL_MAX_CLASS_SIZE + 1);
+
+    cr_assert_not_null(small);
+    cr_assert_not_null(mss);
+    cr_assert_not_null(large);
+
+    memset(small, 1, TCP_HEADER_NOOPTIONS_SIZE);
+    memset(mss, 2, TCP_HEADER_NOOPTIONS_SIZE + 536);
+    memset(large, 3, POOL_MAX_CLASS_SIZE + 1);
+
+    cr_assert_eq(small[TCP_HEADER_NOOPTIONS_SIZE - 1], 1);
+    cr_assert_eq(mss[0], 2);
+
+    chitcp_pool_free(small);
+    chitcp_pool_free(mss);
+    chitcp_pool_free(large);
+
+    /* A freed MSS-sized block is not handed out for small requests */
+    cr_assert_neq(chitcp_pool_alloc(TCP_HEADER_NOOPTIONS_SIZE), (void *) mss);
+}
+
+Test(pool, calloc)
+{
+    uint8_t *p;
+
+    p = chitcp_pool_alloc(256);
+    memset(p, 0xFF, 256);
+    chitcp_pool_free(p);
+
+    p = chitcp_pool_calloc(16, 16);
+    for (int i = 0; i < 256; i++)
+        cr_assert_eq(p[i], 0, "Byte %i is not zero", i);
+    chitcp_pool_free(p);
+}
+
+Test(pool, remote_free)
+{
+    pthread_t owner;
+    struct remote_free_args rfa;
+    bool found = false;
+
+    memset(&rfa, 0, sizeof(rfa));
+    pthread_mutex_init(&rfa.lock, NULL);
+    pthread_cond_init(&rfa.cv, NULL);
+
+    pthread_create(&owner, NULL, owner_func, &rfa);
+
+    /* Wait until the owner has allocated all its blocks */
+    pthread_mutex_lock(&rfa.lock);
+    while (!rfa.allocated)
+        pthread_cond_wait(&rfa.cv, &rfa.lock);
+    pthread_mutex_unlock(&rfa.lock);
+
+    for (int i = 0; i < NBLOCKS; i++)
+        chitcp_pool_free(rfa.blocks[i]);
+
+    pthread_mutex_lock(&rfa.lock);
+    rfa.freed = 1;
+    pthread_cond_broadcast(&rfa.cv);
+    pthread_mutex_unlock(&rfa.lock);
+
+    pthread_join(owner, NULL);
+
+    for (int i = 0; i < NBLOCKS; i++)
+        if (rfa.blocks[i] == rfa.realloc)
+            found = true;
+
+    cr_assert(found, "Block freed by another thread was not returned to its pool");
+}
+
+Test(pool, adopt_orphan)
+{
+    pthread_t t1, t2;
+    void *p1, *p2;
+
+    pthread_create(&t1, NULL, alloc_free_func, &p1);
+    pthread_join(t1, NULL);
+
+    /* The second thread takes over the pool of the first one */
+    pthread_create(&t2, NULL, alloc_func, &p2);
+    pthread_join(t2, NULL);
+
+    cr_assert_eq(p1, p2, "Pool of exited thread was not reused");
+    chitcp_pool_free(p2);
+}
+
+Test(pool, packet_list)
+{
+    tcp_packet_list_t *pl = NULL;
+    uint8_t payload[536];
+
+    memset(payload, 'x', sizeof(payload));
+
+    for (int i = 0; i < 10; i++)
+    {
+        tcp_packet_t *packet = malloc(sizeof(tcp_packet_t));
+        chitcp_tcp_packet_init(packet, payload, i % 2? sizeof(payload) : 0);
+        cr_assert_eq(TCP_PACKET_HEADER(packet)->doff, 5);
+        chitcp_packet_list_append(&pl, packet);
+    }
+
+    cr_assert_eq(chitcp_packet_list_size(pl), 10);
+
+    tcp_packet_t *packet = pl->packet;
+    chitcp_packet_list_pop_head(&pl);
+    cr_assert_eq(TCP_PAYLOAD_LEN(packet), 0);
+    chitcp_tcp_packet_free(packet);
+    free(packet);
+
+    cr_assert_eq(chitcp_packet_list_size(pl), 9);
+    cr_assert_eq(TCP_PAYLOAD_LEN(pl->packet), sizeof(payload));
+    cr_assert(memcmp(TCP_PAYLOAD_START(pl->packet), payload, sizeof(payload)) == 0);
+
+    chitcp_packet_list_destroy(&pl);
+    cr_assert_null(pl);
+}
+
+Test(pool, refcount)
+{
+    void *p;
+
+    p = chitcp_pool_alloc(100);
+    cr_assert_eq(chitcp_pool_refcount(p), 1);
+
+    cr_assert_eq(chitcp_pool_ref(p), p);
+    cr_assert_eq(chitcp_pool_refcount(p), 2);
+
+    /* Still referenced, so it must not be handed out again */
+    chitcp_pool_free(p);
+    cr_assert_eq(chitcp_pool_refcount(p), 1);
+    cr_assert_neq(chitcp_pool_alloc(100), p);
+
+    chitcp_pool_free(p);
+    cr_assert_eq(chitcp_pool_alloc(100), p);
+}
+
+Test(pool, packet_clone)
+{
+    tcp_packet_t packet, retransmit;
+    uint8_t payload[100];
+    uint8_t *raw;
+
+    memset(payload, 'x', sizeof(payload));
+    chitcp_tcp_packet_init(&packet, payload, sizeof(payload));
+    TCP_PACKET_HEADER(&packet)->ack_seq = chitcp_htonl(1000);
+
+    /* The clone shares the raw contents */
+    chitcp_tcp_packet_clone(&retransmit, &packet);
+    cr_assert_eq(retransmit.raw, packet.raw);
+    cr_assert_eq(retransmit.length, packet.length);
+
+    /* Unsharing gives the clone its own copy */
+    raw = packet.raw;
+    cr_assert_eq(chitcp_tcp_packet_unshare(&retransmit), CHITCP_OK);
+    cr_assert_neq(retransmit.raw, packet.raw);
+    cr_assert(memcmp(retransmit.raw, packet.raw, packet.length) == 0);
+
+    TCP_PACKET_HEADER(&retransmit)->ack_seq = chitcp_htonl(2000);
+    cr_assert_eq(SEG_ACK(&packet), 1000);
+    cr_assert_eq(SEG_ACK(&retransmit), 2000);
+
+    /* Unsharing a packet that is not shared is a no-op */
+    cr_assert_eq(chitcp_tcp_packet_unshare(&packet), CHITCP_OK);
+    cr_assert_eq(packet.raw, raw);
+
+    chitcp_tcp_packet_free(&packet);
+    chitcp_tcp_packet_free(&retransmit);
+}
+
+Test(pool, packet_headroom)
+{
+    tcp_packet_t packet;
+    chitcphdr_t header;
+    uint8_t payload[10] = "0123456789";
+    uint8_t *buffer, *p;
+
+    chitcp_tcp_packet_init(&packet, payload, sizeof(payload));
+    cr_assert_eq(packet.headroom, TCP_PACKET_HEADROOM);
+    buffer = TCP_PACKET_BUFFER(&packet);
+
+    /* Prepend a chiTCP header in place */
+    memset(&header, 0, sizeof(header));
+    header.payload_len = chitcp_htons(packet.length);
+    header.proto = CHITCP_PROTO_TCP;
+
+    p = chitcp_tcp_packet_push(&packet, sizeof(chitcphdr_t));
+    cr_assert_not_null(p);
+    memcpy(p, &header, sizeof(header));
+    cr_assert_eq(packet.length, sizeof(chitcphdr_t) + TCP_HEADER_NOOPTIONS_SIZE + sizeof(payload));
+    cr_assert_eq(TCP_PACKET_BUFFER(&packet), buffer);
+    cr_assert(memcmp(packet.raw + sizeof(chitcphdr_t) + TCP_HEADER_NOOPTIONS_SIZE, payload, sizeof(payload)) == 0);
+
+    /* Not enough headroom left */
+    cr_assert_null(chitcp_tcp_packet_push(&packet, TCP_PACKET_HEADROOM));
+
+    /* Removing the header leaves the packet as it was */
+    cr_assert_not_null(chitcp_tcp_packet_pull(&packet, sizeof(chitcphdr_t)));
+    cr_assert_eq(packet.headroom, TCP_PACKET_HEADROOM);
+    cr_assert_eq(TCP_PAYLOAD_LEN(&packet), sizeof(payload));
+    cr_assert(memcmp(TCP_PAYLOAD_START(&packet), payload, sizeof(payload)) == 0);
+
+    cr_assert_null(chitcp_tcp_packet_pull(&packet, packet.length + 1));
+
+    chitcp_tcp_packet_free(&packet);
+
+    /* The buffer went back to the pool */
+    cr_assert_eq(chitcp_pool_alloc(TCP_PACKET_HEADROOM + 30), buffer);
+}
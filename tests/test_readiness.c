@@ -0,0 +1,255 @@
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sys/epoll.h>
+#include <criterion/criterion.h>
+#include "chitcp/buffer.h"
+#include "readiness.h"
+
+#define NSOCKETS (8)
+
+static serverinfo_t si;
+static chisocketentry_t *active, *passive;
+static tcp_data_t *tcp_data;
+static uint8_t data[4] = {1, 2, 3, 4};
+
+/* Socket 0 is an established active socket (with 4-byte buffers),
+ * socket 1 is a listening socket, and socket 2 is not connected */
+static void setup(void)
+{
+    memset(&si, 0, sizeof(serverinfo_t));
+    si.state = CHITCPD_STATE_RUNNING;
+    si.chisocket_table_size = NSOCKETS;
+    si.chisocket_table = calloc(NSOCKETS, sizeof(chisocketentry_t));
+    for (int i = 0; i < NSOCKETS; i++)
+    {
+        si.chisocket_table[i].available = TRUE;
+        si.chisocket_table[i].si = &si;
+    }
+    chitcpd_poll_init(&si);
+
+    active = &si.chisocket_table[0];
+    active->available = FALSE;
+    active->actpas_type = SOCKET_ACTIVE;
+    active->tcp_state = ESTABLISHED;
+    tcp_data = &active->socket_state.active.tcp_data;
+    circular_buffer_init(&tcp_data->send, 4);
+    circular_buffer_init(&tcp_data->recv, 4);
+    circular_buffer_set_notify(&tcp_data->send, chitcpd_poll_buffer_notify, active);
+    circular_buffer_set_notify(&tcp_data->recv, chitcpd_poll_buffer_notify, active);
+
+    passive = &si.chisocket_table[1];
+    passive->available = FALSE;
+    passive->actpas_type = SOCKET_PASSIVE;
+    passive->tcp_state = LISTEN;
+
+    si.chisocket_table[2].available = FALSE;
+}
+
+static void teardown(void)
+{
+    circular_buffer_free(&tcp_data->send);
+    circular_buffer_free(&tcp_data->recv);
+    chitcpd_poll_free(&si);
+    free(si.chisocket_table);
+}
+
+/* Data arrives through the network after a while */
+static void *recv_later(void *args)
+{
+    usleep(50000);
+    circular_buffer_write(&tcp_data->recv, data, 4, BUFFER_BLOCKING);
+    return NULL;
+}
+
+Test(readiness, socket_events, .init = setup, .fini = teardown)
+{
+    cr_assert_eq(chitcpd_socket_events(active), POLLOUT);
+    cr_assert_eq(chitcpd_socket_events(passive), 0);
+    cr_assert_eq(chitcpd_socket_events(&si.chisocket_table[2]), POLLHUP);
+
+    circular_buffer_write(&tcp_data->recv, data, 4, BUFFER_BLOCKING);
+    circular_buffer_write(&tcp_data->send, data, 4, BUFFER_BLOCKING);
+    cr_assert_eq(chitcpd_socket_events(active), POLLIN);
+
+    active->tcp_state = LAST_ACK;
+    cr_assert_eq(chitcpd_socket_events(active), POLLIN);
+
+    active->tcp_state = CLOSED;
+    cr_assert_eq(chitcpd_socket_events(active), POLLHUP);
+}
+
+Test(readiness, poll, .init = setup, .fini = teardown)
+{
+    chitcpd_poll_event_t fds[3] = {{.sockfd = 0, .events = POLLIN | POLLOUT},
+                                   {.sockfd = 1, .events = POLLIN},
+                                   {.sockfd = 5, .events = POLLIN}};
+    chitcpd_poll_event_t fd = {.sockfd = 0, .events = POLLIN};
+    pthread_t thread;
+    int rc, nready;
+
+    rc = chitcpd_poll(&si, fds, 3, 0, &nready);
+    cr_assert_eq(rc, 0);
+    cr_assert_eq(nready, 2);
+    cr_assert_eq(fds[0].revents, POLLOUT);
+    cr_assert_eq(fds[1].revents, 0);
+    cr_assert_eq(fds[2].revents, POLLNVAL);
+
+    /* Times out */
+    rc = chitcpd_poll(&si, &fd, 1, 20, &nready);
+    cr_assert_eq(rc, 0);
+    cr_assert_eq(nready, 0);
+
+    /* Woken up by the write to the receive buffer */
+    pthread_create(&thread, NULL, recv_later, NULL);
+    rc = chitcpd_poll(&si, &fd, 1, -1, &nready);
+    pthread_join(thread, NULL);
+    cr_assert_eq(rc, 0);
+    cr_assert_eq(nready, 1);
+    cr_assert_eq(fd.revents, POLLIN);
+}
+
+Test(readiness, epoll_ctl, .init = setup, .fini = teardown)
+{
+    int epfd;
+
+    cr_assert_eq(chitcpd_epoll_create(&si, &epfd), 0);
+
+    cr_assert_eq(chitcpd_epoll_ctl(&si, epfd, EPOLL_CTL_ADD, 0, POLLIN, 0), 0);
+    cr_assert_eq(chitcpd_epoll_ctl(&si, epfd, EPOLL_CTL_ADD, 0, POLLIN, 0), EEXIST);
+    cr_assert_eq(chitcpd_epoll_ctl(&si, epfd, EPOLL_CTL_ADD, 5, POLLIN, 0), EBADF);
+    cr_assert_eq(chitcpd_epoll_ctl(&si, epfd, EPOLL_CTL_MOD, 1, POLLIN, 0), ENOENT);
+    cr_assert_eq(chitcpd_epoll_ctl(&si, epfd + 1, EPOLL_CTL_ADD, 1, POLLIN, 0), EBADF);
+
+    /* Only level-triggered events are supported */
+    cr_assert_eq(chitcpd_epoll_ctl(&si, epfd, EPOLL_CTL_ADD, 1, EPOLLIN | EPOLLET, 0), EINVAL);
+    cr_assert_eq(chitcpd_epoll_ctl(&si, epfd, EPOLL_CTL_MOD, 0, EPOLLIN | EPOLLONESHOT, 0), EINVAL);
+    cr_assert_eq(chitcpd_epoll_ctl(&si, epfd, EPOLL_CTL_MOD, 0, EPOLLIN | EPOLLOUT | EPOLLHUP | EPOLLERR, 0), 0);
+    cr_assert_eq(chitcpd_epoll_ctl(&si, epfd, EPOLL_CTL_DEL, 0, 0, 0), 0);
+    cr_assert_eq(chitcpd_epoll_ctl(&si, epfd, EPOLL_CTL_DEL, 0, 0, 0), ENOENT);
+
+    cr_assert_eq(chitcpd_epoll_close(&si, epfd), 0);
+    cr_assert_eq(chitcpd_epoll_close(&si, epfd), EBADF);
+}
+
+Test(readiness, epoll_wait, .init = setup, .fini = teardown)
+{
+    chitcpd_poll_event_t events[4];
+    pthread_t thread;
+    int epfd, rc, nready;
+
+    chitcpd_epoll_create(&si, &epfd);
+    chitcpd_epoll_ctl(&si, epfd, EPOLL_CTL_ADD, 0, POLLIN, 100);
+    chitcpd_epoll_ctl(&si, epfd, EPOLL_CTL_ADD, 1, POLLIN, 101);
+
+    rc = chitcpd_epoll_wait(&si, epfd, events, 4, 0, &nready);
+    cr_assert_eq(rc, 0);
+    cr_assert_eq(nready, 0);
+
+    pthread_create(&thread, NULL, recv_later, NULL);
+    rc = chitcpd_epoll_wait(&si, epfd, events, 4, -1, &nready);
+    pthread_join(thread, NULL);
+    cr_assert_eq(rc, 0);
+    cr_assert_eq(nready, 1);
+    cr_assert_eq(events[0].data, 100);
+    cr_assert_eq(events[0].revents, POLLIN);
+
+    /* Events are level-triggered */
+    rc = chitcpd_epoll_wait(&si, epfd, events, 4, 0, &nready);
+    cr_assert_eq(nready, 1);
+
+    /* Consuming the data makes the socket not ready */
+    circular_buffer_read(&tcp_data->recv, NULL, 4, BUFFER_BLOCKING);
+    rc = chitcpd_epoll_wait(&si, epfd, events, 4, 0, &nready);
+    cr_assert_eq(nready, 0);
+
+    /* Changing the events of a socket checks it again */
+    chitcpd_epoll_ctl(&si, epfd, EPOLL_CTL_MOD, 0, POLLOUT, 7);
+    rc = chitcpd_epoll_wait(&si, epfd, events, 4, 0, &nready);
+    cr_assert_eq(nready, 1);
+    cr_assert_eq(events[0].data, 7);
+    cr_assert_eq(events[0].revents, POLLOUT);
+
+    /* A state change is notified */
+    chitcpd_epoll_ctl(&si, epfd, EPOLL_CTL_MOD, 0, POLLIN, 7);
+    active->tcp_state = TIME_WAIT;
+    chitcpd_poll_notify(&si, active);
+    rc = chitcpd_epoll_wait(&si, epfd, events, 4, 0, &nready);
+    cr_assert_eq(nready, 1);
+    cr_assert_eq(events[0].revents, POLLIN);
+
+    chitcpd_epoll_close(&si, epfd);
+}
+
+Test(readiness, epoll_rotation, .init = setup, .fini = teardown)
+{
+    chitcpd_poll_event_t events[2];
+    int epfd, nready;
+
+    chitcpd_epoll_create(&si, &epfd);
+    chitcpd_epoll_ctl(&si, epfd, EPOLL_CTL_ADD, 0, POLLOUT, 100);
+    chitcpd_epoll_ctl(&si, epfd, EPOLL_CTL_ADD, 1, POLLIN, 101);
+
+    /* A pending connection makes the passive socket readable */
+    passive->socket_state.passive.pending_connections = calloc(1, sizeof(pending_connection_t));
+    chitcpd_poll_notify(&si, passive);
+
+    /* With one event at a time, the ready sockets take turns */
+    chitcpd_epoll_wait(&si, epfd, events, 1, 0, &nready);
+    cr_assert_eq(nready, 1);
+    cr_assert_eq(events[0].data, 100);
+    chitcpd_epoll_wait(&si, epfd, events, 1, 0, &nready);
+    cr_assert_eq(nready, 1);
+    cr_assert_eq(events[0].data, 101);
+    chitcpd_epoll_wait(&si, epfd, events, 2, 0, &nready);
+    cr_assert_eq(nready, 2);
+
+    free(passive->socket_state.passive.pending_connections);
+    passive->socket_state.passive.pending_connections = NULL;
+    chitcpd_epoll_close(&si, epfd);
+}
+
+/* The epoll instance is closed while a thread waits on it */
+static void *close_later(void *args)
+{
+    usleep(50000);
+    chitcpd_epoll_close(&si, *((int *) args));
+    return NULL;
+}
+
+Test(readiness, epoll_close_while_waiting, .init = setup, .fini = teardown)
+{
+    chitcpd_poll_event_t events[4];
+    pthread_t thread;
+    int epfd, rc, nready;
+
+    chitcpd_epoll_create(&si, &epfd);
+    chitcpd_epoll_ctl(&si, epfd, EPOLL_CTL_ADD, 1, POLLIN, 0);
+
+    pthread_create(&thread, NULL, close_later, &epfd);
+    rc = chitcpd_epoll_wait(&si, epfd, events, 4, -1, &nready);
+    pthread_join(thread, NULL);
+    cr_assert_eq(rc, EBADF);
+}
+
+Test(readiness, forget, .init = setup, .fini = teardown)
+{
+    chitcpd_poll_event_t events[4];
+    int epfd, nready;
+
+    chitcpd_epoll_create(&si, &epfd);
+    chitcpd_epoll_ctl(&si, epfd, EPOLL_CTL_ADD, 0, POLLOUT, 0);
+
+    /* A freed socket is removed from the interest list */
+    chitcpd_poll_forget(&si, active);
+    chitcpd_epoll_wait(&si, epfd, events, 4, 0, &nready);
+    cr_assert_eq(nready, 0);
+    cr_assert_eq(chitcpd_epoll_ctl(&si, epfd, EPOLL_CTL_DEL, 0, 0, 0), ENOENT);
+
+    /* Instances are closed along with their owner's connection */
+    cr_assert_eq(chitcpd_epoll_close_owned(&si, pthread_self()), 1);
+    cr_assert_eq(chitcpd_epoll_close(&si, epfd), EBADF);
+}
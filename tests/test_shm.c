@@ -0,0 +1,213 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <arpa/inet.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <criterion/criterion.h>
+#include "chitcp/chitcpd.h"
+#include "chitcp/socket.h"
+#include "chitcp/buffer.h"
+#include "serverinfo.h"
+#include "server.h"
+#include "protobuf-wrapper.h"
+
+static serverinfo_t *si;
+static char sock_path[UNIX_PATH_MAX];
+static uint8_t data[6] = {1, 2, 3, 4, 5, 6};
+
+/* A daemon runs in the test process, and the tests talk to it through
+ * the socket library in shared-memory mode, like any other client would */
+static void setup(void)
+{
+    char port[8];
+
+    /* Each test runs in its own process (possibly at the same
+     * time as other tests), so each daemon needs its own port */
+    snprintf(port, sizeof(port), "%d", 20000 + (int) getpid() % 20000);
+    setenv("CHITCPD_PORT", port, 1);
+
+    snprintf(sock_path, sizeof(sock_path), "/tmp/chitcp-test-shm.%d", (int) getpid());
+    unlink(sock_path);
+    setenv("CHITCPD_SOCK", sock_path, 1);
+    setenv("CHITCPD_SHM", "1", 1);
+
+    si = calloc(1, sizeof(serverinfo_t));
+    si->server_port = chitcp_htons(GET_CHITCPD_PORT);
+    chitcp_unix_socket(si->server_socket_path, UNIX_PATH_MAX);
+
+    cr_assert_eq(chitcpd_server_init(si), CHITCP_OK);
+    cr_assert_eq(chitcpd_server_start(si), CHITCP_OK);
+}
+
+static void teardown(void)
+{
+    cr_assert_eq(chitcpd_server_stop(si), CHITCP_OK);
+    cr_assert_eq(chitcpd_server_wait(si), CHITCP_OK);
+    chitcpd_server_free(si);
+    free(si);
+    unlink(sock_path);
+}
+
+static uint64_t histogram_count(chitcpd_histogram_t *h)
+{
+    chitcpd_histogram_snapshot_t snap;
+
+    chitcpd_histogram_snapshot(h, &snap, FALSE);
+
+    return snap.count;
+}
+
+/* The histograms are updated after the response is sent (or after the
+ * TCP thread has handled the event), so we may have to wait for them */
+static void wait_for_count(chitcpd_histogram_t *h, uint64_t count)
+{
+    for (int i = 0; i < 1000 && histogram_count(h) < count; i++)
+        usleep(1000);
+
+    cr_assert_geq(histogram_count(h), count);
+}
+
+/* Creates a socket and connects it to the loopback address. The tests
+ * don't depend on tcp.c implementing the three-way handshake: once the
+ * TCP thread has handled the CONNECT event, we simply make the socket
+ * ESTABLISHED. The socket is left in blocking mode. */
+static int shm_connect(chisocketentry_t **entry_p)
+{
+    struct sockaddr_in addr;
+    chisocketentry_t *entry;
+    int sockfd;
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = chitcp_htons(7);
+    addr.sin_addr.s_addr = chitcp_htonl(INADDR_LOOPBACK);
+
+    sockfd = chisocket_socket(PF_INET, SOCK_STREAM | SOCK_NONBLOCK, IPPROTO_TCP);
+    cr_assert_geq(sockfd, 0);
+    entry = &si->chisocket_table[sockfd];
+    cr_assert_not_null(entry->shm.header, "The socket's buffers are not in shared memory");
+
+    cr_assert_eq(chisocket_connect(sockfd, (struct sockaddr *) &addr, sizeof(addr)), -1);
+    cr_assert_eq(errno, EINPROGRESS);
+
+    /* The TCP thread places the buffers in the region when it starts */
+    wait_for_count(&si->metrics.tcp_event[APPLICATION_CONNECT], 1);
+    cr_assert(atomic_load(&entry->shm.header->ready));
+    chitcpd_update_tcp_state(si, entry, ESTABLISHED);
+
+    cr_assert_eq(chisocket_fcntl(sockfd, F_SETFL, 0), 0);
+
+    *entry_p = entry;
+    return sockfd;
+}
+
+typedef struct recv_args
+{
+    int sockfd;
+    uint8_t buf[sizeof(data)];
+    int nbytes;
+    pthread_t thread;
+} recv_args_t;
+
+static void *recv_thread(void *arg)
+{
+    recv_args_t *ra = arg;
+
+    ra->nbytes = chisocket_recv(ra->sockfd, ra->buf, sizeof(ra->buf), 0);
+
+    return NULL;
+}
+
+Test(shm, send, .init = setup, .fini = teardown, .timeout = 10)
+{
+    chisocketentry_t *entry;
+    tcp_data_t *tcp_data;
+    uint8_t buf[sizeof(data)];
+    int sockfd;
+
+    sockfd = shm_connect(&entry);
+    tcp_data = &entry->socket_state.active.tcp_data;
+
+    cr_assert_eq(chisocket_send(sockfd, data, sizeof(data), 0), sizeof(data));
+
+    /* The data was written straight into the daemon's send buffer
+     * (the peer never opened its window, so it is still there), and
+     * the TCP thread was woken up by a SHM_NOTIFY instead of a SEND */
+    cr_assert_eq(circular_buffer_peek(&tcp_data->send, buf, sizeof(buf), BUFFER_NONBLOCKING), sizeof(data));
+    cr_assert_arr_eq(buf, data, sizeof(data));
+    wait_for_count(&si->metrics.rpc_handler[CHITCPD_MSG_CODE__SHM_NOTIFY], 1);
+    wait_for_count(&si->metrics.tcp_event[APPLICATION_SEND], 1);
+    cr_assert_eq(histogram_count(&si->metrics.rpc_handler[CHITCPD_MSG_CODE__SEND]), 0);
+}
+
+Test(shm, recv, .init = setup, .fini = teardown, .timeout = 10)
+{
+    chisocketentry_t *entry;
+    tcp_data_t *tcp_data;
+    recv_args_t ra;
+
+    ra.sockfd = shm_connect(&entry);
+    tcp_data = &entry->socket_state.active.tcp_data;
+
+    /* The client blocks on the buffer's (process-shared) condition
+     * variable, and is woken up when the daemon writes to the buffer */
+    cr_assert_eq(pthread_create(&ra.thread, NULL, recv_thread, &ra), 0);
+    usleep(10000);
+    cr_assert_eq(circular_buffer_write(&tcp_data->recv, data, sizeof(data), BUFFER_NONBLOCKING), sizeof(data));
+    pthread_join(ra.thread, NULL);
+
+    cr_assert_eq(ra.nbytes, sizeof(data));
+    cr_assert_arr_eq(ra.buf, data, sizeof(data));
+
+    /* Reading the data opens up the receive window, so the TCP thread
+     * has to be notified */
+    wait_for_count(&si->metrics.rpc_handler[CHITCPD_MSG_CODE__SHM_NOTIFY], 1);
+    wait_for_count(&si->metrics.tcp_event[APPLICATION_RECEIVE], 1);
+    cr_assert_eq(histogram_count(&si->metrics.rpc_handler[CHITCPD_MSG_CODE__RECV]), 0);
+}
+
+Test(shm, recv_nonblocking, .init = setup, .fini = teardown, .timeout = 10)
+{
+    chisocketentry_t *entry;
+    uint8_t buf[sizeof(data)];
+    int sockfd;
+
+    sockfd = shm_connect(&entry);
+
+    cr_assert_eq(chisocket_recv(sockfd, buf, sizeof(buf), MSG_DONTWAIT), -1);
+    cr_assert_eq(errno, EAGAIN);
+    cr_assert_eq(histogram_count(&si->metrics.rpc_handler[CHITCPD_MSG_CODE__RECV]), 0);
+}
+
+/* A client that dies while holding the lock of one of the buffers
+ * doesn't leave the daemon (or the other clients) blocked forever */
+Test(shm, owner_dead, .init = setup, .fini = teardown, .timeout = 10)
+{
+    chisocketentry_t *entry;
+    tcp_data_t *tcp_data;
+    uint8_t buf[sizeof(data)];
+    int sockfd, status;
+    pid_t pid;
+
+    sockfd = shm_connect(&entry);
+    tcp_data = &entry->socket_state.active.tcp_data;
+
+    pid = fork();
+    cr_assert_geq(pid, 0);
+    if (pid == 0)
+    {
+        pthread_mutex_lock(&tcp_data->recv.state->lock);
+        _exit(0);
+    }
+    cr_assert_eq(waitpid(pid, &status, 0), pid);
+
+    cr_assert_eq(circular_buffer_write(&tcp_data->recv, data, sizeof(data), BUFFER_NONBLOCKING), sizeof(data));
+    cr_assert_eq(chisocket_recv(sockfd, buf, sizeof(buf), 0), sizeof(data));
+    cr_assert_arr_eq(buf, data, sizeof(data));
+}
@@ -0,0 +1,148 @@
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <criterion/criterion.h>
+#include "chitcp/packet.h"
+#include "stats.h"
+
+static chitcpd_socket_stats_t stats;
+static tcp_data_t tcp_data;
+
+static void setup(void)
+{
+    chitcpd_stats_reset(&stats);
+    memset(&tcp_data, 0, sizeof(tcp_data_t));
+    tcp_data.SND_UNA = 1000;
+    tcp_data.SND_NXT = 1000;
+    tcp_data.SND_WND = 4096;
+    tcp_data.RCV_NXT = 5000;
+}
+
+static void create_segment(tcp_packet_t *packet, uint32_t seq, uint32_t ack, uint16_t win, uint16_t payload_len)
+{
+    uint8_t payload[1024] = {0};
+
+    chitcp_tcp_packet_init(packet, payload, payload_len);
+    TCP_PACKET_HEADER(packet)->seq = chitcp_htonl(seq);
+    TCP_PACKET_HEADER(packet)->ack_seq = chitcp_htonl(ack);
+    TCP_PACKET_HEADER(packet)->ack = 1;
+    TCP_PACKET_HEADER(packet)->win = chitcp_htons(win);
+}
+
+/* Sends a segment, updating SND.NXT as a TCP implementation would */
+static void send_segment(uint32_t seq, uint16_t payload_len)
+{
+    tcp_packet_t packet;
+
+    create_segment(&packet, seq, tcp_data.RCV_NXT, 4096, payload_len);
+    chitcpd_stats_segment_sent(&stats, &tcp_data, &packet);
+    if (seq + payload_len > tcp_data.SND_NXT)
+        tcp_data.SND_NXT = seq + payload_len;
+    chitcp_tcp_packet_free(&packet);
+}
+
+/* Receives a segment, updating SND.UNA and RCV.NXT */
+static void arrive_segment(uint32_t seq, uint32_t ack, uint16_t win, uint16_t payload_len)
+{
+    tcp_packet_t packet;
+
+    create_segment(&packet, seq, ack, win, payload_len);
+    chitcpd_stats_segment_arrived(&stats, &tcp_data, ESTABLISHED, &packet);
+    tcp_data.SND_UNA = ack;
+    if (seq == tcp_data.RCV_NXT)
+        tcp_data.RCV_NXT += payload_len;
+    chitcp_tcp_packet_free(&packet);
+}
+
+Test(stats, sent, .init = setup)
+{
+    send_segment(1000, 100);
+    send_segment(1100, 100);
+    send_segment(1200, 0);
+
+    cr_assert_eq(CHITCPD_STATS_GET(&stats, segs_sent), 3);
+    cr_assert_eq(CHITCPD_STATS_GET(&stats, bytes_sent), 200);
+    cr_assert_eq(CHITCPD_STATS_GET(&stats, retransmits), 0);
+    cr_assert_eq(CHITCPD_STATS_GET(&stats, zero_window_probes), 0);
+}
+
+Test(stats, retransmits, .init = setup)
+{
+    send_segment(1000, 100);
+    send_segment(1100, 100);
+    send_segment(1000, 100);
+    send_segment(1100, 50);
+    send_segment(1200, 100);
+
+    cr_assert_eq(CHITCPD_STATS_GET(&stats, segs_sent), 5);
+    cr_assert_eq(CHITCPD_STATS_GET(&stats, retransmits), 2);
+
+    /* The RTT of the first segment is not measured, because it
+     * was retransmitted */
+    arrive_segment(5000, 1100, 4096, 0);
+    cr_assert_eq(CHITCPD_STATS_GET(&stats, rtt_samples), 0);
+}
+
+Test(stats, zero_window_probes, .init = setup)
+{
+    tcp_data.SND_WND = 0;
+    send_segment(1000, 1);
+    send_segment(1001, 0);
+
+    cr_assert_eq(CHITCPD_STATS_GET(&stats, zero_window_probes), 1);
+}
+
+Test(stats, rtt, .init = setup)
+{
+    send_segment(1000, 100);
+    send_segment(1100, 100);
+    usleep(2000);
+
+    /* Only the first segment is being timed */
+    arrive_segment(5000, 1050, 4096, 0);
+    cr_assert_eq(CHITCPD_STATS_GET(&stats, rtt_samples), 0);
+    arrive_segment(5000, 1200, 4096, 0);
+    cr_assert_eq(CHITCPD_STATS_GET(&stats, rtt_samples), 1);
+    cr_assert_geq(CHITCPD_STATS_GET(&stats, rtt_last_ns), 2000000);
+    cr_assert_eq(CHITCPD_STATS_GET(&stats, rtt_min_ns), CHITCPD_STATS_GET(&stats, rtt_last_ns));
+    cr_assert_eq(CHITCPD_STATS_GET(&stats, srtt_ns), CHITCPD_STATS_GET(&stats, rtt_last_ns));
+
+    send_segment(1200, 100);
+    arrive_segment(5000, 1300, 4096, 0);
+    cr_assert_eq(CHITCPD_STATS_GET(&stats, rtt_samples), 2);
+    cr_assert_leq(CHITCPD_STATS_GET(&stats, rtt_min_ns), CHITCPD_STATS_GET(&stats, rtt_last_ns));
+}
+
+Test(stats, dup_acks, .init = setup)
+{
+    send_segment(1000, 100);
+    send_segment(1100, 100);
+
+    /* The first ACK is not a duplicate */
+    arrive_segment(5000, 1000, 4096, 0);
+    arrive_segment(5000, 1000, 4096, 0);
+    arrive_segment(5000, 1000, 4096, 0);
+    arrive_segment(5000, 1000, 4096, 0);
+    cr_assert_eq(CHITCPD_STATS_GET(&stats, dup_acks), 3);
+
+    /* Window updates and segments with data are not duplicate ACKs */
+    arrive_segment(5000, 1000, 2048, 0);
+    arrive_segment(5000, 1000, 2048, 10);
+    cr_assert_eq(CHITCPD_STATS_GET(&stats, dup_acks), 3);
+
+    /* Nor are ACKs when there is nothing in flight */
+    arrive_segment(5010, 1200, 2048, 0);
+    arrive_segment(5010, 1200, 2048, 0);
+    cr_assert_eq(CHITCPD_STATS_GET(&stats, dup_acks), 3);
+}
+
+Test(stats, out_of_order, .init = setup)
+{
+    arrive_segment(5100, 1000, 4096, 100);
+    arrive_segment(5000, 1000, 4096, 100);
+    arrive_segment(5100, 1000, 4096, 100);
+
+    cr_assert_eq(CHITCPD_STATS_GET(&stats, out_of_order), 1);
+    cr_assert_eq(tcp_data.RCV_NXT, 5200);
+}
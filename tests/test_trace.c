@@ -0,0 +1,152 @@
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <criterion/criterion.h>
+#include "chitcp/packet.h"
+#include "serverinfo.h"
+#include "trace.h"
+
+static chisocketentry_t *create_entry()
+{
+    chisocketentry_t *entry = calloc(1, sizeof(chisocketentry_t));
+    tcp_data_t *tcp_data = &entry->socket_state.active.tcp_data;
+
+    entry->actpas_type = SOCKET_ACTIVE;
+    entry->tcp_state = CLOSED;
+    entry->trace = calloc(1, sizeof(chitcpd_trace_t));
+    pthread_mutex_init(&tcp_data->lock_pending_packets, NULL);
+    tcp_data->ISS = 100;
+    tcp_data->SND_UNA = 100;
+    tcp_data->SND_NXT = 101;
+    tcp_data->SND_WND = 4096;
+
+    return entry;
+}
+
+static void free_entry(chisocketentry_t *entry)
+{
+    free(entry->trace);
+    free(entry);
+}
+
+static char *print_dump(uint8_t *dump, size_t len)
+{
+    char *out;
+    size_t outlen;
+    FILE *f = open_memstream(&out, &outlen);
+
+    cr_assert_eq(chitcpd_trace_print(f, dump, len), CHITCP_OK);
+    fclose(f);
+
+    return out;
+}
+
+Test(trace, records)
+{
+    chisocketentry_t *entry = create_entry();
+    tcp_packet_t packet;
+    chitcpd_trace_header_t *header;
+    uint8_t *dump;
+    size_t len;
+    char *out;
+
+    chitcp_tcp_packet_init(&packet, NULL, 0);
+    TCP_PACKET_HEADER(&packet)->seq = chitcp_htonl(100);
+    TCP_PACKET_HEADER(&packet)->win = chitcp_htons(4096);
+    TCP_PACKET_HEADER(&packet)->syn = 1;
+
+    chitcpd_trace_add(entry, TRACE_SEG_SENT, 0, CLOSED, &packet);
+    entry->tcp_state = SYN_SENT;
+    chitcpd_trace_add(entry, TRACE_STATE, 0, CLOSED, NULL);
+    chitcpd_trace_add(entry, TRACE_TCP_EVENT, APPLICATION_CONNECT, CLOSED, NULL);
+
+    dump = chitcpd_trace_dump(entry->trace, 3, &len);
+    cr_assert_not_null(dump);
+    header = (chitcpd_trace_header_t *) dump;
+    cr_assert_eq(header->sockfd, 3);
+    cr_assert_eq(header->nrecords, 3);
+    cr_assert_eq(header->total, 3);
+    cr_assert_eq(len, sizeof(chitcpd_trace_header_t) + 3 * sizeof(chitcpd_trace_record_t));
+
+    out = print_dump(dump, len);
+    cr_assert_not_null(strstr(out, "[S3] SENT: Flags [S], seq 100, win 4096, length 0"));
+    cr_assert_not_null(strstr(out, "[S3] CLOSED -> SYN_SENT"));
+    cr_assert_not_null(strstr(out, "[S3] Handled event APPLICATION_CONNECT on state CLOSED"));
+    cr_assert_not_null(strstr(out, "            ISS:         100           IRS:           0"));
+    cr_assert_not_null(strstr(out, "        SND.NXT:         101       RCV.NXT:           0 "));
+
+    /* A truncated dump is rejected */
+    cr_assert_eq(chitcpd_trace_print(stdout, dump, len - 1), CHITCP_EINVAL);
+
+    free(out);
+    free(dump);
+    chitcp_tcp_packet_free(&packet);
+    free_entry(entry);
+}
+
+Test(trace, wraparound)
+{
+    chisocketentry_t *entry = create_entry();
+    chitcpd_trace_header_t *header;
+    chitcpd_trace_record_t *records;
+    uint8_t *dump;
+    size_t len;
+
+    for (int i = 0; i < CHITCPD_TRACE_RECORDS + 10; i++)
+        chitcpd_trace_add(entry, TRACE_TCP_EVENT, APPLICATION_SEND, ESTABLISHED, NULL);
+
+    dump = chitcpd_trace_dump(entry->trace, 0, &len);
+    header = (chitcpd_trace_header_t *) dump;
+    records = (chitcpd_trace_record_t *) (dump + sizeof(chitcpd_trace_header_t));
+
+    /* Only the most recent records are kept, oldest first */
+    cr_assert_eq(header->nrecords, CHITCPD_TRACE_RECORDS);
+    cr_assert_eq(header->total, CHITCPD_TRACE_RECORDS + 10);
+    for (int i = 0; i < CHITCPD_TRACE_RECORDS; i++)
+        cr_assert_eq(records[i].number, i + 10);
+
+    free(dump);
+    free_entry(entry);
+}
+
+Test(trace, reset)
+{
+    chisocketentry_t *entry = create_entry();
+    chitcpd_trace_header_t *header;
+    chitcpd_trace_record_t *records;
+    uint8_t *dump;
+    size_t len;
+
+    for (int i = 0; i < 5; i++)
+        chitcpd_trace_add(entry, TRACE_TCP_EVENT, APPLICATION_SEND, ESTABLISHED, NULL);
+
+    /* The trace is reused for a new socket */
+    chitcpd_trace_reset(entry->trace);
+    chitcpd_trace_add(entry, TRACE_TCP_EVENT, APPLICATION_CONNECT, CLOSED, NULL);
+    chitcpd_trace_add(entry, TRACE_TCP_EVENT, APPLICATION_SEND, ESTABLISHED, NULL);
+
+    dump = chitcpd_trace_dump(entry->trace, 0, &len);
+    header = (chitcpd_trace_header_t *) dump;
+    records = (chitcpd_trace_record_t *) (dump + sizeof(chitcpd_trace_header_t));
+
+    /* Only the records of the new socket are dumped */
+    cr_assert_eq(header->nrecords, 2);
+    cr_assert_eq(header->total, 2);
+    cr_assert_eq(records[0].event, APPLICATION_CONNECT);
+    cr_assert_eq(records[1].event, APPLICATION_SEND);
+
+    free(dump);
+    free_entry(entry);
+}
+
+Test(trace, untraced)
+{
+    chisocketentry_t *entry = create_entry();
+
+    /* Sockets without a trace are simply not traced */
+    free(entry->trace);
+    entry->trace = NULL;
+    chitcpd_trace_add(entry, TRACE_TCP_EVENT, APPLICATION_SEND, ESTABLISHED, NULL);
+
+    free(entry);
+}
@@ -38,4 +38,8 @@ do
 
 	local tcp_table = DissectorTable.get("tcp.port")
 	tcp_table:add(23300, chitcp)
+
+	-- chitcpd -u sends each chiTCP packet in a UDP datagram
+	local udp_table = DissectorTable.get("udp.port")
+	udp_table:add(23300, chitcp)
 end